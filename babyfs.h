@@ -2,10 +2,13 @@
 #define __BABYFS_H__
 
 /* 代码区 */
+#include <linux/ioctl.h>
 #include <linux/types.h>
 
 #ifdef __KERNEL__
 #include <linux/writeback.h>
+#include <linux/percpu_counter.h>
+#include <linux/workqueue.h>
 #endif
 
 /*
@@ -22,6 +25,15 @@
  * |    data       |
  * |      blocks   |  rest of the blocks
  * +---------------+
+ * |  wear table   |  s_wear_blocks blocks (WEAR feature only)
+ * +---------------+
+ * | seg summary   |  s_ssa_blocks blocks (LOG feature only)
+ * +---------------+
+ * |    journal    |  s_journal_blocks blocks (optional)
+ * +---------------+
+ *
+ * zoned 设备上 wear table、seg summary 和 journal 放在数据区开头、根目录的数据块之后，
+ * 位图上标记为已用，和其他元数据一起落在设备开头的常规 zone 里
  */
 
 #define BABYFS_BLOCK_SIZE 1024        // 一个块的字节数
@@ -52,6 +64,9 @@
 
 extern unsigned long NR_DSTORE_BLOCKS;  // 保存数据块起始块号
 
+#define BABYFS_MAX_RESV_BLOCKS 4096  // 延迟分配保留给间接块的空间上限
+#define BABYFS_TRUNCATE_BATCH 16384  // 截断时每个 handle 最多释放的块数
+
 /*
  * 数据块索引
  */
@@ -76,8 +91,41 @@ struct baby_super_block {
   __le32 nr_free_inodes;   /* 剩余空闲 inode 数量 */
   __le32 nr_free_blocks;   /* 剩余空闲 data block 数量 */
   __le32 last_bitmap_bits; /* 最后一块block bitmap含有的有效bit位数 */
+  __le32 feature_compat;   /* 兼容特性位，不认识的内核可以忽略 */
+  __le32 feature_incompat; /* 不兼容特性位，不认识的内核拒绝挂载 */
+  __le32 s_journal_start;  /* 日志区起始块号 */
+  __le32 s_journal_blocks; /* 日志区块数，0 表示没有日志 */
+  __le32 s_ssa_start;      /* 段摘要区起始块号，LOG 特性 */
+  __le32 s_ssa_blocks;     /* 段摘要区块数 */
+  __le32 s_wear_start;     /* 磨损表起始块号，WEAR 特性 */
+  __le32 s_wear_blocks;    /* 磨损表块数 */
 };
 
+/*
+ * 超级块特性位
+ * compat: 旧内核不认识也可以正常挂载
+ * incompat: 改变了磁盘格式，旧内核不能挂载
+ */
+#define BABYFS_FEATURE_COMPAT_DIR_INDEX 0x0001    // 目录哈希索引
+#define BABYFS_FEATURE_COMPAT_HAS_JOURNAL 0x0002  // 元数据日志
+#define BABYFS_FEATURE_COMPAT_WEAR 0x0004         // 持久化每个块组的磨损计数
+#define BABYFS_FEATURE_COMPAT_SUPP                                     \
+  (BABYFS_FEATURE_COMPAT_DIR_INDEX | BABYFS_FEATURE_COMPAT_HAS_JOURNAL | \
+   BABYFS_FEATURE_COMPAT_WEAR)
+
+#define BABYFS_FEATURE_INCOMPAT_DIRV2 0x0001    // 变长目录项
+#define BABYFS_FEATURE_INCOMPAT_RECOVER 0x0002  // 日志里可能有未回放的事务
+#define BABYFS_FEATURE_INCOMPAT_EXTENTS 0x0004  // 新建的普通文件使用区间映射
+#define BABYFS_FEATURE_INCOMPAT_LOG 0x0008      // 普通文件的数据异地写，追加到段上
+#define BABYFS_FEATURE_INCOMPAT_SUPP                                    \
+  (BABYFS_FEATURE_INCOMPAT_DIRV2 | BABYFS_FEATURE_INCOMPAT_RECOVER | \
+   BABYFS_FEATURE_INCOMPAT_EXTENTS | BABYFS_FEATURE_INCOMPAT_LOG)
+
+/* inode 标志位，保存在 baby_inode->i_flags */
+#define BABYFS_INDEX_FL 0x0001  // 目录已经建立哈希索引
+#define BABYFS_EXTENTS_FL 0x0002  // i_blocks 中是区间树的根，不是块索引
+#define BABYFS_REWRITE_FL 0x0004  // 普通文件改写过 i_size 之内的数据，不再算作冷数据
+
 /* 
  * 磁盘索引节点
  * 字节对齐：1. 结构体的大小等于其最大成员的整数倍 2.结构体成员的首地址相对于结构体首地址的偏移量是其类型大小的整数倍
@@ -95,9 +143,88 @@ struct baby_inode {
   __le16 i_gid;                     /* inode 所属用户组编号 */
   __le16 i_nlink;                   /* 硬链接计数 */
   __le16 i_subdir_num;              /* 子目录项数量 */
-  __u8 _padding[(BABYFS_INODE_SIZE - (4 + 2 * 3 + 4 * 5 + 2 * 2 + 4 * BABYFS_N_BLOCKS))]; /* inode 结构体扩展到 128B */
+  __le16 i_flags;                   /* inode 标志位 */
+  __le32 i_next_orphan;             /* 孤儿链表中的下一个 inode，0 表示结尾；根目录的这一项是链表头 */
+  __u8 _padding[(BABYFS_INODE_SIZE - (8 + 4 * 4 + 4 * BABYFS_N_BLOCKS + 2 * 6 + 4))]; /* inode 结构体扩展到 128B */
+};
+
+/*
+ * 区间树（BABYFS_EXTENTS_FL），见 extents.c
+ * 根节点放在 inode 的 i_blocks 里（60B：头部加 4 项），其他节点各占一个磁盘块（头部加 84 项）
+ * 叶子节点的项是 baby_extent，索引节点的项是 baby_extent_idx，两者都是 12B
+ */
+#define BABYFS_EXT_MAGIC 0xbaeb
+#define BABYFS_EXT_MAX_DEPTH 5
+#define BABYFS_EXT_INIT_MAX_LEN (1 << 15)  // 一个区间最多的块数
+#define BABYFS_EXT_UNWRITTEN_MAX_LEN (BABYFS_EXT_INIT_MAX_LEN - 1) // 未写区间最多的块数
+
+struct baby_extent_header {
+  __le16 eh_magic;   /* BABYFS_EXT_MAGIC */
+  __le16 eh_entries; /* 已用的项数 */
+  __le16 eh_max;     /* 最多的项数 */
+  __le16 eh_depth;   /* 到叶子的层数，叶子为 0 */
+  __le32 eh_reserved;
+};
+
+/*
+ * 逻辑块 [ee_block, ee_block + ee_len) 映射到物理块 [ee_start, ee_start + ee_len)
+ * ee_len 大于 BABYFS_EXT_INIT_MAX_LEN 时是未写区间（fallocate 预分配的块），
+ * 块数为 ee_len - BABYFS_EXT_INIT_MAX_LEN，读出来都是 0，第一次写完成后转换成普通区间
+ */
+struct baby_extent {
+  __le32 ee_block; /* 起始逻辑块号 */
+  __le32 ee_start; /* 起始物理块号 */
+  __le16 ee_len;   /* 块数，未写区间加上 BABYFS_EXT_INIT_MAX_LEN */
+  __le16 ee_reserved;
+};
+
+// 下一层节点所在的块，这个子树中的逻辑块号都不小于 ei_block
+struct baby_extent_idx {
+  __le32 ei_block; /* 子树覆盖的起始逻辑块号 */
+  __le32 ei_leaf;  /* 下一层节点的物理块号 */
+  __le32 ei_reserved;
 };
 
+/*
+ * 日志结构模式（BABYFS_FEATURE_INCOMPAT_LOG），见 segment.c
+ * 数据区按 BABYFS_SEG_BLOCKS 块分成段，块组是段的整数倍
+ * 段摘要区给每个数据块一项，记录这一块是哪个文件的哪个逻辑块，清理段时用来找到块的主人
+ * ss_ino 为 0 表示没有记录（根目录不是普通文件），摘要和区间树的修改在同一个事务里
+ */
+#define BABYFS_SEG_BLOCKS 1024
+
+struct baby_summary {
+  __le32 ss_ino;   /* 所属的普通文件 */
+  __le32 ss_block; /* 文件内的逻辑块号 */
+};
+
+#define BABYFS_SUMMARY_PER_BLOCK \
+  (BABYFS_BLOCK_SIZE / sizeof(struct baby_summary))
+
+/*
+ * 磨损表（BABYFS_FEATURE_COMPAT_WEAR），见 wear.c
+ * 每个块组一项，记录累计分配（写入）的块数和擦除（discard、zone 重置）的块数，
+ * sync 和卸载时写回，不经过日志；没有这个特性时计数只保存在内存里
+ */
+struct baby_wear {
+  __le64 w_writes; /* 分配的块数 */
+  __le64 w_erases; /* discard 或者 zone 重置的块数 */
+};
+
+#define BABYFS_WEAR_PER_BLOCK (BABYFS_BLOCK_SIZE / sizeof(struct baby_wear))
+
+/*
+ * BABYFS_IOC_GET_WEAR：读出各个块组的磨损计数
+ * wi_groups 传入 wi_wear 数组的项数，返回块组总数，数组不够大时只填前面的项
+ */
+struct baby_wear_info {
+  __u32 wi_groups;       /* 块组数 */
+  __u32 wi_group_blocks; /* 每个块组的块数，最后一个块组可能更少 */
+  __u64 wi_wear;         /* struct baby_wear 数组的用户态地址 */
+};
+
+#define BABYFS_IOC_GET_WEAR _IOWR('b', 1, struct baby_wear_info)
+
 /*
  * 目录项 1 个 block 可以存放 4个
  * 250 + 4 + 2 = 256B
@@ -109,6 +236,95 @@ struct dir_record {
   __u8 file_type;
 };
 
+/*
+ * v2 变长目录项（BABYFS_FEATURE_INCOMPAT_DIRV2）
+ * rec_len 是到下一个目录项的距离，目录项不跨块，块内最后一个目录项延伸到块尾
+ * inode_no 为 0 表示空闲。inode_no 和 v1 一样放在开头，两种格式可以用同一个指针访问
+ */
+struct baby_dir_entry_2 {
+  __le32 inode_no;
+  __le16 rec_len;
+  __u8 name_len;
+  __u8 file_type;
+  char name[];
+};
+
+#define BABYFS_DIR_V2_PAD 4
+#define BABYFS_DIR_V2_REC_LEN(name_len) \
+  (((name_len) + 8 + BABYFS_DIR_V2_PAD - 1) & ~(BABYFS_DIR_V2_PAD - 1))
+
+/*
+ * 目录哈希索引，存放在目录文件自身的逻辑块空间中
+ * 目录项仍然顺序存放在 [0, i_size)，索引从 BABYFS_DX_BLOCK_BASE 开始：
+ * header 块，接着是 dh_nr_buckets 个桶，桶满了之后从 dh_next_free 分配溢出块，
+ * 溢出块从 BABYFS_DX_MAX_BUCKETS + 1 开始编号，桶按线性哈希一个一个往后追加
+ * 索引块的编号都是相对 BABYFS_DX_BLOCK_BASE 的偏移
+ */
+#define BABYFS_DX_BLOCK_BASE (1UL << 23)  // 位于三级索引范围内，远大于目录项区域
+#define BABYFS_DX_MAGIC 0x62616478        // "badx"
+#define BABYFS_DX_MIN_BUCKETS 8
+#ifndef BABYFS_DX_MAX_BUCKETS
+#define BABYFS_DX_MAX_BUCKETS (1U << 20)  // 测试时可以在 Makefile 里改小，见 rw_test/dx_lookup.cc
+#endif
+#define BABYFS_DX_MIN_SIZE (4 * BABYFS_BLOCK_SIZE)  // 目录超过这个大小才建立索引
+#define BABYFS_DX_BUILD_SIZE (2 * BABYFS_DX_MIN_SIZE) // 超过这个大小的目录不再建立索引
+
+struct baby_dx_header {
+  __le32 dh_magic;
+  __le32 dh_nr_buckets; /* 桶数量，按线性哈希增长 */
+  __le32 dh_nr_entries; /* 索引项总数 */
+  __le32 dh_next_free;  /* 下一个可以用作溢出块的编号 */
+};
+
+struct baby_dx_entry {
+  __le32 hash; /* 文件名哈希 */
+  __le32 pos;  /* 目录项在目录文件内的字节偏移 */
+};
+
+#define BABYFS_DX_ENTRIES_PER_BLOCK \
+  ((BABYFS_BLOCK_SIZE - 8) / sizeof(struct baby_dx_entry))
+
+struct baby_dx_bucket {
+  __le32 db_count; /* 本块内的索引项数量 */
+  __le32 db_next;  /* 溢出块编号，0 表示没有 */
+  struct baby_dx_entry db_entries[BABYFS_DX_ENTRIES_PER_BLOCK];
+};
+
+/*
+ * 元数据日志，位于设备末尾的 s_journal_blocks 个块，块号都相对日志区起点
+ * 第 0 块是日志超级块，之后顺序存放事务：
+ *   描述块 + 它列出的元数据块拷贝（可以有多组），撤销块，最后是提交块
+ * 提交块写完才算事务提交；日志写满之前把已提交的块写回原位置（检查点），再从头开始
+ */
+#define BABYFS_JOURNAL_MAGIC 0x62616a6c  // "bajl"
+#define BABYFS_JOURNAL_DESCRIPTOR 1
+#define BABYFS_JOURNAL_COMMIT 2
+#define BABYFS_JOURNAL_REVOKE 3
+#define BABYFS_JOURNAL_DEFAULT_BLOCKS 1024
+
+struct baby_journal_super {
+  __le32 js_magic;
+  __le32 js_blocks;   /* 日志区块数，包括日志超级块 */
+  __le32 js_start;    /* 最早一个未检查点事务的位置，0 表示日志为空 */
+  __le32 js_sequence; /* js_start 处事务的序号，日志为空时是下一个事务的序号 */
+};
+
+struct baby_journal_header {
+  __le32 jh_magic;
+  __le32 jh_type;
+  __le32 jh_sequence; /* 所属事务的序号 */
+  __le32 jh_count;    /* 描述块、撤销块中的块号数量；提交块中是事务的数据块数量 */
+};
+
+// 描述块和撤销块在 header 之后是块号数组
+#define BABYFS_JOURNAL_TAGS_PER_BLOCK \
+  ((BABYFS_BLOCK_SIZE - sizeof(struct baby_journal_header)) / sizeof(__le32))
+
+struct baby_journal_commit {
+  struct baby_journal_header jc_header;
+  __le32 jc_checksum; /* 事务内所有数据块的 crc32 */
+};
+
 #ifdef __KERNEL__
 
 #define rsv_start rsv_window._rsv_start
@@ -141,11 +357,80 @@ struct baby_block_alloc_info { // 用于跟踪文件的磁盘块分配信息
   baby_fsblk_t last_alloc_physical_block; // 上一次分配的物理块号
 };
 
+/*
+ * 一段连续的空闲数据块 [fe_start, fe_start + fe_len)，块号相对于第一个数据块
+ * 同时挂在按起始块号和按长度（长度相同再按起始块号）排序的两棵红黑树上
+ */
+struct baby_free_extent {
+  struct rb_node fe_start_node;
+  struct rb_node fe_len_node;
+  unsigned long fe_start;
+  unsigned long fe_len;
+};
+
+/*
+ * 块组：一个数据块位图管理的 BABYFS_BIT_PRE_BLOCK 个数据块
+ * 空闲块数和空闲区间树都由 bg_lock 保护，不同块组上的分配互不竞争
+ */
+struct baby_block_group {
+  spinlock_t bg_lock;
+  unsigned long bg_free;            // 空闲块数
+  struct rb_root bg_free_by_start;  // 空闲区间，按起始块号排序
+  struct rb_root bg_free_by_len;    // 空闲区间，按长度排序
+  atomic_long_t bg_writes;          // 累计分配的块数，见 wear.c
+  atomic_long_t bg_erases;          // 累计 discard 和 zone 重置的块数
+} ____cacheline_aligned_in_smp;
+
+/*
+ * 数据温度，每一类在数据区里有自己的分配区域，见 balloc.c
+ * 热：目录、间接块和区间树块，修改频繁；温：被改写过的普通文件；
+ * 冷：只追加、没有改写过的普通文件。fcntl(F_SET_RW_HINT) 可以直接指定
+ */
+enum baby_temp {
+  BABY_TEMP_HOT,
+  BABY_TEMP_WARM,
+  BABY_TEMP_COLD,
+  BABY_TEMP_NR,
+};
+
+/*
+ * 日志结构模式下的一个段，通常是 BABYFS_SEG_BLOCKS 块，zoned 设备上是一个 zone，
+ * 范围见 baby_seg_start、baby_seg_len；sg_valid 跟着位图变化，由 s_seg_lock 保护
+ */
+struct baby_segment {
+  unsigned int sg_valid; // 位图中已用的块数
+  unsigned int sg_flags; // BABY_SEG_*
+  time64_t sg_mtime;     // 最近一次在段上分配块的时间，清理时估计数据的年龄
+};
+
+#define BABY_SEG_OPEN 0x0001    // 某个日志正在往这个段上追加
+#define BABY_SEG_NOCLEAN 0x0002 // 清理之后还有搬不走的块，再有块释放之前不选它
+
+// 一个日志当前追加的位置，[l_next, l_end) 还可以顺序分配，块号相对于第一个数据块
+struct baby_log {
+  unsigned long l_next;
+  unsigned long l_end;
+  int l_open; // l_end 所在的段是日志打开的空闲段，否则是没有空闲段时借用的段
+};
+
+// 一段连续的块，块号相对于第一个数据块
+struct baby_free_range {
+  unsigned long fr_start;
+  unsigned long fr_len;
+};
+
+// 挂载选项
+#define BABYFS_MOUNT_DISCARD 0x0001  // 释放块时通知设备
+#define baby_test_opt(sb, opt) (BABY_SB(sb)->s_mount_opt & BABYFS_MOUNT_##opt)
+
 struct baby_sb_info {
   struct baby_super_block *s_babysb;
   struct buffer_head *s_sbh;
-  __le32 nr_free_blocks;
-  __le32 nr_free_inodes;
+  unsigned long s_mount_opt;
+  struct percpu_counter s_freeblocks_counter; // 空闲数据块数量
+  struct percpu_counter s_freeinodes_counter; // 空闲 inode 数量
+  struct percpu_counter s_dirtyblocks_counter; // 延迟分配预留了但还没有分配的块数
+  unsigned long s_resv_blocks; // 延迟分配不能预留的块数，保证回写时有块分配间接块
   __le32 nr_blocks; // 数据块数量
   __le16 nr_bitmap; // bitmap 数量
   __le32 last_bitmap_bits; // 最后一块block bitmap含有的有效bit位数
@@ -155,16 +440,103 @@ struct baby_sb_info {
 	// 树根，文件系统下所有inode的预分配窗口被组织在这棵红黑树上
   struct rb_root s_rsv_window_root;
 	struct baby_reserve_window_node s_rsv_window_head;
+
+  // 块组，每个数据块位图对应一个，共 nr_bitmap 个，见 balloc.c
+  struct baby_block_group *s_groups;
+  unsigned long s_hot_cursor; // 下一个元数据块的 goal，相对于第一个数据块
+  unsigned long s_alloc_end;  // 分配器只分配这之前的块，zoned 设备上是常规 zone 的末尾
+
+  struct baby_journal *s_journal; // 元数据日志，没有日志时为 NULL，见 journal.c
+  struct workqueue_struct *s_unwritten_wq; // 写完之后转换未写区间，见 inode.c
+
+  // 映射缓存，见 map_cache.c
+  struct list_head s_map_inodes;   // 有映射缓存的 inode，shrinker 从头开始回收
+  spinlock_t s_map_lock;           // 保护 s_map_inodes
+  atomic_long_t s_map_nr;          // 缓存的映射数
+  struct shrinker s_map_shrinker;
+
+  // 孤儿 inode：已经删除、块还在等后台释放的大文件，见 orphan.c
+  struct super_block *s_sb;       // 后台 work 用来找到超级块
+  struct list_head s_orphans;     // 和磁盘上的链表顺序相同，头部是最近加入的
+  struct mutex s_orphan_mutex;    // 保护 s_orphans 和磁盘上的链表，在 handle 之后获取
+  struct work_struct s_orphan_work;
+  atomic_long_t s_pending_blocks; // 等待后台释放的块数（按文件大小估计），statfs 算作空闲
+  int s_orphan_stop;              // 卸载时停止后台释放，剩下的下次挂载继续
+
+  // 等待 discard 的已释放区间，见 discard.c
+  struct list_head s_discard_list; // 按释放的顺序，事务序号不减
+  spinlock_t s_discard_lock;       // 保护 s_discard_list
+  struct delayed_work s_discard_work;
+
+  // 日志结构模式，见 segment.c、cleaner.c；没有 LOG 特性时 s_segs 为 NULL
+  struct baby_segment *s_segs;
+  unsigned long s_nr_segs;
+  unsigned long s_seg_blocks;      // 每个段的块数
+  unsigned long s_seg_off;         // 段按 (块号 + s_seg_off) 划分，zoned 设备上和 zone 对齐
+  unsigned long s_seg_first;       // 热区域之后的第一个段，日志和清理只用它之后的段
+  unsigned long s_ssa_start;       // 段摘要区起始块号
+  spinlock_t s_seg_lock;           // 保护 s_segs
+  struct mutex s_log_mutex;        // 保护 s_logs 和 s_seg_cursor，在 i_alloc_mutex 之后获取
+  struct baby_log s_logs[BABY_TEMP_NR]; // 热、温、冷数据各一个日志
+  unsigned long s_seg_cursor;      // 下一次从这个段开始找空闲段
+  struct delayed_work s_clean_work;
+  struct task_struct *s_cleaner;   // 正在清理的线程，它回写的数据追加到冷日志
+  int s_clean_stop;                // 卸载时停止清理
+
+  // zoned 块设备，见 zoned.c
+  int s_zoned;                     // s_seg_first 之后的段都是顺序写 zone
+  struct mutex s_zone_wb_mutex;    // 普通文件的回写串行化，分配的顺序就是写的顺序
+
+  // 磨损均衡，见 wear.c；s_wear_cold 和 s_wear_stamp 由 s_rsv_window_lock 保护
+  unsigned long s_wear_start;      // 磨损表起始块号，为 0 时计数不持久化
+  long s_wear_cold[BABY_TEMP_NR + 1]; // 各个温度区域和整个数据区里磨损最少的块组
+  unsigned long s_wear_stamp;      // 上一次扫描块组的时间，jiffies
 };
 
 // 包含 vfs inode 的自定义 inode，存放对应于磁盘 inode 的额外信息
 struct baby_inode_info {
   __le16 i_subdir_num;              /* 子目录项数量 */
+  __u16 i_flags;                    /* inode 标志位 */
   __le32 i_blocks[BABYFS_N_BLOCKS]; /* 索引数组 */
   struct inode vfs_inode;
   __u32 i_dtime;            /* 删除时间 */
 
+  struct baby_dir_free *i_dir_free; /* 目录空闲空间位图，见 dir.c */
+  __u32 i_sync_tid;                 /* 最近一次修改这个 inode 元数据的事务 */
+  unsigned int i_jbufs;             /* 挂在运行事务上的目录页 buffer 数量 */
+
   struct baby_block_alloc_info *i_block_alloc_info; // 每一个普通文件都有预留窗口，用来加速磁盘块分配
+  struct mutex i_alloc_mutex; /* 串行化同一个文件的块分配和截断，在 handle 之后获取 */
+  unsigned int i_reserved_blocks; /* 延迟分配预留的块数，由 vfs_inode.i_lock 保护 */
+
+  struct rb_root i_map_tree;   /* 逻辑块到物理块的映射缓存，见 map_cache.c */
+  rwlock_t i_map_lock;         /* 保护 i_map_tree */
+  unsigned int i_map_seq;      /* 释放块时加一，查索引期间变了就不插入缓存 */
+  int i_map_referenced;        /* 上次 shrinker 扫描之后命中过 */
+  struct list_head i_map_list; /* 挂在 s_map_inodes 上 */
+  struct rb_root i_da_tree;    /* 延迟分配的逻辑块，由 i_map_lock 保护 */
+
+  struct rw_semaphore i_mmap_sem; /* 缺页时持读锁，截断页缓存时持写锁 */
+
+  struct list_head i_ioend_list;   /* 写到未写区间、等待转换的 ioend */
+  spinlock_t i_ioend_lock;         /* 保护 i_ioend_list，bio 完成时在中断里获取 */
+  struct work_struct i_ioend_work; /* 在 s_unwritten_wq 上转换 i_ioend_list */
+
+  struct baby_orphan *i_orphan; /* 后台正在释放这个孤儿 inode 的块，见 orphan.c */
+  enum rw_hint i_auto_hint;     /* babyfs 按温度设置的 i_write_hint，不同时是用户指定的 */
+};
+
+/*
+ * 目录空闲空间位图，每个目录块在每个等级中占一位
+ * 第 c 个位图中置位的块，块内至少有 baby_free_class[c] 字节连续的空闲空间
+ */
+#define BABYFS_DIR_FREE_CLASSES 13
+
+struct baby_dir_free {
+  unsigned long nblocks;                       // 覆盖的目录块数量
+  unsigned long cap;                           // 每个位图的容量
+  unsigned long hint[BABYFS_DIR_FREE_CLASSES]; // 在这之前没有置位的块
+  unsigned long *map[BABYFS_DIR_FREE_CLASSES];
 };
 
 // 从 vfs inode 返回包含他的 baby_inode_info
@@ -172,6 +544,10 @@ static inline struct baby_inode_info *BABY_I(struct inode *inode) {
   return container_of(inode, struct baby_inode_info, vfs_inode);
 }
 
+static inline int baby_inode_extents(struct inode *inode) {
+  return BABY_I(inode)->i_flags & BABYFS_EXTENTS_FL;
+}
+
 /* dir.c */
 extern int baby_add_link(struct dentry *dentry, struct inode *inode);
 extern const struct file_operations baby_dir_operations;
@@ -190,6 +566,16 @@ extern void baby_set_link(struct inode *dir, struct dir_record *de, struct page
                    struct inode *inode, int update_times);
 extern struct dir_record *baby_dotdot(struct inode *dir, struct page **p);
 extern int baby_empty_dir (struct inode * inode);
+extern void baby_dir_free_map_release(struct inode *dir);
+
+/* dir_index.c */
+extern struct dir_record *baby_dx_find_entry(struct inode *dir,
+                                             const struct qstr *child,
+                                             struct page **res_page, int *err);
+extern void baby_dx_insert(struct inode *dir, const char *name, int len,
+                           loff_t pos);
+extern void baby_dx_remove(struct inode *dir, const char *name, int len,
+                           loff_t pos);
 
 /* inode.c */
 extern struct inode *baby_iget(struct super_block *, unsigned long);
@@ -197,21 +583,195 @@ extern struct baby_inode *baby_get_raw_inode(struct super_block *, ino_t,
                                              struct buffer_head **);
 extern void init_inode_operations(struct inode *, umode_t);
 extern const struct address_space_operations baby_aops;
+extern const struct address_space_operations baby_file_aops;
+struct iomap_ops;
+extern const struct iomap_ops baby_iomap_ops;
 extern int baby_get_block(struct inode *inode, sector_t block,
                           struct buffer_head *bh, int create);
+extern int __baby_write_inode(struct inode *inode, int do_sync);
 extern int baby_write_inode(struct inode *inode, struct writeback_control *wbc);
 extern void baby_evict_inode(struct inode *inode);
 extern unsigned long baby_count_free_inodes(struct super_block *sb);
-extern unsigned long baby_count_free_blocks(struct super_block *sb);
+extern void baby_dirty_inode(struct inode *inode, int flags);
+extern unsigned long baby_default_goal(struct inode *inode);
+extern void baby_free_blocks(struct inode *inode, unsigned long block,
+                             unsigned long count);
+extern void baby_truncate_blocks(struct inode *inode, loff_t offset);
+extern int baby_truncate(struct inode *inode, loff_t size);
+extern unsigned long baby_truncate_credits(struct super_block *sb,
+                                           unsigned long nblocks);
+extern unsigned long baby_truncate_batch(struct super_block *sb);
+extern int baby_punch_blocks(struct inode *inode, unsigned long start,
+                             unsigned long len);
+extern int baby_prealloc_blocks(struct inode *inode, unsigned long start,
+                                unsigned long len);
+extern void baby_end_io_work(struct work_struct *work);
+
+/* extents.c */
+#define BABY_GET_BLOCKS_UNWRITTEN 2 // baby_ext_get_blocks 的 create，分配成未写区间
+extern void baby_ext_tree_init(struct inode *inode);
+extern int baby_ext_get_blocks(struct inode *inode, sector_t block,
+                               unsigned long maxblocks, struct buffer_head *bh,
+                               int create);
+extern void baby_ext_truncate(struct inode *inode, unsigned long from);
+extern int baby_ext_convert(struct inode *inode, unsigned long block,
+                            unsigned long len);
+extern int baby_ext_punch(struct inode *inode, unsigned long block,
+                          unsigned long len);
+extern int baby_ext_relocate(struct inode *inode, unsigned long block,
+                             unsigned long len, struct buffer_head *bh);
+
+/* orphan.c */
+extern void baby_orphan_sb_init(struct baby_sb_info *sbi, struct super_block *sb);
+extern void baby_orphan_load(struct super_block *sb);
+extern void baby_orphan_stop(struct super_block *sb);
+extern void baby_orphan_resume(struct super_block *sb);
+extern void baby_orphan_release(struct super_block *sb);
+extern int baby_orphan_add(struct inode *inode);
+extern void baby_orphan_del(struct inode *inode);
+
+/* discard.c */
+extern void baby_discard_sb_init(struct baby_sb_info *sbi);
+extern void baby_discard_queue(struct super_block *sb, unsigned long block,
+                               unsigned long count);
+extern void baby_discard_flush(struct super_block *sb);
+struct fstrim_range;
+extern int baby_trim_fs(struct super_block *sb, struct fstrim_range *range);
+
+/* segment.c */
+extern int baby_seg_init(struct super_block *sb);
+extern void baby_seg_release(struct super_block *sb);
+extern void baby_seg_update(struct super_block *sb, unsigned long block,
+                            unsigned long count, int used);
+extern unsigned long baby_log_alloc(struct inode *inode, unsigned long *count,
+                                    int *err);
+extern void baby_summary_set(struct inode *inode, unsigned long pblk,
+                             unsigned long block, unsigned long count);
+extern void baby_log_abort(struct super_block *sb, unsigned long pblk,
+                           unsigned long count);
+
+/* zoned.c */
+extern int baby_zoned_init(struct super_block *sb);
+extern int baby_zone_reset(struct super_block *sb, unsigned long seg);
+
+/* wear.c */
+extern void baby_wear_init(struct super_block *sb);
+extern void baby_wear_sync(struct super_block *sb, int wait);
+extern unsigned long baby_wear_goal(struct super_block *sb, unsigned long goal,
+                                    unsigned long size);
+extern long baby_wear_cold_block(struct super_block *sb, unsigned long size);
+extern void baby_wear_erase(struct super_block *sb, unsigned long block,
+                            unsigned long count);
+extern int baby_wear_report(struct super_block *sb,
+                            struct baby_wear_info *info);
+
+/* cleaner.c */
+extern void baby_cleaner_sb_init(struct baby_sb_info *sbi);
+extern void baby_cleaner_start(struct super_block *sb);
+extern void baby_cleaner_kick(struct super_block *sb);
+extern void baby_cleaner_stop(struct super_block *sb);
+extern void baby_cleaner_resume(struct super_block *sb);
+
+/* ioctl.c */
+extern long baby_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+extern long baby_compat_ioctl(struct file *filp, unsigned int cmd,
+                              unsigned long arg);
+
+/* map_cache.c */
+extern unsigned long baby_map_cache_lookup(struct inode *inode,
+                                           unsigned long block,
+                                           unsigned long max,
+                                           unsigned long *pblk);
+extern unsigned int baby_map_cache_seq(struct inode *inode);
+extern void baby_map_cache_insert(struct inode *inode, unsigned int seq,
+                                  unsigned long block, unsigned long pblk,
+                                  unsigned long len);
+extern void baby_map_cache_remove(struct inode *inode, unsigned long start,
+                                  unsigned long len);
+extern void baby_map_cache_drop(struct inode *inode);
+extern unsigned long baby_da_lookup(struct inode *inode, unsigned long block,
+                                    unsigned long max);
+extern long baby_da_insert(struct inode *inode, unsigned long block,
+                           unsigned long len);
+extern unsigned long baby_da_remove(struct inode *inode, unsigned long start,
+                                    unsigned long len);
+extern int baby_map_cache_init_sb(struct super_block *sb);
+extern void baby_map_cache_exit_sb(struct super_block *sb);
+extern int baby_init_map_cache(void);
+extern void baby_destroy_map_cache(void);
+
+/* super.c */
+extern void baby_sync_super(struct baby_sb_info *sb_info,
+                            struct baby_super_block *raw_sb, int wait);
+
+/* journal.c */
+struct baby_handle;
+/*
+ * handle 预留的日志块数（credits），按最坏情况估计
+ * 分配一段块：区间树路径上的块和分裂出的新块，这些新块、新旧数据块所在的位图，
+ * inode 和段摘要；间接块映射的文件用得更少
+ */
+#define BABYFS_ALLOC_CREDITS (3 * (BABYFS_EXT_MAX_DEPTH + 1) + 5)
+#define BABYFS_INODE_CREDITS 1   // 只修改 inode
+#define BABYFS_ORPHAN_CREDITS 3  // inode 和孤儿链表里的前一项、链表头
+// 目录操作：两次分配，两个目录的目录块和索引块，四个 inode，inode 位图
+#define BABYFS_DIR_CREDITS (2 * BABYFS_ALLOC_CREDITS + 16)
+extern int baby_journal_load(struct super_block *sb);
+extern void baby_journal_release(struct super_block *sb);
+extern void baby_journal_set_recover(struct super_block *sb);
+extern int baby_journal_flush(struct super_block *sb);
+extern struct baby_handle *baby_journal_start(struct super_block *sb,
+                                              unsigned long credits);
+extern unsigned long baby_journal_max_credits(struct super_block *sb);
+extern void baby_journal_set_ordered(struct super_block *sb);
+extern int baby_journal_start_ordered(struct super_block *sb, u32 *tid);
+extern void baby_journal_end_ordered(struct super_block *sb, u32 tid);
+extern void baby_journal_stop(struct baby_handle *handle);
+extern void baby_journal_set_sync(struct baby_handle *handle);
+extern void baby_journal_dirty(struct super_block *sb, struct inode *inode,
+                               struct buffer_head *bh);
+extern void baby_journal_forget(struct super_block *sb, unsigned long block,
+                                unsigned long count);
+extern void baby_journal_evict_inode(struct inode *inode, int deleted);
+extern int baby_journal_commit_inode(struct inode *inode);
+extern int baby_journal_sync(struct super_block *sb);
+extern u32 baby_journal_current_tid(struct super_block *sb);
+extern int baby_journal_wait_tid(struct super_block *sb, u32 tid);
 
 /* file.c */
 extern const struct file_operations baby_file_operations;
+extern int baby_fsync(struct file *file, loff_t start, loff_t end, int datasync);
 
 /* balloc.c */
 extern unsigned long baby_new_blocks(struct inode *inode, unsigned long goal,
                                      unsigned long *count, int *err);
+extern unsigned long baby_new_meta_blocks(struct inode *inode,
+                                          unsigned long *count, int *err);
+extern enum baby_temp baby_inode_temp(struct inode *inode);
+extern unsigned long baby_temp_goal(struct super_block *sb,
+                                    enum baby_temp temp);
+extern void baby_temp_region(struct baby_sb_info *sbi, enum baby_temp temp,
+                             unsigned long *first, unsigned long *n);
+extern void baby_set_write_hint(struct inode *inode);
+extern void baby_mark_rewrite(struct inode *inode);
 extern void baby_init_block_alloc_info(struct inode *inode);
+extern int baby_build_free_tree(struct super_block *sb);
+extern void baby_destroy_free_tree(struct super_block *sb);
+extern void baby_release_blocks(struct super_block *sb, unsigned long block,
+                                unsigned long count);
+extern void baby_put_free_blocks(struct super_block *sb, unsigned long block,
+                                 unsigned long count);
+extern baby_fsblk_t baby_alloc_from(struct super_block *sb, unsigned long goal,
+                                    unsigned long *count);
+extern baby_fsblk_t baby_alloc_at(struct super_block *sb, unsigned long start,
+                                  unsigned long *count);
+extern int baby_range_free(struct super_block *sb, unsigned long start,
+                           unsigned long len);
+extern int baby_take_free_extents(struct super_block *sb, unsigned long *start,
+                                  unsigned long end, unsigned long minlen,
+                                  struct baby_free_range *r, int nr);
 extern void baby_discard_reservation(struct inode *inode);
+extern int baby_has_free_blocks(struct baby_sb_info *sbi, unsigned long nblocks);
 extern void rsv_window_add(struct super_block *sb,
                            struct baby_reserve_window_node *rsv);
 
@@ -220,6 +780,107 @@ static inline struct baby_sb_info *BABY_SB(struct super_block *sb) {
   return sb->s_fs_info;
 }
 
+#define BABY_HAS_COMPAT_FEATURE(sb, mask) \
+  (le32_to_cpu(BABY_SB(sb)->s_babysb->feature_compat) & (mask))
+#define BABY_HAS_INCOMPAT_FEATURE(sb, mask) \
+  (le32_to_cpu(BABY_SB(sb)->s_babysb->feature_incompat) & (mask))
+
+static inline int baby_has_journal(struct super_block *sb) {
+  return BABY_SB(sb)->s_journal != NULL;
+}
+
+// 日志结构模式，普通文件改写的数据不写回原位置
+static inline int baby_log_mode(struct super_block *sb) {
+  return BABY_SB(sb)->s_segs != NULL;
+}
+
+static inline int baby_zoned(struct super_block *sb) {
+  return BABY_SB(sb)->s_zoned;
+}
+
+// 块号相对于第一个数据块，下同
+static inline unsigned long baby_seg_of(struct baby_sb_info *sbi,
+                                        unsigned long block) {
+  return (block + sbi->s_seg_off) / sbi->s_seg_blocks;
+}
+
+static inline unsigned long baby_seg_start(struct baby_sb_info *sbi,
+                                           unsigned long seg) {
+  unsigned long start = seg * sbi->s_seg_blocks;
+
+  return start > sbi->s_seg_off ? start - sbi->s_seg_off : 0;
+}
+
+// 段里的块数，不超过数据区的末尾
+static inline unsigned long baby_seg_len(struct baby_sb_info *sbi,
+                                         unsigned long seg) {
+  unsigned long start = max(seg * sbi->s_seg_blocks, sbi->s_seg_off);
+  unsigned long end = min((seg + 1) * sbi->s_seg_blocks,
+                          sbi->s_seg_off + sbi->nr_blocks);
+
+  return end > start ? end - start : 0;
+}
+
+/*
+ * 目录项访问方法，屏蔽 v1 定长目录项和 v2 变长目录项的差别
+ * v1 目录项的长度固定为 BABYFS_DIR_RECORD_SIZE
+ */
+#define BABY_DE2(de) ((struct baby_dir_entry_2 *)(de))
+
+static inline int baby_dir_v2(struct super_block *sb) {
+  return BABY_HAS_INCOMPAT_FEATURE(sb, BABYFS_FEATURE_INCOMPAT_DIRV2);
+}
+
+static inline unsigned int baby_de_rec_len(struct super_block *sb,
+                                           struct dir_record *de) {
+  return baby_dir_v2(sb) ? le16_to_cpu(BABY_DE2(de)->rec_len)
+                         : BABYFS_DIR_RECORD_SIZE;
+}
+
+static inline unsigned int baby_de_name_len(struct super_block *sb,
+                                            struct dir_record *de) {
+  return baby_dir_v2(sb) ? BABY_DE2(de)->name_len : de->name_len;
+}
+
+static inline char *baby_de_name(struct super_block *sb,
+                                 struct dir_record *de) {
+  return baby_dir_v2(sb) ? BABY_DE2(de)->name : de->name;
+}
+
+// 目录项是否有效
+static inline int baby_de_used(struct super_block *sb, struct dir_record *de) {
+  if (baby_dir_v2(sb))
+    return de->inode_no != 0;
+  return de->inode_no && de->name_len;
+}
+
+static inline struct dir_record *baby_next_de(struct super_block *sb,
+                                              struct dir_record *de) {
+  return (struct dir_record *)((char *)de + baby_de_rec_len(sb, de));
+}
+
+// 检查块内偏移 offset 处的目录项是否完整，防止损坏的 rec_len 导致越界或死循环
+static inline int baby_de_ok(struct super_block *sb, struct dir_record *de,
+                             unsigned int offset) {
+  unsigned int rec_len;
+
+  if (!baby_dir_v2(sb))
+    return offset % BABYFS_DIR_RECORD_SIZE == 0;
+  rec_len = le16_to_cpu(BABY_DE2(de)->rec_len);
+  return offset % BABYFS_DIR_V2_PAD == 0 && rec_len % BABYFS_DIR_V2_PAD == 0 &&
+         rec_len >= BABYFS_DIR_V2_REC_LEN(BABY_DE2(de)->name_len) &&
+         offset + rec_len <= BABYFS_BLOCK_SIZE;
+}
+
+static inline int baby_match(struct super_block *sb, int len,
+                             const char *const name, struct dir_record *de) {
+  if (len != baby_de_name_len(sb, de))
+    return 0;
+  if (!de->inode_no)
+    return 0;
+  return !memcmp(name, baby_de_name(sb, de), len);
+}
+
 // 小端序位图操作方法
 // baby_find_next_zero_bit(void *map, unsigned long search_maxnum, unsigned long search_start)
 #define baby_set_bit __test_and_set_bit_le      // set 1，并返回原值
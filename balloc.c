@@ -178,11 +178,11 @@ find_next_reservable_window(struct baby_reserve_window_node *search_head,
                             unsigned long end_block) {
   struct rb_node *next;
   unsigned short size = my_rsv->rsv_goal_size;
-  unsigned long cur = start_block;
+  unsigned long cur = start_block, first;
+  long cold;
   struct baby_reserve_window_node *rsv = search_head, *prev = NULL;
   struct baby_sb_info *sb_info = BABY_SB(sb);
   struct rb_root *rsv_root = &sb_info->s_rsv_window_root;
-  struct rb_node *n = rsv_root->rb_node;
 #ifdef RSV_DEBUG
   printk("find_next_reservable_window: start_block %ld end_block %ld\n", start_block, end_block);
 #endif
@@ -213,15 +213,18 @@ find_next_reservable_window(struct baby_reserve_window_node *search_head,
   }
 
 try_prev:
-  // 从 [0, 0] 开始找
+  /*
+   * 从 [0, 0] 开始找到 search_head 为止，先从磨损最少的块组找；
+   * 它前面的空隙这一遍看不到，找不到时再从第 1 块开始找一遍（跳过第 0 块）
+   */
 #ifdef RSV_DEBUG
   printk("find_next_reservable_window: try_prev\n");
 #endif
-  rsv = rb_entry(n, struct baby_reserve_window_node, rsv_node);
-  cur = 1;  // 跳过第 0 块
-
-  if(rsv == search_head)  // 第一个预留窗口
-    goto find;
+  cold = baby_wear_cold_block(sb, size);
+  first = cold > 0 && (unsigned long)cold < start_block ? cold : 1;
+again:
+  rsv = rb_entry(rb_first(rsv_root), struct baby_reserve_window_node, rsv_node);
+  cur = first;
 
   while(rsv != search_head) {
     if(cur <= rsv->rsv_end)
@@ -235,6 +238,10 @@ try_prev:
     if(cur + size <= rsv->rsv_start)
       goto find;
   }
+  if (first > 1) {
+    first = 1;
+    goto again;
+  }
   return -1;
 
 find:
@@ -284,25 +291,464 @@ search_reserve_window(struct rb_root *root, unsigned long goal) {
   return rsv;
 }
 
-static int bitmap_search_next_usable_block(unsigned int start, unsigned int end,
-                                           struct buffer_head *bh) {
-  int next;
-  next = baby_find_next_zero_bit(bh->b_data, end, start);
-  if (next >= end)
-    return -1;
+/*
+ * 块组与空闲区间树
+ * 数据区按位图块划分成块组，每个块组管理 BABYFS_BIT_PRE_BLOCK 个数据块，
+ * 有自己的锁、空闲块数和空闲区间树，不同块组上的分配和释放互不影响。
+ * 挂载时扫描一遍数据块位图，把每个块组里连续的空闲块组织成区间，同时按起始块号和按长度排序。
+ * 分配和释放只查树，不用再读位图逐位查找；位图只是持久化的副本，在分配/释放后同步修改。
+ * 区间不跨块组，块号都是相对于第一个数据块的
+ */
+static inline unsigned long fext_end(struct baby_free_extent *fe) {
+  return fe->fe_start + fe->fe_len;
+}
+
+static inline struct baby_block_group *baby_get_group(struct baby_sb_info *sbi,
+                                                      unsigned long block) {
+  return &sbi->s_groups[block / BABYFS_BIT_PRE_BLOCK];
+}
+
+// 块组之后第一个块
+static inline unsigned long baby_group_end(struct baby_sb_info *sbi,
+                                           unsigned long group) {
+  return min_t(unsigned long, (group + 1) * BABYFS_BIT_PRE_BLOCK,
+               sbi->nr_blocks);
+}
+
+static void fext_insert_len(struct baby_block_group *bg,
+                            struct baby_free_extent *fe) {
+  struct rb_node **p = &bg->bg_free_by_len.rb_node, *parent = NULL;
+  struct baby_free_extent *this;
+
+  while (*p) {
+    parent = *p;
+    this = rb_entry(parent, struct baby_free_extent, fe_len_node);
+    if (fe->fe_len < this->fe_len ||
+        (fe->fe_len == this->fe_len && fe->fe_start < this->fe_start))
+      p = &(*p)->rb_left;
+    else
+      p = &(*p)->rb_right;
+  }
+  rb_link_node(&fe->fe_len_node, parent, p);
+  rb_insert_color(&fe->fe_len_node, &bg->bg_free_by_len);
+}
+
+static void fext_insert(struct baby_block_group *bg,
+                        struct baby_free_extent *fe) {
+  struct rb_node **p = &bg->bg_free_by_start.rb_node, *parent = NULL;
+  struct baby_free_extent *this;
+
+  while (*p) {
+    parent = *p;
+    this = rb_entry(parent, struct baby_free_extent, fe_start_node);
+    if (fe->fe_start < this->fe_start)
+      p = &(*p)->rb_left;
+    else
+      p = &(*p)->rb_right;
+  }
+  rb_link_node(&fe->fe_start_node, parent, p);
+  rb_insert_color(&fe->fe_start_node, &bg->bg_free_by_start);
+  fext_insert_len(bg, fe);
+}
+
+static void fext_erase(struct baby_block_group *bg,
+                       struct baby_free_extent *fe) {
+  rb_erase(&fe->fe_start_node, &bg->bg_free_by_start);
+  rb_erase(&fe->fe_len_node, &bg->bg_free_by_len);
+  kfree(fe);
+}
+
+// 长度变化后在长度树中重新排序，起始块号树中的顺序不受影响
+static void fext_resize(struct baby_block_group *bg,
+                        struct baby_free_extent *fe, unsigned long start,
+                        unsigned long len) {
+  rb_erase(&fe->fe_len_node, &bg->bg_free_by_len);
+  fe->fe_start = start;
+  fe->fe_len = len;
+  fext_insert_len(bg, fe);
+}
+
+// 返回包含 block 的空闲区间，block 不空闲时返回它之后的第一个空闲区间
+static struct baby_free_extent *fext_search(struct baby_block_group *bg,
+                                            unsigned long block) {
+  struct rb_node *n = bg->bg_free_by_start.rb_node;
+  struct baby_free_extent *fe, *next = NULL;
+
+  while (n) {
+    fe = rb_entry(n, struct baby_free_extent, fe_start_node);
+    if (block < fe->fe_start) {
+      next = fe;
+      n = n->rb_left;
+    } else if (block >= fext_end(fe)) {
+      n = n->rb_right;
+    } else {
+      return fe;
+    }
+  }
   return next;
 }
 
+// 长度不小于 len 的最短空闲区间（最佳适配）
+static struct baby_free_extent *fext_search_len(struct baby_block_group *bg,
+                                                unsigned long len) {
+  struct rb_node *n = bg->bg_free_by_len.rb_node;
+  struct baby_free_extent *fe, *best = NULL;
+
+  while (n) {
+    fe = rb_entry(n, struct baby_free_extent, fe_len_node);
+    if (fe->fe_len >= len) {
+      best = fe;
+      n = n->rb_left;
+    } else {
+      n = n->rb_right;
+    }
+  }
+  return best;
+}
+
+// 块组里最长的空闲区间
+static struct baby_free_extent *fext_longest(struct baby_block_group *bg) {
+  struct rb_node *n = rb_last(&bg->bg_free_by_len);
+
+  return n ? rb_entry(n, struct baby_free_extent, fe_len_node) : NULL;
+}
+
+/*
+ * 从空闲区间 fe 中取走 [start, start + len)
+ * 从中间取走时区间一分为二，需要调用者提供 *spare 节点
+ */
+static void fext_take(struct baby_block_group *bg, struct baby_free_extent *fe,
+                      unsigned long start, unsigned long len,
+                      struct baby_free_extent **spare) {
+  unsigned long end = fext_end(fe);
+
+  if (start == fe->fe_start && start + len == end) {
+    fext_erase(bg, fe);
+  } else if (start == fe->fe_start) {
+    fext_resize(bg, fe, start + len, end - start - len);
+  } else if (start + len == end) {
+    fext_resize(bg, fe, fe->fe_start, start - fe->fe_start);
+  } else {
+    struct baby_free_extent *tail = *spare;
+
+    *spare = NULL;
+    fext_resize(bg, fe, fe->fe_start, start - fe->fe_start);
+    tail->fe_start = start + len;
+    tail->fe_len = end - start - len;
+    fext_insert(bg, tail);
+  }
+}
+
+/*
+ * 把 [start, start + len) 放回空闲区间树，和前后相邻的区间合并
+ * 不能合并时使用 *spare 节点
+ */
+static void fext_put(struct baby_block_group *bg, unsigned long start,
+                     unsigned long len, struct baby_free_extent **spare) {
+  struct baby_free_extent *next = fext_search(bg, start), *prev = NULL;
+  struct rb_node *n;
+
+  if (next && next->fe_start < start + len) {
+    printk(KERN_ERR "babyfs: freeing free blocks %lu+%lu\n", start, len);
+    return;
+  }
+  n = next ? rb_prev(&next->fe_start_node) : rb_last(&bg->bg_free_by_start);
+  if (n)
+    prev = rb_entry(n, struct baby_free_extent, fe_start_node);
+  if (prev && fext_end(prev) != start)
+    prev = NULL;
+  if (next && next->fe_start != start + len)
+    next = NULL;
+
+  if (prev && next) {
+    unsigned long end = fext_end(next);
+
+    fext_erase(bg, next);
+    fext_resize(bg, prev, prev->fe_start, end - prev->fe_start);
+  } else if (prev) {
+    fext_resize(bg, prev, prev->fe_start, prev->fe_len + len);
+  } else if (next) {
+    fext_resize(bg, next, start, next->fe_len + len);
+  } else {
+    struct baby_free_extent *fe = *spare;
+
+    *spare = NULL;
+    fe->fe_start = start;
+    fe->fe_len = len;
+    fext_insert(bg, fe);
+  }
+  bg->bg_free += len;
+}
+
+/*
+ * 从 fe 中从 first 开始取走最多 *count 块，不超过 end，返回实际的起始块号
+ * 没有 *spare 节点时只能从区间头部取，调用者持有 bg_lock
+ */
+static unsigned long bg_take(struct baby_block_group *bg,
+                             struct baby_free_extent *fe, unsigned long first,
+                             unsigned long end, unsigned long *count,
+                             struct baby_free_extent **spare) {
+  *count = min(*count, min(end, fext_end(fe)) - first);
+  if (!*spare && first != fe->fe_start && first + *count != fext_end(fe)) {
+    first = fe->fe_start;
+    *count = min(*count, fe->fe_len);
+  }
+  fext_take(bg, fe, first, *count, spare);
+  bg->bg_free -= *count;
+  return first;
+}
+
+// block 之后（包括 block）的第一个空闲块，没有时返回 -1
+static baby_fsblk_t baby_next_free_block(struct super_block *sb,
+                                         unsigned long block) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_block_group *bg;
+  struct baby_free_extent *fe;
+  unsigned long group = block / BABYFS_BIT_PRE_BLOCK;
+  baby_fsblk_t ret = -1;
+
+  for (; group < sbi->nr_bitmap && ret < 0; group++) {
+    bg = &sbi->s_groups[group];
+    block = max(block, group * BABYFS_BIT_PRE_BLOCK);
+    // 不加锁读空闲块数只是为了跳过满的块组
+    if (!READ_ONCE(bg->bg_free))
+      continue;
+    spin_lock(&bg->bg_lock);
+    fe = fext_search(bg, block);
+    if (fe)
+      ret = max(block, fe->fe_start);
+    spin_unlock(&bg->bg_lock);
+  }
+  return ret;
+}
+
+/*
+ * 在位图上把 [block, block + count) 置位或清零，块号相对于第一个数据块
+ * 位图只是空闲区间树的副本，树已经保证了这些块不会被并发分配/释放，
+ * 但是同一个字里的其他位可能同时被修改，所以使用原子位操作
+ * 所有的分配和释放都经过这里，分配时顺便累加块组的写入计数
+ */
+static void baby_update_bitmap(struct super_block *sb, unsigned long block,
+                               unsigned long count, int used) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_block_group *bg;
+  struct buffer_head *bh;
+  unsigned long bitmap_no = block / BABYFS_BIT_PRE_BLOCK;
+  unsigned long bit = block % BABYFS_BIT_PRE_BLOCK, nr, i;
+
+  if (baby_log_mode(sb))
+    baby_seg_update(sb, block, count, used);
+  while (count > 0) {
+    nr = min(count, BABYFS_BIT_PRE_BLOCK - bit);
+    bh = sb_bread(sb, bitmap_no + BABYFS_DATA_BIT_MAP_BLOCK_BASE);
+    if (!bh) {
+      printk(KERN_ERR "babyfs: cannot read block bitmap %lu\n", bitmap_no);
+      return;
+    }
+    for (i = bit; i < bit + nr; i++) {
+      if (used ? test_and_set_bit_le(i, bh->b_data)
+               : !test_and_clear_bit_le(i, bh->b_data))
+        printk(KERN_ERR "babyfs: block bitmap %lu bit %lu already %s\n",
+               bitmap_no, i, used ? "set" : "clear");
+    }
+    baby_journal_dirty(sb, NULL, bh);
+    brelse(bh);
+    bg = &sbi->s_groups[bitmap_no];
+    if (used)
+      atomic_long_add(nr, &bg->bg_writes);
+    count -= nr;
+    bit = 0;
+    bitmap_no++;
+  }
+}
+
+/*
+ * 把 [block, block + count) 放回空闲区间树，块号相对于第一个数据块
+ * 只修改树和块组的空闲块数，位图和空闲块计数器由调用者处理
+ */
+void baby_put_free_blocks(struct super_block *sb, unsigned long block,
+                          unsigned long count) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_block_group *bg;
+  struct baby_free_extent *spare;
+  unsigned long nr;
+
+  while (count > 0) {
+    bg = baby_get_group(sbi, block);
+    nr = min(count, baby_group_end(sbi, block / BABYFS_BIT_PRE_BLOCK) - block);
+    spare = kmalloc(sizeof(*spare), GFP_NOFS | __GFP_NOFAIL);
+    spin_lock(&bg->bg_lock);
+    fext_put(bg, block, nr, &spare);
+    spin_unlock(&bg->bg_lock);
+    kfree(spare);
+    block += nr;
+    count -= nr;
+  }
+}
+
+/*
+ * 释放 [block, block + count)，block 是物理块号
+ * 先清除位图再放回树里，放回树之后这些块才可能被再次分配
+ * 挂载了 discard 时先交给 discard.c，等释放它们的事务提交、discard 完成之后再放回树里；
+ * 日志结构模式下改写时释放的旧块在事务提交之前还是文件的数据，也走这条路
+ */
+void baby_release_blocks(struct super_block *sb, unsigned long block,
+                         unsigned long count) {
+  block -= NR_DSTORE_BLOCKS;
+  baby_update_bitmap(sb, block, count, 0);
+  if (baby_test_opt(sb, DISCARD) || baby_log_mode(sb)) {
+    baby_discard_queue(sb, block, count);
+    return;
+  }
+  baby_put_free_blocks(sb, block, count);
+  percpu_counter_add(&BABY_SB(sb)->s_freeblocks_counter, count);
+}
+
+// [start, start + len) 是否整段空闲并且在树上（不在等待 discard）
+int baby_range_free(struct super_block *sb, unsigned long start,
+                    unsigned long len) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_block_group *bg;
+  struct baby_free_extent *fe;
+  unsigned long end = start + len, nr;
+  int ret = 1;
+
+  for (; start < end && ret; start += nr) {
+    bg = baby_get_group(sbi, start);
+    nr = min(end, baby_group_end(sbi, start / BABYFS_BIT_PRE_BLOCK)) - start;
+    spin_lock(&bg->bg_lock);
+    fe = fext_search(bg, start);
+    ret = fe && fe->fe_start <= start && fext_end(fe) >= start + nr;
+    spin_unlock(&bg->bg_lock);
+  }
+  return ret;
+}
+
+/*
+ * FITRIM：从 *start 所在块组里取走 [*start, end) 中不短于 minlen 的空闲区间，
+ * 最多 nr 段，取走期间不会被分配；块号相对于第一个数据块
+ * *start 更新为下次继续查找的位置，返回取走的段数
+ */
+int baby_take_free_extents(struct super_block *sb, unsigned long *start,
+                           unsigned long end, unsigned long minlen,
+                           struct baby_free_range *r, int nr) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long group = *start / BABYFS_BIT_PRE_BLOCK, first, last;
+  struct baby_block_group *bg = &sbi->s_groups[group];
+  struct baby_free_extent *fe, *spare;
+  struct rb_node *next;
+  int n = 0;
+
+  end = min(end, baby_group_end(sbi, group));
+  // 范围两端都落在同一个区间中间时要拆成两段，最多用到一个 spare
+  spare = kmalloc(sizeof(*spare), GFP_NOFS | __GFP_NOFAIL);
+  spin_lock(&bg->bg_lock);
+  for (fe = fext_search(bg, *start); fe && fe->fe_start < end && n < nr;
+       fe = next ? rb_entry(next, struct baby_free_extent, fe_start_node)
+                 : NULL) {
+    next = rb_next(&fe->fe_start_node);
+    first = max(*start, fe->fe_start);
+    last = min(end, fext_end(fe));
+    *start = last;
+    if (last - first < minlen)
+      continue;
+    fext_take(bg, fe, first, last - first, &spare);
+    bg->bg_free -= last - first;
+    r[n].fr_start = first;
+    r[n].fr_len = last - first;
+    n++;
+  }
+  if (n < nr)
+    *start = end;
+  spin_unlock(&bg->bg_lock);
+  kfree(spare);
+  return n;
+}
+
+// 根据一个块组的位图建立它的空闲区间树
+static int baby_build_group(struct super_block *sb, unsigned long group) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_block_group *bg = &sbi->s_groups[group];
+  struct baby_free_extent *spare = NULL;
+  struct buffer_head *bh;
+  unsigned long base = group * BABYFS_BIT_PRE_BLOCK;
+  unsigned long bits = baby_group_end(sbi, group) - base, start, end;
+
+  bh = sb_bread(sb, group + BABYFS_DATA_BIT_MAP_BLOCK_BASE);
+  if (!bh)
+    return -EIO;
+  for (end = 0; end < bits;) {
+    start = find_next_zero_bit_le(bh->b_data, bits, end);
+    if (start >= bits)
+      break;
+    end = find_next_bit_le(bh->b_data, bits, start);
+    if (!spare && !(spare = kmalloc(sizeof(*spare), GFP_KERNEL))) {
+      brelse(bh);
+      return -ENOMEM;
+    }
+    fext_put(bg, base + start, end - start, &spare);
+  }
+  brelse(bh);
+  kfree(spare);
+  return 0;
+}
+
+// 挂载时分配块组，根据数据块位图建立各个块组的空闲区间树
+int baby_build_free_tree(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_block_group *bg;
+  unsigned long free = 0;
+  int i, err;
+
+  sbi->s_groups = kcalloc(sbi->nr_bitmap, sizeof(*sbi->s_groups), GFP_KERNEL);
+  if (!sbi->s_groups)
+    return -ENOMEM;
+  sbi->s_alloc_end = sbi->nr_blocks;
+  for (i = 0; i < sbi->nr_bitmap; i++) {
+    bg = &sbi->s_groups[i];
+    spin_lock_init(&bg->bg_lock);
+    bg->bg_free_by_start = RB_ROOT;
+    bg->bg_free_by_len = RB_ROOT;
+    err = baby_build_group(sb, i);
+    if (err) {
+      baby_destroy_free_tree(sb);
+      return err;
+    }
+    free += bg->bg_free;
+  }
+  // 以位图为准，超级块里的计数可能是非正常卸载前的旧值
+  percpu_counter_set(&sbi->s_freeblocks_counter, free);
+  return 0;
+}
+
+void baby_destroy_free_tree(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_free_extent *fe, *tmp;
+  int i;
+
+  if (!sbi->s_groups)
+    return;
+  for (i = 0; i < sbi->nr_bitmap; i++)
+    rbtree_postorder_for_each_entry_safe(fe, tmp,
+                                         &sbi->s_groups[i].bg_free_by_start,
+                                         fe_start_node)
+      kfree(fe);
+  kfree(sbi->s_groups);
+  sbi->s_groups = NULL;
+}
+
 /**
  * 重新初始化预留窗口
+ * 调用者持有 s_rsv_window_lock
  */
 static int alloc_new_reservation(struct baby_reserve_window_node *my_rsv,
-                                 baby_fsblk_t goal, struct super_block *sb,
-                                 struct buffer_head **bh) {
+                                 baby_fsblk_t goal, struct super_block *sb) {
   struct baby_reserve_window_node *search_head = NULL;
   struct baby_sb_info *sb_info = BABY_SB(sb);
-  struct baby_super_block *b_sb = sb_info->s_babysb;
   struct rb_root *rsv_root = &sb_info->s_rsv_window_root;
+  baby_fsblk_t first_free_block;
+  long cold;
+  int wrapped = 0;
 
   // 确定 rsv 起始搜索位置，要么是 goal，要么是 bitmap 第一个
   unsigned long start_block = goal > 0 ? goal : 0,
@@ -325,6 +771,8 @@ static int alloc_new_reservation(struct baby_reserve_window_node *my_rsv,
     #endif
     }
   }
+  // goal 所在的块组磨损太多时，新窗口放到同一温度区域里磨损最少的块组，见 wear.c
+  start_block = baby_wear_goal(sb, start_block, size);
 
   // 查询是否有窗口包含了 goal
   // 没有的话返回 goal 之前的一个窗口
@@ -333,114 +781,39 @@ static int alloc_new_reservation(struct baby_reserve_window_node *my_rsv,
   printk("alloc_new_reservation: search_reserve_window done start_block %lu, search_head:\n", start_block);
   dump_myrsv(search_head);
 #endif
-  int bitmap_no_1 = -1, bitmap_no_2;
-  int first_free_block;
-  int ret;
 retry:
   // 以 search_head 为起点，查询一个可以容纳 my_rsv
   // 并且不与其他预留窗口重叠的新的预留窗口
-  ret = find_next_reservable_window(search_head, my_rsv, sb, start_block,
-                                    end_block);
-#ifdef RSV_DEBUG
-  printk("alloc_new_reservation: find_next_reservable_window done, ret %d\n",
-         ret);
-#endif
-  // retry 失败，移除上一次 add 的 node
-  if (ret == -1) {
-    if (!rsv_is_empty(&my_rsv->rsv_window))
-      rsv_window_remove(sb, my_rsv);
-    return -1;
-  }
+  if (find_next_reservable_window(search_head, my_rsv, sb, start_block,
+                                  end_block) == -1)
+    goto fail;
 #ifdef RSV_DEBUG
   dump_myrsv(my_rsv);
 #endif
 
-  // 读取第一个 bitmap
-  if (bitmap_no_1 != my_rsv->rsv_start / BABYFS_BIT_PRE_BLOCK) { // 非连续
-    if (bitmap_no_1 != -1) // 第一次进入不需要释放
-      brelse(bh[0]);
-    bitmap_no_1 = my_rsv->rsv_start / BABYFS_BIT_PRE_BLOCK;
-    bh[0] = sb_bread(sb, bitmap_no_1 + BABYFS_DATA_BIT_MAP_BLOCK_BASE);
-#ifdef RSV_DEBUG
-    printk("alloc_new_reservation: read bitmap_1 block NO.%d\n",
-           BABYFS_DATA_BIT_MAP_BLOCK_BASE + bitmap_no_1);
-#endif
-  }
-
-  // 检查可能出现的第二个 bitmap
-  bitmap_no_2 = my_rsv->rsv_end / BABYFS_BIT_PRE_BLOCK;
-  if (bitmap_no_1 != bitmap_no_2) {
-    bh[1] = sb_bread(sb, bitmap_no_2 + BABYFS_DATA_BIT_MAP_BLOCK_BASE);
-    #ifdef RSV_DEBUG
-      printk("alloc_new_reservation: read bitmap_2 block NO.%d\n",
-            bitmap_no_2 + BABYFS_DATA_BIT_MAP_BLOCK_BASE);
-    #endif
-  }
-
-  // 找到 bitmap 中的第一个 free_block
-  first_free_block = bitmap_search_next_usable_block(
-      my_rsv->rsv_start - bitmap_no_1 * BABYFS_BIT_PRE_BLOCK,
-      BABYFS_BIT_PRE_BLOCK, bh[0]);
-  #ifdef RSV_DEBUG
-    printk("alloc_new_reservation: in bh[0], first_free_block %d, start %d, end %d, bh %c\n",
-          first_free_block,
-          my_rsv->rsv_start - bitmap_no_1 * BABYFS_BIT_PRE_BLOCK,
-          BABYFS_BIT_PRE_BLOCK, *((char *)(bh[0]->b_data) + (first_free_block > 0 ? first_free_block : 0) / 8));
-  #endif
-  if (first_free_block >= 0) {
-    // 更新 start_block
-    start_block = first_free_block + bitmap_no_1 * BABYFS_BIT_PRE_BLOCK;
-    // 判断 free block 是不是在 rsv 内
-    if (start_block >= my_rsv->rsv_start && start_block <= my_rsv->rsv_end) {
-      #ifdef RSV_DEBUG
-        printk("alloc_new_reservation: get a new rsv in bh[0], start_block %lu\n", start_block);
-      #endif
-      return 0;
-    } else // bh[0]中有空闲的，从空闲位重新分配
-      goto prepare_retry;
-  }
-
-  if (bitmap_no_1 != bitmap_no_2) { // 第一个bitmap没找到，且rsv跨bitmap
-    first_free_block =
-        bitmap_search_next_usable_block(0, BABYFS_BIT_PRE_BLOCK, bh[1]);
-    #ifdef RSV_DEBUG
-      printk("alloc_new_reservation: in bh[1], first_free_block %d, start 0, end %d, bh %c\n",
-          first_free_block, BABYFS_BIT_PRE_BLOCK, 
-          *((char *)(bh[0]->b_data) + (first_free_block > 0 ? first_free_block : 0) / 8));
-    #endif
-    if (first_free_block >= 0) {
-      // 更新 start_block
-      start_block = first_free_block + bitmap_no_2 * BABYFS_BIT_PRE_BLOCK;
-      // 判断 free block 是不是在 rsv 内
-      if (start_block >= my_rsv->rsv_start && start_block <= my_rsv->rsv_end) {
-        #ifdef RSV_DEBUG
-          printk("alloc_new_reservation: get a new rsv in bh[1], start_block %lu\n", start_block);
-        #endif
-        return 0;
-      }
-      else { // bh[1]中有空闲的，释放第一个bh，保留第二个bh做下次分配
-        brelse(bh[0]);
-        bh[0] = bh[1];
-        bh[1] = NULL;
-        bitmap_no_1 = bitmap_no_2;
-      }
-    } else { // bh[0]和bh[1]中都不存在空闲位，释放全部bh
-      brelse(bh[0]);
-      brelse(bh[1]);
-      bh[0] = bh[1] = NULL;
-      start_block = (bitmap_no_2 + 1) * BABYFS_BIT_PRE_BLOCK;
-      bitmap_no_1 = -1;
-    }
-  } else { // bh[0]中不存在空闲位 且 rsv不跨bitmap，释放第一个bh
-    brelse(bh[0]);
-    start_block = (bitmap_no_1 + 1) * BABYFS_BIT_PRE_BLOCK;
-    bitmap_no_1 = -1;
+  // 窗口里有空闲块就可以使用，否则从窗口之后的第一个空闲块开始重新找窗口
+  first_free_block = baby_next_free_block(sb, my_rsv->rsv_start);
+  if (first_free_block >= 0 && first_free_block <= my_rsv->rsv_end)
+    return 0;
+  // 后面没有空闲块了，或者窗口已经绕回到 start_block 之前，从磨损最少的块组再找一遍
+  if (first_free_block < 0 || first_free_block <= start_block) {
+    if (wrapped++)
+      goto fail;
+    cold = baby_wear_cold_block(sb, size);
+    first_free_block = cold >= 0 ? baby_next_free_block(sb, cold) : -1;
+    if (first_free_block < 0)
+      first_free_block = baby_next_free_block(sb, 0);
+    if (first_free_block < 0)
+      goto fail;
   }
-
-prepare_retry:
-
-  search_head = my_rsv;
+  start_block = first_free_block;
+  search_head = search_reserve_window(rsv_root, start_block);
   goto retry;
+
+fail:
+  if (!rsv_is_empty(&my_rsv->rsv_window))
+    rsv_window_remove(sb, my_rsv);
+  return -1;
 }
 
 /*
@@ -469,195 +842,129 @@ static void try_to_extend_reservation(struct baby_reserve_window_node *my_rsv,
 }
 
 /**
- * 占用bitmap中连续的磁盘块[start,end)
- *
- */
-static baby_fsblk_t do_allocate(struct buffer_head *bh, unsigned long *count,
-                                unsigned int start, unsigned int end, baby_fsblk_t goal,
-                                unsigned short is_next) {
-  unsigned long num = 0;
-#ifdef RSV_DEBUG
-  printk("do_allocate begin: start %ld, goal %ld\n", start, goal);
-#endif
-repeat:
-  if (goal < 0) {
-    // TODO 使用按字节查找加速起始块的查找过程
-    goal = bitmap_search_next_usable_block(start, end, bh);
-    if (goal < 0) {
-      goto fail;
-    }
-  }
-  // printk("do_allocate *count %lu start %u end %u goal %lld is_next %d\n",
-  // *count, start, end, goal, is_next);
-
-  start = goal;
-#ifdef RSV_DEBUG
-  printk("do_allocate: start %ld\n", start);
-#endif
-  // 返回1，说明占用失败，start位原先就是1，看下一位是不是空闲位
-  if (baby_set_bit(start, bh->b_data)) {
-    start++;
-    goal++;
-  #ifdef RSV_DEBUG
-    printk("baby_set_bit failed: set bit %ld\n", goal - 1);
-  #endif
-    if (start >= end || is_next) {
-      goto fail;
-    }
-    goto repeat;
-  }
-  num++;  // 已经占用一块了
-  goal++; // 从已经占用的下一块开始
-#ifdef RSV_DEBUG
-  printk("baby_set_bit succeed: set bit %ld, test bit is %ld\n", goal - 1, baby_test_bit(goal - 1, bh->b_data));
-#endif
-  // 继续占用 goal 之后的位，直到到达边界或满足需求
-  while (num < *count && goal < end && !baby_set_bit(goal, bh->b_data)) {
-    num++;
-    goal++;
-  #ifdef RSV_DEBUG
-    printk("baby_set_bit succeed: set bit %ld, test bit is %ld\n", goal - 1, baby_test_bit(goal - 1, bh->b_data));
-  #endif
-  }
-
-  *count = num;
-  mark_buffer_dirty(bh);
-  // sync_dirty_buffer(bh);
-  brelse(bh);
-  return goal - num;
-
-fail:
-  *count = num;
-  brelse(bh);
-  return -1;
-}
-
-/**
- * 在一个指定范围内分配磁盘块，范围由窗口指定
- * @bh: my_rsv 所在的 bitmap，rsv 跨 bitmap 时，数组长度为2
+ * 在空闲区间树中分配最多 *count 个连续块，块号相对于第一个数据块，分配不跨块组
+ * 有预留窗口时只在窗口内分配，goal 在窗口内时从 goal 开始找
+ * 没有预留窗口时在 goal 所在的块组里优先使用 goal 所在的空闲区间，
+ * 其次是 goal 之后第一个放得下全部块的区间，再按长度最佳适配；
+ * 都放不下时依次在其他块组里最佳适配，最后从最长的区间分配一部分
+ * 只分配 s_alloc_end 之前的块，zoned 设备的顺序写 zone 只由日志按写指针分配
  */
 static baby_fsblk_t baby_try_to_allocate(struct super_block *sb,
                                          baby_fsblk_t goal,
                                          unsigned long *count,
-                                         struct baby_reserve_window *my_rsv,
-                                         struct buffer_head **bh) {
-  int start, end, first;
-  unsigned long num = *count, remain;
-  unsigned short has_next = 0;
-  int bitmap_offset = 0, bitmap_no = 0, bitmap_no_1, bitmap_no_2, ret_bitmap_no;
-  if (goal > 0) {
-    bitmap_offset = goal % BABYFS_BIT_PRE_BLOCK;
-    bitmap_no = goal / BABYFS_BIT_PRE_BLOCK;
-  }
-#ifdef RSV_DEBUG
-  printk("baby_try_to_allocate goal %lld count %lu\n", goal, *count);
-#endif
+                                         struct baby_reserve_window *my_rsv) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_block_group *bg;
+  struct baby_free_extent *fe, *spare;
+  unsigned long limit = sbi->s_alloc_end, first, end, group, i;
+  unsigned long ngroups = (limit + BABYFS_BIT_PRE_BLOCK - 1) / BABYFS_BIT_PRE_BLOCK;
+  baby_fsblk_t ret = -1;
+
+  // 从区间中间分配时区间要一分为二，先准备好节点；内存不足时只从区间头部分配
+  spare = kmalloc(sizeof(*spare), GFP_NOFS);
   if (my_rsv) {
-    bitmap_no_1 = my_rsv->_rsv_start / BABYFS_BIT_PRE_BLOCK;
-    bitmap_no_2 = my_rsv->_rsv_end / BABYFS_BIT_PRE_BLOCK;
-    start = my_rsv->_rsv_start % BABYFS_BIT_PRE_BLOCK;
-    end = my_rsv->_rsv_end % BABYFS_BIT_PRE_BLOCK + 1;
-    ret_bitmap_no = bitmap_no_1;
-
-    if (bh && bh[0] && bh[1])
-      has_next = 1;
-
-    /* my_rsv 存在，goal 也存在并且在 rsv 内部 */
-    if (my_rsv->_rsv_start <= goal && goal <= my_rsv->_rsv_end) {
-      start = bitmap_offset;
-
-      /* goal 在第二个 bitmap */
-      if (bitmap_no > bitmap_no_1) {
-        brelse(bh[0]);
-        bh[0] = bh[1];
-        ret_bitmap_no = bitmap_no_2;
-        has_next = 0; // 在第二块的 [bitmap_offset,rsv_end]查找
-      #ifdef RSV_DEBUG
-        printk("baby_try_to_allocate: goal in second bitmap\n");
-      #endif
-      }
-      /* goal 在第一个 bitmap 上，并且有两个 bitmap */
-      else if (bitmap_no_1 != bitmap_no_2)
-        end = BABYFS_BIT_PRE_BLOCK; // 在第一块的 [bitmap_offset,bitmap_end]
-      /* else，goal 在第一个 bitmap 并只有一个 bitmap 的情况不需要额外修改，就是初始情况 */
+    // 预留窗口最多跨两个块组
+    first = goal >= 0 ? goal : my_rsv->_rsv_start;
+    end = min_t(unsigned long, my_rsv->_rsv_end + 1, limit);
+    for (; first < end && ret < 0;
+         first = (first / BABYFS_BIT_PRE_BLOCK + 1) * BABYFS_BIT_PRE_BLOCK) {
+      bg = baby_get_group(sbi, first);
+      spin_lock(&bg->bg_lock);
+      fe = fext_search(bg, first);
+      if (fe && fe->fe_start < end)
+        ret = bg_take(bg, fe, max(first, fe->fe_start), end, count, &spare);
+      spin_unlock(&bg->bg_lock);
     }
-    /* goal 不在里面或者 goal=-1（其实就是 goal 不在里面） */
-    else {
-      goal = -1;
-      end = BABYFS_BIT_PRE_BLOCK;
-    }
-  } 
-  /* myrsv 不存在 */
-  else {
-    if (bitmap_offset > 0)
-      start = bitmap_offset;
-    else
-      start = 0;
-    end = (bitmap_no + BABYFS_DATA_BIT_MAP_BLOCK_BASE) == NR_DSTORE_BLOCKS - 1 ? BABY_SB(sb)->last_bitmap_bits : BABYFS_BIT_PRE_BLOCK;
-
-    ret_bitmap_no = bitmap_no;
-    bh[0] = sb_bread(sb, bitmap_no + BABYFS_DATA_BIT_MAP_BLOCK_BASE);
-    if (!bh[0])
-      goto fail;
+    goto out;
   }
-  #ifdef RSV_DEBUG
-    printk("baby_try_to_allocate: num %d start %u end %u goal %lld\n", num, start,
-          end, goal);
-  #endif
-  // 在第一个bitmap中分配
-  baby_fsblk_t mod_goal = goal < 0 ? goal : goal % BABYFS_BIT_PRE_BLOCK;
-  first = do_allocate(bh[0], &num, start, end, mod_goal, 0);
-#ifdef RSV_DEBUG
-  printk("baby_try_to_allocate: first %d, get %d, [%u, %u) goal %lld\n",
-         first, num, start, end, goal);
-#endif
 
-  if (first < 0) {
-  #ifdef RSV_DEBUG
-    printk("baby_try_to_allocate: first < 0\n");  
-  #endif
-    if (!has_next) { // 在第一块中分配失败，且没有第二块
-      goto fail;
-    }
-    /* 第一块失败，但是存在第二块的情况，继续往下执行 */
-    ret_bitmap_no = bitmap_no_2;
+  if (goal < 0 || goal >= limit)
+    goal = 0;
+  group = goal / BABYFS_BIT_PRE_BLOCK;
+  bg = &sbi->s_groups[group];
+  spin_lock(&bg->bg_lock);
+  fe = fext_search(bg, goal);
+  if (fe && fe->fe_start <= goal) {
+    ret = bg_take(bg, fe, goal, limit, count, &spare);
   } else {
-    // 在第一块里分配就满足要求了，跳转到成功返回
-    if (!(num < *count && has_next && first + num == BABYFS_BIT_PRE_BLOCK))
-      goto success;
+    if (!fe || fe->fe_len < *count)
+      fe = fext_search_len(bg, *count);
+    if (fe && fe->fe_start < limit)
+      ret = bg_take(bg, fe, fe->fe_start, limit, count, &spare);
+  }
+  spin_unlock(&bg->bg_lock);
+
+  // 其他块组里找一个放得下全部块的区间，空闲块数不够的块组直接跳过
+  for (i = 1; i < ngroups && ret < 0; i++) {
+    bg = &sbi->s_groups[(group + i) % ngroups];
+    if (READ_ONCE(bg->bg_free) < *count)
+      continue;
+    spin_lock(&bg->bg_lock);
+    fe = fext_search_len(bg, *count);
+    if (fe && fe->fe_start < limit)
+      ret = bg_take(bg, fe, fe->fe_start, limit, count, &spare);
+    spin_unlock(&bg->bg_lock);
+  }
+  // 没有放得下的区间，从最长的区间里分配一部分
+  for (i = 0; i < ngroups && ret < 0; i++) {
+    bg = &sbi->s_groups[(group + i) % ngroups];
+    if (!READ_ONCE(bg->bg_free))
+      continue;
+    spin_lock(&bg->bg_lock);
+    fe = fext_longest(bg);
+    if (fe && fe->fe_start < limit)
+      ret = bg_take(bg, fe, fe->fe_start, limit, count, &spare);
+    spin_unlock(&bg->bg_lock);
   }
 
-  // 分配到第一个bitmap末尾都没达到需求的block数量，尝试第二个bitmap
-  remain = *count - num; // 剩余需求数量
+out:
+  kfree(spare);
+  if (ret >= 0) {
+    percpu_counter_sub(&sbi->s_freeblocks_counter, *count);
+    baby_update_bitmap(sb, ret, *count, 1);
+  }
 #ifdef RSV_DEBUG
-  printk("baby_try_to_allocate next, remain %lu\n", remain);
+  printk("baby_try_to_allocate return %lld count %lu\n", ret, *count);
 #endif
-  int ret = do_allocate(bh[1], &remain, 0, my_rsv->_rsv_end % BABYFS_BIT_PRE_BLOCK + 1, 0, 1);
-  if(ret < 0 && first < 0) // 第一和第二块都分配失败
-    goto fail;
-  num += remain;
-  if(first < 0)
-    first = ret;
+  return ret;
+}
 
-success:
-  *count = num;
-#ifdef RSV_DEBUG
-  printk("baby_try_to_allocate return %lld count %ld\n",
-         first + BABYFS_BIT_PRE_BLOCK * ret_bitmap_no, *count);
-#endif
-  return first + BABYFS_BIT_PRE_BLOCK * ret_bitmap_no;
+// 不使用预留窗口，从 goal 开始分配最多 *count 个连续块，块号相对于第一个数据块，失败时返回 -1
+baby_fsblk_t baby_alloc_from(struct super_block *sb, unsigned long goal,
+                             unsigned long *count) {
+  return baby_try_to_allocate(sb, goal, count, NULL);
+}
 
-fail:
-  return -1;
+/*
+ * 从 start 开始分配最多 *count 个连续块，start 不空闲时返回 -1
+ * zoned 设备上日志只能从写指针的位置分配，不能像 baby_alloc_from 那样挪到别处
+ */
+baby_fsblk_t baby_alloc_at(struct super_block *sb, unsigned long start,
+                           unsigned long *count) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_block_group *bg = baby_get_group(sbi, start);
+  struct baby_free_extent *fe, *spare;
+  baby_fsblk_t ret = -1;
+
+  spare = kmalloc(sizeof(*spare), GFP_NOFS | __GFP_NOFAIL);
+  spin_lock(&bg->bg_lock);
+  fe = fext_search(bg, start);
+  if (fe && fe->fe_start <= start)
+    ret = bg_take(bg, fe, start, fext_end(fe), count, &spare);
+  spin_unlock(&bg->bg_lock);
+  kfree(spare);
+  if (ret >= 0) {
+    percpu_counter_sub(&sbi->s_freeblocks_counter, *count);
+    baby_update_bitmap(sb, ret, *count, 1);
+  }
+  return ret;
 }
 
 /**
  * @sb:			superblock
- * @group:		goal 所在的块组的块组号
- * @bitmap_bh:		goal 所在块组的位图
- * @grp_goal:		goal 在其所在块组中的相对块号
- * @count:		target number of blocks to allocate
- * @my_rsv:		reservation window
+ * @goal:		目标块号，相对于第一个数据块
+ * @my_rsv:		reservation window，为空时不使用预留窗口
+ * @count:		target number of blocks to allocate，返回实际分配的块数
  *
  * 块分配的核心函数
  */
@@ -666,13 +973,10 @@ baby_try_to_allocate_with_rsv(struct super_block *sb, baby_fsblk_t goal,
                               struct baby_reserve_window_node *my_rsv,
                               unsigned long *count) {
   struct baby_sb_info *bbi = BABY_SB(sb);
+  spinlock_t *rsv_lock = &bbi->s_rsv_window_lock;
   baby_fsblk_t ret = 0;
   unsigned long num = *count;
 
-  // bh 数组用来存放可能读取到的相邻两个 bitmap
-  struct buffer_head *bh_array[2];
-  bh_array[0] = NULL;
-  bh_array[1] = NULL;
 #ifdef RSV_DEBUG
   printk("baby_try_to_allocate_with_rsv goal %lld count %lu\n", goal, *count);
 #endif
@@ -680,7 +984,7 @@ baby_try_to_allocate_with_rsv(struct super_block *sb, baby_fsblk_t goal,
   #ifdef RSV_DEBUG
     printk("baby_try_to_allocate_with_rsv not use rsv\n");
   #endif
-    return baby_try_to_allocate(sb, goal, count, NULL, bh_array);
+    return baby_try_to_allocate(sb, goal, count, NULL);
   }
 #ifdef RSV_DEBUG
   printk("baby_try_to_allocate_with_rsv use rsv\n");
@@ -714,7 +1018,9 @@ baby_try_to_allocate_with_rsv(struct super_block *sb, baby_fsblk_t goal,
         my_rsv->rsv_goal_size = *count;
 
       // 重新分配预留窗口
-      ret = alloc_new_reservation(my_rsv, goal, sb, bh_array);
+      spin_lock(rsv_lock);
+      ret = alloc_new_reservation(my_rsv, goal, sb);
+      spin_unlock(rsv_lock);
       if (ret < 0) // 整个磁盘块都分配不出新的窗口
         break;     /* failed */
 
@@ -727,15 +1033,6 @@ baby_try_to_allocate_with_rsv(struct super_block *sb, baby_fsblk_t goal,
       // 若可分配长度比需要分配的数量小，则尝试扩大预留窗口到满足所需，也有可能不能扩大这么多
       if (curr < *count)
         try_to_extend_reservation(my_rsv, sb, *count - curr);
-
-      // 读出当前预留窗口的bh
-      bh_array[0] = sb_bread(sb, my_rsv->rsv_start / BABYFS_BIT_PRE_BLOCK +
-                                     BABYFS_DATA_BIT_MAP_BLOCK_BASE);
-      if (my_rsv->rsv_start / BABYFS_BIT_PRE_BLOCK !=
-          my_rsv->rsv_end / BABYFS_BIT_PRE_BLOCK) {
-        bh_array[1] = sb_bread(sb, my_rsv->rsv_end / BABYFS_BIT_PRE_BLOCK +
-                                       BABYFS_DATA_BIT_MAP_BLOCK_BASE);
-      }
     }
 
     // 若预留窗口超过了可分配范围，则报错
@@ -743,8 +1040,8 @@ baby_try_to_allocate_with_rsv(struct super_block *sb, baby_fsblk_t goal,
       rsv_window_dump(&bbi->s_rsv_window_root, 1);
       BUG();
     }
-    // 将预留窗口中预分配的数据块，在其所属块组位图上对应的bit置1，即正式占用
-    ret = baby_try_to_allocate(sb, goal, &num, &my_rsv->rsv_window, bh_array);
+    // 从空闲区间树中取出预留窗口内的块，并在位图上对应的bit置1，即正式占用
+    ret = baby_try_to_allocate(sb, goal, &num, &my_rsv->rsv_window);
 
     if (ret >= 0) { // 如果分配成功，统计预留窗口中已分配数量后退出循环
       my_rsv->rsv_alloc_hit += num; // 统计预留窗口中已分配数量
@@ -756,8 +1053,29 @@ baby_try_to_allocate_with_rsv(struct super_block *sb, baby_fsblk_t goal,
   return ret;
 }
 
+/*
+ * 计数器各个 cpu 上的误差之和可能达到的量，空闲块少于这个数时读精确值
+ */
+#define BABY_FREEBLOCKS_WATERMARK (4 * (percpu_counter_batch * nr_cpu_ids))
+
+/*
+ * 延迟分配预留 nblocks 块之前检查空间是否足够
+ * 已经预留但还没有分配的块和保留给间接块的 s_resv_blocks 都不能再预留
+ */
+int baby_has_free_blocks(struct baby_sb_info *sbi, unsigned long nblocks) {
+  s64 free = percpu_counter_read_positive(&sbi->s_freeblocks_counter);
+  s64 dirty = percpu_counter_read_positive(&sbi->s_dirtyblocks_counter);
+  s64 need = nblocks + sbi->s_resv_blocks;
+
+  if (free - (need + dirty) < BABY_FREEBLOCKS_WATERMARK) {
+    free = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+    dirty = percpu_counter_sum_positive(&sbi->s_dirtyblocks_counter);
+  }
+  return free >= need + dirty;
+}
+
 /**
- * 尽最大努力分配连续的磁盘块，仅在一个bitmap管理的数据块中分配
+ * 尽最大努力分配连续的磁盘块，在空闲区间树中查找，不读位图
  *
  * @param goal 建议分配的物理磁盘块号，引用类型，
  * @param count 要求分配的磁盘块数，引用类型，返回实际分配的磁盘块数
@@ -768,7 +1086,6 @@ unsigned long baby_new_blocks(struct inode *inode, unsigned long goal,
   struct super_block *sb = inode->i_sb;
   struct baby_inode_info *inode_info = BABY_I(inode);
   struct baby_reserve_window_node *my_rsv = NULL;
-  unsigned long free_blocks;
   baby_fsblk_t ret_block;
 #ifdef RSV_DEBUG
   printk("-----------------------------\n");
@@ -778,40 +1095,23 @@ unsigned long baby_new_blocks(struct inode *inode, unsigned long goal,
   if (block_i) {
     my_rsv = &block_i->rsv_window_node;
   }
-  // 检查文件系统中剩余块数是否能满足需求数量
+  // 空间是否足够由各个块组的空闲区间树决定，不再检查全局的空闲块数
   struct baby_sb_info *sb_info = BABY_SB(sb);
-  if (sb_info->nr_free_blocks < *count) {
-    *err = -ENOSPC;
-    goto out;
-  }
   // 检查 goal 是否超出
   struct baby_super_block *b_sb = sb_info->s_babysb;
   if (goal < NR_DSTORE_BLOCKS || goal > NR_DSTORE_BLOCKS + b_sb->nr_blocks - 1)
     goal = NR_DSTORE_BLOCKS;
+  // 日志结构模式下普通文件的数据追加到日志上，不用 goal 和预留窗口
+  if (baby_log_mode(sb) && S_ISREG(inode->i_mode))
+    return baby_log_alloc(inode, count, err);
 
   goal -= NR_DSTORE_BLOCKS;
 #ifdef RSV_DEBUG
   printk("baby_new_blocks: logical goal %lu\n", goal);
 #endif
-  // bitmap 数量
   unsigned long num = *count;
-  unsigned int windowsz = 0; // 窗口大小
-  if(my_rsv)  // 需要判断，否则会在目录文件为 null 的时候使用 my_rsv
-    windowsz = my_rsv->rsv_goal_size;
-  free_blocks = sb_info->nr_free_blocks;         // 系统剩余空闲数量
-  
 
 retry_alloc:
-  // 没有剩余空间分配预留窗口了
-  if (my_rsv && (free_blocks < windowsz) && (free_blocks > 0) &&
-      (rsv_is_empty(&my_rsv->rsv_window)))
-    my_rsv = NULL;
-
-  if (!free_blocks) {
-    *err = -ENOSPC;
-    goto out;
-  }
-
   // 尝试分配
   ret_block = baby_try_to_allocate_with_rsv(sb, goal, my_rsv, &num);
 #ifdef RSV_DEBUG
@@ -835,7 +1135,6 @@ allocated:
   printk("-----------------------------\n");
 #endif
 
-  sb_info->nr_free_blocks -= num;
   *err = 0;
   if (num < *count) {
     *count = num;
@@ -850,4 +1149,143 @@ out:
 #endif
 
   return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * 冷热分离
+ *
+ * 闪存的擦除块里混着寿命差别很大的数据时，垃圾回收要反复搬运其中还有效的数据。
+ * 数据区按块组分成三个区域：开头 1/16 的块组放热数据，接下来 1/4 放温数据，其余放冷数据。
+ * 新文件的第一个 goal 落在自己温度的区域里，之后顺着已有的块分配；
+ * 区域满了时分配器照常去其他块组找，区域只决定 goal，不限制分配。
+ * 间接块和区间树块不使用文件的预留窗口，从 s_hot_cursor 开始顺序分配，和数据块分开。
+ *
+ * 每一类还通过 inode 的 i_write_hint 告诉块层数据的寿命，iomap 回写、直接 I/O
+ * 和目录页的回写都会把它带到 bio 上；用户用 fcntl(F_SET_RW_HINT) 设置过时以用户的为准
+ */
+
+// 温度 temp 的区域：从第 *first 个块组开始的 *n 个块组
+void baby_temp_region(struct baby_sb_info *sbi, enum baby_temp temp,
+                             unsigned long *first, unsigned long *n) {
+  unsigned long ngroups = sbi->nr_bitmap;
+  unsigned long hot = max(ngroups / 16, 1UL), warm = max(ngroups / 4, 1UL);
+
+  switch (temp) {
+  case BABY_TEMP_HOT:
+    *first = 0;
+    *n = hot;
+    break;
+  case BABY_TEMP_WARM:
+    *first = hot;
+    *n = warm;
+    break;
+  default:
+    *first = hot + warm;
+    *n = ngroups > hot + warm ? ngroups - hot - warm : 0;
+    break;
+  }
+  // 块组太少，分不出这个区域时使用全部块组
+  if (!*n || *first + *n > ngroups) {
+    *first = 0;
+    *n = ngroups;
+  }
+}
+
+/*
+ * 温度 temp 的新文件的第一个 goal，返回物理块号
+ * 热数据从 s_hot_cursor 接着往后放；其他按进程号在区域里分成 16 * n 个位置，
+ * 多核同时写新文件时落在不同的块组里
+ */
+unsigned long baby_temp_goal(struct super_block *sb, enum baby_temp temp) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long first, n, start, len;
+
+  if (temp == BABY_TEMP_HOT)
+    return READ_ONCE(sbi->s_hot_cursor) + NR_DSTORE_BLOCKS;
+  baby_temp_region(sbi, temp, &first, &n);
+  start = first * BABYFS_BIT_PRE_BLOCK;
+  len = baby_group_end(sbi, first + n - 1) - start;
+  return NR_DSTORE_BLOCKS + start +
+         (current->pid % (16 * n)) * (len / (16 * n));
+}
+
+// 目录和符号链接是热的；普通文件按用户指定的寿命，没有指定时改写过的是温的，只追加的是冷的
+enum baby_temp baby_inode_temp(struct inode *inode) {
+  struct baby_inode_info *bbi = BABY_I(inode);
+  enum rw_hint hint = inode->i_write_hint;
+
+  if (!S_ISREG(inode->i_mode))
+    return BABY_TEMP_HOT;
+  if (hint != WRITE_LIFE_NOT_SET && hint != bbi->i_auto_hint) {
+    switch (hint) {
+    case WRITE_LIFE_SHORT:
+      return BABY_TEMP_HOT;
+    case WRITE_LIFE_LONG:
+    case WRITE_LIFE_EXTREME:
+      return BABY_TEMP_COLD;
+    default:
+      return BABY_TEMP_WARM;
+    }
+  }
+  return bbi->i_flags & BABYFS_REWRITE_FL ? BABY_TEMP_WARM : BABY_TEMP_COLD;
+}
+
+// 用户没有指定寿命时按温度设置 i_write_hint，记在 i_auto_hint 里，以便和用户的区分开
+void baby_set_write_hint(struct inode *inode) {
+  static const enum rw_hint hints[BABY_TEMP_NR] = {
+      [BABY_TEMP_HOT] = WRITE_LIFE_SHORT,
+      [BABY_TEMP_WARM] = WRITE_LIFE_MEDIUM,
+      [BABY_TEMP_COLD] = WRITE_LIFE_LONG,
+  };
+  struct baby_inode_info *bbi = BABY_I(inode);
+  enum rw_hint hint = inode->i_write_hint;
+
+  if (hint != WRITE_LIFE_NOT_SET && hint != bbi->i_auto_hint)
+    return;
+  bbi->i_auto_hint = hints[baby_inode_temp(inode)];
+  inode->i_write_hint = bbi->i_auto_hint;
+}
+
+/*
+ * 写 i_size 之内的数据时调用：普通文件第一次被改写之后不再是冷数据，
+ * 之后新分配的块放到温区域，标志记在磁盘上
+ */
+void baby_mark_rewrite(struct inode *inode) {
+  struct baby_inode_info *bbi = BABY_I(inode);
+
+  if (!S_ISREG(inode->i_mode) || (bbi->i_flags & BABYFS_REWRITE_FL))
+    return;
+  bbi->i_flags |= BABYFS_REWRITE_FL;
+  baby_set_write_hint(inode);
+  mark_inode_dirty(inode);
+}
+
+/*
+ * 分配最多 *count 个连续的元数据块（间接块、区间树块），返回物理块号
+ * 从 s_hot_cursor 开始，不使用预留窗口；游标离开热区域之后回到区域开头
+ * 元数据最集中地反复改写热区域，游标所在的块组比热区域里磨损最少的块组写得多很多时
+ * 和预留窗口一样换到那个块组，热文件的第一个 goal 跟着游标走
+ */
+unsigned long baby_new_meta_blocks(struct inode *inode, unsigned long *count,
+                                   int *err) {
+  struct super_block *sb = inode->i_sb;
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long first, n, next, goal;
+  baby_fsblk_t ret;
+
+  spin_lock(&sbi->s_rsv_window_lock);
+  goal = baby_wear_goal(sb, READ_ONCE(sbi->s_hot_cursor), *count);
+  spin_unlock(&sbi->s_rsv_window_lock);
+  ret = baby_try_to_allocate(sb, goal, count, NULL);
+  if (ret < 0) {
+    *err = -ENOSPC;
+    return 0;
+  }
+  baby_temp_region(sbi, BABY_TEMP_HOT, &first, &n);
+  next = ret + *count;
+  if (next >= baby_group_end(sbi, first + n - 1))
+    next = first * BABYFS_BIT_PRE_BLOCK;
+  WRITE_ONCE(sbi->s_hot_cursor, next);
+  *err = 0;
+  return ret + NR_DSTORE_BLOCKS;
+}
@@ -0,0 +1,272 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/math64.h>
+#include <linux/pagemap.h>
+#include <linux/timekeeping.h>
+#include <linux/workqueue.h>
+
+#include "babyfs.h"
+
+/*
+ * 段清理
+ *
+ * 日志结构模式下改写留下的旧块分散在各个段里，空闲段用完之后日志只能在
+ * 段里的空隙中分配，写入又变回随机的。后台 work 定期检查空闲段的数量，
+ * 不够时按收益/成本选出要清理的段（Sprite LFS 的 cost-benefit）：
+ *
+ *   (1 - u) * age / (1 + u)
+ *
+ * u 是段里有效块的比例，age 是段最近一次写入到现在的时间，越空、越久没写的段越值得清理。
+ *
+ * 清理时按段摘要找到每个有效块所属的文件和逻辑块，确认区间树仍然指向这一块之后
+ * 把对应的页读进来标记为脏，再由清理线程自己回写：回写时和普通的改写一样分配新块、
+ * 释放旧块，数据追加到冷日志上。这样不用另外处理和写入、截断的并发，页锁已经保证了。
+ * 清理之后段里还有块（目录、间接块、未写区间等搬不走的块），在这个段再有块释放之前不再选它
+ *
+ * zoned 设备上清理的单位是整个 zone，清空之后日志重新打开它时才重置 zone
+ */
+
+#define BABY_CLEAN_INTERVAL (10 * HZ) // 检查空闲段的周期
+#define BABY_CLEAN_FREE_RATIO 8       // 空闲段少于 1/8 时开始清理
+#define BABY_CLEAN_MAX_VICTIMS 4      // 每一轮最多清理的段数
+
+// 正在处理的文件，它的脏页在 [first, last] 之间，换到下一个文件之前一起回写
+struct baby_clean_ctx {
+  struct inode *inode;
+  pgoff_t first;
+  pgoff_t last;
+};
+
+static unsigned long baby_free_segs(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long seg, nr = 0;
+
+  spin_lock(&sbi->s_seg_lock);
+  for (seg = sbi->s_seg_first; seg < sbi->s_nr_segs; seg++)
+    nr += !sbi->s_segs[seg].sg_valid;
+  spin_unlock(&sbi->s_seg_lock);
+  return nr;
+}
+
+// 按收益/成本选出要清理的段，没有可以清理的段时返回 -1
+static long baby_select_victim(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  time64_t now = ktime_get_real_seconds();
+  struct baby_segment *sg;
+  unsigned long seg, len, age;
+  u64 score, best = 0;
+  long victim = -1;
+
+  spin_lock(&sbi->s_seg_lock);
+  for (seg = sbi->s_seg_first; seg < sbi->s_nr_segs; seg++) {
+    sg = &sbi->s_segs[seg];
+    len = baby_seg_len(sbi, seg);
+    if ((sg->sg_flags & (BABY_SEG_OPEN | BABY_SEG_NOCLEAN)) ||
+        !sg->sg_valid || sg->sg_valid >= len)
+      continue;
+    age = now > sg->sg_mtime ? now - sg->sg_mtime : 0;
+    // 放大 1024 倍保留小数部分，age 加一让刚挂载时只按有效块比例选
+    score = div_u64((u64)(len - sg->sg_valid) * (age + 1) * 1024,
+                    len + sg->sg_valid);
+    if (score > best) {
+      best = score;
+      victim = seg;
+    }
+  }
+  spin_unlock(&sbi->s_seg_lock);
+  return victim;
+}
+
+// 回写当前文件在清理中标脏的页，放掉 inode
+static void baby_clean_flush(struct baby_clean_ctx *ctx) {
+  struct inode *inode = ctx->inode;
+
+  if (!inode)
+    return;
+  if (ctx->first <= ctx->last)
+    filemap_write_and_wait_range(inode->i_mapping,
+                                 (loff_t)ctx->first << PAGE_SHIFT,
+                                 ((loff_t)(ctx->last + 1) << PAGE_SHIFT) - 1);
+  iput(inode);
+  ctx->inode = NULL;
+}
+
+/*
+ * 搬走物理块 pblk（inode ino 的逻辑块 block）：确认映射还是这一块之后把页标记为脏
+ * 摘要过时、文件已经删除或者块在未写区间里时跳过
+ */
+static void baby_clean_block(struct super_block *sb, struct baby_clean_ctx *ctx,
+                             unsigned long pblk, unsigned long ino,
+                             unsigned long block) {
+  struct inode *inode = ctx->inode;
+  struct buffer_head map;
+  struct page *page;
+  pgoff_t index;
+
+  if (!ino || ino >= BABYFS_INODE_NUM_COUNTS)
+    return;
+  if (inode && inode->i_ino != ino) {
+    baby_clean_flush(ctx);
+    inode = NULL;
+  }
+  if (!inode) {
+    inode = baby_iget(sb, ino);
+    if (IS_ERR(inode))
+      return;
+    if (!S_ISREG(inode->i_mode) || !baby_inode_extents(inode) ||
+        !inode->i_nlink) {
+      iput(inode);
+      return;
+    }
+    ctx->inode = inode;
+    ctx->first = ULONG_MAX;
+    ctx->last = 0;
+  }
+
+  map.b_state = 0;
+  if (baby_ext_get_blocks(inode, block, 1, &map, 0) != 1 ||
+      buffer_unwritten(&map) || map.b_blocknr != pblk)
+    return;
+  index = block >> (PAGE_SHIFT - inode->i_blkbits);
+  if ((loff_t)index << PAGE_SHIFT >= i_size_read(inode))
+    return;
+  page = read_mapping_page(inode->i_mapping, index, NULL);
+  if (IS_ERR(page))
+    return;
+  lock_page(page);
+  // 等待锁的时候可能被截断了
+  if (page->mapping == inode->i_mapping) {
+    set_page_dirty(page);
+    ctx->first = min(ctx->first, index);
+    ctx->last = max(ctx->last, index);
+  }
+  unlock_page(page);
+  put_page(page);
+}
+
+/*
+ * 清理一个段：段摘要和位图一块块对照着读，搬走其中的有效块
+ * zoned 设备上的段是整个 zone，可能跨过多个块组
+ */
+static void baby_clean_segment(struct super_block *sb, unsigned long seg) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long start = baby_seg_start(sbi, seg), blk, end, group = ULONG_MAX;
+  struct baby_clean_ctx ctx = {};
+  struct buffer_head *bitmap = NULL, *bh;
+  struct baby_summary *ss;
+  int i;
+
+  end = start + baby_seg_len(sbi, seg);
+  for (blk = start; blk < end && !READ_ONCE(sbi->s_clean_stop);) {
+    if (blk / BABYFS_BIT_PRE_BLOCK != group) {
+      group = blk / BABYFS_BIT_PRE_BLOCK;
+      brelse(bitmap);
+      bitmap = sb_bread(sb, BABYFS_DATA_BIT_MAP_BLOCK_BASE + group);
+      if (!bitmap)
+        break;
+    }
+    bh = sb_bread(sb, sbi->s_ssa_start + blk / BABYFS_SUMMARY_PER_BLOCK);
+    if (!bh)
+      break;
+    ss = (struct baby_summary *)bh->b_data;
+    // 块组是摘要块的整数倍，一个摘要块不会跨块组
+    for (i = blk % BABYFS_SUMMARY_PER_BLOCK;
+         i < BABYFS_SUMMARY_PER_BLOCK && blk < end; i++, blk++) {
+      if (!test_bit_le(blk % BABYFS_BIT_PRE_BLOCK, bitmap->b_data))
+        continue;
+      baby_clean_block(sb, &ctx, blk + NR_DSTORE_BLOCKS,
+                       le32_to_cpu(ss[i].ss_ino), le32_to_cpu(ss[i].ss_block));
+    }
+    brelse(bh);
+    cond_resched();
+  }
+  baby_clean_flush(&ctx);
+  brelse(bitmap);
+
+  spin_lock(&sbi->s_seg_lock);
+  if (sbi->s_segs[seg].sg_valid)
+    sbi->s_segs[seg].sg_flags |= BABY_SEG_NOCLEAN;
+  spin_unlock(&sbi->s_seg_lock);
+}
+
+static void baby_clean_work(struct work_struct *work) {
+  struct baby_sb_info *sbi =
+      container_of(to_delayed_work(work), struct baby_sb_info, s_clean_work);
+  struct super_block *sb = sbi->s_sb;
+  unsigned long target = (sbi->s_nr_segs - sbi->s_seg_first) /
+                         BABY_CLEAN_FREE_RATIO;
+  long victim;
+  int i;
+
+  if (READ_ONCE(sbi->s_clean_stop))
+    return;
+  // 冻结期间不能写
+  if (!sb_start_write_trylock(sb))
+    goto out;
+  sbi->s_cleaner = current;
+  for (i = 0; i < BABY_CLEAN_MAX_VICTIMS && !READ_ONCE(sbi->s_clean_stop);
+       i++) {
+    if (baby_free_segs(sb) > target)
+      break;
+    victim = baby_select_victim(sb);
+    if (victim < 0)
+      break;
+    // 搬运需要新块，空间不够时不清理
+    if (!baby_has_free_blocks(sbi, sbi->s_segs[victim].sg_valid))
+      break;
+    baby_clean_segment(sb, victim);
+  }
+  sbi->s_cleaner = NULL;
+  sb_end_write(sb);
+out:
+  if (!READ_ONCE(sbi->s_clean_stop))
+    queue_delayed_work(system_long_wq, &sbi->s_clean_work,
+                       BABY_CLEAN_INTERVAL);
+}
+
+void baby_cleaner_sb_init(struct baby_sb_info *sbi) {
+  INIT_DELAYED_WORK(&sbi->s_clean_work, baby_clean_work);
+}
+
+// 挂载的最后调用，只读挂载时不清理
+void baby_cleaner_start(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+
+  if (!baby_log_mode(sb) || sb_rdonly(sb))
+    return;
+  queue_delayed_work(system_long_wq, &sbi->s_clean_work, BABY_CLEAN_INTERVAL);
+}
+
+// 日志找不到空闲段时在 s_log_mutex 下调用，立即开始一轮清理
+void baby_cleaner_kick(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+
+  if (!READ_ONCE(sbi->s_clean_stop) && !sb_rdonly(sb))
+    mod_delayed_work(system_long_wq, &sbi->s_clean_work, 0);
+}
+
+/*
+ * 清理时持有 inode 引用，和孤儿一样要在 VFS 回收所有 inode 之前停下来
+ * 正在清理的段处理完当前的摘要块就返回
+ */
+void baby_cleaner_stop(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+
+  if (!baby_log_mode(sb))
+    return;
+  // baby_cleaner_kick 都在 s_log_mutex 下调用，之后不会再有人排队
+  mutex_lock(&sbi->s_log_mutex);
+  WRITE_ONCE(sbi->s_clean_stop, 1);
+  mutex_unlock(&sbi->s_log_mutex);
+  cancel_delayed_work_sync(&sbi->s_clean_work);
+}
+
+// 重新挂载为读写时调用，这时 sb 上还是只读标志
+void baby_cleaner_resume(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+
+  if (!baby_log_mode(sb))
+    return;
+  WRITE_ONCE(sbi->s_clean_stop, 0);
+  queue_delayed_work(system_long_wq, &sbi->s_clean_work, BABY_CLEAN_INTERVAL);
+}
@@ -1,16 +1,24 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/iversion.h>
+#include <linux/mm.h>
 #include <linux/pagemap.h>
 
 #include "babyfs.h"
 
-// 获取 ".." 磁盘目录项
+// 块内偏移
+#define BABY_BLOCK_OFFSET(x) ((x) & (BABYFS_BLOCK_SIZE - 1))
+
+static inline __u8 *baby_de_type(struct super_block *sb, struct dir_record *de) {
+  return baby_dir_v2(sb) ? &BABY_DE2(de)->file_type : &de->file_type;
+}
+
+// 获取 ".." 磁盘目录项，它紧跟在 "." 之后
 struct dir_record *baby_dotdot(struct inode *dir, struct page **p) {
   struct page *page = baby_get_page(dir, 0);
   struct dir_record *de = NULL;
   if (!IS_ERR(page)) {
-    de = (struct dir_record *)page_address(page);
+    de = baby_next_de(dir->i_sb, (struct dir_record *)page_address(page));
     *p = page;
   }
   return de;
@@ -22,13 +30,14 @@ void baby_set_link(struct inode *dir, struct dir_record *de, struct page *page,
                    struct inode *inode, int update_times) {
   // 获取 de 在 dir 中的偏移
   loff_t pos = page_offset(page) + (char *)de - (char *)page_address(page);
+  unsigned int len = baby_de_rec_len(dir->i_sb, de);
   int err;
   // 写数据
   lock_page(page);
-  err = baby_prepare_chunk(page, pos, de->name_len);
+  err = baby_prepare_chunk(page, pos, len);
   de->inode_no = cpu_to_le32(inode->i_ino);
   baby_set_de_type(de, inode);
-  err = baby_commit_chunk(page, pos, de->name_len);
+  err = baby_commit_chunk(page, pos, len);
   baby_put_page(page);
   if(update_times)
     dir->i_mtime = dir->i_ctime = current_time(dir);
@@ -68,39 +77,265 @@ int baby_prepare_chunk(struct page *page, loff_t pos, unsigned len) {
   return __block_write_begin(page, pos, len, baby_get_block);
 }
 
+/*
+ * 有日志时目录块不走页回写，[from, to) 区间内的 bh 交给当前事务，
+ * 提交后由日志检查点写回原位置
+ */
+static void baby_journal_chunk(struct inode *dir, struct page *page,
+                               unsigned from, unsigned to) {
+  struct buffer_head *bh, *head = page_buffers(page);
+  unsigned block_start, block_end;
+  int partial = 0;
+
+  for (bh = head, block_start = 0; bh != head || !block_start;
+       block_start = block_end, bh = bh->b_this_page) {
+    block_end = block_start + bh->b_size;
+    if (block_end <= from || block_start >= to) {
+      if (!buffer_uptodate(bh))
+        partial = 1;
+      continue;
+    }
+    set_buffer_uptodate(bh);
+    clear_buffer_new(bh);
+    baby_journal_dirty(dir->i_sb, dir, bh);
+  }
+  if (!partial)
+    SetPageUptodate(page);
+}
+
 int baby_commit_chunk(struct page *page, loff_t pos, unsigned len) {
   struct address_space *mapping = page->mapping;
   struct inode *dir = mapping->host;
+  unsigned from = pos & (PAGE_SIZE - 1);
   int err = 0;
   inode_inc_iversion(dir);
-  block_write_end(NULL, mapping, pos, len, len, page,
-                  NULL);  // 标记在 [from, to] 区间内的 bh 为脏
+  if (baby_has_journal(dir->i_sb))
+    baby_journal_chunk(dir, page, from, from + len);
+  else
+    block_write_end(NULL, mapping, pos, len, len, page,
+                    NULL);  // 标记在 [from, to] 区间内的 bh 为脏
 
   if (pos + len > dir->i_size) {
     i_size_write(dir, pos + len);
     mark_inode_dirty(dir);
   }
-  err = write_one_page(page);  // 调用 aops->writepage，函数执行结束 page 被解锁
-  if (!err) sync_inode_metadata(dir, 1);  // 将 inode 写到磁盘
+  /*
+   * 只有目录同步（inode 的 S_DIRSYNC、dirsync/sync 挂载选项）时才立即写盘，
+   * 否则页面已经标记为脏，和目录 inode 一起交给 writepages/write_inode 批量回写，
+   * 需要持久化的时候由目录的 fsync 保证；有日志时由 handle 结束时提交事务保证
+   */
+  if (IS_DIRSYNC(dir) && !baby_has_journal(dir->i_sb)) {
+    err = write_one_page(page);  // 调用 aops->writepage，函数执行结束 page 被解锁
+    if (!err) err = sync_inode_metadata(dir, 1);  // 将 inode 写到磁盘
+  } else {
+    unlock_page(page);
+  }
   return err;
 }
 
 void baby_set_de_type(struct dir_record *de, struct inode *inode) {
-  de->file_type = 0;
+  __u8 *type = baby_de_type(inode->i_sb, de);
+  *type = 0;
   if (S_ISDIR(inode->i_mode))
-    de->file_type = S_IFDIR;
+    *type = S_IFDIR;
   else if (S_ISREG(inode->i_mode))
-    de->file_type = S_IFREG;
+    *type = S_IFREG;
   return;
 }
 
-static inline int baby_match(int len, const char * const name,
-          struct dir_record *de){
-  if(len != de->name_len)
-    return 0;
-  if(!de->inode_no)
+/*
+ * 目录项 de 中可以用来存放新目录项的空间
+ * 空闲目录项是整个 rec_len；v2 的有效目录项还可以拆分出名字之后的剩余空间
+ */
+static unsigned int baby_de_space(struct super_block *sb,
+                                  struct dir_record *de) {
+  if (!baby_de_used(sb, de))
+    return baby_de_rec_len(sb, de);
+  if (baby_dir_v2(sb))
+    return baby_de_rec_len(sb, de) -
+           BABYFS_DIR_V2_REC_LEN(BABY_DE2(de)->name_len);
+  return 0;
+}
+
+/*
+ * 在 kaddr 开始的目录块中找一个能放下 need 字节的目录项
+ * @space: 不为 NULL 时返回块内最大的空闲空间，此时会扫描整个块
+ */
+static struct dir_record *baby_block_find_room(struct super_block *sb,
+                                               char *kaddr, unsigned int need,
+                                               unsigned int *space) {
+  struct dir_record *de, *found = NULL;
+  unsigned int offset = 0, max_space = 0, s;
+
+  while (offset < BABYFS_BLOCK_SIZE) {
+    de = (struct dir_record *)(kaddr + offset);
+    if (!baby_de_ok(sb, de, offset)) { // 块已经损坏，不再往里面插入目录项
+      found = NULL;
+      max_space = 0;
+      break;
+    }
+    s = baby_de_space(sb, de);
+    if (s >= need && !found) {
+      found = de;
+      if (!space)
+        break;
+    }
+    max_space = max(max_space, s);
+    offset += baby_de_rec_len(sb, de);
+  }
+  if (space)
+    *space = max_space;
+  return found;
+}
+
+/*
+ * 目录空闲空间位图
+ * 每个目录块在每个等级的位图中占一位，第 c 个位图中置位的块至少有 baby_free_class[c]
+ * 字节连续的空闲空间。插入 need 字节的目录项时，在第一个不小于 need 的等级中查找，
+ * 找到的块一定放得下。v1 目录块的空闲空间只有 0 和 256 两种情况
+ *
+ * 第一次插入目录项时扫描整个目录建立，之后由 add_link/delete_entry 维护。
+ * 修改目录的操作都持有目录的 i_rwsem，所以这里不需要额外的锁
+ */
+static const unsigned short baby_free_class[BABYFS_DIR_FREE_CLASSES] = {
+    12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 1024};
+
+// 扩大位图，使其可以容纳 nblocks 个目录块，新增的位都是 0
+static int baby_dir_free_grow(struct baby_dir_free *df, unsigned long nblocks) {
+  unsigned long cap, words, old_words;
+  unsigned long *map;
+  int c;
+
+  if (nblocks <= df->cap)
     return 0;
-  return !memcmp(name, de->name, len);
+  cap = max3(df->cap * 2, nblocks, (unsigned long)BITS_PER_LONG);
+  cap = round_up(cap, BITS_PER_LONG);
+  words = BITS_TO_LONGS(cap);
+  old_words = BITS_TO_LONGS(df->cap);
+  // 所有等级的位图放在一次分配中
+  map = kvzalloc(words * BABYFS_DIR_FREE_CLASSES * sizeof(unsigned long),
+                 GFP_NOFS);
+  if (!map)
+    return -ENOMEM;
+  for (c = 0; c < BABYFS_DIR_FREE_CLASSES; ++c) {
+    if (df->map[0])
+      memcpy(map + c * words, df->map[c], old_words * sizeof(unsigned long));
+  }
+  kvfree(df->map[0]);
+  for (c = 0; c < BABYFS_DIR_FREE_CLASSES; ++c)
+    df->map[c] = map + c * words;
+  df->cap = cap;
+  return 0;
+}
+
+void baby_dir_free_map_release(struct inode *dir) {
+  struct baby_dir_free *df = BABY_I(dir)->i_dir_free;
+
+  if (!df)
+    return;
+  kvfree(df->map[0]);
+  kfree(df);
+  BABY_I(dir)->i_dir_free = NULL;
+}
+
+// 记录第 blk 个目录块的最大空闲空间
+static void baby_dir_free_set(struct baby_dir_free *df, unsigned long blk,
+                              unsigned int space) {
+  int c;
+
+  for (c = 0; c < BABYFS_DIR_FREE_CLASSES; ++c) {
+    if (space >= baby_free_class[c]) {
+      __set_bit(blk, df->map[c]);
+      if (blk < df->hint[c])
+        df->hint[c] = blk;
+    } else {
+      __clear_bit(blk, df->map[c]);
+    }
+  }
+}
+
+// 扫描整个目录，建立空闲空间位图
+static int baby_dir_free_build(struct inode *dir) {
+  unsigned long nblocks = dir->i_size / BABYFS_BLOCK_SIZE, blk;
+  struct baby_dir_free *df;
+  struct page *page = NULL;
+  unsigned int space;
+  loff_t pos;
+
+  df = kzalloc(sizeof(*df), GFP_NOFS);
+  if (!df)
+    return -ENOMEM;
+  if (baby_dir_free_grow(df, nblocks)) {
+    kfree(df);
+    return -ENOMEM;
+  }
+  for (blk = 0; blk < nblocks; ++blk) {
+    pos = (loff_t)blk * BABYFS_BLOCK_SIZE;
+    if (!page || page->index != pos >> PAGE_SHIFT) {
+      if (page)
+        baby_put_page(page);
+      page = baby_get_page(dir, pos >> PAGE_SHIFT);
+      if (IS_ERR(page)) {
+        kvfree(df->map[0]);
+        kfree(df);
+        return PTR_ERR(page);
+      }
+    }
+    baby_block_find_room(dir->i_sb,
+                         (char *)page_address(page) + (pos & ~PAGE_MASK),
+                         UINT_MAX, &space);
+    baby_dir_free_set(df, blk, space);
+  }
+  if (page)
+    baby_put_page(page);
+  df->nblocks = nblocks;
+  BABY_I(dir)->i_dir_free = df;
+  return 0;
+}
+
+/*
+ * 从空闲空间位图中找一个能放下 need 字节的目录块
+ * 返回目录块编号，等于目录块数量表示需要追加一个新块
+ */
+static long baby_dir_free_find(struct inode *dir, unsigned int need) {
+  struct baby_dir_free *df;
+  unsigned long blk;
+  int c = 0, err;
+
+  if (!BABY_I(dir)->i_dir_free) {
+    err = baby_dir_free_build(dir);
+    if (err)
+      return err;
+  }
+  df = BABY_I(dir)->i_dir_free;
+  while (baby_free_class[c] < need)
+    ++c;
+  blk = find_next_bit(df->map[c], df->nblocks, df->hint[c]);
+  df->hint[c] = blk; // blk 之前已经没有满足这个等级的块了
+  return blk;
+}
+
+// pos 所在的目录块被修改了，重新计算它的空闲空间
+static void baby_dir_free_update(struct inode *dir, struct page *page,
+                                 loff_t pos) {
+  struct baby_dir_free *df = BABY_I(dir)->i_dir_free;
+  unsigned long blk = pos / BABYFS_BLOCK_SIZE;
+  unsigned int space;
+
+  if (!df)
+    return;
+  if (blk >= df->nblocks) { // 追加了一个新块
+    if (baby_dir_free_grow(df, blk + 1)) {
+      baby_dir_free_map_release(dir); // 下次插入时重建
+      return;
+    }
+    df->nblocks = blk + 1;
+  }
+  baby_block_find_room(dir->i_sb,
+                       (char *)page_address(page) +
+                           (((loff_t)blk * BABYFS_BLOCK_SIZE) & ~PAGE_MASK),
+                       UINT_MAX, &space);
+  baby_dir_free_set(df, blk, space);
 }
 
 /*
@@ -111,77 +346,133 @@ static inline int baby_match(int len, const char * const name,
  */
 int baby_add_link(struct dentry *dentry, struct inode *inode) {
   struct inode *dir = d_inode(dentry->d_parent);  // 父目录 inode
+  struct super_block *sb = dir->i_sb;
   const char *name = dentry->d_name.name;         // 目录项的 name
   int namelen = dentry->d_name.len;               // 目录项 namelen
-  unsigned long npages = dir_pages(dir);          // 父目录的页数
-  loff_t pos;
-  struct dir_record *de;
-  unsigned long nloop = 0;
-  struct page *page;
+  unsigned long nblocks = dir->i_size / BABYFS_BLOCK_SIZE; // 父目录的块数
+  unsigned int need = baby_dir_v2(sb) ? BABYFS_DIR_V2_REC_LEN(namelen)
+                                      : BABYFS_DIR_RECORD_SIZE;
+  unsigned long blk;
+  long start;
+  loff_t pos, chunk_pos;
+  unsigned int chunk_len;
+  struct dir_record *de = NULL;
+  struct page *page = NULL;
   char *kaddr;
-  unsigned short rec_len;
   int err = 0;
-  /* 开始查找空闲的目录项 */
-  for (nloop = 0; nloop <= npages; ++nloop) {
-    page = baby_get_page(dir, nloop);  // 按编号查找 page
-    if (IS_ERR(page)) goto out;
-    lock_page(page);
-    kaddr = page_address(page);  // page 起始地址
-    char *dir_end =
-        kaddr +
-        baby_last_byte(dir, nloop);  // 当前页面的最后地址，page 可能不满一页
-                                     // last_byte 正常情况下返回 BLOCK_SIZE
-    de = (struct dir_record *)kaddr;
-    while ((char *)de < kaddr + PAGE_SIZE) {
-      // 到达 i_size
-      if ((char *)de == dir_end) {
-        rec_len = BABYFS_BLOCK_SIZE;
-        goto got_it;
+  // 有索引的目录直接通过索引判断重名
+  if (BABY_I(dir)->i_flags & BABYFS_INDEX_FL) {
+    if (baby_find_entry(dir, &dentry->d_name, &page)) {
+      baby_put_page(page);
+      return -EEXIST;
+    }
+    page = NULL;
+  }
+  /*
+   * 优先使用空闲空间位图，直接定位到放得下的目录块或者追加位置；位图不可用（内存不足）时从头逐块查找
+   * 这里不再逐项检查重名：vfs 在持有目录 i_rwsem 的情况下已经确认 dentry 不存在
+   */
+  start = baby_dir_free_find(dir, need);
+  if (start < 0 || (unsigned long)start > nblocks)
+    start = 0;
+  for (blk = start; blk <= nblocks; ++blk) {
+    pos = (loff_t)blk * BABYFS_BLOCK_SIZE;
+    if (!page || page->index != pos >> PAGE_SHIFT) {
+      if (page) {
+        unlock_page(page);
+        baby_put_page(page);
       }
-      if (baby_match (namelen, name, de))	// 判断重名
-        goto page_unlock;
-      rec_len = BABYFS_DIR_RECORD_SIZE;
-      // 无效 de
-      if (!de->inode_no && !de->name_len) goto got_it;
-      ++de;
+      page = baby_get_page(dir, pos >> PAGE_SHIFT);
+      if (IS_ERR(page))
+        return PTR_ERR(page);
+      lock_page(page);
+    }
+    kaddr = (char *)page_address(page) + (pos & ~PAGE_MASK);
+    if (blk == nblocks) { // 到达 i_size，追加一个新块
+      de = (struct dir_record *)kaddr;
+      chunk_pos = pos;
+      chunk_len = BABYFS_BLOCK_SIZE;
+      break;
+    }
+    de = baby_block_find_room(sb, kaddr, need, NULL);
+    if (de) {
+      chunk_pos = pos + ((char *)de - kaddr);
+      chunk_len = baby_de_rec_len(sb, de);
+      break;
     }
-    unlock_page(page);
-    baby_put_page(page);
   }
-  return -EINVAL;
 
-got_it:
-  // 获取文件内偏移量; page->index >> PAGE_SHIFT + delta
-  pos = page_offset(page) + (char *)de - (char *)page_address(page);
   // 直接调用 __block_write_begin，保证写数据的时候先和磁盘同步，避免数据覆盖
-  err = baby_prepare_chunk(page, pos, rec_len);
-  // printk(KERN_INFO "add_link---err_baby_prepare_chunk: %d", err);
+  err = baby_prepare_chunk(page, chunk_pos, chunk_len);
   if (err) goto page_unlock;
-  de->name_len = namelen;
-  memcpy(de->name, name, namelen);
-  // 由于babyfs的目录项长度固定，将目录项名称后的字符清零会更有利于调试，不这样做也可以
-  memset((char *)(de->name) + namelen, 0, BABYFS_FILENAME_MAX_LEN - namelen);
+  if (baby_dir_v2(sb)) {
+    struct baby_dir_entry_2 *de2 = BABY_DE2(de);
+    if (blk == nblocks) {
+      de2->rec_len = cpu_to_le16(BABYFS_BLOCK_SIZE);
+    } else if (de2->inode_no) {
+      // 拆分有效目录项，新目录项放在它名字之后的剩余空间中
+      unsigned int used = BABYFS_DIR_V2_REC_LEN(de2->name_len);
+      struct baby_dir_entry_2 *next =
+          (struct baby_dir_entry_2 *)((char *)de2 + used);
+      next->rec_len = cpu_to_le16(le16_to_cpu(de2->rec_len) - used);
+      de2->rec_len = cpu_to_le16(used);
+      de2 = next;
+    }
+    de2->name_len = namelen;
+    memcpy(de2->name, name, namelen);
+    // 清零名字后面用于对齐的字节
+    memset(de2->name + namelen, 0, BABYFS_DIR_V2_REC_LEN(namelen) - 8 - namelen);
+    de = (struct dir_record *)de2;
+  } else {
+    de->name_len = namelen;
+    memcpy(de->name, name, namelen);
+    // 由于babyfs的目录项长度固定，将目录项名称后的字符清零会更有利于调试，不这样做也可以
+    memset((char *)(de->name) + namelen, 0, BABYFS_FILENAME_MAX_LEN - namelen);
+  }
   de->inode_no = cpu_to_le32(inode->i_ino);
   baby_set_de_type(de, inode);
+  // 获取文件内偏移量; page->index >> PAGE_SHIFT + delta
+  pos = page_offset(page) + (char *)de - (char *)page_address(page);
   // 提交 change，把 page 写到磁盘
-  err = baby_commit_chunk(page, pos, rec_len);
-  // printk(KERN_INFO "add_link---err_baby_commit_chunk: %d", err);
-  dir->i_mtime = dir->i_ctime = BABYFS_CURRENT_TIME;
+  err = baby_commit_chunk(page, chunk_pos, chunk_len);
+  if (!err) {
+    baby_dir_free_update(dir, page, pos);
+    baby_dx_insert(dir, name, namelen, pos);
+  }
+  dir->i_mtime = dir->i_ctime = current_time(dir);
   mark_inode_dirty(dir);
 page_put:
   baby_put_page(page);
-out:
   return err;
 page_unlock:
   unlock_page(page);
   goto page_put;
 }
 
+/*
+ * 找到 offset 之后（含）的第一个目录项的页内偏移
+ * v2 目录项是变长的，readdir 上次停下的位置可能已经被合并到前一个目录项中，需要从块头重新对齐
+ */
+static unsigned int baby_validate_entry(struct super_block *sb, char *kaddr,
+                                        unsigned int offset) {
+  unsigned int p = offset & ~(BABYFS_BLOCK_SIZE - 1);
+  struct dir_record *de;
+
+  while (p < offset) {
+    de = (struct dir_record *)(kaddr + p);
+    if (!baby_de_ok(sb, de, BABY_BLOCK_OFFSET(p)))
+      break;
+    p += baby_de_rec_len(sb, de);
+  }
+  return p;
+}
+
 // 遍历目录项
 static int baby_iterate(struct file *dir, struct dir_context *ctx) {
   loff_t pos = ctx->pos;  // ctx->pos 表示已经读取了多少字节的数据
   struct inode *inode = file_inode(dir);  // 获取 inode 数据结构
-  // unsigned int offset = pos & ~PAGE_MASK;     // 清除 pos 的后面 12 位数据
+  struct super_block *sb = inode->i_sb;
+  unsigned int offset = pos & ~PAGE_MASK;    // 页内偏移
   unsigned long npages = dir_pages(inode);   // inode 数据的最大页数
   unsigned long nstart = pos >> PAGE_SHIFT;  // 从第 nstart 页开始查找
   // 超出最大数据
@@ -189,33 +480,41 @@ static int baby_iterate(struct file *dir, struct dir_context *ctx) {
 
   /* 开始查找目录项 */
   unsigned long nloop;
-  for (nloop = nstart; nloop < npages; ++nloop) {
+  for (nloop = nstart; nloop < npages; ++nloop, offset = 0) {
     char *kaddr;            // 保存 page 的起始地址
     struct dir_record *de;  // 保存目录项
     struct page *page = baby_get_page(inode, nloop);  // 获取 page 结构体
     if (IS_ERR(page)) {
-      ctx->pos += PAGE_SIZE;
+      ctx->pos += PAGE_SIZE - offset;
       return PTR_ERR(page);
     }
     /* 现在开始在 page 内部查找 */
     kaddr = page_address(page);
+    if (offset && baby_dir_v2(sb)) {
+      offset = baby_validate_entry(sb, kaddr, offset);
+      ctx->pos = page_offset(page) + offset;
+    }
     char *limit = kaddr + baby_last_byte(inode, nloop);
-    de = (struct dir_record *)kaddr;
-    for (; (char *)de < limit; ++de) {
+    de = (struct dir_record *)(kaddr + offset);
+    for (; (char *)de < limit; de = baby_next_de(sb, de)) {
+      if (!baby_de_ok(sb, de, BABY_BLOCK_OFFSET((char *)de - kaddr))) {
+        printk(KERN_ERR "baby_iterate: bad entry in dir ino %lu, pos %lld\n",
+               inode->i_ino, ctx->pos);
+        baby_put_page(page);
+        return -EIO;
+      }
       // 必须要目录项存在并且 inode 编号大于 0
-      if (de->name_len && de->inode_no) {
+      if (baby_de_used(sb, de)) {
         // TODO d_type 改成指定类型
-        unsigned char d_type = de->file_type;
-        int ret = dir_emit(ctx, de->name, de->name_len,
+        unsigned char d_type = *baby_de_type(sb, de);
+        int ret = dir_emit(ctx, baby_de_name(sb, de), baby_de_name_len(sb, de),
                            le32_to_cpu(de->inode_no), d_type);
-        // printk(KERN_INFO "filename: %s, de 的地址: %p, ret: %d", de->name,
-        // (char *)de, ret);
         if (!ret) {
           baby_put_page(page);
           return 0;
         }
       }
-      ctx->pos += BABYFS_DIR_RECORD_SIZE;  // 长度增加
+      ctx->pos += baby_de_rec_len(sb, de);  // 长度增加
     }
     baby_put_page(page);  // 释放 page
   }
@@ -225,6 +524,7 @@ static int baby_iterate(struct file *dir, struct dir_context *ctx) {
 // 实现从 dir 中根据 child 文件名匹配目录项
 struct dir_record *baby_find_entry(struct inode *dir,
       const struct qstr *child, struct page **res_page) {
+  struct super_block *sb = dir->i_sb;
   struct dir_record *de = NULL;
   unsigned long nloop, npages;
   struct page *page = NULL;
@@ -233,8 +533,14 @@ struct dir_record *baby_find_entry(struct inode *dir,
   npages = dir_pages(dir); // inode 数据的最大页数
   if(npages == 0)
     goto out;
-  /* TODO 可优化项，在bbi中添加i_dir_start_lookup为上一次find entry找到目录项的页，
-	根据局部性原理，下次要找的目录项大概率也在这一页或者相邻页 */
+  // 有哈希索引的目录只需要读一个桶和目标目录项所在的页
+  if (BABY_I(dir)->i_flags & BABYFS_INDEX_FL) {
+    int err;
+    de = baby_dx_find_entry(dir, child, res_page, &err);
+    if (!err)
+      return de;
+    // 索引不可用，退回线性扫描
+  }
   for(nloop = 0; nloop < npages; ++nloop) { // 查找所有页
     page = baby_get_page(dir, nloop);
     if(IS_ERR(page))
@@ -242,14 +548,17 @@ struct dir_record *baby_find_entry(struct inode *dir,
     kaddr = page_address(page);
     limit = kaddr + baby_last_byte(dir, nloop);
     de = (struct dir_record *)kaddr;
-    for(; (char *)de < limit; ++de){ // 查找页内的所有目录项
-      if (de->name_len && de->inode_no) { // 检查有效项
-        if (baby_match(child->len, child->name, de)) {
+    for(; (char *)de < limit; de = baby_next_de(sb, de)){ // 查找页内的所有目录项
+      if (!baby_de_ok(sb, de, BABY_BLOCK_OFFSET((char *)de - kaddr)))
+        break; // 本页已经损坏
+      if (baby_de_used(sb, de)) { // 检查有效项
+        if (baby_match(sb, child->len, child->name, de)) {
           *res_page = page;
           return de;
         }
       }
     }
+    baby_put_page(page);
   }
 out:
   return NULL;
@@ -281,6 +590,24 @@ int baby_make_empty(struct inode *inode, struct inode *parent) {
   kaddr = kmap_atomic(page); // 关闭内核抢占，这个函数里面会调用 page_address()
   memset(kaddr, 0, BABYFS_BLOCK_SIZE);
   de = (struct dir_record *)kaddr;
+  if (baby_dir_v2(inode->i_sb)) {
+    // v2: "." 只占用需要的长度，".." 延伸到块尾
+    struct baby_dir_entry_2 *de2 = BABY_DE2(de);
+    de2->name_len = 1;
+    de2->rec_len = cpu_to_le16(BABYFS_DIR_V2_REC_LEN(1));
+    memcpy(de2->name, ".", 1);
+    de2->inode_no = cpu_to_le32(inode->i_ino);
+    baby_set_de_type(de, inode);
+
+    de = baby_next_de(inode->i_sb, de);
+    de2 = BABY_DE2(de);
+    de2->name_len = 2;
+    de2->rec_len = cpu_to_le16(BABYFS_BLOCK_SIZE - BABYFS_DIR_V2_REC_LEN(1));
+    memcpy(de2->name, "..", 2);
+    de2->inode_no = cpu_to_le32(parent->i_ino);
+    baby_set_de_type(de, inode);
+    goto done;
+  }
   de->name_len = 1;
   memcpy(de->name, ".", 1);
   de->inode_no = cpu_to_le32(inode->i_ino);
@@ -291,6 +618,7 @@ int baby_make_empty(struct inode *inode, struct inode *parent) {
   de->inode_no = cpu_to_le32(parent->i_ino);
   memcpy(de->name, "..", 2);
   baby_set_de_type(de, inode);
+done:
   kunmap_atomic(kaddr);
   err = baby_commit_chunk(page, 0, BABYFS_BLOCK_SIZE);
 fail:
@@ -300,7 +628,8 @@ fail:
 
 /**
  * 删除一个目录项，先找到那个目录项，把inode号和name_len变成0，
- * 
+ * v2 目录项的空间合并到同一块内的前一个目录项中，块内第一个目录项只把 inode 号变成 0
+ *
  * @param de 待删除目录项
  * @param page 待删除目录项所在的page
  * @return int 
@@ -308,30 +637,59 @@ fail:
 int baby_delete_entry (struct dir_record * de, struct page * page)
 {
   struct inode *inode = page->mapping->host;
-  loff_t pos = page_offset(page) + (char *)de - (char *)page_address(page);
+  struct super_block *sb = inode->i_sb;
+  char *kaddr = page_address(page);
+  unsigned int from = (char *)de - kaddr;
+  unsigned int to = from + baby_de_rec_len(sb, de);
+  loff_t pos = page_offset(page) + from;
+  struct dir_record *pde = NULL; // 同一块内的前一个目录项
   int err;
 
+  if (baby_dir_v2(sb)) {
+    unsigned int p = from & ~(BABYFS_BLOCK_SIZE - 1);
+    while (p < from) {
+      pde = (struct dir_record *)(kaddr + p);
+      if (!baby_de_ok(sb, pde, BABY_BLOCK_OFFSET(p)))
+        break;
+      p += baby_de_rec_len(sb, pde);
+    }
+    if (p != from) {
+      printk(KERN_ERR "baby_delete_entry: bad entry in dir ino %lu\n",
+             inode->i_ino);
+      err = -EIO;
+      goto out;
+    }
+    if (pde)
+      from = (char *)pde - kaddr;
+  }
+  baby_dx_remove(inode, baby_de_name(sb, de), baby_de_name_len(sb, de),
+                 pos); // 先从索引中删除
   lock_page(page);
-  err = baby_prepare_chunk(page, pos, sizeof(struct dir_record));
+  err = baby_prepare_chunk(page, page_offset(page) + from, to - from);
   BUG_ON(err);
+  if (pde)
+    BABY_DE2(pde)->rec_len = cpu_to_le16(to - from);
   /*要删除的目录项inode号和name_len变成0*/
   de->inode_no = 0;
-  de->name_len = 0;
-  err = baby_commit_chunk(page, pos, sizeof(struct dir_record)); // 提交修改
+  if (!baby_dir_v2(sb))
+    de->name_len = 0;
+  err = baby_commit_chunk(page, page_offset(page) + from, to - from); // 提交修改
+  baby_dir_free_update(inode, page, pos);
   inode->i_ctime = inode->i_mtime = current_time(inode); // 更新文件修改时间
   mark_inode_dirty(inode);
-
+out:
   baby_put_page(page);
   return err;
 }
 
 /*检查一个目录是不是空的，inode是要检查的目录的inode结构体，空=1 */
 int baby_empty_dir (struct inode * inode) {
+  struct super_block *sb = inode->i_sb;
   struct page *page = NULL;
   unsigned long i, npages = dir_pages(inode);
 
   for (i = 0; i < npages; i++) { /*遍历目录的每一个页*/
-    char *kaddr;
+    char *kaddr, *limit;
     struct dir_record * de;
     page = baby_get_page(inode, i); /*获得遍历到的当前页*/
     if (IS_ERR(page)) {
@@ -341,22 +699,26 @@ int baby_empty_dir (struct inode * inode) {
 
     kaddr = page_address(page);
     de = (struct dir_record *)kaddr;
-    kaddr += baby_last_byte(inode, i);
+    limit = kaddr + baby_last_byte(inode, i);
 
-    while ((char *)de < kaddr) { // 遍历页内的所有目录项
+    while ((char *)de < limit) { // 遍历页内的所有目录项
+      char *name = baby_de_name(sb, de);
+      unsigned int name_len = baby_de_name_len(sb, de);
+      if (!baby_de_ok(sb, de, BABY_BLOCK_OFFSET((char *)de - kaddr)))
+        goto not_empty; // 损坏的目录不当作空目录删除
       if (de->inode_no != 0) { // 检查有效项
         /* check for . and .. */
-        if (de->name[0] != '.') // 不是以.开头的必有效
+        if (name[0] != '.') // 不是以.开头的必有效
 					goto not_empty;
-				if (de->name_len > 2) // 以.开头的长度大于2的有效
+				if (name_len > 2) // 以.开头的长度大于2的有效
 					goto not_empty;
-				if (de->name_len < 2) { // name = .
+				if (name_len < 2) { // name = .
 					if (de->inode_no != cpu_to_le32(inode->i_ino))
 						goto not_empty;
-				} else if (de->name[1] != '.') // 第一个为.且name_len为2且第二个不是.也有效
+				} else if (name[1] != '.') // 第一个为.且name_len为2且第二个不是.也有效
 					goto not_empty;
       }
-      de++;
+      de = baby_next_de(sb, de);
     }
     baby_put_page(page);
   }
@@ -370,5 +732,9 @@ not_empty:
 const struct file_operations baby_dir_operations = {
     .read           = generic_read_dir,   // 读目录文件
     .iterate_shared = baby_iterate,       // 遍历目录项
-    .fsync          = generic_file_fsync  // 异步同步目录内容
+    .unlocked_ioctl = baby_ioctl,         // FITRIM 等，见 ioctl.c
+#ifdef CONFIG_COMPAT
+    .compat_ioctl   = baby_compat_ioctl,
+#endif
+    .fsync          = baby_fsync  // 异步同步目录内容
 };
\ No newline at end of file
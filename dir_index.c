@@ -0,0 +1,477 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/log2.h>
+#include <linux/pagemap.h>
+
+#include "babyfs.h"
+
+/*
+ * 目录哈希索引
+ * 线性扫描目录时，查找一个目录项需要读完目录的所有页。索引保存 "文件名哈希 ->
+ * 目录项偏移" 的映射，查找时只需要读一个桶（以及很少出现的溢出块）和目标目录项所在的页
+ *
+ * 索引只是加速结构，目录项本身的格式和位置都没有变化，v1、v2 目录项都按字节偏移索引。
+ * 索引出错的时候清除 BABYFS_INDEX_FL 标志退回线性扫描即可，不会影响目录的正确性
+ *
+ * 索引在插入目录项的 handle 里维护，每次只能改动有限的几个块，所以按线性哈希增长：
+ * 装载率超过一半时只分裂一个桶，把它的一部分项搬到新追加的桶里，不会重建整个索引。
+ * 第一次建立索引要读完整个目录，只在目录刚超过 BABYFS_DX_MIN_SIZE 时做，
+ * 更大的目录索引被丢弃之后一直线性扫描
+ */
+
+#define DX_READ 0 // 读取已经存在的索引块
+#define DX_ZERO 1 // 获取索引块（必要时分配），并清零
+
+// FNV-1a，结果会写到磁盘上，不能使用和内核配置相关的 full_name_hash
+static __u32 baby_dx_hash(const char *name, int len) {
+  __u32 hash = 2166136261u;
+  while (len--) {
+    hash ^= (unsigned char)*name++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * 读取第 nr 个索引块，nr 是相对 BABYFS_DX_BLOCK_BASE 的编号
+ * 索引块不在目录的 page cache 中（超出了 i_size），这里直接映射到物理块后通过
+ * buffer cache 访问
+ */
+static struct buffer_head *baby_dx_getblk(struct inode *dir, unsigned long nr,
+                                          int mode, int *err) {
+  struct super_block *sb = dir->i_sb;
+  struct buffer_head dummy, *bh;
+
+  dummy.b_state = 0;
+  dummy.b_blocknr = -1000;
+  dummy.b_size = sb->s_blocksize;
+  *err = baby_get_block(dir, BABYFS_DX_BLOCK_BASE + nr, &dummy, mode == DX_ZERO);
+  if (*err)
+    return NULL;
+  if (!buffer_mapped(&dummy)) { // 需要读的索引块不存在，索引已经损坏
+    *err = -EIO;
+    return NULL;
+  }
+
+  if (mode == DX_ZERO) {
+    bh = sb_getblk(sb, dummy.b_blocknr);
+    if (unlikely(!bh)) {
+      *err = -ENOMEM;
+      return NULL;
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, sb->s_blocksize);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    baby_journal_dirty(dir->i_sb, dir, bh);
+    return bh;
+  }
+
+  bh = sb_bread(sb, dummy.b_blocknr);
+  if (!bh)
+    *err = -EIO;
+  return bh;
+}
+
+// 读取索引头，并检查魔数
+static struct buffer_head *baby_dx_read_header(struct inode *dir, int *err) {
+  struct buffer_head *bh = baby_dx_getblk(dir, 0, DX_READ, err);
+  struct baby_dx_header *dh;
+
+  if (!bh)
+    return NULL;
+  dh = (struct baby_dx_header *)bh->b_data;
+  if (le32_to_cpu(dh->dh_magic) != BABYFS_DX_MAGIC ||
+      !le32_to_cpu(dh->dh_nr_buckets) ||
+      le32_to_cpu(dh->dh_nr_buckets) > BABYFS_DX_MAX_BUCKETS) {
+    printk(KERN_ERR "baby_dx: bad index header, dir ino %lu\n", dir->i_ino);
+    brelse(bh);
+    *err = -EIO;
+    return NULL;
+  }
+  return bh;
+}
+
+/*
+ * 线性哈希：桶数 n 在 2^L 和 2^(L+1) 之间时，先按低 L+1 位取桶，
+ * 落在还没有分裂出来的桶上时改按低 L 位。n 是 2 的幂时和直接取模一样
+ */
+static inline unsigned long baby_dx_bucket_of(struct baby_dx_header *dh,
+                                              __u32 hash) {
+  unsigned long n = le32_to_cpu(dh->dh_nr_buckets);
+  unsigned long mask = roundup_pow_of_two(n) - 1;
+
+  if ((hash & mask) >= n)
+    mask >>= 1;
+  return 1 + (hash & mask);
+}
+
+// 丢弃目录的索引，之后的操作都退回线性扫描。已经分配的索引块留到下次重建时复用
+static void baby_dx_drop(struct inode *dir) {
+  printk(KERN_WARNING "baby_dx: drop index of dir ino %lu\n", dir->i_ino);
+  BABY_I(dir)->i_flags &= ~BABYFS_INDEX_FL;
+  mark_inode_dirty(dir);
+}
+
+/*
+ * 在第 nr 个桶的桶链中追加一项，桶链满了就分配一个溢出块
+ * 不修改索引项总数，header 由调用者写进日志
+ */
+static int baby_dx_add(struct inode *dir, struct buffer_head *dh_bh,
+                       unsigned long nr, __u32 hash, __u32 pos) {
+  struct baby_dx_header *dh = (struct baby_dx_header *)dh_bh->b_data;
+  unsigned long next;
+  struct buffer_head *bh, *nbh;
+  struct baby_dx_bucket *db;
+  unsigned int count;
+  int err;
+
+  while (1) {
+    bh = baby_dx_getblk(dir, nr, DX_READ, &err);
+    if (!bh)
+      return err;
+    db = (struct baby_dx_bucket *)bh->b_data;
+    count = le32_to_cpu(db->db_count);
+    if (count < BABYFS_DX_ENTRIES_PER_BLOCK)
+      break;
+
+    next = le32_to_cpu(db->db_next);
+    if (!next) { // 桶链已满，链上一个新的溢出块
+      next = le32_to_cpu(dh->dh_next_free);
+      nbh = baby_dx_getblk(dir, next, DX_ZERO, &err);
+      if (!nbh) {
+        brelse(bh);
+        return err;
+      }
+      brelse(nbh);
+      db->db_next = cpu_to_le32(next);
+      baby_journal_dirty(dir->i_sb, dir, bh);
+      dh->dh_next_free = cpu_to_le32(next + 1);
+    }
+    brelse(bh);
+    nr = next;
+  }
+
+  db->db_entries[count].hash = cpu_to_le32(hash);
+  db->db_entries[count].pos = cpu_to_le32(pos);
+  db->db_count = cpu_to_le32(count + 1);
+  baby_journal_dirty(dir->i_sb, dir, bh);
+  brelse(bh);
+  return 0;
+}
+
+// 在 hash 对应的桶中插入一项
+static int __baby_dx_insert(struct inode *dir, struct buffer_head *dh_bh,
+                            __u32 hash, __u32 pos) {
+  struct baby_dx_header *dh = (struct baby_dx_header *)dh_bh->b_data;
+  int err;
+
+  err = baby_dx_add(dir, dh_bh, baby_dx_bucket_of(dh, hash), hash, pos);
+  if (err)
+    return err;
+  le32_add_cpu(&dh->dh_nr_entries, 1);
+  baby_journal_dirty(dir->i_sb, dir, dh_bh);
+  return 0;
+}
+
+/*
+ * 线性哈希分裂一个桶：桶数从 n 变成 n + 1，新桶的下标是 n，
+ * 它的项都来自下标 n - 2^L 的桶链，按低 L+1 位等于 n 的项搬过去
+ * 旧链上的块原地删除搬走的项，空出来的溢出块仍然挂在链上
+ */
+static int baby_dx_split(struct inode *dir, struct buffer_head *dh_bh) {
+  struct baby_dx_header *dh = (struct baby_dx_header *)dh_bh->b_data;
+  unsigned long n = le32_to_cpu(dh->dh_nr_buckets);
+  unsigned long mask = rounddown_pow_of_two(n) * 2 - 1;
+  unsigned long nr = 1 + (n & (mask >> 1));
+  struct buffer_head *bh;
+  struct baby_dx_bucket *db;
+  unsigned int i, count;
+  __u32 hash;
+  int err;
+
+  if (n >= BABYFS_DX_MAX_BUCKETS)
+    return -ENOSPC;
+  // 旧格式的溢出块紧接在桶后面，新桶的位置已经被占用，不能原地增长
+  if (le32_to_cpu(dh->dh_next_free) <= BABYFS_DX_MAX_BUCKETS) {
+    if (le32_to_cpu(dh->dh_next_free) != n + 1)
+      return -ENOSPC;
+    dh->dh_next_free = cpu_to_le32(BABYFS_DX_MAX_BUCKETS + 1);
+  }
+  bh = baby_dx_getblk(dir, n + 1, DX_ZERO, &err);
+  if (!bh)
+    return err;
+  brelse(bh);
+
+  while (nr) {
+    bh = baby_dx_getblk(dir, nr, DX_READ, &err);
+    if (!bh)
+      return err;
+    db = (struct baby_dx_bucket *)bh->b_data;
+    count = min_t(unsigned int, le32_to_cpu(db->db_count),
+                  BABYFS_DX_ENTRIES_PER_BLOCK);
+    for (i = 0; i < count;) {
+      hash = le32_to_cpu(db->db_entries[i].hash);
+      if ((hash & mask) != n) {
+        ++i;
+        continue;
+      }
+      err = baby_dx_add(dir, dh_bh, n + 1, hash,
+                        le32_to_cpu(db->db_entries[i].pos));
+      if (err) {
+        brelse(bh);
+        return err;
+      }
+      db->db_entries[i] = db->db_entries[--count];
+      memset(&db->db_entries[count], 0, sizeof(struct baby_dx_entry));
+    }
+    if (count != le32_to_cpu(db->db_count)) {
+      db->db_count = cpu_to_le32(count);
+      baby_journal_dirty(dir->i_sb, dir, bh);
+    }
+    nr = le32_to_cpu(db->db_next);
+    brelse(bh);
+  }
+  dh->dh_nr_buckets = cpu_to_le32(n + 1);
+  baby_journal_dirty(dir->i_sb, dir, dh_bh);
+  return 0;
+}
+
+/*
+ * 根据目录内容建立索引
+ * 目录项是索引的唯一数据来源，所以不需要读旧的索引，直接覆盖即可
+ * 溢出块从 BABYFS_DX_MAX_BUCKETS + 1 开始分配，桶可以一直往后追加
+ */
+static int baby_dx_build(struct inode *dir) {
+  struct super_block *sb = dir->i_sb;
+  unsigned long nr_buckets, i, n, npages = dir_pages(dir);
+  struct baby_dx_header *dh;
+  struct buffer_head *dh_bh, *bh;
+  struct dir_record *de;
+  struct page *page;
+  char *kaddr, *limit;
+  loff_t pos;
+  int err;
+
+  // 平均装载率不超过一半，溢出块就很少出现。v2 目录项按平均 32B 估计
+  nr_buckets = (dir->i_size / (baby_dir_v2(sb) ? 32 : BABYFS_DIR_RECORD_SIZE)) *
+                   2 / BABYFS_DX_ENTRIES_PER_BLOCK + 1;
+  nr_buckets = max_t(unsigned long, nr_buckets, BABYFS_DX_MIN_BUCKETS);
+  // 目录太大，放弃索引，已有的旧索引也不能再用
+  if (nr_buckets > BABYFS_DX_MAX_BUCKETS) {
+    err = -ENOSPC;
+    goto fail;
+  }
+
+  dh_bh = baby_dx_getblk(dir, 0, DX_ZERO, &err);
+  if (!dh_bh)
+    goto fail;
+  for (i = 1; i <= nr_buckets; ++i) {
+    bh = baby_dx_getblk(dir, i, DX_ZERO, &err);
+    if (!bh)
+      goto fail_header;
+    brelse(bh);
+  }
+  dh = (struct baby_dx_header *)dh_bh->b_data;
+  dh->dh_magic = cpu_to_le32(BABYFS_DX_MAGIC);
+  dh->dh_nr_buckets = cpu_to_le32(nr_buckets);
+  dh->dh_nr_entries = 0;
+  dh->dh_next_free = cpu_to_le32(BABYFS_DX_MAX_BUCKETS + 1);
+
+  // 把目录中所有有效的目录项加入索引
+  for (n = 0; n < npages; ++n) {
+    page = baby_get_page(dir, n);
+    if (IS_ERR(page)) {
+      err = PTR_ERR(page);
+      goto fail_header;
+    }
+    kaddr = page_address(page);
+    limit = kaddr + min_t(loff_t, PAGE_SIZE, dir->i_size - page_offset(page));
+    for (de = (struct dir_record *)kaddr; (char *)de < limit;
+         de = baby_next_de(sb, de)) {
+      pos = page_offset(page) + (char *)de - kaddr;
+      if (!baby_de_ok(sb, de, pos & (BABYFS_BLOCK_SIZE - 1))) {
+        baby_put_page(page);
+        err = -EIO;
+        goto fail_header;
+      }
+      if (!baby_de_used(sb, de))
+        continue;
+      err = __baby_dx_insert(
+          dir, dh_bh,
+          baby_dx_hash(baby_de_name(sb, de), baby_de_name_len(sb, de)), pos);
+      if (err) {
+        baby_put_page(page);
+        goto fail_header;
+      }
+    }
+    baby_put_page(page);
+  }
+  baby_journal_dirty(dir->i_sb, dir, dh_bh);
+  brelse(dh_bh);
+
+  BABY_I(dir)->i_flags |= BABYFS_INDEX_FL;
+  mark_inode_dirty(dir);
+  return 0;
+
+fail_header:
+  brelse(dh_bh);
+fail:
+  if (err != -ENOSPC)
+    printk(KERN_ERR "baby_dx_build: dir ino %lu failed, err %d\n", dir->i_ino,
+           err);
+  BABY_I(dir)->i_flags &= ~BABYFS_INDEX_FL;
+  mark_inode_dirty(dir);
+  return err;
+}
+
+/*
+ * 通过索引查找目录项
+ * 返回 NULL 且 *err == 0 表示目录项不存在；*err != 0 表示索引不可用，调用者应该退回线性扫描
+ */
+struct dir_record *baby_dx_find_entry(struct inode *dir,
+                                      const struct qstr *child,
+                                      struct page **res_page, int *err) {
+  __u32 hash = baby_dx_hash(child->name, child->len);
+  struct buffer_head *dh_bh, *bh;
+  struct baby_dx_bucket *db;
+  struct dir_record *de;
+  struct page *page;
+  unsigned long nr;
+  unsigned int i, count;
+  loff_t pos;
+
+  dh_bh = baby_dx_read_header(dir, err);
+  if (!dh_bh)
+    return NULL;
+  nr = baby_dx_bucket_of((struct baby_dx_header *)dh_bh->b_data, hash);
+  brelse(dh_bh);
+
+  while (nr) {
+    bh = baby_dx_getblk(dir, nr, DX_READ, err);
+    if (!bh)
+      return NULL;
+    db = (struct baby_dx_bucket *)bh->b_data;
+    count = min_t(unsigned int, le32_to_cpu(db->db_count),
+                  BABYFS_DX_ENTRIES_PER_BLOCK);
+    for (i = 0; i < count; ++i) {
+      if (le32_to_cpu(db->db_entries[i].hash) != hash)
+        continue;
+      pos = le32_to_cpu(db->db_entries[i].pos);
+      if (pos >= dir->i_size)
+        continue;
+      // 哈希相同，读取目录项所在的页比较文件名
+      page = baby_get_page(dir, pos >> PAGE_SHIFT);
+      if (IS_ERR(page)) {
+        brelse(bh);
+        *err = PTR_ERR(page);
+        return NULL;
+      }
+      de = (struct dir_record *)((char *)page_address(page) +
+                                 (pos & ~PAGE_MASK));
+      if (baby_de_ok(dir->i_sb, de, pos & (BABYFS_BLOCK_SIZE - 1)) &&
+          baby_match(dir->i_sb, child->len, child->name, de)) {
+        brelse(bh);
+        *res_page = page;
+        return de;
+      }
+      baby_put_page(page);
+    }
+    nr = le32_to_cpu(db->db_next);
+    brelse(bh);
+  }
+  *err = 0;
+  return NULL;
+}
+
+/*
+ * 目录在 pos 处新增了目录项 name，维护索引
+ * 目录刚超过 BABYFS_DX_MIN_SIZE 还没有索引的时候，顺便建立索引；
+ * 再大的目录建立索引要读的页太多，不能放在一个 handle 里
+ */
+void baby_dx_insert(struct inode *dir, const char *name, int len, loff_t pos) {
+  struct buffer_head *dh_bh;
+  struct baby_dx_header *dh;
+  unsigned int nr_buckets;
+  int err;
+
+  if (!(BABY_I(dir)->i_flags & BABYFS_INDEX_FL)) {
+    if (BABY_HAS_COMPAT_FEATURE(dir->i_sb, BABYFS_FEATURE_COMPAT_DIR_INDEX) &&
+        dir->i_size > BABYFS_DX_MIN_SIZE &&
+        dir->i_size <= BABYFS_DX_BUILD_SIZE)
+      // 失败时 baby_dx_build 已经清除了 BABYFS_INDEX_FL，继续线性扫描
+      baby_dx_build(dir);
+    return;
+  }
+
+  dh_bh = baby_dx_read_header(dir, &err);
+  if (!dh_bh)
+    goto drop;
+  dh = (struct baby_dx_header *)dh_bh->b_data;
+  nr_buckets = le32_to_cpu(dh->dh_nr_buckets);
+  // 装载率超过一半，分裂一个桶。每次插入最多分裂一次，装载率增长得比分裂慢
+  if (le32_to_cpu(dh->dh_nr_entries) + 1 >
+      nr_buckets * BABYFS_DX_ENTRIES_PER_BLOCK / 2) {
+    err = baby_dx_split(dir, dh_bh);
+    if (err) {
+      brelse(dh_bh);
+      goto drop;
+    }
+  }
+  err = __baby_dx_insert(dir, dh_bh, baby_dx_hash(name, len), pos);
+  brelse(dh_bh);
+  if (!err)
+    return;
+drop:
+  baby_dx_drop(dir);
+}
+
+// 目录删除了 pos 处的目录项 name，从索引中删除对应的项
+void baby_dx_remove(struct inode *dir, const char *name, int len, loff_t pos) {
+  __u32 hash = baby_dx_hash(name, len);
+  struct buffer_head *dh_bh, *bh;
+  struct baby_dx_header *dh;
+  struct baby_dx_bucket *db;
+  unsigned int i, count;
+  unsigned long nr;
+  int err;
+
+  if (!(BABY_I(dir)->i_flags & BABYFS_INDEX_FL))
+    return;
+
+  dh_bh = baby_dx_read_header(dir, &err);
+  if (!dh_bh)
+    goto drop;
+  dh = (struct baby_dx_header *)dh_bh->b_data;
+  nr = baby_dx_bucket_of(dh, hash);
+  while (nr) {
+    bh = baby_dx_getblk(dir, nr, DX_READ, &err);
+    if (!bh)
+      goto drop_header;
+    db = (struct baby_dx_bucket *)bh->b_data;
+    count = min_t(unsigned int, le32_to_cpu(db->db_count),
+                  BABYFS_DX_ENTRIES_PER_BLOCK);
+    for (i = 0; i < count; ++i) {
+      if (le32_to_cpu(db->db_entries[i].hash) != hash ||
+          le32_to_cpu(db->db_entries[i].pos) != pos)
+        continue;
+      // 用块内最后一项填补空位
+      db->db_entries[i] = db->db_entries[count - 1];
+      memset(&db->db_entries[count - 1], 0, sizeof(struct baby_dx_entry));
+      db->db_count = cpu_to_le32(count - 1);
+      baby_journal_dirty(dir->i_sb, dir, bh);
+      brelse(bh);
+      le32_add_cpu(&dh->dh_nr_entries, -1);
+      baby_journal_dirty(dir->i_sb, dir, dh_bh);
+      brelse(dh_bh);
+      return;
+    }
+    nr = le32_to_cpu(db->db_next);
+    brelse(bh);
+  }
+  err = -ENOENT; // 索引中没有这一项，索引和目录不一致
+drop_header:
+  brelse(dh_bh);
+drop:
+  baby_dx_drop(dir);
+}
@@ -0,0 +1,246 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/fs.h>
+#include <linux/list_sort.h>
+#include <linux/slab.h>
+
+#include "babyfs.h"
+
+/*
+ * discard
+ *
+ * 挂载时带 discard 选项，释放块时通知设备这些块不再使用，闪存设备的垃圾回收不用再搬运它们。
+ * baby_release_blocks 清除位图之后不把块放回空闲区间树，而是记到 s_discard_list 上，
+ * 截断时攒好的连续段直接成为一项，和上一项相邻时合并。
+ *
+ * 释放块的事务提交之前不能 discard：崩溃后回放不到这次释放，文件仍然指向这些块；
+ * 也不能在 discard 完成之前重新分配，否则 discard 可能晚于新数据到达设备。
+ * 所以后台 work 先保证事务已经提交，再按块号排序、合并成尽量长的段一起下发，
+ * 全部完成之后才放回空闲区间树；期间这些块和后台释放的孤儿一样只算进 statfs 的 f_bfree。
+ * 等不到事务提交时日志已经中止，这次释放可能不会持久化，这些块直接丢掉，不再分配
+ *
+ * 日志结构模式下改写释放的旧块同样要等事务提交之后才能重新分配，也挂在这个链表上，
+ * 没有 discard 选项时 work 只等事务提交，不下发 discard
+ *
+ * FITRIM 按块组从空闲区间树中一批批取走不短于 minlen 的空闲区间，discard 之后放回
+ *
+ * zoned 设备的顺序写 zone 不 discard，日志重新打开 zone 时会重置，两者都只处理 s_alloc_end 之前的块
+ */
+
+#define BABY_DISCARD_DELAY (5 * HZ) // 和日志的周期提交间隔相同，通常事务已经提交
+#define BABY_TRIM_BATCH 64          // FITRIM 每批 discard 的区间数
+
+struct baby_discard {
+  struct list_head d_list;
+  unsigned long d_start; // 相对于第一个数据块
+  unsigned long d_len;
+  u32 d_tid; // 释放这些块的事务
+};
+
+// 在 handle 里调用，[block, block + count) 的位图已经清除
+void baby_discard_queue(struct super_block *sb, unsigned long block,
+                        unsigned long count) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_discard *d = NULL, *new;
+  u32 tid = baby_journal_current_tid(sb);
+
+  new = kmalloc(sizeof(*new), GFP_NOFS | __GFP_NOFAIL);
+  spin_lock(&sbi->s_discard_lock);
+  if (!list_empty(&sbi->s_discard_list))
+    d = list_last_entry(&sbi->s_discard_list, struct baby_discard, d_list);
+  if (d && d->d_tid == tid && d->d_start + d->d_len == block) {
+    d->d_len += count;
+  } else {
+    new->d_start = block;
+    new->d_len = count;
+    new->d_tid = tid;
+    list_add_tail(&new->d_list, &sbi->s_discard_list);
+    new = NULL;
+  }
+  spin_unlock(&sbi->s_discard_lock);
+  kfree(new);
+  atomic_long_add(count, &sbi->s_pending_blocks);
+  queue_delayed_work(system_unbound_wq, &sbi->s_discard_work,
+                     BABY_DISCARD_DELAY);
+}
+
+// 把 [start, start + len) 的 discard 加到 *biop 的 bio 链上
+static int baby_discard_add(struct super_block *sb, unsigned long start,
+                            unsigned long len, struct bio **biop) {
+  int shift = sb->s_blocksize_bits - 9;
+
+  return __blkdev_issue_discard(sb->s_bdev,
+                                (sector_t)(start + NR_DSTORE_BLOCKS) << shift,
+                                (sector_t)len << shift, GFP_NOFS, 0, biop);
+}
+
+// 下发 bio 链并等待全部完成，err 是组装 bio 链时的错误
+static int baby_discard_wait(struct bio *bio, int err) {
+  int ret;
+
+  if (!bio)
+    return err;
+  ret = submit_bio_wait(bio);
+  bio_put(bio);
+  if (ret == -EOPNOTSUPP)
+    ret = 0;
+  return err ? err : ret;
+}
+
+static int baby_discard_cmp(void *priv, struct list_head *a,
+                            struct list_head *b) {
+  struct baby_discard *da = list_entry(a, struct baby_discard, d_list);
+  struct baby_discard *db = list_entry(b, struct baby_discard, d_list);
+
+  return da->d_start < db->d_start ? -1 : da->d_start > db->d_start;
+}
+
+static void baby_discard_work(struct work_struct *work) {
+  struct baby_sb_info *sbi =
+      container_of(to_delayed_work(work), struct baby_sb_info, s_discard_work);
+  struct super_block *sb = sbi->s_sb;
+  struct baby_discard *d, *tmp;
+  struct bio *bio = NULL;
+  struct blk_plug plug;
+  unsigned long start = 0, len = 0;
+  LIST_HEAD(list);
+  int err;
+
+  spin_lock(&sbi->s_discard_lock);
+  list_splice_init(&sbi->s_discard_list, &list);
+  spin_unlock(&sbi->s_discard_lock);
+  if (list_empty(&list))
+    return;
+  // 事务序号不减，最后一项的事务提交了，前面的都已经提交
+  d = list_last_entry(&list, struct baby_discard, d_list);
+  err = baby_journal_wait_tid(sb, d->d_tid);
+  if (err) {
+    printk(KERN_ERR "babyfs: commit before discard failed, err %d, "
+                    "freed blocks not reused\n",
+           err);
+    goto drop;
+  }
+
+  if (!baby_test_opt(sb, DISCARD))
+    goto put;
+
+  list_sort(NULL, &list, baby_discard_cmp);
+  blk_start_plug(&plug);
+  list_for_each_entry(d, &list, d_list) {
+    if (err || d->d_start >= sbi->s_alloc_end)
+      break;
+    if (len && start + len == d->d_start) {
+      len += min(d->d_len, sbi->s_alloc_end - d->d_start);
+      continue;
+    }
+    if (len)
+      err = baby_discard_add(sb, start, len, &bio);
+    start = d->d_start;
+    len = min(d->d_len, sbi->s_alloc_end - d->d_start);
+  }
+  if (!err && len)
+    err = baby_discard_add(sb, start, len, &bio);
+  blk_finish_plug(&plug);
+  err = baby_discard_wait(bio, err);
+  if (err)
+    printk(KERN_WARNING "babyfs: discard failed, err %d\n", err);
+  list_for_each_entry(d, &list, d_list) {
+    if (err || d->d_start >= sbi->s_alloc_end)
+      break;
+    baby_wear_erase(sb, d->d_start,
+                    min(d->d_len, sbi->s_alloc_end - d->d_start));
+  }
+
+put:
+  // discard 结束之后才能重新分配
+  list_for_each_entry_safe(d, tmp, &list, d_list) {
+    baby_put_free_blocks(sb, d->d_start, d->d_len);
+    percpu_counter_add(&sbi->s_freeblocks_counter, d->d_len);
+    atomic_long_sub(d->d_len, &sbi->s_pending_blocks);
+    list_del(&d->d_list);
+    kfree(d);
+  }
+  return;
+
+drop:
+  list_for_each_entry_safe(d, tmp, &list, d_list) {
+    atomic_long_sub(d->d_len, &sbi->s_pending_blocks);
+    list_del(&d->d_list);
+    kfree(d);
+  }
+}
+
+void baby_discard_sb_init(struct baby_sb_info *sbi) {
+  INIT_LIST_HEAD(&sbi->s_discard_list);
+  spin_lock_init(&sbi->s_discard_lock);
+  INIT_DELAYED_WORK(&sbi->s_discard_work, baby_discard_work);
+}
+
+// 卸载时在日志释放之前调用，等待的区间全部 discard 并放回空闲区间树
+void baby_discard_flush(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+
+  cancel_delayed_work_sync(&sbi->s_discard_work);
+  baby_discard_work(&sbi->s_discard_work.work);
+}
+
+/*
+ * FITRIM：range 的 start、len 是文件系统内的字节偏移，minlen 是最短的 discard 长度
+ * 只处理数据区，返回时 range->len 是 discard 的字节数
+ */
+int baby_trim_fs(struct super_block *sb, struct fstrim_range *range) {
+  struct request_queue *q = bdev_get_queue(sb->s_bdev);
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned int bits = sb->s_blocksize_bits;
+  unsigned long start, end, minlen, trimmed = 0;
+  struct baby_free_range *r;
+  struct blk_plug plug;
+  struct bio *bio;
+  int i, n, err = 0;
+
+  if (!blk_queue_discard(q))
+    return -EOPNOTSUPP;
+  if (range->len < sb->s_blocksize)
+    return -EINVAL;
+  minlen = max_t(u64, range->minlen, q->limits.discard_granularity) >> bits;
+  if (!minlen)
+    minlen = 1;
+  if (minlen > sbi->nr_blocks)
+    return -EINVAL;
+  start = range->start >> bits;
+  end = min_t(u64, (range->start >> bits) + (range->len >> bits),
+              (u64)NR_DSTORE_BLOCKS + sbi->s_alloc_end);
+  // 换算成相对于第一个数据块的块号
+  start = start > NR_DSTORE_BLOCKS ? start - NR_DSTORE_BLOCKS : 0;
+  end = end > NR_DSTORE_BLOCKS ? end - NR_DSTORE_BLOCKS : 0;
+
+  r = kmalloc_array(BABY_TRIM_BATCH, sizeof(*r), GFP_KERNEL);
+  if (!r)
+    return -ENOMEM;
+  while (start < end) {
+    n = baby_take_free_extents(sb, &start, end, minlen, r, BABY_TRIM_BATCH);
+    bio = NULL;
+    blk_start_plug(&plug);
+    for (i = 0; i < n && !err; i++)
+      err = baby_discard_add(sb, r[i].fr_start, r[i].fr_len, &bio);
+    blk_finish_plug(&plug);
+    err = baby_discard_wait(bio, err);
+    for (i = 0; i < n; i++) {
+      baby_put_free_blocks(sb, r[i].fr_start, r[i].fr_len);
+      if (!err) {
+        baby_wear_erase(sb, r[i].fr_start, r[i].fr_len);
+        trimmed += r[i].fr_len;
+      }
+    }
+    if (err)
+      break;
+    if (fatal_signal_pending(current)) {
+      err = -ERESTARTSYS;
+      break;
+    }
+    cond_resched();
+  }
+  kfree(r);
+  range->len = (u64)trimmed << bits;
+  return err;
+}
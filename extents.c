@@ -0,0 +1,880 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+
+#include "babyfs.h"
+
+/*
+ * 区间映射
+ *
+ * 打开 BABYFS_EXTENTS_FL 的文件用一棵 B+ 树记录 逻辑块 -> 物理块 的连续区间，
+ * 根节点在 inode 的 i_blocks 里，最多 4 项，放不下之后根里的项搬到新分配的块中，
+ * 树长高一层；其他节点满了之后一分为二，在父节点中插入新的索引项
+ *
+ * 大文件连续分配时只有少量区间，映射、分配和截断只需要读写几个树块，
+ * 不再像间接块那样每 256 个块就要一个索引块
+ *
+ * 树的查找和修改都在 i_alloc_mutex 下进行，修改时调用者先获取 handle
+ *
+ * fallocate 预分配的块记成未写区间，映射时带上 BH_Unwritten，读的时候当作空洞，
+ * 数据写到磁盘之后由 baby_ext_convert 转换成普通区间
+ */
+
+#define BABYFS_EXT_ROOT_MAX                                   \
+  ((sizeof(((struct baby_inode_info *)0)->i_blocks) -         \
+    sizeof(struct baby_extent_header)) /                      \
+   sizeof(struct baby_extent))
+#define BABYFS_EXT_BLOCK_MAX                                  \
+  ((BABYFS_BLOCK_SIZE - sizeof(struct baby_extent_header)) /  \
+   sizeof(struct baby_extent))
+#define BABYFS_EXT_MAX_BLOCKS 0xffffffffUL // 逻辑块号的上限
+
+#define EXT_FIRST_EXTENT(hdr) ((struct baby_extent *)((hdr) + 1))
+#define EXT_FIRST_INDEX(hdr) ((struct baby_extent_idx *)((hdr) + 1))
+#define EXT_LAST_EXTENT(hdr) \
+  (EXT_FIRST_EXTENT(hdr) + le16_to_cpu((hdr)->eh_entries) - 1)
+#define EXT_LAST_INDEX(hdr) \
+  (EXT_FIRST_INDEX(hdr) + le16_to_cpu((hdr)->eh_entries) - 1)
+
+// 从根到叶子查找时每一层的位置
+struct baby_ext_path {
+  struct buffer_head *p_bh;         // 这一层节点所在的块，根节点为 NULL
+  struct baby_extent_header *p_hdr; // 这一层节点的头部
+  struct baby_extent_idx *p_idx;    // 索引节点：往下走的索引项
+  struct baby_extent *p_ext;        // 叶子节点：起始块号不大于要找的块的最后一个区间，没有时为 NULL
+};
+
+static inline struct baby_extent_header *ext_inode_hdr(struct inode *inode) {
+  return (struct baby_extent_header *)BABY_I(inode)->i_blocks;
+}
+
+static inline int ext_is_unwritten(struct baby_extent *ex) {
+  return le16_to_cpu(ex->ee_len) > BABYFS_EXT_INIT_MAX_LEN;
+}
+
+static inline unsigned long ext_len(struct baby_extent *ex) {
+  unsigned long len = le16_to_cpu(ex->ee_len);
+
+  return len > BABYFS_EXT_INIT_MAX_LEN ? len - BABYFS_EXT_INIT_MAX_LEN : len;
+}
+
+static inline void ext_set_len(struct baby_extent *ex, unsigned long len,
+                               int unwritten) {
+  ex->ee_len = cpu_to_le16(unwritten ? len + BABYFS_EXT_INIT_MAX_LEN : len);
+}
+
+static inline unsigned long ext_max_len(int unwritten) {
+  return unwritten ? BABYFS_EXT_UNWRITTEN_MAX_LEN : BABYFS_EXT_INIT_MAX_LEN;
+}
+
+// 新建文件时初始化一个空的根节点
+void baby_ext_tree_init(struct inode *inode) {
+  struct baby_extent_header *hdr = ext_inode_hdr(inode);
+
+  BUILD_BUG_ON(sizeof(struct baby_extent) != sizeof(struct baby_extent_idx));
+  BUILD_BUG_ON(sizeof(struct baby_extent_header) != sizeof(struct baby_extent));
+  memset(BABY_I(inode)->i_blocks, 0, sizeof(BABY_I(inode)->i_blocks));
+  hdr->eh_magic = cpu_to_le16(BABYFS_EXT_MAGIC);
+  hdr->eh_max = cpu_to_le16(BABYFS_EXT_ROOT_MAX);
+  mark_inode_dirty(inode);
+}
+
+// 检查节点头部，depth < 0 时不检查层数
+static int baby_ext_check(struct inode *inode, struct baby_extent_header *hdr,
+                          int depth) {
+  if (le16_to_cpu(hdr->eh_magic) != BABYFS_EXT_MAGIC ||
+      le16_to_cpu(hdr->eh_entries) > le16_to_cpu(hdr->eh_max) ||
+      le16_to_cpu(hdr->eh_depth) > BABYFS_EXT_MAX_DEPTH ||
+      (depth >= 0 && le16_to_cpu(hdr->eh_depth) != depth)) {
+    printk(KERN_ERR "babyfs: bad extent header in inode %lu\n", inode->i_ino);
+    return -EIO;
+  }
+  return 0;
+}
+
+static void baby_ext_drop_path(struct baby_ext_path *path, int depth) {
+  int i;
+
+  for (i = 0; i <= depth; i++) {
+    brelse(path[i].p_bh);
+    path[i].p_bh = NULL;
+  }
+}
+
+// 修改了某一层节点之后标记为脏
+static void baby_ext_dirty(struct inode *inode, struct baby_ext_path *p) {
+  if (p->p_bh)
+    baby_journal_dirty(inode->i_sb, inode, p->p_bh);
+  else
+    mark_inode_dirty(inode);
+}
+
+// 索引节点中 ei_block 不大于 block 的最后一项，没有时返回第一项
+static struct baby_extent_idx *
+baby_ext_search_idx(struct baby_extent_header *hdr, unsigned long block) {
+  struct baby_extent_idx *l = EXT_FIRST_INDEX(hdr) + 1;
+  struct baby_extent_idx *r = EXT_LAST_INDEX(hdr);
+  struct baby_extent_idx *m;
+
+  while (l <= r) {
+    m = l + (r - l) / 2;
+    if (block < le32_to_cpu(m->ei_block))
+      r = m - 1;
+    else
+      l = m + 1;
+  }
+  return l - 1;
+}
+
+// 叶子节点中 ee_block 不大于 block 的最后一个区间，没有时返回 NULL
+static struct baby_extent *
+baby_ext_search_ext(struct baby_extent_header *hdr, unsigned long block) {
+  struct baby_extent *l = EXT_FIRST_EXTENT(hdr);
+  struct baby_extent *r = EXT_LAST_EXTENT(hdr);
+  struct baby_extent *m;
+
+  while (l <= r) {
+    m = l + (r - l) / 2;
+    if (block < le32_to_cpu(m->ee_block))
+      r = m - 1;
+    else
+      l = m + 1;
+  }
+  return l == EXT_FIRST_EXTENT(hdr) ? NULL : l - 1;
+}
+
+/*
+ * 从根节点找到 block 所在的叶子，填充 path
+ * 返回树的深度，出错时返回负的错误码
+ */
+static int baby_ext_find(struct inode *inode, unsigned long block,
+                         struct baby_ext_path *path) {
+  struct baby_extent_header *hdr = ext_inode_hdr(inode);
+  struct buffer_head *bh;
+  int depth, i;
+
+  if (baby_ext_check(inode, hdr, -1))
+    return -EIO;
+  depth = le16_to_cpu(hdr->eh_depth);
+  memset(path, 0, sizeof(*path) * (depth + 1));
+  for (i = 0; i < depth; i++) {
+    path[i].p_hdr = hdr;
+    if (!hdr->eh_entries)
+      goto corrupted;
+    path[i].p_idx = baby_ext_search_idx(hdr, block);
+    bh = sb_bread(inode->i_sb, le32_to_cpu(path[i].p_idx->ei_leaf));
+    if (!bh) {
+      baby_ext_drop_path(path, i);
+      return -EIO;
+    }
+    path[i + 1].p_bh = bh;
+    hdr = (struct baby_extent_header *)bh->b_data;
+    if (baby_ext_check(inode, hdr, depth - i - 1))
+      goto corrupted;
+  }
+  path[depth].p_hdr = hdr;
+  path[depth].p_ext = baby_ext_search_ext(hdr, block);
+  return depth;
+
+corrupted:
+  baby_ext_drop_path(path, depth);
+  return -EIO;
+}
+
+// block 之后第一个已经映射的逻辑块号，用来限制一次分配的长度
+static unsigned long baby_ext_next_allocated(struct baby_ext_path *path,
+                                             int depth) {
+  struct baby_extent_header *hdr = path[depth].p_hdr;
+  struct baby_extent *ex = path[depth].p_ext;
+  int i;
+
+  if (ex ? ex < EXT_LAST_EXTENT(hdr) : hdr->eh_entries != 0)
+    return le32_to_cpu((ex ? ex + 1 : EXT_FIRST_EXTENT(hdr))->ee_block);
+  for (i = depth - 1; i >= 0; i--) {
+    if (path[i].p_idx < EXT_LAST_INDEX(path[i].p_hdr))
+      return le32_to_cpu(path[i].p_idx[1].ei_block);
+  }
+  return BABYFS_EXT_MAX_BLOCKS;
+}
+
+/*
+ * block 已经映射时返回从 block 开始连续映射的块数（不超过 max），*pblk 为物理块号，
+ * *unwritten 表示是不是未写区间
+ * 没有映射时返回 0，*next 为之后第一个已经映射的逻辑块号
+ */
+static unsigned long baby_ext_lookup(struct baby_ext_path *path, int depth,
+                                     unsigned long block, unsigned long max,
+                                     unsigned long *pblk, unsigned long *next,
+                                     int *unwritten) {
+  struct baby_extent *ex = path[depth].p_ext;
+  unsigned long start, len;
+
+  if (ex) {
+    start = le32_to_cpu(ex->ee_block);
+    len = ext_len(ex);
+    if (block < start + len) {
+      *pblk = le32_to_cpu(ex->ee_start) + block - start;
+      *unwritten = ext_is_unwritten(ex);
+      return min(max, start + len - block);
+    }
+  }
+  *next = baby_ext_next_allocated(path, depth);
+  return 0;
+}
+
+// 分配一个树块，返回加锁并清零的 buffer；树块是元数据，放在热区域
+static struct buffer_head *baby_ext_new_block(struct inode *inode, int *err) {
+  struct buffer_head *bh;
+  unsigned long count = 1, block;
+
+  block = baby_new_meta_blocks(inode, &count, err);
+  if (*err)
+    return NULL;
+  bh = sb_getblk(inode->i_sb, block);
+  if (unlikely(!bh)) {
+    baby_free_blocks(inode, block, 1);
+    *err = -ENOMEM;
+    return NULL;
+  }
+  lock_buffer(bh);
+  memset(bh->b_data, 0, bh->b_size);
+  return bh;
+}
+
+/*
+ * 根节点满了：把根里的项搬到一个新块中，根节点只留一个指向它的索引项，树长高一层
+ */
+static int baby_ext_grow(struct inode *inode) {
+  struct baby_extent_header *root = ext_inode_hdr(inode), *hdr;
+  struct baby_extent_idx *idx;
+  struct buffer_head *bh;
+  int err;
+
+  if (le16_to_cpu(root->eh_depth) >= BABYFS_EXT_MAX_DEPTH)
+    return -EFBIG;
+  bh = baby_ext_new_block(inode, &err);
+  if (!bh)
+    return err;
+  hdr = (struct baby_extent_header *)bh->b_data;
+  memcpy(hdr + 1, root + 1,
+         le16_to_cpu(root->eh_entries) * sizeof(struct baby_extent));
+  hdr->eh_magic = cpu_to_le16(BABYFS_EXT_MAGIC);
+  hdr->eh_entries = root->eh_entries;
+  hdr->eh_max = cpu_to_le16(BABYFS_EXT_BLOCK_MAX);
+  hdr->eh_depth = root->eh_depth;
+  set_buffer_uptodate(bh);
+  unlock_buffer(bh);
+  baby_journal_dirty(inode->i_sb, inode, bh);
+
+  idx = EXT_FIRST_INDEX(root);
+  idx->ei_block = EXT_FIRST_EXTENT(hdr)->ee_block; // 两种项的第一个域都是起始逻辑块号
+  idx->ei_leaf = cpu_to_le32(bh->b_blocknr);
+  idx->ei_reserved = 0;
+  root->eh_entries = cpu_to_le16(1);
+  le16_add_cpu(&root->eh_depth, 1);
+  mark_inode_dirty(inode);
+  brelse(bh);
+  return 0;
+}
+
+/*
+ * 第 level 层的节点满了，把它的后一部分搬到新块中，在父节点插入新块的索引项
+ * 父节点也满时先分裂父节点，调用者重新查找后再试
+ */
+static int baby_ext_split(struct inode *inode, struct baby_ext_path *path,
+                          int depth, int level) {
+  struct baby_extent_header *hdr = path[level].p_hdr, *nhdr, *phdr;
+  struct baby_extent_idx *pidx;
+  struct buffer_head *bh;
+  int entries = le16_to_cpu(hdr->eh_entries);
+  int pos, m, err;
+
+  if (level == 0)
+    return baby_ext_grow(inode);
+  phdr = path[level - 1].p_hdr;
+  if (phdr->eh_entries == phdr->eh_max)
+    return baby_ext_split(inode, path, depth, level - 1);
+
+  // 要插入的位置在最后（顺序写），只搬走最后一项，原来的节点保持满的
+  if (level == depth)
+    pos = path[level].p_ext ? path[level].p_ext - EXT_FIRST_EXTENT(hdr) : -1;
+  else
+    pos = path[level].p_idx - EXT_FIRST_INDEX(hdr);
+  m = pos == entries - 1 ? entries - 1 : entries / 2;
+
+  bh = baby_ext_new_block(inode, &err);
+  if (!bh)
+    return err;
+  nhdr = (struct baby_extent_header *)bh->b_data;
+  memcpy(nhdr + 1, EXT_FIRST_EXTENT(hdr) + m,
+         (entries - m) * sizeof(struct baby_extent));
+  nhdr->eh_magic = cpu_to_le16(BABYFS_EXT_MAGIC);
+  nhdr->eh_entries = cpu_to_le16(entries - m);
+  nhdr->eh_max = cpu_to_le16(BABYFS_EXT_BLOCK_MAX);
+  nhdr->eh_depth = hdr->eh_depth;
+  set_buffer_uptodate(bh);
+  unlock_buffer(bh);
+  baby_journal_dirty(inode->i_sb, inode, bh);
+
+  hdr->eh_entries = cpu_to_le16(m);
+  baby_ext_dirty(inode, &path[level]);
+
+  pidx = path[level - 1].p_idx + 1;
+  memmove(pidx + 1, pidx, (EXT_LAST_INDEX(phdr) - pidx + 1) * sizeof(*pidx));
+  pidx->ei_block = EXT_FIRST_EXTENT(nhdr)->ee_block;
+  pidx->ei_leaf = cpu_to_le32(bh->b_blocknr);
+  pidx->ei_reserved = 0;
+  le16_add_cpu(&phdr->eh_entries, 1);
+  baby_ext_dirty(inode, &path[level - 1]);
+  brelse(bh);
+  return 0;
+}
+
+// 叶子的第一个区间往前扩展到 block 时，沿路径调小索引项的起始块号
+static void baby_ext_correct_index(struct inode *inode,
+                                   struct baby_ext_path *path, int depth,
+                                   unsigned long block) {
+  int i;
+
+  for (i = depth - 1; i >= 0; i--) {
+    if (le32_to_cpu(path[i].p_idx->ei_block) <= block)
+      break;
+    path[i].p_idx->ei_block = cpu_to_le32(block);
+    baby_ext_dirty(inode, &path[i]);
+  }
+}
+
+// 只有未写状态相同的区间才能合并
+static inline int baby_ext_can_append(struct baby_extent *ex,
+                                      unsigned long block, unsigned long pblk,
+                                      unsigned long len, int unwritten) {
+  unsigned long ex_len = ext_len(ex);
+
+  return ext_is_unwritten(ex) == unwritten &&
+         le32_to_cpu(ex->ee_block) + ex_len == block &&
+         le32_to_cpu(ex->ee_start) + ex_len == pblk &&
+         ex_len + len <= ext_max_len(unwritten);
+}
+
+// 把 [block, block + len) -> pblk 加入区间树，能和相邻区间合并时直接合并
+static int baby_ext_insert(struct inode *inode, unsigned long block,
+                           unsigned long pblk, unsigned long len,
+                           int unwritten) {
+  struct baby_ext_path path[BABYFS_EXT_MAX_DEPTH + 1];
+  struct baby_extent_header *hdr;
+  struct baby_extent *ex, *nex;
+  int depth, err;
+
+repeat:
+  depth = baby_ext_find(inode, block, path);
+  if (depth < 0)
+    return depth;
+  hdr = path[depth].p_hdr;
+  ex = path[depth].p_ext;
+  // 紧跟在左边区间之后，左边区间往后延长
+  if (ex && baby_ext_can_append(ex, block, pblk, len, unwritten)) {
+    le16_add_cpu(&ex->ee_len, len);
+    goto out;
+  }
+  // 紧挨着右边区间，右边区间往前延长
+  nex = ex ? ex + 1 : EXT_FIRST_EXTENT(hdr);
+  if (nex <= EXT_LAST_EXTENT(hdr) && ext_is_unwritten(nex) == unwritten &&
+      block + len == le32_to_cpu(nex->ee_block) &&
+      pblk + len == le32_to_cpu(nex->ee_start) &&
+      ext_len(nex) + len <= ext_max_len(unwritten)) {
+    nex->ee_block = cpu_to_le32(block);
+    nex->ee_start = cpu_to_le32(pblk);
+    le16_add_cpu(&nex->ee_len, len);
+    goto fix_index;
+  }
+  if (hdr->eh_entries == hdr->eh_max) {
+    err = baby_ext_split(inode, path, depth, depth);
+    baby_ext_drop_path(path, depth);
+    if (err)
+      return err;
+    goto repeat;
+  }
+  memmove(nex + 1, nex, (EXT_LAST_EXTENT(hdr) - nex + 1) * sizeof(*nex));
+  nex->ee_block = cpu_to_le32(block);
+  nex->ee_start = cpu_to_le32(pblk);
+  ext_set_len(nex, len, unwritten);
+  nex->ee_reserved = 0;
+  le16_add_cpu(&hdr->eh_entries, 1);
+fix_index:
+  if (nex == EXT_FIRST_EXTENT(hdr))
+    baby_ext_correct_index(inode, path, depth, block);
+out:
+  baby_ext_dirty(inode, &path[depth]);
+  baby_ext_drop_path(path, depth);
+  return 0;
+}
+
+static unsigned long baby_ext_find_goal(struct inode *inode,
+                                        struct baby_ext_path *path, int depth,
+                                        unsigned long block) {
+  struct baby_block_alloc_info *block_i = BABY_I(inode)->i_block_alloc_info;
+  struct baby_extent *ex = path[depth].p_ext;
+
+  // 顺序写，接着上一次分配的物理块
+  if (block_i && block == block_i->last_alloc_logical_block + 1 &&
+      block_i->last_alloc_physical_block != 0)
+    return block_i->last_alloc_physical_block + 1;
+  // 按左边区间的物理位置推算；树块在热区域里，不能用来推算数据块的位置
+  if (ex)
+    return le32_to_cpu(ex->ee_start) + block - le32_to_cpu(ex->ee_block);
+  return baby_default_goal(inode);
+}
+
+/*
+ * 区间映射文件的 baby_get_blocks
+ * 返回从 block 开始连续映射的块数，出错时返回负的错误码
+ * 分配时一次最多分配 maxblocks 块，并且不会覆盖到后面已经映射的块
+ * create 为 BABY_GET_BLOCKS_UNWRITTEN 时新分配的块记成未写区间
+ * 映射到未写区间时给 bh 设置 BH_Unwritten
+ */
+int baby_ext_get_blocks(struct inode *inode, sector_t block,
+                        unsigned long maxblocks, struct buffer_head *bh,
+                        int create) {
+  struct baby_ext_path path[BABYFS_EXT_MAX_DEPTH + 1];
+  struct baby_inode_info *bbi = BABY_I(inode);
+  struct baby_sb_info *sbi = BABY_SB(inode->i_sb);
+  struct baby_block_alloc_info *block_i;
+  struct baby_handle *handle = NULL;
+  unsigned long pblk = 0, next = 0, goal, count;
+  int unwritten = create == BABY_GET_BLOCKS_UNWRITTEN;
+  int depth, err = 0;
+
+  if (block >= BABYFS_EXT_MAX_BLOCKS)
+    return -EFBIG;
+  mutex_lock(&bbi->i_alloc_mutex);
+  depth = baby_ext_find(inode, block, path);
+  if (depth < 0) {
+    mutex_unlock(&bbi->i_alloc_mutex);
+    return depth;
+  }
+  count = baby_ext_lookup(path, depth, block, maxblocks, &pblk, &next,
+                          &unwritten);
+  baby_ext_drop_path(path, depth);
+  if (count || !create)
+    goto out;
+
+  // 需要分配，handle 要在 i_alloc_mutex 之前获取，放锁之后重新查找
+  mutex_unlock(&bbi->i_alloc_mutex);
+  handle = baby_journal_start(inode->i_sb, BABYFS_ALLOC_CREDITS);
+  if (IS_ERR(handle))
+    return PTR_ERR(handle);
+  mutex_lock(&bbi->i_alloc_mutex);
+  depth = baby_ext_find(inode, block, path);
+  if (depth < 0) {
+    err = depth;
+    goto out;
+  }
+  count = baby_ext_lookup(path, depth, block, maxblocks, &pblk, &next,
+                          &unwritten);
+  if (count) {
+    baby_ext_drop_path(path, depth);
+    goto out;
+  }
+  goal = baby_ext_find_goal(inode, path, depth, block);
+  baby_ext_drop_path(path, depth);
+  if (goal < NR_DSTORE_BLOCKS)
+    goal = NR_DSTORE_BLOCKS;
+  goal = (goal - NR_DSTORE_BLOCKS) % sbi->nr_blocks + NR_DSTORE_BLOCKS;
+
+  count = min3(maxblocks, next - (unsigned long)block, ext_max_len(unwritten));
+  pblk = baby_new_blocks(inode, goal, &count, &err);
+  if (err) {
+    count = 0;
+    goto out;
+  }
+  err = baby_ext_insert(inode, block, pblk, count, unwritten);
+  if (err) {
+    baby_log_abort(inode->i_sb, pblk, count);
+    baby_free_blocks(inode, pblk, count);
+    count = 0;
+    goto out;
+  }
+  if (baby_log_mode(inode->i_sb))
+    baby_summary_set(inode, pblk, block, count);
+  block_i = bbi->i_block_alloc_info;
+  if (block_i) {
+    block_i->last_alloc_logical_block = block + count - 1;
+    block_i->last_alloc_physical_block = pblk + count - 1;
+  }
+  inode->i_ctime = current_time(inode);
+  mark_inode_dirty(inode);
+  set_buffer_new(bh);
+
+out:
+  mutex_unlock(&bbi->i_alloc_mutex);
+  if (handle)
+    baby_journal_stop(handle);
+  if (err)
+    return err;
+  if (count) {
+    map_bh(bh, inode->i_sb, pblk);
+    if (unwritten)
+      set_buffer_unwritten(bh);
+  }
+  return count;
+}
+
+/*
+ * 在叶子中 ex 之后腾出 n 个空项
+ * 叶子放不下时先分裂，返回 -EAGAIN，调用者放掉 path 重新查找
+ */
+static int baby_ext_make_room(struct inode *inode, struct baby_ext_path *path,
+                              int depth, int n) {
+  struct baby_extent_header *hdr = path[depth].p_hdr;
+  struct baby_extent *ex = path[depth].p_ext;
+  int err;
+
+  if (le16_to_cpu(hdr->eh_entries) + n > le16_to_cpu(hdr->eh_max)) {
+    err = baby_ext_split(inode, path, depth, depth);
+    return err ? err : -EAGAIN;
+  }
+  memmove(ex + 1 + n, ex + 1, (EXT_LAST_EXTENT(hdr) - ex) * sizeof(*ex));
+  le16_add_cpu(&hdr->eh_entries, n);
+  return 0;
+}
+
+static inline void ext_set(struct baby_extent *ex, unsigned long block,
+                           unsigned long pblk, unsigned long len,
+                           int unwritten) {
+  ex->ee_block = cpu_to_le32(block);
+  ex->ee_start = cpu_to_le32(pblk);
+  ext_set_len(ex, len, unwritten);
+  ex->ee_reserved = 0;
+}
+
+// 删除叶子中的 ex，删空的叶子留在树里，截断时再释放
+static void baby_ext_remove(struct baby_ext_path *path, int depth,
+                            struct baby_extent *ex) {
+  struct baby_extent_header *hdr = path[depth].p_hdr;
+
+  memmove(ex, ex + 1, (EXT_LAST_EXTENT(hdr) - ex) * sizeof(*ex));
+  le16_add_cpu(&hdr->eh_entries, -1);
+}
+
+/*
+ * 把 [block, block + len) 中的未写区间转换成普通区间，数据写到磁盘之后调用
+ * 只转换区间的中间一段时拆成两到三项；顺序写预分配的文件时，
+ * 转换的部分直接并入左边已经转换过的区间，不会每次写都多出一项
+ * 范围内的区间数不固定，每转换一个区间换一个 handle
+ */
+int baby_ext_convert(struct inode *inode, unsigned long block,
+                     unsigned long len) {
+  struct baby_ext_path path[BABYFS_EXT_MAX_DEPTH + 1];
+  struct baby_inode_info *bbi = BABY_I(inode);
+  struct baby_handle *handle;
+  struct baby_extent *ex;
+  unsigned long end = block + len, start, ex_end, pblk, to;
+  int depth, n, err = 0;
+
+  handle = baby_journal_start(inode->i_sb, BABYFS_ALLOC_CREDITS);
+  if (IS_ERR(handle))
+    return PTR_ERR(handle);
+  mutex_lock(&bbi->i_alloc_mutex);
+  while (block < end) {
+    depth = baby_ext_find(inode, block, path);
+    if (depth < 0) {
+      err = depth;
+      break;
+    }
+    ex = path[depth].p_ext;
+    // 已经被打洞或者截掉了
+    if (!ex || le32_to_cpu(ex->ee_block) + ext_len(ex) <= block) {
+      block = baby_ext_next_allocated(path, depth);
+      baby_ext_drop_path(path, depth);
+      continue;
+    }
+    start = le32_to_cpu(ex->ee_block);
+    ex_end = start + ext_len(ex);
+    pblk = le32_to_cpu(ex->ee_start);
+    to = min(end, ex_end);
+    if (!ext_is_unwritten(ex)) {
+      baby_ext_drop_path(path, depth);
+      block = ex_end;
+      continue;
+    }
+
+    if (block == start && ex > EXT_FIRST_EXTENT(path[depth].p_hdr) &&
+        baby_ext_can_append(ex - 1, block, pblk, to - block, 0)) {
+      le16_add_cpu(&ex[-1].ee_len, to - block);
+      if (to < ex_end)
+        ext_set(ex, to, pblk + to - start, ex_end - to, 1);
+      else
+        baby_ext_remove(path, depth, ex);
+    } else {
+      n = (block > start) + (to < ex_end);
+      err = n ? baby_ext_make_room(inode, path, depth, n) : 0;
+      if (err) {
+        baby_ext_drop_path(path, depth);
+        if (err != -EAGAIN)
+          break;
+        err = 0;
+        continue;
+      }
+      if (block > start) {
+        ext_set_len(ex, block - start, 1);
+        ex++;
+      }
+      ext_set(ex, block, pblk + block - start, to - block, 0);
+      if (to < ex_end)
+        ext_set(ex + 1, to, pblk + to - start, ex_end - to, 1);
+    }
+    baby_ext_dirty(inode, &path[depth]);
+    baby_ext_drop_path(path, depth);
+    block = to;
+    if (block >= end)
+      break;
+    mutex_unlock(&bbi->i_alloc_mutex);
+    baby_journal_stop(handle);
+    handle = baby_journal_start(inode->i_sb, BABYFS_ALLOC_CREDITS);
+    if (IS_ERR(handle)) {
+      err = PTR_ERR(handle);
+      goto out;
+    }
+    mutex_lock(&bbi->i_alloc_mutex);
+  }
+  mutex_unlock(&bbi->i_alloc_mutex);
+  baby_journal_stop(handle);
+out:
+  if (err)
+    printk(KERN_ERR "babyfs: convert unwritten extents failed, inode %lu\n",
+           inode->i_ino);
+  return err;
+}
+
+/*
+ * 日志结构模式下回写已经有块的数据：给 [block, block + len) 分配新块，
+ * 区间中的这一段改为指向新块，旧块释放，和分配在同一个 handle 里
+ * 只处理 block 所在的普通区间，返回换到新块的块数并把新块映射到 bh；
+ * 分配不到新块、树块不够或者映射已经变了时返回 0 或错误码，bh 不变，调用者原地写
+ */
+int baby_ext_relocate(struct inode *inode, unsigned long block,
+                      unsigned long len, struct buffer_head *bh) {
+  struct baby_ext_path path[BABYFS_EXT_MAX_DEPTH + 1];
+  struct baby_inode_info *bbi = BABY_I(inode);
+  struct baby_handle *handle;
+  struct baby_extent *ex;
+  unsigned long start, ex_end, pblk, new = 0, count = 0, to;
+  int depth, n, err = 0;
+
+  handle = baby_journal_start(inode->i_sb, BABYFS_ALLOC_CREDITS);
+  if (IS_ERR(handle))
+    return PTR_ERR(handle);
+  mutex_lock(&bbi->i_alloc_mutex);
+  for (;;) {
+    depth = baby_ext_find(inode, block, path);
+    if (depth < 0) {
+      err = depth;
+      break;
+    }
+    ex = path[depth].p_ext;
+    if (!ex || ext_is_unwritten(ex) ||
+        le32_to_cpu(ex->ee_block) + ext_len(ex) <= block) {
+      baby_ext_drop_path(path, depth);
+      break;
+    }
+    start = le32_to_cpu(ex->ee_block);
+    ex_end = start + ext_len(ex);
+    pblk = le32_to_cpu(ex->ee_start);
+    // 新块只分配一次，腾出空项要分裂叶子时重新查找
+    if (!new) {
+      count = min(len, ex_end - block);
+      new = baby_new_blocks(inode, baby_default_goal(inode), &count, &err);
+      if (err) {
+        baby_ext_drop_path(path, depth);
+        break;
+      }
+    }
+    to = block + count;
+    if (to > ex_end) {
+      // 分裂叶子期间不会改变映射，保险起见放弃
+      baby_ext_drop_path(path, depth);
+      err = -EIO;
+      break;
+    }
+
+    if (block == start && ex > EXT_FIRST_EXTENT(path[depth].p_hdr) &&
+        baby_ext_can_append(ex - 1, block, new, count, 0)) {
+      le16_add_cpu(&ex[-1].ee_len, count);
+      if (to < ex_end)
+        ext_set(ex, to, pblk + to - start, ex_end - to, 0);
+      else
+        baby_ext_remove(path, depth, ex);
+    } else {
+      n = (block > start) + (to < ex_end);
+      err = n ? baby_ext_make_room(inode, path, depth, n) : 0;
+      if (err) {
+        baby_ext_drop_path(path, depth);
+        if (err != -EAGAIN)
+          break;
+        err = 0;
+        continue;
+      }
+      if (block > start) {
+        ext_set_len(ex, block - start, 0);
+        ex++;
+      }
+      ext_set(ex, block, new, count, 0);
+      if (to < ex_end)
+        ext_set(ex + 1, to, pblk + to - start, ex_end - to, 0);
+    }
+    baby_ext_dirty(inode, &path[depth]);
+    baby_ext_drop_path(path, depth);
+    baby_map_cache_remove(inode, block, count);
+    baby_free_blocks(inode, pblk + block - start, count);
+    baby_summary_set(inode, new, block, count);
+    map_bh(bh, inode->i_sb, new);
+    mutex_unlock(&bbi->i_alloc_mutex);
+    baby_journal_stop(handle);
+    return count;
+  }
+  if (new) {
+    baby_log_abort(inode->i_sb, new, count);
+    baby_free_blocks(inode, new, count);
+  }
+  mutex_unlock(&bbi->i_alloc_mutex);
+  baby_journal_stop(handle);
+  return err;
+}
+
+/*
+ * 打洞：释放 [block, block + len) 中的块，区间跨过洞的两端时只删掉中间的部分
+ * 调用者持有 handle 和 i_alloc_mutex
+ */
+int baby_ext_punch(struct inode *inode, unsigned long block,
+                   unsigned long len) {
+  struct baby_ext_path path[BABYFS_EXT_MAX_DEPTH + 1];
+  struct baby_extent *ex;
+  unsigned long end = block + len, start, ex_end, pblk, to;
+  int depth, unwritten, err;
+
+  if (end < block || end > BABYFS_EXT_MAX_BLOCKS)
+    end = BABYFS_EXT_MAX_BLOCKS;
+  while (block < end) {
+    depth = baby_ext_find(inode, block, path);
+    if (depth < 0)
+      return depth;
+    ex = path[depth].p_ext;
+    if (!ex || le32_to_cpu(ex->ee_block) + ext_len(ex) <= block) {
+      block = baby_ext_next_allocated(path, depth);
+      baby_ext_drop_path(path, depth);
+      continue;
+    }
+    start = le32_to_cpu(ex->ee_block);
+    ex_end = start + ext_len(ex);
+    pblk = le32_to_cpu(ex->ee_start);
+    to = min(end, ex_end);
+    unwritten = ext_is_unwritten(ex);
+
+    if (block > start && to < ex_end) {
+      // 洞在区间中间，拆成两项
+      err = baby_ext_make_room(inode, path, depth, 1);
+      if (err) {
+        baby_ext_drop_path(path, depth);
+        if (err != -EAGAIN)
+          return err;
+        continue;
+      }
+      ext_set_len(ex, block - start, unwritten);
+      ext_set(ex + 1, to, pblk + to - start, ex_end - to, unwritten);
+    } else if (block > start) {
+      ext_set_len(ex, block - start, unwritten);
+    } else if (to < ex_end) {
+      // 起始块变大，索引项中的起始块号仍然不大于它，不用修改
+      ext_set(ex, to, pblk + to - start, ex_end - to, unwritten);
+    } else {
+      baby_ext_remove(path, depth, ex);
+    }
+    baby_ext_dirty(inode, &path[depth]);
+    baby_ext_drop_path(path, depth);
+    baby_free_blocks(inode, pblk + block - start, to - block);
+    block = to;
+  }
+  return 0;
+}
+
+// 释放叶子中从 from 开始的区间，区间从后往前删，不需要移动
+static void baby_ext_rm_leaf(struct inode *inode,
+                             struct baby_extent_header *hdr,
+                             unsigned long from) {
+  struct baby_extent *ex;
+  unsigned long start, len, pblk;
+
+  while (hdr->eh_entries) {
+    ex = EXT_LAST_EXTENT(hdr);
+    start = le32_to_cpu(ex->ee_block);
+    len = ext_len(ex);
+    pblk = le32_to_cpu(ex->ee_start);
+    if (start + len <= from)
+      break;
+    if (start >= from) {
+      baby_free_blocks(inode, pblk, len);
+      le16_add_cpu(&hdr->eh_entries, -1);
+      continue;
+    }
+    // 区间跨过 from，保留前一半
+    baby_free_blocks(inode, pblk + from - start, start + len - from);
+    ext_set_len(ex, from - start, ext_is_unwritten(ex));
+    break;
+  }
+}
+
+// 释放以 hdr 为根、深度为 depth 的子树中从 from 开始的映射，空了的子节点一起释放
+static int baby_ext_rm_node(struct inode *inode,
+                            struct baby_extent_header *hdr, int depth,
+                            unsigned long from) {
+  struct baby_extent_header *chdr;
+  struct baby_extent_idx *idx;
+  struct buffer_head *bh;
+  unsigned long nr;
+  int err;
+
+  if (!depth) {
+    baby_ext_rm_leaf(inode, hdr, from);
+    return 0;
+  }
+  while (hdr->eh_entries) {
+    idx = EXT_LAST_INDEX(hdr);
+    nr = le32_to_cpu(idx->ei_leaf);
+    bh = sb_bread(inode->i_sb, nr);
+    if (!bh)
+      return -EIO;
+    chdr = (struct baby_extent_header *)bh->b_data;
+    err = baby_ext_check(inode, chdr, depth - 1);
+    if (!err)
+      err = baby_ext_rm_node(inode, chdr, depth - 1, from);
+    if (!err && !chdr->eh_entries) {
+      bforget(bh);
+      baby_free_blocks(inode, nr, 1);
+      le16_add_cpu(&hdr->eh_entries, -1);
+      continue;
+    }
+    if (!err)
+      baby_journal_dirty(inode->i_sb, inode, bh);
+    brelse(bh);
+    // 这个子树里还有 from 之前的映射，前面的子树都不用动
+    return err;
+  }
+  return 0;
+}
+
+/*
+ * 截断：释放逻辑块号不小于 from 的所有块，调用者持有 i_alloc_mutex
+ */
+void baby_ext_truncate(struct inode *inode, unsigned long from) {
+  struct baby_extent_header *root = ext_inode_hdr(inode);
+
+  if (baby_ext_check(inode, root, -1))
+    return;
+  if (baby_ext_rm_node(inode, root, le16_to_cpu(root->eh_depth), from))
+    printk(KERN_ERR "babyfs: truncate extents failed, inode %lu\n",
+           inode->i_ino);
+  // 全部删空之后根节点重新当作叶子
+  if (!root->eh_entries)
+    root->eh_depth = 0;
+  mark_inode_dirty(inode);
+  baby_discard_reservation(inode);
+}
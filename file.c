@@ -1,10 +1,455 @@
+#include <linux/blkdev.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
+#include <linux/iomap.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/uio.h>
 #include "babyfs.h"
 
+/*
+ * 有日志时元数据都在事务里，fsync 先写回数据页，再提交包含这个 inode
+ * 最近修改的事务；事务已经提交过时只需要刷新磁盘缓存
+ */
+int baby_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+  struct inode *inode = file->f_mapping->host;
+  int err;
+
+  if (!baby_has_journal(inode->i_sb))
+    return generic_file_fsync(file, start, end, datasync);
+  err = file_write_and_wait_range(file, start, end);
+  if (err)
+    return err;
+  err = baby_journal_commit_inode(inode);
+  if (err < 0)
+    return err;
+  if (!err)
+    err = blkdev_issue_flush(inode->i_sb->s_bdev, GFP_KERNEL, NULL);
+  else
+    err = 0;
+  return err;
+}
+
+static ssize_t baby_file_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+  struct inode *inode = file_inode(iocb->ki_filp);
+  ssize_t ret;
+
+  if (!(iocb->ki_flags & IOCB_DIRECT))
+    return generic_file_read_iter(iocb, to);
+  if (!iov_iter_count(to))
+    return 0;
+  inode_lock_shared(inode);
+  file_accessed(iocb->ki_filp);
+  ret = iomap_dio_rw(iocb, to, &baby_iomap_ops, NULL, is_sync_kiocb(iocb));
+  inode_unlock_shared(inode);
+  return ret;
+}
+
+// 写到未写区间的直接 I/O 完成之后转换成普通区间
+static int baby_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error,
+                                 unsigned flags) {
+  struct inode *inode = file_inode(iocb->ki_filp);
+  unsigned int blkbits = inode->i_blkbits;
+  unsigned long first = iocb->ki_pos >> blkbits;
+
+  if (error || size <= 0 || !(flags & IOMAP_DIO_UNWRITTEN))
+    return error;
+  return baby_ext_convert(inode, first,
+                          ((iocb->ki_pos + size - 1) >> blkbits) - first + 1);
+}
+
+static const struct iomap_dio_ops baby_dio_write_ops = {
+    .end_io = baby_dio_write_end_io,
+};
+
+static ssize_t baby_buffered_write(struct kiocb *iocb, struct iov_iter *from) {
+  struct inode *inode = file_inode(iocb->ki_filp);
+  ssize_t ret;
+
+  current->backing_dev_info = inode_to_bdi(inode);
+  ret = iomap_file_buffered_write(iocb, from, &baby_iomap_ops);
+  current->backing_dev_info = NULL;
+  if (ret > 0)
+    iocb->ki_pos += ret;
+  return ret;
+}
+
+/*
+ * 直接 I/O 写改成写页缓存之后立即回写，再丢掉这些页，之后的直接 I/O 读不会看到旧页
+ * 日志结构模式下改写要在回写时换到新块，直接 I/O 会写回原位置，全部走这里；
+ * 间接块映射的文件写到空洞时，新块跟着回写按 ordered 方式分配
+ */
+static ssize_t baby_dio_write_buffered(struct kiocb *iocb,
+                                       struct iov_iter *from) {
+  struct address_space *mapping = iocb->ki_filp->f_mapping;
+  loff_t pos = iocb->ki_pos;
+  ssize_t ret;
+  int err;
+
+  ret = baby_buffered_write(iocb, from);
+  if (ret <= 0)
+    return ret;
+  err = filemap_write_and_wait_range(mapping, pos, pos + ret - 1);
+  if (err)
+    return err;
+  invalidate_mapping_pages(mapping, pos >> PAGE_SHIFT,
+                           (pos + ret - 1) >> PAGE_SHIFT);
+  return ret;
+}
+
+/*
+ * 直接 I/O 写，空洞在 iomap_begin 里分配成未写区间，I/O 完成之后转换
+ * 间接块映射的文件遇到空洞时 iomap_dio_rw 停下，剩下的部分改成缓冲写
+ * 扩展文件的写要等它完成才能修改 i_size，写失败时释放分配到 i_size 之外的块
+ */
+static ssize_t baby_dio_write(struct kiocb *iocb, struct iov_iter *from) {
+  struct inode *inode = file_inode(iocb->ki_filp);
+  unsigned int blkbits = inode->i_blkbits;
+  loff_t end = iocb->ki_pos + iov_iter_count(from);
+  bool extend = end > i_size_read(inode);
+  unsigned long first, last;
+  ssize_t ret, buffered;
+
+  ret = iomap_dio_rw(iocb, from, &baby_iomap_ops, &baby_dio_write_ops,
+                     is_sync_kiocb(iocb) || extend);
+  if (extend) {
+    if (ret > 0 && iocb->ki_pos > i_size_read(inode)) {
+      i_size_write(inode, iocb->ki_pos);
+      mark_inode_dirty(inode);
+    }
+    first = (i_size_read(inode) + (1 << blkbits) - 1) >> blkbits;
+    last = (end + (1 << blkbits) - 1) >> blkbits;
+    if (iocb->ki_pos < end && baby_inode_extents(inode) && first < last)
+      baby_punch_blocks(inode, first, last - first);
+  }
+  if (ret < 0 || !iov_iter_count(from) || baby_inode_extents(inode))
+    return ret;
+  buffered = baby_dio_write_buffered(iocb, from);
+  if (buffered < 0)
+    return ret ? ret : buffered;
+  return ret + buffered;
+}
+
+static ssize_t baby_file_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+  struct inode *inode = file_inode(iocb->ki_filp);
+  ssize_t ret;
+
+  inode_lock(inode);
+  ret = generic_write_checks(iocb, from);
+  if (ret <= 0)
+    goto out;
+  ret = file_remove_privs(iocb->ki_filp);
+  if (ret)
+    goto out;
+  ret = file_update_time(iocb->ki_filp);
+  if (ret)
+    goto out;
+  // 改写已有的数据，这个文件不再按只追加的冷数据放置
+  if (iocb->ki_pos < i_size_read(inode))
+    baby_mark_rewrite(inode);
+
+  if (!(iocb->ki_flags & IOCB_DIRECT))
+    ret = baby_buffered_write(iocb, from);
+  else if (baby_log_mode(inode->i_sb))
+    ret = baby_dio_write_buffered(iocb, from);
+  else
+    ret = baby_dio_write(iocb, from);
+out:
+  inode_unlock(inode);
+  if (ret > 0)
+    ret = generic_write_sync(iocb, ret);
+  return ret;
+}
+
+// SEEK_HOLE/SEEK_DATA 按块映射查找，延迟块算作数据
+static loff_t baby_file_llseek(struct file *file, loff_t offset, int whence) {
+  struct inode *inode = file->f_mapping->host;
+
+  switch (whence) {
+  case SEEK_HOLE:
+    inode_lock_shared(inode);
+    offset = iomap_seek_hole(inode, offset, &baby_iomap_ops);
+    inode_unlock_shared(inode);
+    break;
+  case SEEK_DATA:
+    inode_lock_shared(inode);
+    offset = iomap_seek_data(inode, offset, &baby_iomap_ops);
+    inode_unlock_shared(inode);
+    break;
+  default:
+    return generic_file_llseek(file, offset, whence);
+  }
+  if (offset < 0)
+    return offset;
+  return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+/*
+ * 缺页和 page_mkwrite 都持有 i_mmap_sem 读锁，截断页缓存时持写锁，
+ * 截断过程中不会有新的页被读进来或者被写脏、重新预留已经归还的块
+ */
+static vm_fault_t baby_filemap_fault(struct vm_fault *vmf) {
+  struct inode *inode = file_inode(vmf->vma->vm_file);
+  vm_fault_t ret;
+
+  down_read(&BABY_I(inode)->i_mmap_sem);
+  ret = filemap_fault(vmf);
+  up_read(&BABY_I(inode)->i_mmap_sem);
+  return ret;
+}
+
+/*
+ * mmap 的页第一次被写时调用，空洞和写入一样只预留空间，回写时再分配，
+ * 空间不够时在这里返回 SIGBUS，而不是回写时才丢数据
+ */
+static vm_fault_t baby_page_mkwrite(struct vm_fault *vmf) {
+  struct inode *inode = file_inode(vmf->vma->vm_file);
+  vm_fault_t ret;
+
+  sb_start_pagefault(inode->i_sb);
+  file_update_time(vmf->vma->vm_file);
+  baby_mark_rewrite(inode);
+  down_read(&BABY_I(inode)->i_mmap_sem);
+  ret = iomap_page_mkwrite(vmf, &baby_iomap_ops);
+  up_read(&BABY_I(inode)->i_mmap_sem);
+  sb_end_pagefault(inode->i_sb);
+  return ret;
+}
+
+static const struct vm_operations_struct baby_file_vm_ops = {
+  .fault = baby_filemap_fault,
+  .map_pages = filemap_map_pages,
+  .page_mkwrite = baby_page_mkwrite,
+};
+
+static int baby_file_mmap(struct file *file, struct vm_area_struct *vma) {
+  file_accessed(file);
+  vma->vm_ops = &baby_file_vm_ops;
+  return 0;
+}
+
+// copy_file_range 一次交给 iomap 的源文件页数
+#define BABY_COPY_PAGES 16
+
+/*
+ * 把源文件 [pos, pos + len) 所在的页放进 bvec，len 不超过 BABY_COPY_PAGES 页
+ * 返回放进去的页数，第一页就读失败时返回错误码
+ */
+static int baby_copy_get_pages(struct file *file, loff_t pos, size_t len,
+                               struct bio_vec *bvec) {
+  struct address_space *mapping = file->f_mapping;
+  pgoff_t index = pos >> PAGE_SHIFT;
+  pgoff_t last = (pos + len - 1) >> PAGE_SHIFT;
+  unsigned int off = pos & ~PAGE_MASK;
+  struct page *page;
+  int nr = 0;
+
+  for (; index <= last; index++, nr++) {
+    // 和普通的读一样触发预读
+    page = find_get_page(mapping, index);
+    if (!page) {
+      page_cache_sync_readahead(mapping, &file->f_ra, file, index,
+                                last - index + 1);
+    } else {
+      if (PageReadahead(page))
+        page_cache_async_readahead(mapping, &file->f_ra, file, page, index,
+                                   last - index + 1);
+      put_page(page);
+    }
+    page = read_mapping_page(mapping, index, file);
+    if (IS_ERR(page))
+      return nr ? nr : PTR_ERR(page);
+    bvec[nr].bv_page = page;
+    bvec[nr].bv_offset = off;
+    bvec[nr].bv_len = min_t(size_t, len, PAGE_SIZE - off);
+    len -= bvec[nr].bv_len;
+    off = 0;
+  }
+  return nr;
+}
+
+/*
+ * 同一个文件系统内的 copy_file_range
+ * 源文件的页直接作为 bvec 交给 iomap_file_buffered_write 写入目标文件，
+ * 不经过用户态和 pipe，目标文件的块和 write(2) 一样延迟分配；
+ * 写到目标文件末尾之后时跳过源文件的空洞，目标文件保持稀疏
+ */
+static ssize_t baby_copy_file_range(struct file *file_in, loff_t pos_in,
+                                    struct file *file_out, loff_t pos_out,
+                                    size_t len, unsigned int flags) {
+  struct inode *src = file_inode(file_in), *dst = file_inode(file_out);
+  struct bio_vec bvec[BABY_COPY_PAGES];
+  struct iov_iter iter;
+  struct kiocb kiocb;
+  size_t copied = 0, chunk;
+  loff_t data;
+  ssize_t ret;
+  int nr, i;
+
+  if (src->i_sb != dst->i_sb)
+    return generic_copy_file_range(file_in, pos_in, file_out, pos_out, len,
+                                   flags);
+
+  inode_lock(dst);
+  ret = file_remove_privs(file_out);
+  if (!ret)
+    ret = file_update_time(file_out);
+  if (ret)
+    goto out;
+  // 源文件末尾之后没有数据
+  len = min_t(loff_t, len, max_t(loff_t, i_size_read(src) - pos_in, 0));
+  while (copied < len) {
+    if (fatal_signal_pending(current)) {
+      ret = -EINTR;
+      break;
+    }
+    if (pos_out >= i_size_read(dst)) {
+      data = iomap_seek_data(src, pos_in, &baby_iomap_ops);
+      if (data == -ENXIO)
+        data = pos_in + (len - copied);
+      if (data < 0) {
+        ret = data;
+        break;
+      }
+      if (data > pos_in) {
+        chunk = min_t(loff_t, data - pos_in, len - copied);
+        pos_in += chunk;
+        pos_out += chunk;
+        copied += chunk;
+        continue;
+      }
+    }
+
+    chunk = min_t(size_t, len - copied,
+                  BABY_COPY_PAGES * PAGE_SIZE - (pos_in & ~PAGE_MASK));
+    nr = baby_copy_get_pages(file_in, pos_in, chunk, bvec);
+    if (nr < 0) {
+      ret = nr;
+      break;
+    }
+    for (chunk = 0, i = 0; i < nr; i++)
+      chunk += bvec[i].bv_len;
+    iov_iter_bvec(&iter, WRITE, bvec, nr, chunk);
+    init_sync_kiocb(&kiocb, file_out);
+    kiocb.ki_pos = pos_out;
+    ret = iomap_file_buffered_write(&kiocb, &iter, &baby_iomap_ops);
+    for (i = 0; i < nr; i++)
+      put_page(bvec[i].bv_page);
+    if (ret <= 0)
+      break;
+    pos_in += ret;
+    pos_out += ret;
+    copied += ret;
+    cond_resched();
+  }
+  // 最后跳过的空洞也算在文件大小里
+  if (copied && pos_out > i_size_read(dst)) {
+    i_size_write(dst, pos_out);
+    mark_inode_dirty(dst);
+  }
+out:
+  inode_unlock(dst);
+  return copied ? copied : ret;
+}
+
+/*
+ * 打洞：不足一块的头尾在页缓存里清零，中间的整块连同页缓存一起删掉
+ * 持有 i_mmap_sem 写锁，删掉的页不会被缺页重新读进来
+ */
+static long baby_punch_hole(struct inode *inode, loff_t offset, loff_t len) {
+  struct baby_inode_info *bbi = BABY_I(inode);
+  unsigned int blkbits = inode->i_blkbits;
+  loff_t isize = i_size_read(inode);
+  loff_t end, first, last;
+  long ret = 0;
+
+  if (offset >= isize)
+    return 0;
+  end = min(offset + len, isize);
+  first = round_up(offset, 1 << blkbits);
+  last = round_down(end, 1 << blkbits);
+
+  down_write(&bbi->i_mmap_sem);
+  inode_dio_wait(inode);
+  if (first > last) {
+    ret = iomap_zero_range(inode, offset, end - offset, NULL, &baby_iomap_ops);
+  } else {
+    if (offset < first)
+      ret = iomap_zero_range(inode, offset, first - offset, NULL,
+                             &baby_iomap_ops);
+    if (!ret && last < end)
+      ret = iomap_zero_range(inode, last, end - last, NULL, &baby_iomap_ops);
+  }
+  if (!ret && first < last) {
+    truncate_pagecache_range(inode, first, last - 1);
+    ret = baby_punch_blocks(inode, first >> blkbits,
+                            (last - first) >> blkbits);
+  }
+  up_write(&bbi->i_mmap_sem);
+  return ret;
+}
+
+/*
+ * fallocate 支持预分配（可以带 FALLOC_FL_KEEP_SIZE）和 FALLOC_FL_PUNCH_HOLE
+ * 预分配的块记成未写区间，不用写零，读出来也是 0
+ * 间接块没有地方记录未写状态，只支持区间映射的文件；zoned 设备上只支持打洞
+ */
+static long baby_fallocate(struct file *file, int mode, loff_t offset,
+                           loff_t len) {
+  struct inode *inode = file_inode(file);
+  unsigned int blkbits = inode->i_blkbits;
+  loff_t end = offset + len;
+  long ret;
+
+  if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+    return -EOPNOTSUPP;
+  if (!baby_inode_extents(inode))
+    return -EOPNOTSUPP;
+  // 预分配的块不写，zoned 设备的写指针会停在它们前面
+  if (baby_zoned(inode->i_sb) && !(mode & FALLOC_FL_PUNCH_HOLE))
+    return -EOPNOTSUPP;
+
+  inode_lock(inode);
+  if (mode & FALLOC_FL_PUNCH_HOLE) {
+    ret = baby_punch_hole(inode, offset, len);
+    if (!ret)
+      inode->i_mtime = inode->i_ctime = current_time(inode);
+    goto out;
+  }
+  if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+    ret = inode_newsize_ok(inode, end);
+    if (ret)
+      goto out;
+  }
+  ret = baby_prealloc_blocks(inode, offset >> blkbits,
+                             ((end - 1) >> blkbits) - (offset >> blkbits) + 1);
+  if (ret)
+    goto out;
+  inode->i_ctime = current_time(inode);
+  if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+    i_size_write(inode, end);
+    inode->i_mtime = inode->i_ctime;
+  }
+out:
+  if (!ret)
+    mark_inode_dirty(inode);
+  inode_unlock(inode);
+  return ret;
+}
+
 const struct file_operations baby_file_operations = {
   .open = generic_file_open,
-  .read_iter = generic_file_read_iter,
-  .write_iter = generic_file_write_iter,
-  .llseek		= generic_file_llseek,
-  .fsync =generic_file_fsync,
-};
\ No newline at end of file
+  .read_iter = baby_file_read_iter,
+  .write_iter = baby_file_write_iter,
+  .mmap = baby_file_mmap,
+  .splice_read = generic_file_splice_read,
+  .splice_write = iter_file_splice_write,
+  .copy_file_range = baby_copy_file_range,
+  .fallocate = baby_fallocate,
+  .unlocked_ioctl = baby_ioctl,
+#ifdef CONFIG_COMPAT
+  .compat_ioctl = baby_compat_ioctl,
+#endif
+  .llseek		= baby_file_llseek,
+  .fsync = baby_fsync,
+};
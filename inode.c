@@ -1,6 +1,7 @@
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
+#include <linux/iomap.h>
 #include <linux/mm.h>
 #include <linux/mpage.h>
 
@@ -22,7 +23,7 @@ void file_type_special_operation(struct inode *inode, umode_t mode) {
     case S_IFREG:  // 普通文件
       inode->i_op = &baby_file_inode_operations;
       inode->i_fop = &baby_file_operations;
-      inode->i_mapping->a_ops = &baby_aops;
+      inode->i_mapping->a_ops = &baby_file_aops;
 
       // 普通文件的磁盘块分配使用预留窗口加速
       baby_init_block_alloc_info(inode);
@@ -39,6 +40,8 @@ void file_type_special_operation(struct inode *inode, umode_t mode) {
       inode->i_mapping->a_ops = &baby_aops;
       break;
   }
+  // 按温度告诉块层数据的寿命，回写时带在 bio 上
+  baby_set_write_hint(inode);
 }
 
 // 由索引结点编号返回 inode 的磁盘块
@@ -103,6 +106,7 @@ struct inode *baby_iget(struct super_block *sb, unsigned long ino) {
       vfs_inode->i_ctime.tv_nsec = 0;
   vfs_inode->i_blocks = le32_to_cpu(raw_inode->i_blocknum);
   bbi->i_subdir_num = le16_to_cpu(raw_inode->i_subdir_num);
+  bbi->i_flags = le16_to_cpu(raw_inode->i_flags);
   bbi->i_block_alloc_info = NULL;
   for (i = 0; i < BABYFS_N_BLOCKS; i++) { // 拷贝数据块索引数组
     bbi->i_blocks[i] = raw_inode->i_blocks[i];
@@ -234,21 +238,13 @@ static unsigned long baby_find_near(struct inode *inode, Indirect *ind) {
       return le32_to_cpu(*p);
     }
   }
-  // 没有找到，就找当前的间接块
-  if (ind->bh) {
-    return ind->bh->b_blocknr;
-  }
-  // 再没有的话就随机返回一块
-  struct super_block *sb = inode->i_sb;
-  struct baby_sb_info *sb_info = BABY_SB(sb);
-  unsigned short bitmap_num = sb_info->nr_bitmap;
-  baby_fsblk_t first_block = NR_DSTORE_BLOCKS;
-  baby_fsblk_t colour = (current->pid % (16 * bitmap_num)) * (sb_info->nr_blocks / (16 * bitmap_num));
-#ifdef RSV_DEBUG
-  printk("first_block + colour: %ld\n", first_block + colour);
-#endif
-  return first_block + colour;
-  // return NR_DSTORE_BLOCKS + 1;
+  // 没有找到就从文件所属温度的区域开始，间接块在热区域里，不能用来推算数据块的位置
+  return baby_default_goal(inode);
+}
+
+// 文件还没有任何块时的 goal，在文件温度对应的区域里按进程号分散到不同的块组
+unsigned long baby_default_goal(struct inode *inode) {
+  return baby_temp_goal(inode->i_sb, baby_inode_temp(inode));
 }
 
 /*
@@ -294,39 +290,31 @@ static int baby_blks_to_allocate(Indirect *partial, int indirect_blk,
   return count;
 }
 
+/*
+ * 分配 indirect_blks 个间接块和最多 blks 个连续的直接块
+ * 间接块是元数据，在热区域里单独分配，不占用文件的预留窗口；直接块从 goal 开始
+ * 返回直接块的数量，new_blocks[indirect_blks] 是第一个直接块
+ */
 static int baby_alloc_blocks(struct inode *inode, unsigned long goal,
                              int indirect_blks, int blks,
                              unsigned long new_blocks[4], int *err) {
-  // 目标分配块数，只保证间接块分配完全并且至少分配一块直接块
-  int target = indirect_blks + blks;
-  unsigned long count = 0;
-  unsigned long next_goal = goal;
-  unsigned long current_block = 0;
-  unsigned int index = 0; // new_blocks 数组索引
-  int ret = 0, i = 0;
-  while (1) {
-    count = target;
-    current_block = baby_new_blocks(inode, next_goal, &count, err);
-    if (*err) {
+  unsigned long count, current_block;
+  int index = 0, i;
+
+  while (index < indirect_blks) {
+    count = indirect_blks - index;
+    current_block = baby_new_meta_blocks(inode, &count, err);
+    if (*err)
       goto failed_out;
-    }
-    target -= count;
-    while (index < indirect_blks && count) {
+    while (count--)
       new_blocks[index++] = current_block++;
-      count--;
-    }
-    /*
-     * count >  0 表示间接块已经全部分配了，并且分配了一定数量的直接块
-     * count = 0 表示简介块分配完，但是直接块还没有分配一块
-     */
-    if (count > 0) {
-      break;
-    }
   }
+  count = blks;
+  current_block = baby_new_blocks(inode, goal, &count, err);
+  if (*err)
+    goto failed_out;
   new_blocks[index] = current_block; // 直接块起始块号
-  ret = count;                       // 直接块的数量
-  *err = 0;
-  return ret;
+  return count;                      // 直接块的数量
 
 failed_out:
   printk(KERN_ERR "baby_alloc_blocks failed_out\n");
@@ -335,7 +323,7 @@ failed_out:
   }
   if (index)
     mark_inode_dirty(inode);
-  return ret;
+  return 0;
 }
 
 static int baby_alloc_branch(struct inode *inode, int indirect_blks,
@@ -384,8 +372,9 @@ static int baby_alloc_branch(struct inode *inode, int indirect_blks,
     }
     set_buffer_uptodate(bh);
     unlock_buffer(bh);
-    mark_buffer_dirty_inode(bh, inode);
-    if (S_ISDIR(inode->i_mode) && IS_DIRSYNC(inode))
+    baby_journal_dirty(inode->i_sb, inode, bh);
+    if (S_ISDIR(inode->i_mode) && IS_DIRSYNC(inode) &&
+        !baby_has_journal(inode->i_sb))
       sync_dirty_buffer(bh);
   }
   *blks = num; // blks 表示分配的直接块的数量
@@ -430,11 +419,16 @@ static void baby_splice_branch(struct inode *inode, unsigned long block,
     block_i->last_alloc_physical_block = le32_to_cpu(partial[num].key) + blks - 1;
   }
   if (partial->bh)
-    mark_buffer_dirty_inode(partial->bh, inode);
+    baby_journal_dirty(inode->i_sb, inode, partial->bh);
   inode->i_ctime = current_time(inode);
   mark_inode_dirty(inode);
 }
 
+/*
+ * 把逻辑块 block 映射到物理块，create 时没有映射的块会被分配
+ * 返回映射的块数，出错时返回负的错误码
+ * 最多返回 maxblocks 个物理上连续的块，不跨过最后一级索引块的边界
+ */
 static int baby_get_blocks(struct inode *inode, sector_t block,
                            unsigned long maxblocks, struct buffer_head *bh,
                            int create) {
@@ -444,23 +438,80 @@ static int baby_get_blocks(struct inode *inode, sector_t block,
   Indirect *partial;
   struct super_block *sb = inode->i_sb;
   struct baby_sb_info *sb_info = BABY_SB(sb);
+  struct baby_handle *handle;
   int blocks_to_boundary =
       0; // boundary 为最后一级间接块中从要取的块到最后一块的距离
+  unsigned long count = 1; // 映射的块数
+  unsigned long pblk;
+  unsigned int seq;
+  int depth;
+
+  // 先查映射缓存，命中时不用读索引块
+  count = baby_map_cache_lookup(inode, block, maxblocks, &pblk);
+  if (count) {
+    map_bh(bh, sb, pblk);
+    return count;
+  }
+  count = 1;
+  seq = baby_map_cache_seq(inode);
+  if (baby_inode_extents(inode)) {
+    err = baby_ext_get_blocks(inode, block, maxblocks, bh, create);
+    // 未写区间写完之后要转换，不进缓存，每次都查区间树
+    if (err > 0 && !buffer_unwritten(bh))
+      baby_map_cache_insert(inode, seq, block, bh->b_blocknr, err);
+    return err;
+  }
   // 获取索引深度，直接索引是 0
-  int depth = baby_block_to_path(inode, block, offset, &blocks_to_boundary);
+  depth = baby_block_to_path(inode, block, offset, &blocks_to_boundary);
   if (!depth)
     return err;
   // 读取索引信息，返回 NULL 表示找到了所有的。partial 不为 NULL 说明 partial
   // 的下一级没有分配数据块
   partial = baby_get_branch(inode, depth, offset, chain, &err);
   if (!partial) {
-    // printk("partial == NULL\n");
+    unsigned long first_block = le32_to_cpu(chain[depth - 1].key);
+    unsigned long blk;
+
+    // 已经映射，沿着同一个索引块往后数物理上连续的块
+    while (count < maxblocks && count <= blocks_to_boundary) {
+      blk = le32_to_cpu(*(chain[depth - 1].p + count));
+      if (blk != first_block + count)
+        break;
+      count++;
+    }
+    // 索引块可能正在被截断修改，读到的不一致时退回只映射一块
+    if (!verify_chain(chain, chain + depth - 1))
+      count = 1;
     goto got_it;
   }
 
   if (!create || err == -EIO)
     goto clean_up;
 
+  // 分配块会修改位图、间接块和 inode，放在同一个 handle 里
+  handle = baby_journal_start(sb, BABYFS_ALLOC_CREDITS);
+  if (IS_ERR(handle)) {
+    err = PTR_ERR(handle);
+    goto clean_up;
+  }
+  /*
+   * 回写和写入可能同时为同一个文件分配块，持锁后重新读一遍索引，
+   * 其他进程可能已经分配了这一块
+   */
+  mutex_lock(&BABY_I(inode)->i_alloc_mutex);
+  while (partial > chain) {
+    brelse(partial->bh);
+    partial--;
+  }
+  partial = baby_get_branch(inode, depth, offset, chain, &err);
+  if (!partial || err == -EIO) {
+    mutex_unlock(&BABY_I(inode)->i_alloc_mutex);
+    baby_journal_stop(handle);
+    if (!partial)
+      goto got_it;
+    goto clean_up;
+  }
+
   /* 开始分配数据块，如果 find_goal 返回
    * 0，就让它等于数据块起始位置，这样可以避免在分配的时候 if-else 判断 */
   unsigned long temp = baby_find_goal(inode, block, partial);
@@ -471,18 +522,29 @@ static int baby_get_blocks(struct inode *inode, sector_t block,
       (temp - NR_DSTORE_BLOCKS) % (sb_info->nr_blocks) + NR_DSTORE_BLOCKS;
   unsigned long indirect_blk =
       chain + depth - partial - 1; // 计算需要分配的间接块的数量
-  unsigned long count = baby_blks_to_allocate(partial, indirect_blk, maxblocks,
-                                              blocks_to_boundary);
+  count = baby_blks_to_allocate(partial, indirect_blk, maxblocks,
+                                blocks_to_boundary);
   err = baby_alloc_branch(inode, indirect_blk, &count, goal,
                           offset + (partial - chain), partial);
-  if (err)
+  if (err) {
+    mutex_unlock(&BABY_I(inode)->i_alloc_mutex);
+    baby_journal_stop(handle);
     goto clean_up;
+  }
   // 收尾工作，此时的 count 表示直接块的数量
   baby_splice_branch(inode, block, partial, indirect_blk, count);
+  mutex_unlock(&BABY_I(inode)->i_alloc_mutex);
+  baby_journal_stop(handle);
+  set_buffer_new(bh); // 新分配的块，磁盘上的内容无效
 
 got_it:
   map_bh(bh, inode->i_sb, le32_to_cpu(chain[depth - 1].key));
+  // 下一块的映射在另一个索引块里，让 mpage 在这里提交 bio
+  if (count > blocks_to_boundary)
+    set_buffer_boundary(bh);
   partial = chain + depth - 1;
+  baby_map_cache_insert(inode, seq, block, bh->b_blocknr, count);
+  err = count;
 clean_up:
   // printk("baby_get_blocks: phy_block no: %ld, logic_block no: %ld\n",
   //        chain[depth - 1].key, block);
@@ -493,6 +555,46 @@ clean_up:
   return err;
 }
 
+/*
+ * 延迟分配
+ * 普通文件写入时只预留空间，预留的逻辑块记在 i_da_tree 上（见 map_cache.c），
+ * 到回写时已经知道整段脏数据，再把连续的延迟块一次分配出来；
+ * 回写之前被删除或截断的文件不会碰位图
+ */
+
+// 写入时为 nr 个延迟块预留空间
+static int baby_da_reserve_space(struct inode *inode, unsigned long nr) {
+  struct baby_sb_info *sbi = BABY_SB(inode->i_sb);
+
+  if (!baby_has_free_blocks(sbi, nr))
+    return -ENOSPC;
+  percpu_counter_add(&sbi->s_dirtyblocks_counter, nr);
+  spin_lock(&inode->i_lock);
+  BABY_I(inode)->i_reserved_blocks += nr;
+  spin_unlock(&inode->i_lock);
+  return 0;
+}
+
+// 延迟块分配了磁盘块或者被丢弃，归还预留
+static void baby_da_release_space(struct inode *inode, unsigned long nr) {
+  struct baby_inode_info *bbi = BABY_I(inode);
+
+  if (!nr)
+    return;
+  spin_lock(&inode->i_lock);
+  if (WARN_ON_ONCE(nr > bbi->i_reserved_blocks))
+    nr = bbi->i_reserved_blocks;
+  bbi->i_reserved_blocks -= nr;
+  spin_unlock(&inode->i_lock);
+  percpu_counter_sub(&BABY_SB(inode->i_sb)->s_dirtyblocks_counter, nr);
+}
+
+// 丢弃 [start, start + len) 内的延迟块，归还它们的预留
+static void baby_da_discard(struct inode *inode, unsigned long start,
+                            unsigned long len) {
+  baby_da_release_space(inode, baby_da_remove(inode, start, len));
+}
+
 int baby_get_block(struct inode *inode, sector_t block, struct buffer_head *bh,
                    int create) {
   unsigned maxblocks = bh->b_size / inode->i_sb->s_blocksize;
@@ -500,13 +602,24 @@ int baby_get_block(struct inode *inode, sector_t block, struct buffer_head *bh,
   printk("baby_get_block: ino %ld block %ld\n", inode->i_ino, block);
 #endif
   int ret = baby_get_blocks(inode, block, maxblocks, bh, create);
-  return ret;
+  if (ret <= 0)
+    return ret;
+  bh->b_size = ret << inode->i_blkbits;
+  return 0;
 }
 
+/*
+ * 目录和符号链接的页仍然挂 buffer_head，块在 write_begin 时立即分配
+ */
 static int baby_readpage(struct file *file, struct page *page) {
   return mpage_readpage(page, baby_get_block);
 }
 
+static int baby_readpages(struct file *file, struct address_space *mapping,
+                          struct list_head *pages, unsigned nr_pages) {
+  return mpage_readpages(mapping, pages, nr_pages, baby_get_block);
+}
+
 static int baby_writepage(struct page *page, struct writeback_control *wbc) {
   return block_write_full_page(page, baby_get_block, wbc);
 }
@@ -536,6 +649,520 @@ static int baby_write_begin(struct file *file, struct address_space *mapping,
   return ret;
 }
 
+/*
+ * 普通文件的数据路径走 iomap
+ * 缓冲读写、直接 I/O、回写、FIEMAP、SEEK_HOLE/SEEK_DATA 和 page_mkwrite
+ * 都通过 baby_iomap_ops 一次拿到一段连续的映射，页上不再挂 buffer_head
+ */
+
+// 空洞一次最多往后看多少块
+#define BABY_IOMAP_MAX_HOLE 1024
+
+static void baby_set_iomap(struct inode *inode, struct iomap *iomap,
+                           sector_t block, unsigned long len, u16 type,
+                           unsigned long pblk) {
+  iomap->bdev = inode->i_sb->s_bdev;
+  iomap->offset = (loff_t)block << inode->i_blkbits;
+  iomap->length = (u64)len << inode->i_blkbits;
+  iomap->type = type;
+  iomap->flags = 0;
+  if (type == IOMAP_MAPPED || type == IOMAP_UNWRITTEN)
+    iomap->addr = (u64)pblk << inode->i_blkbits;
+  else
+    iomap->addr = IOMAP_NULL_ADDR;
+}
+
+// block 开始的空洞长度，最多 max 块，遇到已经映射或者延迟分配的块停下
+static unsigned long baby_hole_len(struct inode *inode, sector_t block,
+                                   unsigned long max) {
+  struct buffer_head map;
+  unsigned long len;
+
+  max = min_t(unsigned long, max, BABY_IOMAP_MAX_HOLE);
+  for (len = 1; len < max; len++) {
+    map.b_state = 0;
+    if (baby_get_blocks(inode, block + len, 1, &map, 0) ||
+        baby_da_lookup(inode, block + len, 1))
+      break;
+  }
+  return len;
+}
+
+static inline u16 baby_iomap_type(struct buffer_head *map) {
+  return buffer_unwritten(map) ? IOMAP_UNWRITTEN : IOMAP_MAPPED;
+}
+
+/*
+ * 返回 pos 开始的一段映射：已经分配的块、未写区间、延迟块或者空洞
+ * 直接 I/O 写到空洞时立即分配成未写区间，I/O 完成之后转换，崩溃时不会读到旧数据；
+ * 间接块映射的文件没有未写状态，返回 -ENOTBLK，调用者把剩下的部分改成缓冲写
+ * 缓冲写和 mmap 写到空洞时只预留空间，返回延迟块
+ * 未写区间读的时候当作空洞，写完之后在 I/O 完成时转换
+ */
+static int baby_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+                            unsigned flags, struct iomap *iomap,
+                            struct iomap *srcmap) {
+  unsigned int blkbits = inode->i_blkbits;
+  sector_t block = pos >> blkbits;
+  unsigned long max = ((pos + length - 1) >> blkbits) - block + 1;
+  struct buffer_head map;
+  unsigned long len;
+  long ret;
+
+  map.b_state = 0;
+  if ((flags & IOMAP_DIRECT) && (flags & IOMAP_WRITE)) {
+    ret = baby_get_blocks(inode, block, max, &map, 0);
+    if (!ret && !baby_inode_extents(inode))
+      return -ENOTBLK;
+    if (!ret)
+      ret = baby_get_blocks(inode, block, max, &map,
+                            BABY_GET_BLOCKS_UNWRITTEN);
+    if (ret < 0)
+      return ret;
+    baby_set_iomap(inode, iomap, block, ret, baby_iomap_type(&map),
+                   map.b_blocknr);
+    // 新块上没写到的部分由 iomap 补零
+    if (buffer_new(&map)) {
+      clean_bdev_aliases(inode->i_sb->s_bdev, map.b_blocknr, ret);
+      iomap->flags |= IOMAP_F_NEW;
+    }
+    return 0;
+  }
+
+  ret = baby_get_blocks(inode, block, max, &map, 0);
+  if (ret < 0)
+    return ret;
+  if (ret) {
+    baby_set_iomap(inode, iomap, block, ret, baby_iomap_type(&map),
+                   map.b_blocknr);
+    return 0;
+  }
+  len = baby_da_lookup(inode, block, max);
+  if (len) {
+    baby_set_iomap(inode, iomap, block, len, IOMAP_DELALLOC, 0);
+    return 0;
+  }
+  len = baby_hole_len(inode, block, max);
+  // 读、报告映射和补零都不需要给空洞分配
+  if (!(flags & IOMAP_WRITE) || (flags & IOMAP_ZERO)) {
+    baby_set_iomap(inode, iomap, block, len, IOMAP_HOLE, 0);
+    return 0;
+  }
+
+  ret = baby_da_reserve_space(inode, len);
+  if (ret)
+    return ret;
+  ret = baby_da_insert(inode, block, len);
+  if (ret < 0) {
+    baby_da_release_space(inode, len);
+    return ret;
+  }
+  // 同时发生的 page_mkwrite 已经为其中一部分预留过
+  baby_da_release_space(inode, ret);
+  baby_set_iomap(inode, iomap, block, len, IOMAP_DELALLOC, 0);
+  iomap->flags |= IOMAP_F_NEW;
+  return 0;
+}
+
+static int baby_iomap_end(struct inode *inode, loff_t pos, loff_t length,
+                          ssize_t written, unsigned flags,
+                          struct iomap *iomap) {
+  unsigned int blkbits = inode->i_blkbits;
+  sector_t start, end;
+
+  // iomap_write_end 修改了 i_size
+  if (iomap->flags & IOMAP_F_SIZE_CHANGED)
+    mark_inode_dirty(inode);
+  if (iomap->type != IOMAP_DELALLOC || !(iomap->flags & IOMAP_F_NEW) ||
+      (flags & IOMAP_FAULT))
+    return 0;
+
+  /*
+   * 这次新预留的块没有全部写到（拷贝用户数据失败），没写到的块上不会有脏数据，
+   * 先删掉页缓存中可能留下的页，再归还预留
+   */
+  start = (pos + written + (1 << blkbits) - 1) >> blkbits;
+  end = (iomap->offset + iomap->length) >> blkbits;
+  if (start >= end)
+    return 0;
+  truncate_pagecache_range(inode, (loff_t)start << blkbits,
+                           ((loff_t)end << blkbits) - 1);
+  baby_da_discard(inode, start, end - start);
+  return 0;
+}
+
+const struct iomap_ops baby_iomap_ops = {
+    .iomap_begin = baby_iomap_begin,
+    .iomap_end = baby_iomap_end,
+};
+
+static int baby_iomap_readpage(struct file *file, struct page *page) {
+  return iomap_readpage(page, &baby_iomap_ops);
+}
+
+static int baby_iomap_readpages(struct file *file,
+                                struct address_space *mapping,
+                                struct list_head *pages, unsigned nr_pages) {
+  return iomap_readpages(mapping, pages, nr_pages, &baby_iomap_ops);
+}
+
+struct baby_writepage_ctx {
+  struct iomap_writepage_ctx ctx;
+  unsigned int seq; // 得到 ctx.iomap 时的 i_map_seq，之后发生过截断就要重新映射
+};
+
+/*
+ * 日志结构模式下已经有块的数据不写回原位置，换到日志上的新块
+ * iomap 不写页里没有读进来的块，页不是全部最新时只换 block 这一块，否则换到页尾；
+ * 返回映射的块数，换不了时原样返回 len，原地写
+ * zoned 设备的顺序写 zone 不能原地写，换不了时返回错误
+ */
+static int baby_relocate_blocks(struct inode *inode, sector_t block, int len,
+                                struct buffer_head *map) {
+  unsigned int shift = PAGE_SHIFT - inode->i_blkbits;
+  pgoff_t index = block >> shift;
+  unsigned long n = 1;
+  struct page *page;
+  int ret;
+
+  page = find_get_page(inode->i_mapping, index);
+  if (page) {
+    if (PageUptodate(page))
+      n = ((sector_t)(index + 1) << shift) - block;
+    put_page(page);
+  }
+  ret = baby_ext_relocate(inode, block, min_t(unsigned long, n, len), map);
+  if (ret > 0)
+    return ret;
+  if (baby_zoned(inode->i_sb) &&
+      map->b_blocknr - NR_DSTORE_BLOCKS >= BABY_SB(inode->i_sb)->s_alloc_end)
+    return ret < 0 ? ret : -ENOSPC;
+  return len;
+}
+
+/*
+ * 回写时 iomap 对页里每个要写的块调用，ctx.iomap 还覆盖 offset 时直接复用
+ * 遇到延迟块时把从这里开始、i_size 以内的整段延迟块一次分配出来
+ * 日志结构模式下已经有块的数据换到新块上，每次最多换一页
+ * 已经有块的范围里也可能留着延迟块（写入之后 fallocate 分配了块），一起归还预留
+ * 有日志时在 baby_iomap_writepages 的 handle 里调用，分配和换块都标记为 ordered
+ */
+static int baby_map_blocks(struct iomap_writepage_ctx *wpc,
+                           struct inode *inode, loff_t offset) {
+  struct baby_writepage_ctx *bwpc =
+      container_of(wpc, struct baby_writepage_ctx, ctx);
+  unsigned int blkbits = inode->i_blkbits;
+  sector_t block = offset >> blkbits;
+  sector_t end = (i_size_read(inode) + (1 << blkbits) - 1) >> blkbits;
+  struct buffer_head map;
+  unsigned long len;
+  int ret;
+
+  if (offset >= wpc->iomap.offset &&
+      offset < wpc->iomap.offset + wpc->iomap.length &&
+      bwpc->seq == baby_map_cache_seq(inode))
+    return 0;
+  bwpc->seq = baby_map_cache_seq(inode);
+  len = end > block ? end - block : 1;
+  map.b_state = 0;
+  ret = baby_get_blocks(inode, block, len, &map, 0);
+  if (ret < 0)
+    return ret;
+  if (ret && baby_log_mode(inode->i_sb) && baby_inode_extents(inode) &&
+      !buffer_unwritten(&map)) {
+    baby_journal_set_ordered(inode->i_sb);
+    ret = baby_relocate_blocks(inode, block, ret, &map);
+    if (ret < 0)
+      return ret;
+    // 换块删掉了映射缓存，序号变了，这一页剩下的块仍然用这次的映射
+    bwpc->seq = baby_map_cache_seq(inode);
+  }
+  if (!ret) {
+    len = baby_da_lookup(inode, block, len);
+    // 页里没有写过的空洞块，不用写
+    if (!len) {
+      baby_set_iomap(inode, &wpc->iomap, block, 1, IOMAP_HOLE, 0);
+      return 0;
+    }
+    ret = baby_get_blocks(inode, block, len, &map, 1);
+    if (ret < 0)
+      return ret;
+    if (buffer_new(&map)) {
+      clean_bdev_aliases(inode->i_sb->s_bdev, map.b_blocknr, ret);
+      baby_journal_set_ordered(inode->i_sb);
+    }
+  }
+  baby_da_discard(inode, block, ret);
+  baby_set_iomap(inode, &wpc->iomap, block, ret, baby_iomap_type(&map),
+                 map.b_blocknr);
+  return 0;
+}
+
+/*
+ * 写到未写区间的 bio 完成之后要修改区间树，不能在中断上下文里做，
+ * 挂到 inode 的链表上交给 s_unwritten_wq
+ */
+static void baby_end_bio(struct bio *bio) {
+  struct iomap_ioend *ioend = bio->bi_private;
+  struct inode *inode = ioend->io_inode;
+  struct baby_inode_info *bbi = BABY_I(inode);
+  unsigned long flags;
+
+  spin_lock_irqsave(&bbi->i_ioend_lock, flags);
+  if (list_empty(&bbi->i_ioend_list))
+    queue_work(BABY_SB(inode->i_sb)->s_unwritten_wq, &bbi->i_ioend_work);
+  list_add_tail(&ioend->io_list, &bbi->i_ioend_list);
+  spin_unlock_irqrestore(&bbi->i_ioend_lock, flags);
+}
+
+// 转换写完的未写区间，之后才结束页的回写状态，fsync 返回时区间已经转换
+void baby_end_io_work(struct work_struct *work) {
+  struct baby_inode_info *bbi =
+      container_of(work, struct baby_inode_info, i_ioend_work);
+  struct inode *inode = &bbi->vfs_inode;
+  unsigned int blkbits = inode->i_blkbits;
+  struct iomap_ioend *ioend;
+  unsigned long flags;
+  LIST_HEAD(list);
+  int err;
+
+  spin_lock_irqsave(&bbi->i_ioend_lock, flags);
+  list_replace_init(&bbi->i_ioend_list, &list);
+  spin_unlock_irqrestore(&bbi->i_ioend_lock, flags);
+
+  while (!list_empty(&list)) {
+    ioend = list_first_entry(&list, struct iomap_ioend, io_list);
+    list_del_init(&ioend->io_list);
+    err = blk_status_to_errno(ioend->io_bio->bi_status);
+    if (!err)
+      err = baby_ext_convert(inode, ioend->io_offset >> blkbits,
+                             ioend->io_size >> blkbits);
+    if (err)
+      mapping_set_error(inode->i_mapping, err);
+    iomap_finish_ioends(ioend, err);
+  }
+}
+
+// 写到新分配的块的 bio 完成，事务可以写提交块了
+static void baby_end_ordered_bio(struct bio *bio) {
+  struct iomap_ioend *ioend = bio->bi_private;
+  struct super_block *sb = ioend->io_inode->i_sb;
+  u32 tid = (unsigned long)ioend->io_private;
+
+  iomap_finish_ioends(ioend, blk_status_to_errno(bio->bi_status));
+  baby_journal_end_ordered(sb, tid);
+}
+
+/*
+ * 未写区间要在 I/O 完成后转换；其他 ioend 在分配过块的 handle 里提交时记为 ordered，
+ * 未写区间的块是之前的事务分配的，不需要 ordered
+ */
+static int baby_prepare_ioend(struct iomap_ioend *ioend, int status) {
+  u32 tid;
+
+  if (status)
+    return status;
+  if (ioend->io_type == IOMAP_UNWRITTEN) {
+    ioend->io_bio->bi_end_io = baby_end_bio;
+  } else if (baby_journal_start_ordered(ioend->io_inode->i_sb, &tid)) {
+    ioend->io_private = (void *)(unsigned long)tid;
+    ioend->io_bio->bi_end_io = baby_end_ordered_bio;
+  }
+  return status;
+}
+
+// 回写时映射失败，这一页的数据不会再写回，归还页内延迟块的预留
+static void baby_discard_page(struct page *page) {
+  struct inode *inode = page->mapping->host;
+  unsigned int shift = PAGE_SHIFT - inode->i_blkbits;
+
+  baby_da_discard(inode, (unsigned long)page->index << shift, 1UL << shift);
+}
+
+static const struct iomap_writeback_ops baby_writeback_ops = {
+    .map_blocks = baby_map_blocks,
+    .prepare_ioend = baby_prepare_ioend,
+    .discard_page = baby_discard_page,
+};
+
+/*
+ * 有日志时单独回写一页（内存回收）不能在持页锁的时候开始 handle，
+ * 需要分配块或者换块的页重新标记为脏，留给 writepages
+ */
+static int baby_writepage_needs_handle(struct page *page) {
+  struct inode *inode = page->mapping->host;
+  unsigned int shift = PAGE_SHIFT - inode->i_blkbits;
+  unsigned long block = (unsigned long)page->index << shift, i;
+
+  if (!baby_has_journal(inode->i_sb))
+    return 0;
+  if (baby_log_mode(inode->i_sb) && baby_inode_extents(inode))
+    return 1;
+  for (i = 0; i < (1UL << shift); i++) {
+    if (baby_da_lookup(inode, block + i, 1))
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * zoned 设备上分配到的块要按分配的顺序写到设备上，回写整个串行化：
+ * iomap 在返回之前按顺序提交了这次分配的所有块
+ */
+static int baby_iomap_writepage(struct page *page,
+                                struct writeback_control *wbc) {
+  struct super_block *sb = page->mapping->host->i_sb;
+  struct baby_writepage_ctx wpc = {};
+  int ret;
+
+  if (baby_writepage_needs_handle(page)) {
+    redirty_page_for_writepage(wbc, page);
+    unlock_page(page);
+    return 0;
+  }
+  if (!baby_zoned(sb))
+    return iomap_writepage(page, wbc, &wpc.ctx, &baby_writeback_ops);
+  mutex_lock(&BABY_SB(sb)->s_zone_wb_mutex);
+  ret = iomap_writepage(page, wbc, &wpc.ctx, &baby_writeback_ops);
+  mutex_unlock(&BABY_SB(sb)->s_zone_wb_mutex);
+  return ret;
+}
+
+/*
+ * 回写一段 nblocks 块的 handle 要预留的日志块：分配的索引块、位图按截断的算法估计，
+ * 日志结构模式下换块还要释放旧块、写段摘要
+ */
+static unsigned long baby_writeback_credits(struct super_block *sb,
+                                            unsigned long nblocks) {
+  unsigned long credits = baby_truncate_credits(sb, nblocks);
+
+  if (baby_log_mode(sb))
+    credits += min(nblocks, BABY_SB(sb)->nr_bitmap) +
+               nblocks / BABYFS_SUMMARY_PER_BLOCK + 1;
+  return credits;
+}
+
+/*
+ * 回写 [start, end] 中的脏页，每段 nblocks 块在一个 handle 里调用 iomap_writepages，
+ * 返回时这一段的 ioend 都已经提交；跳过没有脏页的段
+ * 中途停下（写够了 nr_to_write 或者出错）时 *next 是下次开始的位置，写完整个范围时是 -1
+ */
+static int baby_writepages_range(struct address_space *mapping,
+                                 struct writeback_control *wbc, loff_t start,
+                                 loff_t end, unsigned long nblocks,
+                                 loff_t *next) {
+  struct inode *inode = mapping->host;
+  struct super_block *sb = inode->i_sb;
+  loff_t chunk = (loff_t)nblocks << inode->i_blkbits, pos = start;
+  struct baby_writepage_ctx wpc;
+  struct baby_handle *handle;
+  struct page *page;
+  pgoff_t index;
+  int err = 0;
+
+  *next = -1;
+  while (pos <= end && pos < i_size_read(inode)) {
+    if (wbc->sync_mode == WB_SYNC_NONE && wbc->nr_to_write <= 0) {
+      *next = pos;
+      break;
+    }
+    index = pos >> PAGE_SHIFT;
+    if (!find_get_pages_range_tag(mapping, &index, end >> PAGE_SHIFT,
+                                  PAGECACHE_TAG_DIRTY, 1, &page))
+      break;
+    pos = max(pos, page_offset(page));
+    put_page(page);
+
+    wbc->range_start = pos;
+    wbc->range_end = min(end, round_down(pos, chunk) + chunk - 1);
+    handle = baby_journal_start(sb, baby_writeback_credits(sb, nblocks));
+    if (IS_ERR(handle)) {
+      err = PTR_ERR(handle);
+      *next = pos;
+      break;
+    }
+    memset(&wpc, 0, sizeof(wpc));
+    err = iomap_writepages(mapping, wbc, &wpc.ctx, &baby_writeback_ops);
+    baby_journal_stop(handle);
+    pos = wbc->range_end + 1;
+    if (err) {
+      *next = pos;
+      break;
+    }
+    cond_resched();
+  }
+  return err;
+}
+
+/*
+ * 有日志时分段回写，每段一个 handle，段里分配块修改的元数据都属于 handle 所在的事务，
+ * 段里的 ioend 在 handle 结束之前提交，这个事务提交时等它们写完（见 journal.c）
+ * 段的大小按 handle 的预留放得进一个事务算，循环回写时从 writeback_index 开始绕一圈
+ */
+static int baby_writepages_ordered(struct address_space *mapping,
+                                   struct writeback_control *wbc) {
+  struct super_block *sb = mapping->host->i_sb;
+  unsigned long nblocks = baby_truncate_batch(sb);
+  unsigned long max = baby_journal_max_credits(sb);
+  loff_t range_start = wbc->range_start, range_end = wbc->range_end;
+  loff_t start, next;
+  int cyclic = wbc->range_cyclic, err;
+
+  while (nblocks > 1 && baby_writeback_credits(sb, nblocks) > max)
+    nblocks /= 2;
+  wbc->range_cyclic = 0;
+  if (!cyclic) {
+    err = baby_writepages_range(mapping, wbc, range_start, range_end, nblocks,
+                                &next);
+  } else {
+    start = (loff_t)mapping->writeback_index << PAGE_SHIFT;
+    err = baby_writepages_range(mapping, wbc, start, LLONG_MAX, nblocks, &next);
+    if (!err && next < 0 && start &&
+        (wbc->sync_mode != WB_SYNC_NONE || wbc->nr_to_write > 0))
+      err = baby_writepages_range(mapping, wbc, 0, start - 1, nblocks, &next);
+    mapping->writeback_index = next < 0 ? 0 : next >> PAGE_SHIFT;
+  }
+  wbc->range_cyclic = cyclic;
+  wbc->range_start = range_start;
+  wbc->range_end = range_end;
+  return err;
+}
+
+static int baby_iomap_writepages(struct address_space *mapping,
+                                 struct writeback_control *wbc) {
+  struct super_block *sb = mapping->host->i_sb;
+  struct baby_writepage_ctx wpc = {};
+  int ret;
+
+  if (!baby_has_journal(sb) && !baby_zoned(sb))
+    return iomap_writepages(mapping, wbc, &wpc.ctx, &baby_writeback_ops);
+  if (baby_zoned(sb))
+    mutex_lock(&BABY_SB(sb)->s_zone_wb_mutex);
+  if (baby_has_journal(sb))
+    ret = baby_writepages_ordered(mapping, wbc);
+  else
+    ret = iomap_writepages(mapping, wbc, &wpc.ctx, &baby_writeback_ops);
+  if (baby_zoned(sb))
+    mutex_unlock(&BABY_SB(sb)->s_zone_wb_mutex);
+  return ret;
+}
+
+/*
+ * 页被截断或者丢弃时，范围内整块的延迟块不会再写回，归还预留
+ */
+static void baby_iomap_invalidatepage(struct page *page, unsigned int offset,
+                                      unsigned int length) {
+  struct inode *inode = page->mapping->host;
+  unsigned int blkbits = inode->i_blkbits;
+  loff_t start = page_offset(page) + offset;
+  sector_t first = (start + (1 << blkbits) - 1) >> blkbits;
+  sector_t last = (start + length) >> blkbits;
+
+  if (first < last)
+    baby_da_discard(inode, first, last - first);
+  iomap_invalidatepage(page, offset, length);
+}
+
 int __baby_write_inode(struct inode *inode, int do_sync) {
   struct super_block *sb = inode->i_sb;
   struct baby_inode_info *bbi = BABY_I(inode);
@@ -561,12 +1188,13 @@ int __baby_write_inode(struct inode *inode, int do_sync) {
   raw_inode->i_blocknum = cpu_to_le32(inode->i_blocks);
   raw_inode->i_nlink = cpu_to_le16(inode->i_nlink);
   raw_inode->i_subdir_num = cpu_to_le16(bbi->i_subdir_num);
+  raw_inode->i_flags = cpu_to_le16(bbi->i_flags);
   for (i = 0; i < BABYFS_N_BLOCKS; i++) {
     raw_inode->i_blocks[i] = bbi->i_blocks[i];
   }
 
-  mark_buffer_dirty(bh);
-  if (do_sync == WB_SYNC_ALL) { // 支持同步写
+  baby_journal_dirty(sb, NULL, bh);
+  if (do_sync && !baby_has_journal(sb)) { // 支持同步写
     sync_dirty_buffer(bh);
     if (buffer_req(bh) && !buffer_uptodate(bh))
       ret = -EIO;
@@ -578,7 +1206,33 @@ int __baby_write_inode(struct inode *inode, int do_sync) {
 
 // 将一个 inode 写回到磁盘上，(baby_inode_info, vfs_inode)->raw_inode
 int baby_write_inode(struct inode *inode, struct writeback_control *wbc) {
-  return __baby_write_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
+  int err;
+
+  if (!baby_has_journal(inode->i_sb))
+    return __baby_write_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
+  // 有日志时 inode 在 dirty_inode 里已经进入事务，同步写回只需要提交事务
+  // sync(2) 随后会调用 sync_fs 统一提交
+  if (wbc->sync_mode != WB_SYNC_ALL || wbc->for_sync)
+    return 0;
+  err = baby_journal_commit_inode(inode);
+  return err < 0 ? err : 0;
+}
+
+/*
+ * 有日志时，inode 每次被标记为脏都拷贝到 inode 表块，随所在的事务一起提交
+ * 回写线程不再单独写 inode
+ */
+void baby_dirty_inode(struct inode *inode, int flags) {
+  struct baby_handle *handle;
+
+  if (!baby_has_journal(inode->i_sb) || !(flags & I_DIRTY_INODE) ||
+      sb_rdonly(inode->i_sb))
+    return;
+  handle = baby_journal_start(inode->i_sb, BABYFS_INODE_CREDITS);
+  if (IS_ERR(handle))
+    return;
+  __baby_write_inode(inode, 0);
+  baby_journal_stop(handle);
 }
 
 // 创建一个新的 raw inode，并返回其对应的 vfs inode
@@ -600,6 +1254,11 @@ struct inode *baby_new_inode(struct inode *dir, umode_t mode,
   // 读 inode 分配位图
   // TODO 当前 inode 分配位图只占了一个磁盘块，要支持多块的话这里要改成循环
   bh_bitmap = sb_bread(sb, BABYFS_INODE_BIT_MAP_BLOCK_BASE);
+  if (!bh_bitmap) {
+    err = -EIO;
+    goto fail;
+  }
+repeat:
   // 寻找第一个空闲的位
   i_no = baby_find_first_zero_bit(bh_bitmap->b_data, BABYFS_BIT_PRE_BLOCK);
   if (i_no >= BABYFS_BIT_PRE_BLOCK) {
@@ -607,9 +1266,10 @@ struct inode *baby_new_inode(struct inode *dir, umode_t mode,
     err = -ENOSPC;
     goto fail;
   }
-
-  baby_set_bit(i_no, bh_bitmap->b_data); // 占用这一位
-  mark_buffer_dirty(bh_bitmap);
+  // 不同目录下的创建可以并发执行，原子地占用这一位，被抢先时重新找
+  if (test_and_set_bit_le(i_no, bh_bitmap->b_data))
+    goto repeat;
+  baby_journal_dirty(sb, NULL, bh_bitmap);
   brelse(bh_bitmap);
 
   // 设置 inode 的属性
@@ -619,6 +1279,7 @@ struct inode *baby_new_inode(struct inode *dir, umode_t mode,
   inode->i_size = 0;
   inode->i_mtime = inode->i_atime = inode->i_ctime = current_time(inode);
   bbi->i_subdir_num = 0;
+  bbi->i_flags = 0;
   bbi->i_block_alloc_info = NULL;
   // bbi->i_blocks[0] = i_no + NR_DSTORE_BLOCKS; // 新 inode 的第一个数据块号
   memset(bbi->i_blocks, 0, sizeof(bbi->i_blocks)); // 初始化索引数组
@@ -632,12 +1293,27 @@ struct inode *baby_new_inode(struct inode *dir, umode_t mode,
   }
   // 根据文件类型执行特定操作
   file_type_special_operation(inode, inode->i_mode);
+  // 开启了 extents 特性时新的普通文件用区间映射
+  if (S_ISREG(inode->i_mode) &&
+      BABY_HAS_INCOMPAT_FEATURE(sb, BABYFS_FEATURE_INCOMPAT_EXTENTS)) {
+    bbi->i_flags |= BABYFS_EXTENTS_FL;
+    baby_ext_tree_init(inode);
+  }
 
   mark_inode_dirty(inode);
 
   // printk("baby_new_inode: alloc new inode ino: %d\n", i_no);
   sb_info = BABY_SB(sb);
-  sb_info->nr_free_inodes--;
+  percpu_counter_dec(&sb_info->s_freeinodes_counter);
+  // 目录同步模式下，新 inode 要先于指向它的目录项落盘；有日志时由事务保证
+  if (IS_DIRSYNC(inode) && !baby_has_journal(sb)) {
+    err = sync_inode_metadata(inode, 1);
+    if (err) {
+      clear_nlink(inode); // evict 时释放 inode
+      discard_new_inode(inode);
+      return ERR_PTR(err);
+    }
+  }
   return inode;
 
 fail:
@@ -662,7 +1338,7 @@ static inline int parentdir_add_inode(struct dentry *dentry,
 }
 
 // 创建普通文件
-static int baby_create(struct inode *dir, struct dentry *dentry, umode_t mode,
+static int __baby_create(struct inode *dir, struct dentry *dentry, umode_t mode,
                        bool excl) {
   struct inode *inode = baby_new_inode(dir, mode, &dentry->d_name);
 
@@ -675,7 +1351,7 @@ static int baby_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 }
 
 // 创建目录
-static int baby_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode) {
+static int __baby_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode) {
   int ret = 0;
   struct inode *inode;
 
@@ -723,7 +1399,7 @@ out:
  * @param symname 链接文件存储的源文件路径
  * @return int
  */
-static int baby_symlink(struct inode *dir, struct dentry *dentry,
+static int __baby_symlink(struct inode *dir, struct dentry *dentry,
                         const char *symname) {
   int err = -ENAMETOOLONG;
   int l = strlen(symname) + 1; /*源文件路径长度*/
@@ -764,7 +1440,7 @@ out_fail:
  * @param dentry 新目录项
  * @return int
  */
-static int baby_link(struct dentry *old_dentry, struct inode *dir,
+static int __baby_link(struct dentry *old_dentry, struct inode *dir,
                      struct dentry *dentry) {
   struct inode *inode = d_inode(old_dentry); // 获得目标文件的inode
   int err;
@@ -786,7 +1462,7 @@ static int baby_link(struct dentry *old_dentry, struct inode *dir,
 
 // vfs删除文件时调用unlink，删除目录时调用rmdir，这两个函数都只做了目录项的删除，而没有删除文件内容
 // 从父目录dir中删除目录项dentry
-static int baby_unlink(struct inode *dir, struct dentry *dentry) {
+static int __baby_unlink(struct inode *dir, struct dentry *dentry) {
   struct inode *inode = d_inode(dentry);
   struct dir_record *de;
   struct page *page;
@@ -811,13 +1487,13 @@ out:
 }
 
 /*删除目录，dir 是删除的目录的父目录，dentry 是待删除的目录的 dentry*/
-static int baby_rmdir(struct inode *dir, struct dentry *dentry) {
+static int __baby_rmdir(struct inode *dir, struct dentry *dentry) {
   struct inode *inode = d_inode(dentry); // 待删除文件 inode
   int err = -ENOTEMPTY;
 
   if (baby_empty_dir(
           inode)) { // 检查待删除的目录是否为空，只有空的目录才能被删除
-    err = baby_unlink(dir, dentry); // 从父目录中删除自身的目录项
+    err = __baby_unlink(dir, dentry); // 从父目录中删除自身的目录项
     if (!err) { /*把目标文件大小置为0，减少引用计数*/
       inode->i_size = 0;
       inode_dec_link_count(inode);
@@ -854,7 +1530,7 @@ struct dentry *baby_lookup(struct inode *dir, struct dentry *dentry,
  * @new_dir: 目的地的目录 inode
  * @new_dentry: 新的目录项，目的地文件
  */
-static int baby_rename(struct inode *old_dir, struct dentry *old_dentry,
+static int __baby_rename(struct inode *old_dir, struct dentry *old_dentry,
                        struct inode *new_dir, struct dentry *new_dentry,
                        unsigned int flags) {
   struct inode *old_inode = d_inode(old_dentry);
@@ -938,44 +1614,71 @@ out:
  */
 void baby_free_blocks(struct inode *inode, unsigned long block,
                       unsigned long count) {
-  struct buffer_head *bitmap_bh = NULL; // 用来读取 bitmap 块
   struct super_block *sb = inode->i_sb;
-  struct baby_sb_info *bbi = BABY_SB(sb);
-  unsigned long nr_need_free = count;
-  unsigned long i, bitmap_no, nr_del_bit, clear_bit_no;
-
-  // 待释放 block 对应 bit 所在位图的物理磁盘块号
-  bitmap_no = (block - NR_DSTORE_BLOCKS) / BABYFS_BIT_PRE_BLOCK + BABYFS_DATA_BIT_MAP_BLOCK_BASE;
-  // 待释放 block 对应 bit 在其位图磁盘块中的偏移
-  // data_bitmap记录磁盘块距离第一个数据块的距离，所以block要减去第一个数据块的偏移
-  clear_bit_no = (block - NR_DSTORE_BLOCKS) % BABYFS_BIT_PRE_BLOCK;
-  // 在一个位图中，待清除的bit个数，第一个块的起始位不为0
-  nr_del_bit = min(count, BABYFS_BIT_PRE_BLOCK - clear_bit_no);
-
-  while (count > 0) { // 操作bitmap_no指示的位图
-    bitmap_bh = sb_bread(sb, bitmap_no);
-    
-    // 清空bitmap_no位图块内指定的bit，[clear_bit_no, clear_bit_no+nr)
-    for (i = 0; i < nr_del_bit; i++) { 
-      // 清除该 bitmap 中的相对位置的 bit
-      if(!baby_clear_bit(clear_bit_no + i, (unsigned long *)bitmap_bh->b_data)) {
-        printk(KERN_ERR "clear bitmap no %ld on bit %ld err\n", bitmap_no, clear_bit_no + i);
-      }
+
+#ifdef CLEAR_DEBUG
+  printk("baby_free_blocks：free [%lu, %lu]\n", block, block + count - 1);
+#endif
+  // 清除位图并放回所在块组的空闲区间树，块组维护空闲块数
+  baby_release_blocks(sb, block, count);
+  // 释放的块如果是日志跟踪的元数据块，不再写回，回放时也不能再写回去
+  baby_journal_forget(sb, block, count);
+}
+
+/*
+ * 截断时攒在一起的连续空闲块，新释放的块接在某一段的头部或者尾部时合并，
+ * 都接不上时换掉较早的一段，这时才真正清位图，一次释放一整段
+ * 间接块在热区域里和数据块分开放，数据块和间接块各占一段，互不打断
+ */
+#define BABY_FREE_RUNS 2
+
+struct baby_free_batch {
+  struct baby_free_range run[BABY_FREE_RUNS];
+  int last; // 最近使用的一段
+};
+
+static void baby_free_batch_add(struct inode *inode,
+                                struct baby_free_batch *batch,
+                                unsigned long nr) {
+  struct baby_free_range *r;
+  int i;
+
+  for (i = 0; i < BABY_FREE_RUNS; i++) {
+    r = &batch->run[i];
+    if (!r->fr_len)
+      continue;
+    if (nr == r->fr_start + r->fr_len) {
+      r->fr_len++;
+      batch->last = i;
+      return;
+    }
+    if (nr + 1 == r->fr_start) {
+      r->fr_start--;
+      r->fr_len++;
+      batch->last = i;
+      return;
     }
-  #ifdef CLEAR_DEBUG
-    printk("baby_free_blocks：bitmap_no %ld clear bit [%ld, %ld]\n", bitmap_no, clear_bit_no, clear_bit_no + nr_del_bit - 1);
-  #endif
-    mark_buffer_dirty(bitmap_bh);
-    // sync_dirty_buffer(bitmap_bh);
-    brelse(bitmap_bh);
+  }
+  i = (batch->last + 1) % BABY_FREE_RUNS;
+  r = &batch->run[i];
+  if (r->fr_len)
+    baby_free_blocks(inode, r->fr_start, r->fr_len);
+  r->fr_start = nr;
+  r->fr_len = 1;
+  batch->last = i;
+}
+
+static void baby_free_batch_flush(struct inode *inode,
+                                  struct baby_free_batch *batch) {
+  struct baby_free_range *r;
+  int i;
 
-    count -= nr_del_bit; // 还剩多少bit要清除
-    clear_bit_no = 0; // 跨位图的情况，除第一个位图外都从第一个bit开始清除
-    bitmap_no++; // 操作下一个位图
-    nr_del_bit =
-        min(count, BABYFS_BIT_PRE_BLOCK); // 下一个位图中，要清除的bit个数
+  for (i = 0; i < BABY_FREE_RUNS; i++) {
+    r = &batch->run[i];
+    if (r->fr_len)
+      baby_free_blocks(inode, r->fr_start, r->fr_len);
+    r->fr_len = 0;
   }
-  bbi->nr_free_blocks += nr_need_free; // 维护系统中剩余的可用数据块个数
 }
 
 /*
@@ -983,31 +1686,17 @@ void baby_free_blocks(struct inode *inode, unsigned long block,
  * @p: 索引数组开始的位置
  * @q: 索引数组结束的位置
  */
-static inline baby_free_data(struct inode *inode, __le32 *p, __le32 *q) {
-  unsigned long block_to_free = 0, count = 0, nr;
-  struct baby_sb_info *sb_info = BABY_SB(inode->i_sb);
+static void baby_free_data(struct inode *inode, __le32 *p, __le32 *q,
+                           struct baby_free_batch *batch) {
+  unsigned long nr;
+
   for (; p < q; ++p) {
     nr = le32_to_cpu(*p);
     if (nr) {
       *p = 0;
-      if (count == 0)
-        goto free_this;
-      else if (block_to_free ==
-               nr - count) // 连续的块先记录着，然后再一次性 free
-        count++;
-      else {
-        baby_free_blocks(inode, block_to_free, count);
-        mark_inode_dirty(inode);
-      free_this:
-        block_to_free = nr;
-        count = 1;
-      }
+      baby_free_batch_add(inode, batch, nr);
     }
   }
-  if (count > 0) {
-    baby_free_blocks(inode, block_to_free, count);
-    mark_inode_dirty(inode);
-  }
 }
 
 /*
@@ -1017,12 +1706,10 @@ static inline baby_free_data(struct inode *inode, __le32 *p, __le32 *q) {
  * @depth: 需要释放的数量
  */
 static void baby_free_branches(struct inode *inode, __le32 *p, __le32 *q,
-                               int depth) {
+                               int depth, struct baby_free_batch *batch) {
   struct buffer_head *bh;
-  struct baby_sb_info *sb_info = BABY_SB(inode->i_sb);
   unsigned long nr;
-  unsigned long address_num_per_block =
-      BABYFS_BLOCK_SIZE / sizeof(__u32); // 每个磁盘块中可以表示的 块号的数量
+
   if (depth--) {
     for (; p < q; ++p) {
       nr = le32_to_cpu(*p); // 下一级索引块的物理块号
@@ -1037,29 +1724,69 @@ static void baby_free_branches(struct inode *inode, __le32 *p, __le32 *q,
         continue;
       }
       baby_free_branches(inode, (__le32 *)bh->b_data,
-                         (__le32 *)bh->b_data + address_num_per_block,
-                         depth); // 递归释放下一级索引块中的所有索引项
+                         (__le32 *)bh->b_data + BABYFS_PER_BLOCK_INDEX_NUM,
+                         depth, batch); // 递归释放下一级索引块中的所有索引项
       // 抛弃bh的所有待同步信息，并释放bh，因为释放数据不再需要关心数据同步
       bforget(bh);
-      baby_free_blocks(inode, nr, 1); // 释放该索引项指示的下一级索引磁盘块
-      mark_inode_dirty(inode);
+      baby_free_batch_add(inode, batch, nr); // 释放该索引项指示的下一级索引磁盘块
     }
   } else {
     // 此时 depth == 0，说明是直接块，调用释放直接块的函数
-    baby_free_data(inode, p, q);
+    baby_free_data(inode, p, q, batch);
   }
 }
 
+/*
+ * 部分截断一棵间接块子树，截断点和它之后的块都释放
+ * @p: 指向子树根的索引项
+ * @depth: 子树的间接层数
+ * @offsets: 截断点在每一层索引块中的下标
+ * 截断点之后的整棵子树直接交给 baby_free_branches，不用逐块查找；
+ * 截断点在子树开头时连子树根一起释放，否则沿路径留下的索引块写进日志
+ */
+static void baby_truncate_branch(struct inode *inode, __le32 *p, int depth,
+                                 int *offsets, struct baby_free_batch *batch) {
+  __le32 *ptrs, *end;
+  struct buffer_head *bh;
+  unsigned long nr = le32_to_cpu(*p);
+  int i;
+
+  if (!nr)
+    return;
+  for (i = 0; i < depth && !offsets[i]; ++i)
+    ;
+  if (i == depth) {
+    baby_free_branches(inode, p, p + 1, depth, batch);
+    return;
+  }
+  bh = sb_bread(inode->i_sb, nr);
+  if (!bh) {
+    printk(KERN_ERR "baby_truncate_branch, read failure, inode = %ld, "
+                    "block = %ld\n",
+           inode->i_ino, nr);
+    return;
+  }
+  ptrs = (__le32 *)bh->b_data;
+  end = ptrs + BABYFS_PER_BLOCK_INDEX_NUM;
+  if (depth == 1) {
+    baby_free_data(inode, ptrs + offsets[0], end, batch);
+  } else {
+    baby_truncate_branch(inode, ptrs + offsets[0], depth - 1, offsets + 1,
+                         batch);
+    baby_free_branches(inode, ptrs + offsets[0] + 1, end, depth - 1, batch);
+  }
+  baby_journal_dirty(inode->i_sb, inode, bh);
+  brelse(bh);
+}
+
 static void __baby_truncate_blocks(struct inode *inode, loff_t offset) {
   int offsets[4];
   __le32 nr = 0;
   struct baby_inode_info *inode_info = BABY_I(inode);
   __le32 *i_blocks = inode_info->i_blocks;
-  // 获取开始截断的块号，这个函数应该还会在别的地方用到，单纯的释放 inode
-  // 的话，iblock 就是 0 不需要计算
-  unsigned long block_bit = 10;
-  long iblock = (offset + BABYFS_BLOCK_SIZE - 1) >> block_bit;
-  // printk("iblock: %ld\n", iblock);
+  struct baby_free_batch batch = {};
+  // 开始截断的块号，释放 inode 时为 0
+  long iblock = (offset + BABYFS_BLOCK_SIZE - 1) >> inode->i_blkbits;
   // 获取 iblock 的磁盘块信息
   int n = baby_block_to_path(inode, iblock, offsets, NULL);
   if (n == 0)
@@ -1067,50 +1794,165 @@ static void __baby_truncate_blocks(struct inode *inode, loff_t offset) {
   if (n == 1) {
     // 释放直接块
     baby_free_data(inode, i_blocks + offsets[0],
-                   i_blocks + BABYFS_DIRECT_BLOCK);
-    goto do_indirects;
+                   i_blocks + BABYFS_DIRECT_BLOCK, &batch);
+  } else {
+    // 截断点在 offsets[0] 的间接块里，先截掉这棵子树里截断点之后的部分
+    baby_truncate_branch(inode, i_blocks + offsets[0], n - 1, offsets + 1,
+                         &batch);
   }
-  // TODO 非 inode 释放块的场景下的额外工作; 此时一开始返回的 n 可能会大于 1
 
-// 从 offsets[0] 对应的间接块开始，往下释放更高级的间接块
-do_indirects:
+  // 从 offsets[0] 之后的间接块开始，往下释放更高级的间接块
   switch (offsets[0]) {
   default: // 如果offsets[0]是直接块，则释放所有间接索引
     nr = i_blocks[BABYFS_PRIMARY_BLOCK];
-    // printk("BABYFS_PRIMARY_BLOCK: %d\n", nr);
     if (nr) {
       i_blocks[BABYFS_PRIMARY_BLOCK] = 0; // 先重置i_blocks对应位
-      mark_inode_dirty(inode);
-      baby_free_branches(inode, &nr, &nr + 1, 1); // 释放索引
+      baby_free_branches(inode, &nr, &nr + 1, 1, &batch); // 释放索引
     }
   case BABYFS_PRIMARY_BLOCK: // 如果offsets[0]是一级索引，则释放二级和三级索引
     nr = i_blocks[BABYFS_SECONDRTY_BLOCK];
-    // printk("BABYFS_SECONDRTY_BLOCK: %d\n", nr);
     if (nr) {
       i_blocks[BABYFS_SECONDRTY_BLOCK] = 0;
-      mark_inode_dirty(inode);
-      baby_free_branches(inode, &nr, &nr + 1, 2);
+      baby_free_branches(inode, &nr, &nr + 1, 2, &batch);
     }
   case BABYFS_SECONDRTY_BLOCK: // 如果offsets[0]是二级索引，则释放三级索引
     nr = i_blocks[BABYFS_THIRD_BLOCKS];
-    // printk("BABYFS_THIRD_BLOCKS: %d\n", nr);
     if (nr) {
       i_blocks[BABYFS_THIRD_BLOCKS] = 0;
-      mark_inode_dirty(inode);
-      baby_free_branches(inode, &nr, &nr + 1, 3);
+      baby_free_branches(inode, &nr, &nr + 1, 3, &batch);
     }
   case BABYFS_THIRD_BLOCKS:;
   }
+  baby_free_batch_flush(inode, &batch);
+  mark_inode_dirty(inode);
 
   baby_discard_reservation(inode);
 }
 
-static void baby_truncate_blocks(struct inode *inode, loff_t offset) {
+void baby_truncate_blocks(struct inode *inode, loff_t offset) {
   // 只有这些文件可以释放磁盘块
   if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) ||
         S_ISLNK(inode->i_mode)))
     return;
-  __baby_truncate_blocks(inode, offset);
+  mutex_lock(&BABY_I(inode)->i_alloc_mutex);
+  if (baby_inode_extents(inode))
+    baby_ext_truncate(inode, (offset + BABYFS_BLOCK_SIZE - 1) >>
+                                 inode->i_blkbits);
+  else
+    __baby_truncate_blocks(inode, offset);
+  // 块已经释放，再删除缓存中对应的映射
+  baby_map_cache_remove(inode,
+                        (offset + BABYFS_BLOCK_SIZE - 1) >> inode->i_blkbits,
+                        ULONG_MAX);
+  mutex_unlock(&BABY_I(inode)->i_alloc_mutex);
+  // 页缓存已经截掉，范围内还没回写的延迟块不会再分配
+  baby_da_discard(inode, (offset + BABYFS_BLOCK_SIZE - 1) >> inode->i_blkbits,
+                  ULONG_MAX);
+}
+
+/*
+ * 截掉 nblocks 块的 handle 要预留的日志块：最坏情况下每块在不同的块组，
+ * 经过的间接块或区间树块都要修改或者撤销，按项数更少的区间树叶子算；
+ * 再加上 inode，删除文件时还有 inode 位图和孤儿链表
+ */
+unsigned long baby_truncate_credits(struct super_block *sb,
+                                    unsigned long nblocks) {
+  unsigned long meta = nblocks / (BABYFS_BLOCK_SIZE / sizeof(struct baby_extent)) +
+                       BABYFS_EXT_MAX_DEPTH + 1;
+
+  return 2 * meta + min(nblocks + meta, BABY_SB(sb)->nr_bitmap) +
+         BABYFS_ORPHAN_CREDITS + 2;
+}
+
+/*
+ * 每个 handle 截掉的块数，最多 BABYFS_TRUNCATE_BATCH
+ * 日志区小或者块组多时减半，直到预留放得进一个事务
+ */
+unsigned long baby_truncate_batch(struct super_block *sb) {
+  unsigned long n = BABYFS_TRUNCATE_BATCH, max = baby_journal_max_credits(sb);
+
+  while (n > 1 && baby_truncate_credits(sb, n) > max)
+    n /= 2;
+  return n;
+}
+
+/*
+ * 把文件截短到 size：从文件末尾往前每次截掉 baby_truncate_batch 块，
+ * 每一批一个 handle，磁盘上的 i_size 跟着变小，中途崩溃时已经截掉的部分和 i_size 一致
+ * 调用者持有 i_rwsem 和 i_mmap_sem 写锁；页缓存在 handle 外截断：回写在 handle 里锁页，
+ * 截断要等回写完成，转换未写区间的 I/O 完成时又要开始新的 handle
+ */
+int baby_truncate(struct inode *inode, loff_t size) {
+  struct super_block *sb = inode->i_sb;
+  struct baby_handle *handle;
+  unsigned long nr = baby_truncate_batch(sb);
+  loff_t batch = (loff_t)nr << inode->i_blkbits;
+  loff_t isize = i_size_read(inode), off;
+
+  while (isize > size) {
+    off = isize - size > batch ? isize - batch : size;
+    truncate_setsize(inode, off);
+    handle = baby_journal_start(sb, baby_truncate_credits(sb, nr));
+    if (IS_ERR(handle))
+      return PTR_ERR(handle);
+    baby_truncate_blocks(inode, off);
+    mark_inode_dirty(inode);
+    baby_journal_stop(handle);
+    isize = off;
+    cond_resched();
+  }
+  return 0;
+}
+
+/*
+ * 打洞：释放 [start, start + len) 的块，只支持区间映射文件
+ * 和截断一样每次释放 baby_truncate_batch 块，每一批一个 handle
+ * 调用者已经删掉范围内的页缓存
+ */
+int baby_punch_blocks(struct inode *inode, unsigned long start,
+                      unsigned long len) {
+  struct super_block *sb = inode->i_sb;
+  unsigned long batch = baby_truncate_batch(sb), end = start + len, nr;
+  struct baby_handle *handle;
+  int err = 0;
+
+  for (; start < end && !err; start += nr) {
+    nr = min(end - start, batch);
+    handle = baby_journal_start(sb, baby_truncate_credits(sb, nr));
+    if (IS_ERR(handle))
+      return PTR_ERR(handle);
+    mutex_lock(&BABY_I(inode)->i_alloc_mutex);
+    err = baby_ext_punch(inode, start, nr);
+    baby_map_cache_remove(inode, start, nr);
+    mutex_unlock(&BABY_I(inode)->i_alloc_mutex);
+    baby_journal_stop(handle);
+    baby_da_discard(inode, start, nr);
+    cond_resched();
+  }
+  return err;
+}
+
+/*
+ * fallocate：给 [start, start + len) 中的空洞分配未写区间
+ * 每次分配不超过一个区间的长度，分配器尽量给出整段连续的块
+ */
+int baby_prealloc_blocks(struct inode *inode, unsigned long start,
+                         unsigned long len) {
+  unsigned long end = start + len;
+  struct buffer_head map;
+  int ret;
+
+  while (start < end) {
+    map.b_state = 0;
+    ret = baby_ext_get_blocks(inode, start, end - start, &map,
+                              BABY_GET_BLOCKS_UNWRITTEN);
+    if (ret < 0)
+      return ret;
+    start += ret;
+    if (fatal_signal_pending(current))
+      return -EINTR;
+  }
+  return 0;
 }
 
 /*
@@ -1123,11 +1965,24 @@ void baby_free_inode(struct inode *inode) {
 
   // TODO 当前 inode 分配位图只占了一个磁盘块，要支持多块的话这里要改成循环
   bitmap_bh = sb_bread(inode->i_sb, BABYFS_INODE_BIT_MAP_BLOCK_BASE);
-  baby_clear_bit(inode->i_ino, (unsigned long *)bitmap_bh->b_data);
-  mark_buffer_dirty(bitmap_bh);
+  test_and_clear_bit_le(inode->i_ino, bitmap_bh->b_data);
+  baby_journal_dirty(inode->i_sb, NULL, bitmap_bh);
   brelse(bitmap_bh);
 }
 
+// 根据 inode 位图重新统计空闲 inode 数量，日志回放后使用
+unsigned long baby_count_free_inodes(struct super_block *sb) {
+  struct buffer_head *bitmap_bh;
+  unsigned long used;
+
+  bitmap_bh = sb_bread(sb, BABYFS_INODE_BIT_MAP_BLOCK_BASE);
+  if (!bitmap_bh)
+    return percpu_counter_sum_positive(&BABY_SB(sb)->s_freeinodes_counter);
+  used = memweight(bitmap_bh->b_data, BABYFS_BLOCK_SIZE);
+  brelse(bitmap_bh);
+  return BABYFS_INODE_NUM_COUNTS - used;
+}
+
 /**
  * 调用 iput() 时，如果 i_nlink 为零，调用该函数执行 inode 相关磁盘块和 page
  * 的释放
@@ -1137,25 +1992,50 @@ void baby_evict_inode(struct inode *inode) {
   int want_delete = 0;
   struct baby_inode_info *inode_info = BABY_I(inode);
   struct baby_sb_info *sb_info = BABY_SB(inode->i_sb);
+  struct baby_handle *handle = NULL;
 
-  // 删除 inode 的占用的 pages
-  truncate_inode_pages_final(&inode->i_data);
   // iput可能会用在分配new inode失败时，此时inode未分配数据块，不用真的删除
   // 分配失败用make_bad_inode标记坏页，用is_bad_inode判断
   if (!is_bad_inode(inode) && !inode->i_nlink)
     want_delete = 1;
+  // 日志还持有目录页的 buffer，先放掉，页缓存才能清空
+  baby_journal_evict_inode(inode, want_delete);
+  // 删除 inode 的占用的 pages
+  truncate_inode_pages_final(&inode->i_data);
+  // 回写已经结束，等转换未写区间的 work 退出
+  flush_work(&inode_info->i_ioend_work);
+  // 大文件的块交给后台释放，inode 挂到孤儿链表上，这里不再删除
+  if (want_delete && baby_orphan_add(inode))
+    want_delete = 0;
   if (want_delete) {
+    unsigned long nr = baby_truncate_batch(inode->i_sb);
+    loff_t batch = (loff_t)nr << inode->i_blkbits;
+
     sb_start_intwrite(inode->i_sb);
+    /*
+     * 没能交给后台的大文件（正在卸载）先分批截到一批以内，
+     * 最后一批数据块和 inode 的释放放在同一个事务里
+     */
+    if (S_ISREG(inode->i_mode) && inode->i_size > batch)
+      baby_truncate(inode, batch);
+    handle = baby_journal_start(inode->i_sb,
+                                baby_truncate_credits(inode->i_sb, nr));
+    if (inode_needs_sync(inode))
+      baby_journal_set_sync(handle);
     inode_info->i_dtime = get_seconds();
     mark_inode_dirty(inode);
     __baby_write_inode(inode, inode_needs_sync(inode));
     inode->i_size = 0;
     // if (inode->i_blocks)
     baby_truncate_blocks(inode, 0); // 释放 inode 占用的磁盘块
+    baby_orphan_del(inode);
   }
   // 要被删除的文件不需要再同步数据到磁盘了，清空待IO队列
   invalidate_inode_buffers(inode);
   clear_inode(inode);
+  if (S_ISDIR(inode->i_mode))
+    baby_dir_free_map_release(inode);
+  baby_map_cache_drop(inode);
 
   /*释放预留窗口中的块，释放预分配相关数据结构*/
 	baby_discard_reservation(inode);
@@ -1166,11 +2046,108 @@ void baby_evict_inode(struct inode *inode) {
   
   if (want_delete) {
     baby_free_inode(inode); // 释放 inode
-    sb_info->nr_free_inodes++;
+    percpu_counter_inc(&sb_info->s_freeinodes_counter);
+    baby_journal_stop(handle);
     sb_end_intwrite(inode->i_sb);
   }
 }
 
+/*
+ * 目录操作包在一个 handle 里，一次操作的所有元数据修改属于同一个事务
+ * 目录同步时 handle 结束即提交
+ */
+static struct baby_handle *baby_dir_journal_start(struct inode *dir) {
+  struct baby_handle *handle = baby_journal_start(dir->i_sb, BABYFS_DIR_CREDITS);
+
+  if (IS_DIRSYNC(dir))
+    baby_journal_set_sync(handle);
+  return handle;
+}
+
+static int baby_create(struct inode *dir, struct dentry *dentry, umode_t mode,
+                       bool excl) {
+  struct baby_handle *handle = baby_dir_journal_start(dir);
+  int err;
+
+  if (IS_ERR(handle))
+    return PTR_ERR(handle);
+  err = __baby_create(dir, dentry, mode, excl);
+  baby_journal_stop(handle);
+  return err;
+}
+
+static int baby_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode) {
+  struct baby_handle *handle = baby_dir_journal_start(dir);
+  int err;
+
+  if (IS_ERR(handle))
+    return PTR_ERR(handle);
+  err = __baby_mkdir(dir, dentry, mode);
+  baby_journal_stop(handle);
+  return err;
+}
+
+static int baby_symlink(struct inode *dir, struct dentry *dentry,
+                        const char *symname) {
+  struct baby_handle *handle = baby_dir_journal_start(dir);
+  int err;
+
+  if (IS_ERR(handle))
+    return PTR_ERR(handle);
+  err = __baby_symlink(dir, dentry, symname);
+  baby_journal_stop(handle);
+  return err;
+}
+
+static int baby_link(struct dentry *old_dentry, struct inode *dir,
+                     struct dentry *dentry) {
+  struct baby_handle *handle = baby_dir_journal_start(dir);
+  int err;
+
+  if (IS_ERR(handle))
+    return PTR_ERR(handle);
+  err = __baby_link(old_dentry, dir, dentry);
+  baby_journal_stop(handle);
+  return err;
+}
+
+static int baby_unlink(struct inode *dir, struct dentry *dentry) {
+  struct baby_handle *handle = baby_dir_journal_start(dir);
+  int err;
+
+  if (IS_ERR(handle))
+    return PTR_ERR(handle);
+  err = __baby_unlink(dir, dentry);
+  baby_journal_stop(handle);
+  return err;
+}
+
+static int baby_rmdir(struct inode *dir, struct dentry *dentry) {
+  struct baby_handle *handle = baby_dir_journal_start(dir);
+  int err;
+
+  if (IS_ERR(handle))
+    return PTR_ERR(handle);
+  err = __baby_rmdir(dir, dentry);
+  baby_journal_stop(handle);
+  return err;
+}
+
+static int baby_rename(struct inode *old_dir, struct dentry *old_dentry,
+                       struct inode *new_dir, struct dentry *new_dentry,
+                       unsigned int flags) {
+  struct baby_handle *handle = baby_dir_journal_start(old_dir);
+  int err;
+
+  if (IS_ERR(handle))
+    return PTR_ERR(handle);
+  if (IS_DIRSYNC(new_dir))
+    baby_journal_set_sync(handle);
+  err = __baby_rename(old_dir, old_dentry, new_dir, new_dentry, flags);
+  baby_journal_stop(handle);
+  return err;
+}
+
 struct inode_operations baby_dir_inode_operations = {
     // 目录文件inode的操作
     .lookup = baby_lookup,   //
@@ -1183,10 +2160,53 @@ struct inode_operations baby_dir_inode_operations = {
     .rename = baby_rename,   .getattr = simple_getattr,
 };
 
+// 按区间报告文件的映射，延迟块报告为 FIEMAP_EXTENT_DELALLOC
+static int baby_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+                       u64 start, u64 len) {
+  int ret;
+
+  inode_lock(inode);
+  ret = iomap_fiemap(inode, fieinfo, start, len, &baby_iomap_ops);
+  inode_unlock(inode);
+  return ret;
+}
+
+/*
+ * 修改文件大小时持有 i_mmap_sem 写锁截断页缓存，和缺页互斥
+ * 截短时新末尾所在块的剩余部分清零，截断点之后的块分批释放
+ */
+static int baby_setattr(struct dentry *dentry, struct iattr *iattr) {
+  struct inode *inode = d_inode(dentry);
+  loff_t size = iattr->ia_size;
+  int err;
+
+  err = setattr_prepare(dentry, iattr);
+  if (err)
+    return err;
+  if ((iattr->ia_valid & ATTR_SIZE) && size != i_size_read(inode)) {
+    inode_dio_wait(inode);
+    down_write(&BABY_I(inode)->i_mmap_sem);
+    if (size < i_size_read(inode)) {
+      err = iomap_truncate_page(inode, size, NULL, &baby_iomap_ops);
+      if (!err)
+        err = baby_truncate(inode, size);
+    } else {
+      truncate_setsize(inode, size);
+    }
+    up_write(&BABY_I(inode)->i_mmap_sem);
+    if (err)
+      return err;
+  }
+  setattr_copy(inode, iattr);
+  mark_inode_dirty(inode);
+  return 0;
+}
+
 struct inode_operations baby_file_inode_operations = {
     // 普通文件inode的操作
     .getattr = simple_getattr,
-    .setattr = simple_setattr,
+    .setattr = baby_setattr,
+    .fiemap = baby_fiemap,
 };
 
 struct inode_operations baby_symlink_inode_operations = {
@@ -1194,10 +2214,27 @@ struct inode_operations baby_symlink_inode_operations = {
     .get_link = page_get_link,
 };
 
+// 目录和符号链接
 const struct address_space_operations baby_aops = {
     .readpage = baby_readpage,
+    .readpages = baby_readpages,
     .writepage = baby_writepage,
     .writepages = baby_writepages,
     .write_end = baby_write_end,
     .write_begin = baby_write_begin,
+};
+
+// 普通文件，直接 I/O 在 file.c 里调用 iomap_dio_rw，这里的 direct_IO 只用来允许 O_DIRECT 打开
+const struct address_space_operations baby_file_aops = {
+    .readpage = baby_iomap_readpage,
+    .readpages = baby_iomap_readpages,
+    .writepage = baby_iomap_writepage,
+    .writepages = baby_iomap_writepages,
+    .set_page_dirty = iomap_set_page_dirty,
+    .releasepage = iomap_releasepage,
+    .invalidatepage = baby_iomap_invalidatepage,
+    .direct_IO = noop_direct_IO,
+    .migratepage = iomap_migrate_page,
+    .is_partially_uptodate = iomap_is_partially_uptodate,
+    .error_remove_page = generic_error_remove_page,
 };
\ No newline at end of file
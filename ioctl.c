@@ -0,0 +1,58 @@
+#include <linux/compat.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+
+#include "babyfs.h"
+
+/*
+ * 文件和目录共用的 ioctl
+ * FITRIM: discard 数据区中的空闲块，见 discard.c
+ * BABYFS_IOC_GET_WEAR: 读出各个块组的磨损计数，见 wear.c
+ */
+long baby_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+  struct super_block *sb = file_inode(filp)->i_sb;
+
+  switch (cmd) {
+  case FITRIM: {
+    struct fstrim_range range;
+    int ret;
+
+    if (!capable(CAP_SYS_ADMIN))
+      return -EPERM;
+    if (copy_from_user(&range, (struct fstrim_range __user *)arg,
+                       sizeof(range)))
+      return -EFAULT;
+    ret = baby_trim_fs(sb, &range);
+    if (ret < 0)
+      return ret;
+    if (copy_to_user((struct fstrim_range __user *)arg, &range, sizeof(range)))
+      return -EFAULT;
+    return 0;
+  }
+  case BABYFS_IOC_GET_WEAR: {
+    struct baby_wear_info info;
+    int ret;
+
+    if (copy_from_user(&info, (struct baby_wear_info __user *)arg,
+                       sizeof(info)))
+      return -EFAULT;
+    ret = baby_wear_report(sb, &info);
+    if (ret < 0)
+      return ret;
+    if (copy_to_user((struct baby_wear_info __user *)arg, &info,
+                     sizeof(info)))
+      return -EFAULT;
+    return 0;
+  }
+  default:
+    return -ENOTTY;
+  }
+}
+
+#ifdef CONFIG_COMPAT
+// 参数结构体的布局在 32 位和 64 位下相同，只需要转换指针
+long baby_compat_ioctl(struct file *filp, unsigned int cmd,
+                       unsigned long arg) {
+  return baby_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
@@ -0,0 +1,1199 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/crc32.h>
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/highmem.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "babyfs.h"
+
+/*
+ * 元数据日志（redo log），日志区由 mkfs.babyfs 预留在设备末尾
+ *
+ * 位图、inode 表、间接块、目录页和目录索引块都在 handle 里修改，修改完调用
+ * baby_journal_dirty 把 buffer 挂到运行事务上，这些 buffer 不再标记为脏，
+ * 不会被回写线程提前写到原位置。
+ *
+ * 提交分两步：
+ * 1. 持 j_barrier 写锁（此时没有进行中的 handle）把运行事务的块拷贝进日志块，
+ *    同时保存一份冻结副本，然后放开写锁，新的操作进入下一个事务
+ * 2. 顺序写描述块、数据块、撤销块，刷新磁盘缓存后写提交块
+ * 已提交的块在检查点时用冻结副本写回原位置，不会把后续事务未提交的修改写出去。
+ * 日志写不下时做检查点，日志从头开始使用。
+ * 写日志或者检查点出错时日志中止：冻结副本里可能是没有提交的内容，之后不再检查点，
+ * 新的 handle 返回 -EIO，已经提交的事务留在日志里，下次挂载时回放。
+ *
+ * handle 开始时预留它最多会修改的块数（credits），运行事务加上所有 handle 还没用掉的
+ * 预留超过 j_max_txn 时先提交运行事务再开始，一个事务总能写进日志区；
+ * 修改量不固定的操作（截断、打洞、转换未写区间）拆成多个 handle。
+ * 即使这样事务还是比日志区大，说明预留的估计错了，日志中止，不再破坏原子性。
+ *
+ * 很多操作的修改合并在同一个事务里（周期提交，fsync、sync_fs 强制提交），
+ * fsync 的代价是一次顺序的日志写，而不是逐个同步写散落的元数据块。
+ * 普通文件的数据块不经过日志，但是新分配的块要先于映射落盘（ordered）：
+ * 回写在 handle 里分配块、提交 ioend，这些 ioend 按 handle 所在的事务计数，
+ * 提交事务时等它们写完再写提交块，崩溃之后文件不会指向没写过的块。
+ */
+
+#define BABY_JOURNAL_HASH_BITS 8
+#define BABY_JOURNAL_COMMIT_INTERVAL (5 * HZ)  // 周期提交间隔
+
+// 日志跟踪的一个元数据块，从第一次修改到检查点（或者被释放）为止
+struct baby_jentry {
+  struct hlist_node e_hash;
+  struct list_head e_list;   // 运行事务链表
+  unsigned long e_blocknr;
+  struct buffer_head *e_bh;  // 持有 buffer，保证检查点之前不会从磁盘读到旧内容
+  struct inode *e_inode;     // 目录页 buffer 所属的目录，块设备 buffer 为 NULL
+  void *e_frozen;            // 最近一次提交的内容，等待检查点写回原位置
+  int e_running;             // 运行事务修改过
+  int e_logged;              // 上次检查点之后写进过日志，释放时需要撤销记录
+};
+
+// 撤销记录：块被释放了，回放时不要把更早的日志拷贝写回去
+struct baby_jrevoke {
+  struct list_head r_list;
+  struct hlist_node r_hash;  // 回放时使用
+  unsigned long r_blocknr;
+  u32 r_sequence;
+};
+
+struct baby_journal {
+  struct super_block *j_sb;
+  unsigned long j_first;      // 日志区起始物理块号
+  unsigned long j_blocks;     // 日志区块数
+  unsigned long j_dev_blocks; // 设备的总块数，回放时检查块号
+  unsigned long j_head;       // 下一个事务写入的位置
+  unsigned long j_tail;       // 最早未检查点事务的位置，0 表示日志为空
+  u32 j_tail_sequence;
+  u32 j_running_tid;          // 运行事务的序号
+  u32 j_commit_tid;           // 最近一次提交的事务序号
+  unsigned long j_max_txn;    // 运行事务超过这么多块就立即提交
+  int j_errno;                // 日志中止的原因，不为 0 时不再提交和检查点
+
+  struct rw_semaphore j_barrier;  // handle 持读锁，提交时持写锁拷贝运行事务
+  struct mutex j_commit_mutex;    // 串行化提交和检查点
+  spinlock_t j_lock;              // handle 之间保护下面的哈希表、链表和计数
+  struct hlist_head j_hash[1 << BABY_JOURNAL_HASH_BITS];
+  struct list_head j_running;
+  struct list_head j_revoke;
+  unsigned long j_nr_running;
+  unsigned long j_nr_revoke;
+  unsigned long j_reserved;       // 进行中的 handle 还没用掉的预留块数
+  atomic_t j_ordered[2];          // 按事务序号奇偶计数的未完成的 ordered 数据 I/O
+  wait_queue_head_t j_ordered_wait;
+  struct delayed_work j_commit_work;
+};
+
+struct baby_handle {
+  struct baby_journal *h_journal;  // 必须是第一个成员，见 baby_journal_start
+  void *h_saved;                   // 进入前的 current->journal_info
+  int h_ref;                       // 嵌套深度
+  unsigned long h_credits;         // 还没用掉的预留块数
+  u32 h_tid;                       // 所在的事务
+  int h_ordered;                   // 分配了数据块，之后提交的 ioend 要先于提交块写完
+  int h_sync;                      // 结束时同步提交
+  unsigned int h_nofs;
+};
+
+// 一组写回原位置的 bio
+struct baby_jio {
+  atomic_t pending;
+  int err;
+  struct completion done;
+};
+
+static inline int tid_geq(u32 x, u32 y) { return (int)(x - y) >= 0; }
+
+// 中止日志，调用者持有 j_commit_mutex
+static void baby_journal_abort(struct baby_journal *j, int err) {
+  if (j->j_errno)
+    return;
+  WRITE_ONCE(j->j_errno, err);
+  printk(KERN_ERR "babyfs: journal aborted, err %d\n", err);
+}
+
+static inline struct hlist_head *baby_jhash(struct hlist_head *table,
+                                            unsigned long blocknr) {
+  return &table[hash_long(blocknr, BABY_JOURNAL_HASH_BITS)];
+}
+
+static struct baby_jentry *baby_jentry_find(struct baby_journal *j,
+                                            unsigned long blocknr) {
+  struct baby_jentry *e;
+
+  hlist_for_each_entry(e, baby_jhash(j->j_hash, blocknr), e_hash) {
+    if (e->e_blocknr == blocknr)
+      return e;
+  }
+  return NULL;
+}
+
+static void baby_jentry_put_bh(struct baby_jentry *e) {
+  if (!e->e_bh)
+    return;
+  if (e->e_inode)
+    BABY_I(e->e_inode)->i_jbufs--;
+  brelse(e->e_bh);
+  e->e_bh = NULL;
+  e->e_inode = NULL;
+}
+
+// 从运行事务中拿掉，调用者持有 j_lock 或者 j_barrier 写锁
+static void baby_jentry_unrun(struct baby_journal *j, struct baby_jentry *e) {
+  if (!e->e_running)
+    return;
+  list_del_init(&e->e_list);
+  e->e_running = 0;
+  j->j_nr_running--;
+}
+
+static void baby_jentry_free(struct baby_journal *j, struct baby_jentry *e) {
+  baby_jentry_unrun(j, e);
+  baby_jentry_put_bh(e);
+  hlist_del(&e->e_hash);
+  kfree(e->e_frozen);
+  kfree(e);
+}
+
+static void baby_jio_init(struct baby_jio *io) {
+  atomic_set(&io->pending, 1);
+  io->err = 0;
+  init_completion(&io->done);
+}
+
+static void baby_jio_end_io(struct bio *bio) {
+  struct baby_jio *io = bio->bi_private;
+
+  if (bio->bi_status)
+    io->err = -EIO;
+  bio_put(bio);
+  if (atomic_dec_and_test(&io->pending))
+    complete(&io->done);
+}
+
+static int baby_jio_wait(struct baby_jio *io) {
+  if (!atomic_dec_and_test(&io->pending))
+    wait_for_completion(&io->done);
+  return io->err;
+}
+
+// 绕过缓存把一块内容写到原位置，缓存里的 buffer 可能已经有未提交的修改
+static void baby_journal_write_home(struct baby_journal *j, struct baby_jio *io,
+                                    unsigned long blocknr, struct page *page,
+                                    unsigned int offset) {
+  struct bio *bio = bio_alloc(GFP_NOFS, 1);
+
+  bio_set_dev(bio, j->j_sb->s_bdev);
+  bio->bi_iter.bi_sector = blocknr * (BABYFS_BLOCK_SIZE >> 9);
+  bio->bi_opf = REQ_OP_WRITE | REQ_SYNC;
+  bio->bi_write_hint = WRITE_LIFE_SHORT; // 元数据改动频繁，算作热数据
+  bio_add_page(bio, page, BABYFS_BLOCK_SIZE, offset);
+  bio->bi_private = io;
+  bio->bi_end_io = baby_jio_end_io;
+  atomic_inc(&io->pending);
+  submit_bio(bio);
+}
+
+static void baby_journal_submit(struct buffer_head *bh, int op_flags) {
+  lock_buffer(bh);
+  set_buffer_uptodate(bh);
+  get_bh(bh);
+  bh->b_end_io = end_buffer_write_sync;
+  submit_bh(REQ_OP_WRITE, op_flags, bh);
+}
+
+static int baby_journal_write_super(struct baby_journal *j) {
+  struct buffer_head *bh = sb_bread(j->j_sb, j->j_first);
+  struct baby_journal_super *jsb;
+  int err;
+
+  if (!bh)
+    return -EIO;
+  jsb = (struct baby_journal_super *)bh->b_data;
+  jsb->js_start = cpu_to_le32(j->j_tail);
+  jsb->js_sequence = cpu_to_le32(j->j_tail_sequence);
+  mark_buffer_dirty(bh);
+  err = __sync_dirty_buffer(bh, REQ_SYNC | REQ_FUA);
+  brelse(bh);
+  return err;
+}
+
+// 一个事务在日志里占用的块数：描述块 + 数据块 + 撤销块 + 提交块
+static unsigned long baby_journal_txn_blocks(unsigned long nbufs,
+                                             unsigned long nrevoke) {
+  return DIV_ROUND_UP(nbufs, BABYFS_JOURNAL_TAGS_PER_BLOCK) + nbufs +
+         DIV_ROUND_UP(nrevoke, BABYFS_JOURNAL_TAGS_PER_BLOCK) + 1;
+}
+
+static struct buffer_head *baby_journal_getblk(struct baby_journal *j,
+                                               unsigned long pos) {
+  struct buffer_head *bh = sb_getblk(j->j_sb, j->j_first + pos);
+
+  if (bh)
+    memset(bh->b_data, 0, BABYFS_BLOCK_SIZE);
+  return bh;
+}
+
+static void baby_journal_init_header(struct buffer_head *bh, int type, u32 tid) {
+  struct baby_journal_header *h = (struct baby_journal_header *)bh->b_data;
+
+  h->jh_magic = cpu_to_le32(BABYFS_JOURNAL_MAGIC);
+  h->jh_type = cpu_to_le32(type);
+  h->jh_sequence = cpu_to_le32(tid);
+  h->jh_count = 0;
+}
+
+// 在描述块或撤销块里追加一个块号
+static void baby_journal_add_tag(struct buffer_head *bh, unsigned long blocknr) {
+  struct baby_journal_header *h = (struct baby_journal_header *)bh->b_data;
+  __le32 *tags = (__le32 *)(h + 1);
+
+  tags[le32_to_cpu(h->jh_count)] = cpu_to_le32(blocknr);
+  le32_add_cpu(&h->jh_count, 1);
+}
+
+static int baby_journal_tags_full(struct buffer_head *bh) {
+  struct baby_journal_header *h = (struct baby_journal_header *)bh->b_data;
+
+  return le32_to_cpu(h->jh_count) == BABYFS_JOURNAL_TAGS_PER_BLOCK;
+}
+
+/*
+ * 检查点：把所有已提交块的冻结副本写回原位置，然后清空日志
+ * 调用者持有 j_commit_mutex 和 j_barrier 写锁
+ */
+static int __baby_journal_checkpoint(struct baby_journal *j) {
+  struct baby_jentry *e;
+  struct hlist_node *tmp;
+  struct baby_jio io;
+  struct blk_plug plug;
+  int i, err;
+
+  if (j->j_errno)
+    return j->j_errno;
+  baby_jio_init(&io);
+  blk_start_plug(&plug);
+  for (i = 0; i < ARRAY_SIZE(j->j_hash); i++) {
+    hlist_for_each_entry(e, &j->j_hash[i], e_hash) {
+      if (e->e_frozen)
+        baby_journal_write_home(j, &io, e->e_blocknr,
+                                virt_to_page(e->e_frozen),
+                                offset_in_page(e->e_frozen));
+    }
+  }
+  blk_finish_plug(&plug);
+  err = baby_jio_wait(&io);
+  if (!err)
+    err = blkdev_issue_flush(j->j_sb->s_bdev, GFP_NOFS, NULL);
+  // 没有写回原位置的块在日志里也没法覆盖了
+  if (err) {
+    printk(KERN_ERR "babyfs: journal checkpoint failed, err %d\n", err);
+    baby_journal_abort(j, err);
+    return err;
+  }
+
+  for (i = 0; i < ARRAY_SIZE(j->j_hash); i++) {
+    hlist_for_each_entry_safe(e, tmp, &j->j_hash[i], e_hash) {
+      kfree(e->e_frozen);
+      e->e_frozen = NULL;
+      e->e_logged = 0;
+      if (!e->e_running)
+        baby_jentry_free(j, e);
+    }
+  }
+  j->j_head = 1;
+  j->j_tail = 0;
+  j->j_tail_sequence = j->j_running_tid;
+  return baby_journal_write_super(j);
+}
+
+// 提交运行事务，调用者持有 j_commit_mutex
+static int baby_journal_do_commit(struct baby_journal *j) {
+  struct baby_jentry *e, *tmp;
+  struct baby_jrevoke *r, *rtmp;
+  struct buffer_head **bhs, *bh, *desc = NULL;
+  struct baby_journal_commit *c;
+  unsigned long need, start, pos, nbufs, i, n = 0;
+  u32 tid, crc = ~0;
+  char *src;
+  int err = 0;
+
+  if (j->j_errno)
+    return j->j_errno;
+  down_write(&j->j_barrier);
+  nbufs = j->j_nr_running;
+  if (!nbufs && !j->j_nr_revoke)
+    goto out_unlock;
+  need = baby_journal_txn_blocks(nbufs, j->j_nr_revoke);
+  // handle 的预留保证了事务不会超过 j_max_txn 太多，写不下是预留的估计错了
+  if (need > j->j_blocks - 1) {
+    printk(KERN_ERR "babyfs: transaction %u too large for journal, "
+           "%lu blocks\n", j->j_running_tid, need);
+    err = -ENOSPC;
+    baby_journal_abort(j, err);
+    goto out_unlock;
+  }
+  if (j->j_head + need > j->j_blocks) {
+    err = __baby_journal_checkpoint(j);
+    if (err)
+      goto out_unlock;
+  }
+  bhs = kvmalloc_array(need, sizeof(*bhs), GFP_NOFS);
+  if (!bhs) {
+    err = -ENOMEM;
+    goto out_unlock;
+  }
+
+  tid = j->j_running_tid;
+  start = pos = j->j_head;
+  // 没有进行中的 handle，运行事务里的块内容是一致的，拷贝进日志块
+  list_for_each_entry_safe(e, tmp, &j->j_running, e_list) {
+    if (!desc || baby_journal_tags_full(desc)) {
+      desc = baby_journal_getblk(j, pos++);
+      baby_journal_init_header(desc, BABYFS_JOURNAL_DESCRIPTOR, tid);
+      bhs[n++] = desc;
+    }
+    baby_journal_add_tag(desc, e->e_blocknr);
+    bh = baby_journal_getblk(j, pos++);
+    src = kmap_atomic(e->e_bh->b_page);
+    memcpy(bh->b_data, src + bh_offset(e->e_bh), BABYFS_BLOCK_SIZE);
+    kunmap_atomic(src);
+    crc = crc32_le(crc, bh->b_data, BABYFS_BLOCK_SIZE);
+    bhs[n++] = bh;
+
+    if (!e->e_frozen)
+      e->e_frozen = kmalloc(BABYFS_BLOCK_SIZE, GFP_NOFS | __GFP_NOFAIL);
+    memcpy(e->e_frozen, bh->b_data, BABYFS_BLOCK_SIZE);
+    e->e_logged = 1;
+    baby_jentry_unrun(j, e);
+  }
+  desc = NULL;
+  list_for_each_entry_safe(r, rtmp, &j->j_revoke, r_list) {
+    if (!desc || baby_journal_tags_full(desc)) {
+      desc = baby_journal_getblk(j, pos++);
+      baby_journal_init_header(desc, BABYFS_JOURNAL_REVOKE, tid);
+      bhs[n++] = desc;
+    }
+    baby_journal_add_tag(desc, r->r_blocknr);
+    list_del(&r->r_list);
+    kfree(r);
+  }
+  bh = baby_journal_getblk(j, pos++);
+  baby_journal_init_header(bh, BABYFS_JOURNAL_COMMIT, tid);
+  c = (struct baby_journal_commit *)bh->b_data;
+  c->jc_header.jh_count = cpu_to_le32(nbufs);
+  c->jc_checksum = cpu_to_le32(crc);
+  bhs[n++] = bh;
+
+  j->j_nr_revoke = 0;
+  j->j_running_tid++;
+  j->j_head = pos;
+  up_write(&j->j_barrier);
+
+  // 日志原来是空的，先在日志超级块里记下回放的起点
+  if (!j->j_tail) {
+    j->j_tail = start;
+    j->j_tail_sequence = tid;
+    err = baby_journal_write_super(j);
+  }
+  for (i = 0; i + 1 < n; i++)
+    baby_journal_submit(bhs[i], REQ_SYNC);
+  /*
+   * 这个事务里分配的数据块在 handle 结束之前都已经提交了 I/O，等它们写完，
+   * 提交块的 PREFLUSH 把它们和日志块一起刷到介质上
+   */
+  wait_event(j->j_ordered_wait, !atomic_read(&j->j_ordered[tid & 1]));
+  for (i = 0; i + 1 < n; i++) {
+    wait_on_buffer(bhs[i]);
+    if (!buffer_uptodate(bhs[i]))
+      err = -EIO;
+  }
+  // 提交块之前刷新磁盘缓存，提交块落盘时整个事务都已经落盘
+  if (!err) {
+    baby_journal_submit(bhs[n - 1], REQ_SYNC | REQ_PREFLUSH | REQ_FUA);
+    wait_on_buffer(bhs[n - 1]);
+    if (!buffer_uptodate(bhs[n - 1]))
+      err = -EIO;
+  }
+  for (i = 0; i < n; i++)
+    brelse(bhs[i]);
+  kvfree(bhs);
+
+  /*
+   * 这个事务的块已经标记为写进过日志，冻结副本也换成了它的内容，
+   * 检查点会把没有提交的事务写回原位置，只能中止日志
+   */
+  if (err) {
+    printk(KERN_ERR "babyfs: journal commit %u failed, err %d\n", tid, err);
+    baby_journal_abort(j, err);
+  } else {
+    j->j_commit_tid = tid;
+  }
+  return err;
+
+out_unlock:
+  up_write(&j->j_barrier);
+  return err;
+}
+
+// 保证序号为 tid 的事务已经提交，同时在等待的 fsync 会合并进同一次提交
+static int baby_journal_commit_tid(struct baby_journal *j, u32 tid) {
+  int err = 0;
+
+  mutex_lock(&j->j_commit_mutex);
+  if (!tid_geq(j->j_commit_tid, tid))
+    err = baby_journal_do_commit(j);
+  mutex_unlock(&j->j_commit_mutex);
+  return err;
+}
+
+static void baby_journal_commit_work(struct work_struct *work) {
+  struct baby_journal *j =
+      container_of(to_delayed_work(work), struct baby_journal, j_commit_work);
+
+  mutex_lock(&j->j_commit_mutex);
+  baby_journal_do_commit(j);
+  mutex_unlock(&j->j_commit_mutex);
+}
+
+// 运行事务放得下 credits 块时预留下来，否则返回 0
+static int baby_journal_reserve(struct baby_journal *j, unsigned long credits) {
+  int ok;
+
+  spin_lock(&j->j_lock);
+  ok = j->j_nr_running + j->j_nr_revoke + j->j_reserved + credits <=
+       j->j_max_txn;
+  if (ok)
+    j->j_reserved += credits;
+  spin_unlock(&j->j_lock);
+  return ok;
+}
+
+/*
+ * 开始一个 handle，handle 结束之前的元数据修改属于同一个事务
+ * credits 是这个 handle 最多修改的元数据块数（包括撤销记录），运行事务放不下时
+ * 先提交；超过 j_max_txn 时只能预留 j_max_txn，事务会超出一些，日志区留有余量
+ * 可以嵌套，内层直接复用外层的 handle，外层的预留要包括内层的修改；没有日志时返回 NULL
+ */
+struct baby_handle *baby_journal_start(struct super_block *sb,
+                                       unsigned long credits) {
+  struct baby_journal *j = BABY_SB(sb)->s_journal;
+  struct baby_handle *handle = current->journal_info;
+  u32 tid;
+
+  if (!j)
+    return NULL;
+  // journal_info 也可能属于别的文件系统，它们的 handle 第一个成员同样是指针
+  if (handle && handle->h_journal == j) {
+    handle->h_ref++;
+    return handle;
+  }
+  if (READ_ONCE(j->j_errno))
+    return ERR_PTR(-EIO);
+  if (WARN_ON_ONCE(sb_rdonly(sb)))
+    return ERR_PTR(-EROFS);
+  handle = kmalloc(sizeof(*handle), GFP_NOFS);
+  if (!handle)
+    return ERR_PTR(-ENOMEM);
+  credits = min(credits, j->j_max_txn);
+  /*
+   * 提交要等进行中的 handle 结束，它们的预留随之放掉；
+   * 还没开始的 handle 不持有 j_barrier，在这里等不会死锁
+   */
+  while (!baby_journal_reserve(j, credits)) {
+    tid = READ_ONCE(j->j_running_tid);
+    if (baby_journal_commit_tid(j, tid) && READ_ONCE(j->j_errno)) {
+      kfree(handle);
+      return ERR_PTR(-EIO);
+    }
+  }
+  handle->h_journal = j;
+  handle->h_saved = current->journal_info;
+  handle->h_ref = 1;
+  handle->h_sync = 0;
+  handle->h_credits = credits;
+  handle->h_ordered = 0;
+  down_read(&j->j_barrier);
+  handle->h_tid = j->j_running_tid;
+  // handle 里分配内存不能回收本文件系统的 inode，否则会在 j_barrier 上死锁
+  handle->h_nofs = memalloc_nofs_save();
+  current->journal_info = handle;
+  return handle;
+}
+
+void baby_journal_stop(struct baby_handle *handle) {
+  struct baby_journal *j;
+  int commit;
+  u32 tid;
+
+  if (IS_ERR_OR_NULL(handle) || --handle->h_ref)
+    return;
+  j = handle->h_journal;
+  current->journal_info = handle->h_saved;
+  memalloc_nofs_restore(handle->h_nofs);
+  tid = j->j_running_tid;
+  spin_lock(&j->j_lock);
+  j->j_reserved -= handle->h_credits;
+  commit = handle->h_sync || j->j_nr_running + j->j_nr_revoke >= j->j_max_txn;
+  spin_unlock(&j->j_lock);
+  up_read(&j->j_barrier);
+  kfree(handle);
+  if (commit)
+    baby_journal_commit_tid(j, tid);
+}
+
+/*
+ * 运行事务多了一块，从当前 handle 的预留里扣掉，调用者持有 j_lock
+ * 预留用完了说明估计少了，事务可能超过 j_max_txn，只警告一次
+ */
+static void baby_journal_charge(struct baby_journal *j) {
+  struct baby_handle *handle = current->journal_info;
+
+  if (!handle || handle->h_journal != j)
+    return;
+  if (handle->h_credits) {
+    handle->h_credits--;
+    j->j_reserved--;
+  } else {
+    WARN_ONCE(1, "babyfs: journal handle ran out of credits\n");
+  }
+}
+
+// 当前 handle 里分配了普通文件的数据块，之后这个 handle 里提交的数据 I/O 是 ordered 的
+void baby_journal_set_ordered(struct super_block *sb) {
+  struct baby_handle *handle = current->journal_info;
+
+  if (handle && handle->h_journal == BABY_SB(sb)->s_journal)
+    handle->h_ordered = 1;
+}
+
+/*
+ * 提交数据 I/O 之前调用，当前 handle 分配过数据块时计数并返回 1，
+ * tid 返回给 I/O 完成时的 baby_journal_end_ordered
+ */
+int baby_journal_start_ordered(struct super_block *sb, u32 *tid) {
+  struct baby_journal *j = BABY_SB(sb)->s_journal;
+  struct baby_handle *handle = current->journal_info;
+
+  if (!j || !handle || handle->h_journal != j || !handle->h_ordered)
+    return 0;
+  atomic_inc(&j->j_ordered[handle->h_tid & 1]);
+  *tid = handle->h_tid;
+  return 1;
+}
+
+// ordered 数据 I/O 完成，可以在中断上下文里调用
+void baby_journal_end_ordered(struct super_block *sb, u32 tid) {
+  struct baby_journal *j = BABY_SB(sb)->s_journal;
+
+  if (atomic_dec_and_test(&j->j_ordered[tid & 1]))
+    wake_up(&j->j_ordered_wait);
+}
+
+// 一个 handle 最多能预留的块数，没有日志时不限制
+unsigned long baby_journal_max_credits(struct super_block *sb) {
+  struct baby_journal *j = BABY_SB(sb)->s_journal;
+
+  return j ? j->j_max_txn : ULONG_MAX;
+}
+
+// 目录同步等场景，handle 结束时同步提交事务
+void baby_journal_set_sync(struct baby_handle *handle) {
+  if (!IS_ERR_OR_NULL(handle))
+    handle->h_sync = 1;
+}
+
+/*
+ * 元数据块修改完成后调用，必须在 handle 里
+ * 没有日志时按原来的方式标记为脏，inode 不为空时关联到 inode 上
+ */
+void baby_journal_dirty(struct super_block *sb, struct inode *inode,
+                        struct buffer_head *bh) {
+  struct baby_journal *j = BABY_SB(sb)->s_journal;
+  struct baby_jentry *e, *new = NULL;
+  struct baby_jrevoke *r;
+  struct inode *owner = bh->b_page->mapping->host;
+  int added = 0;
+
+  if (!j) {
+    if (inode)
+      mark_buffer_dirty_inode(bh, inode);
+    else
+      mark_buffer_dirty(bh);
+    return;
+  }
+  // 日志已经中止，修改不会再提交
+  if (READ_ONCE(j->j_errno))
+    return;
+  WARN_ON_ONCE(!current->journal_info);
+  if (owner == sb->s_bdev->bd_inode)
+    owner = NULL;
+  if (inode)
+    BABY_I(inode)->i_sync_tid = j->j_running_tid;
+
+retry:
+  spin_lock(&j->j_lock);
+  e = baby_jentry_find(j, bh->b_blocknr);
+  if (!e) {
+    if (!new) {
+      spin_unlock(&j->j_lock);
+      new = kzalloc(sizeof(*new), GFP_NOFS | __GFP_NOFAIL);
+      goto retry;
+    }
+    e = new;
+    new = NULL;
+    e->e_blocknr = bh->b_blocknr;
+    INIT_LIST_HEAD(&e->e_list);
+    hlist_add_head(&e->e_hash, baby_jhash(j->j_hash, e->e_blocknr));
+  }
+  if (e->e_bh != bh) {
+    WARN_ON_ONCE(e->e_bh);
+    baby_jentry_put_bh(e);
+    get_bh(bh);
+    e->e_bh = bh;
+    e->e_inode = owner;
+    if (owner)
+      BABY_I(owner)->i_jbufs++;
+  }
+  if (!e->e_running) {
+    e->e_running = 1;
+    list_add_tail(&e->e_list, &j->j_running);
+    j->j_nr_running++;
+    baby_journal_charge(j);
+    added = 1;
+    // 同一个事务里释放后又重新用作元数据的块，之前的撤销记录作废
+    list_for_each_entry(r, &j->j_revoke, r_list) {
+      if (r->r_blocknr == e->e_blocknr) {
+        list_del(&r->r_list);
+        kfree(r);
+        j->j_nr_revoke--;
+        break;
+      }
+    }
+  }
+  spin_unlock(&j->j_lock);
+  kfree(new);
+  if (added)
+    schedule_delayed_work(&j->j_commit_work, BABY_JOURNAL_COMMIT_INTERVAL);
+}
+
+/*
+ * 块被释放，在 handle 里调用
+ * 不再需要把它写回原位置；写进过日志的块还要记一条撤销记录
+ */
+void baby_journal_forget(struct super_block *sb, unsigned long block,
+                         unsigned long count) {
+  struct baby_journal *j = BABY_SB(sb)->s_journal;
+  struct baby_jentry *e;
+  struct baby_jrevoke *r;
+  int logged;
+
+  if (!j)
+    return;
+  for (; count; block++, count--) {
+    spin_lock(&j->j_lock);
+    e = baby_jentry_find(j, block);
+    logged = e && e->e_logged;
+    if (e)
+      baby_jentry_free(j, e);
+    spin_unlock(&j->j_lock);
+    if (!logged)
+      continue;
+
+    r = kmalloc(sizeof(*r), GFP_NOFS | __GFP_NOFAIL);
+    r->r_blocknr = block;
+    spin_lock(&j->j_lock);
+    list_add_tail(&r->r_list, &j->j_revoke);
+    j->j_nr_revoke++;
+    baby_journal_charge(j);
+    spin_unlock(&j->j_lock);
+    schedule_delayed_work(&j->j_commit_work, BABY_JOURNAL_COMMIT_INTERVAL);
+  }
+}
+
+/*
+ * 目录 inode 被回收之前调用，放掉日志持有的目录页 buffer，页缓存才能被清空
+ * deleted: 目录已经删除，它的块马上会被释放，直接丢掉
+ * 否则目录只是被挤出 inode 缓存：先提交事务，再把这些块已提交的内容写回原位置，
+ * 之后重新读入的才是最新内容
+ */
+void baby_journal_evict_inode(struct inode *inode, int deleted) {
+  struct baby_journal *j = BABY_SB(inode->i_sb)->s_journal;
+  struct baby_inode_info *bbi = BABY_I(inode);
+  struct baby_jentry *e, *etmp;
+  struct hlist_node *tmp;
+  struct baby_jio io;
+  LIST_HEAD(home);
+  int i;
+
+  if (!j || !bbi->i_jbufs)
+    return;
+  if (deleted) {
+    spin_lock(&j->j_lock);
+    for (i = 0; i < ARRAY_SIZE(j->j_hash); i++) {
+      hlist_for_each_entry_safe(e, tmp, &j->j_hash[i], e_hash) {
+        if (e->e_inode != inode)
+          continue;
+        baby_jentry_unrun(j, e);
+        baby_jentry_put_bh(e);
+        if (!e->e_logged)
+          baby_jentry_free(j, e);
+      }
+    }
+    spin_unlock(&j->j_lock);
+    return;
+  }
+
+  baby_journal_commit_tid(j, bbi->i_sync_tid);
+  mutex_lock(&j->j_commit_mutex);
+  spin_lock(&j->j_lock);
+  for (i = 0; i < ARRAY_SIZE(j->j_hash); i++) {
+    hlist_for_each_entry(e, &j->j_hash[i], e_hash) {
+      if (e->e_inode == inode && !e->e_running)
+        list_add_tail(&e->e_list, &home);
+    }
+  }
+  spin_unlock(&j->j_lock);
+
+  // 日志中止之后冻结副本不一定提交过，不能写回原位置
+  baby_jio_init(&io);
+  list_for_each_entry(e, &home, e_list) {
+    if (e->e_frozen && !j->j_errno)
+      baby_journal_write_home(j, &io, e->e_blocknr, virt_to_page(e->e_frozen),
+                              offset_in_page(e->e_frozen));
+  }
+  if (baby_jio_wait(&io))
+    printk(KERN_ERR "babyfs: write back dir %lu blocks failed\n", inode->i_ino);
+
+  spin_lock(&j->j_lock);
+  list_for_each_entry_safe(e, etmp, &home, e_list) {
+    list_del_init(&e->e_list);
+    kfree(e->e_frozen);
+    e->e_frozen = NULL;
+    baby_jentry_put_bh(e);
+  }
+  spin_unlock(&j->j_lock);
+  mutex_unlock(&j->j_commit_mutex);
+}
+
+// fsync：提交包含这个 inode 最近修改的事务，返回 1 表示写了日志
+int baby_journal_commit_inode(struct inode *inode) {
+  struct baby_journal *j = BABY_SB(inode->i_sb)->s_journal;
+  u32 tid = BABY_I(inode)->i_sync_tid;
+  int err;
+
+  if (!j || tid_geq(j->j_commit_tid, tid))
+    return 0;
+  err = baby_journal_commit_tid(j, tid);
+  return err ? err : 1;
+}
+
+int baby_journal_sync(struct super_block *sb) {
+  struct baby_journal *j = BABY_SB(sb)->s_journal;
+
+  if (!j)
+    return 0;
+  return baby_journal_commit_tid(j, j->j_running_tid);
+}
+
+// 运行事务的序号，这时做的修改在这个事务提交之后才持久化；没有日志时返回 0
+u32 baby_journal_current_tid(struct super_block *sb) {
+  struct baby_journal *j = BABY_SB(sb)->s_journal;
+
+  return j ? j->j_running_tid : 0;
+}
+
+// 保证序号为 tid 的事务已经提交，已经提交时直接返回
+int baby_journal_wait_tid(struct super_block *sb, u32 tid) {
+  struct baby_journal *j = BABY_SB(sb)->s_journal;
+
+  if (!j || tid_geq(j->j_commit_tid, tid))
+    return 0;
+  return baby_journal_commit_tid(j, tid);
+}
+
+static struct baby_jrevoke *baby_jrevoke_find(struct hlist_head *table,
+                                              unsigned long blocknr) {
+  struct baby_jrevoke *r;
+
+  hlist_for_each_entry(r, baby_jhash(table, blocknr), r_hash) {
+    if (r->r_blocknr == blocknr)
+      return r;
+  }
+  return NULL;
+}
+
+static void baby_jrevoke_table_free(struct hlist_head *table) {
+  struct baby_jrevoke *r;
+  struct hlist_node *tmp;
+  int i;
+
+  for (i = 0; i < (1 << BABY_JOURNAL_HASH_BITS); i++) {
+    hlist_for_each_entry_safe(r, tmp, &table[i], r_hash) {
+      hlist_del(&r->r_hash);
+      kfree(r);
+    }
+  }
+  kfree(table);
+}
+
+/*
+ * 扫描一遍日志：校验每个事务，找到最后一个完整提交的事务，收集撤销记录
+ * 返回最后一个提交事务的下一个序号
+ */
+static int baby_journal_scan(struct baby_journal *j, struct hlist_head *revokes,
+                             u32 *end_tid) {
+  struct super_block *sb = j->j_sb;
+  struct buffer_head *bh, *dbh;
+  struct baby_journal_header *h;
+  struct baby_journal_commit *c;
+  struct baby_jrevoke *r, *tmp;
+  LIST_HEAD(pending);
+  unsigned long pos = j->j_tail, nblocks = 0, count, i;
+  u32 seq = j->j_tail_sequence, crc = ~0;
+  __le32 *tags;
+  int err = 0;
+
+  while (pos < j->j_blocks) {
+    bh = sb_bread(sb, j->j_first + pos);
+    if (!bh) {
+      err = -EIO;
+      break;
+    }
+    h = (struct baby_journal_header *)bh->b_data;
+    tags = (__le32 *)(h + 1);
+    count = le32_to_cpu(h->jh_count);
+    if (le32_to_cpu(h->jh_magic) != BABYFS_JOURNAL_MAGIC ||
+        le32_to_cpu(h->jh_sequence) != seq) {
+      brelse(bh);
+      break;
+    }
+    switch (le32_to_cpu(h->jh_type)) {
+    case BABYFS_JOURNAL_DESCRIPTOR:
+      if (count > BABYFS_JOURNAL_TAGS_PER_BLOCK ||
+          pos + 1 + count > j->j_blocks)
+        goto stop;
+      for (i = 0; i < count; i++) {
+        dbh = sb_bread(sb, j->j_first + pos + 1 + i);
+        if (!dbh) {
+          err = -EIO;
+          goto stop;
+        }
+        crc = crc32_le(crc, dbh->b_data, BABYFS_BLOCK_SIZE);
+        brelse(dbh);
+      }
+      nblocks += count;
+      pos += 1 + count;
+      break;
+    case BABYFS_JOURNAL_REVOKE:
+      if (count > BABYFS_JOURNAL_TAGS_PER_BLOCK)
+        goto stop;
+      for (i = 0; i < count; i++) {
+        r = kmalloc(sizeof(*r), GFP_KERNEL);
+        if (!r) {
+          err = -ENOMEM;
+          goto stop;
+        }
+        r->r_blocknr = le32_to_cpu(tags[i]);
+        r->r_sequence = seq;
+        list_add_tail(&r->r_list, &pending);
+      }
+      pos++;
+      break;
+    case BABYFS_JOURNAL_COMMIT:
+      c = (struct baby_journal_commit *)h;
+      if (count != nblocks || le32_to_cpu(c->jc_checksum) != crc)
+        goto stop;
+      // 事务完整，它的撤销记录生效，同一个块保留最新的序号
+      list_for_each_entry_safe(r, tmp, &pending, r_list) {
+        struct baby_jrevoke *old = baby_jrevoke_find(revokes, r->r_blocknr);
+
+        list_del(&r->r_list);
+        if (old) {
+          old->r_sequence = seq;
+          kfree(r);
+        } else {
+          hlist_add_head(&r->r_hash, baby_jhash(revokes, r->r_blocknr));
+        }
+      }
+      seq++;
+      crc = ~0;
+      nblocks = 0;
+      pos++;
+      break;
+    default:
+      goto stop;
+    }
+    brelse(bh);
+    continue;
+stop:
+    brelse(bh);
+    break;
+  }
+
+  list_for_each_entry_safe(r, tmp, &pending, r_list) {
+    list_del(&r->r_list);
+    kfree(r);
+  }
+  *end_tid = seq;
+  return err;
+}
+
+// 把 [j_tail_sequence, end_tid) 之间已提交事务里的块写回原位置
+static int baby_journal_replay(struct baby_journal *j,
+                               struct hlist_head *revokes, u32 end_tid) {
+  struct super_block *sb = j->j_sb;
+  struct buffer_head *bh, *dbh, *home;
+  struct baby_journal_header *h;
+  struct baby_jrevoke *r;
+  unsigned long pos = j->j_tail, blocknr, count, i;
+  u32 seq = j->j_tail_sequence;
+  __le32 *tags;
+
+  while (seq != end_tid) {
+    bh = sb_bread(sb, j->j_first + pos);
+    if (!bh)
+      return -EIO;
+    h = (struct baby_journal_header *)bh->b_data;
+    tags = (__le32 *)(h + 1);
+    count = le32_to_cpu(h->jh_count);
+    switch (le32_to_cpu(h->jh_type)) {
+    case BABYFS_JOURNAL_DESCRIPTOR:
+      for (i = 0; i < count; i++) {
+        blocknr = le32_to_cpu(tags[i]);
+        r = baby_jrevoke_find(revokes, blocknr);
+        // 块在之后（或者同一个）事务里被释放了，不能写回去
+        if (r && tid_geq(r->r_sequence, seq))
+          continue;
+        // zoned 设备上日志区在数据区中间，只排除日志区本身和设备末尾之后的块
+        if (blocknr <= BABYFS_SUPER_BLOCK || blocknr >= j->j_dev_blocks ||
+            (blocknr >= j->j_first && blocknr < j->j_first + j->j_blocks)) {
+          printk(KERN_ERR "babyfs: journal block %lu out of range\n", blocknr);
+          continue;
+        }
+        dbh = sb_bread(sb, j->j_first + pos + 1 + i);
+        home = sb_getblk(sb, blocknr);
+        if (!dbh || !home) {
+          brelse(dbh);
+          brelse(home);
+          brelse(bh);
+          return -EIO;
+        }
+        lock_buffer(home);
+        memcpy(home->b_data, dbh->b_data, BABYFS_BLOCK_SIZE);
+        set_buffer_uptodate(home);
+        unlock_buffer(home);
+        mark_buffer_dirty(home);
+        brelse(home);
+        brelse(dbh);
+      }
+      pos += 1 + count;
+      break;
+    case BABYFS_JOURNAL_REVOKE:
+      pos++;
+      break;
+    case BABYFS_JOURNAL_COMMIT:
+      seq++;
+      pos++;
+      break;
+    }
+    brelse(bh);
+  }
+  return sync_blockdev(sb->s_bdev);
+}
+
+static int baby_journal_recover(struct baby_journal *j) {
+  struct hlist_head *revokes;
+  u32 end_tid;
+  int err;
+
+  revokes = kcalloc(1 << BABY_JOURNAL_HASH_BITS, sizeof(*revokes), GFP_KERNEL);
+  if (!revokes)
+    return -ENOMEM;
+  err = baby_journal_scan(j, revokes, &end_tid);
+  if (!err)
+    err = baby_journal_replay(j, revokes, end_tid);
+  baby_jrevoke_table_free(revokes);
+  if (err)
+    return err;
+
+  printk(KERN_INFO "babyfs: replayed %u journal transactions\n",
+         end_tid - j->j_tail_sequence);
+  j->j_tail = 0;
+  j->j_tail_sequence = end_tid;
+  return baby_journal_write_super(j);
+}
+
+/*
+ * 挂载时调用：读日志超级块，有未检查点的事务就回放
+ * 上次没有正常卸载时重新统计空闲 inode，超级块里的计数不经过日志；空闲块由块组根据位图统计
+ */
+int baby_journal_load(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_super_block *raw_sb = sbi->s_babysb;
+  struct baby_journal_super *jsb;
+  struct baby_journal *j;
+  struct buffer_head *bh;
+  unsigned long data_end;
+  int i, err = -EINVAL;
+
+  j = kzalloc(sizeof(*j), GFP_KERNEL);
+  if (!j)
+    return -ENOMEM;
+  j->j_sb = sb;
+  j->j_first = le32_to_cpu(raw_sb->s_journal_start);
+  j->j_blocks = le32_to_cpu(raw_sb->s_journal_blocks);
+  j->j_dev_blocks = i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+  data_end = NR_DSTORE_BLOCKS + sbi->nr_blocks;
+  /*
+   * 日志区不能和超级块、位图、inode 表重叠，也不能超出设备；
+   * 通常在数据区之后，zoned 设备上在数据区开头（位图上已经标记为已用），不能跨过数据区的末尾
+   */
+  if (j->j_blocks < 8 || j->j_first < NR_DSTORE_BLOCKS ||
+      j->j_first + j->j_blocks > j->j_dev_blocks ||
+      (j->j_first < data_end && j->j_first + j->j_blocks > data_end)) {
+    printk(KERN_ERR "babyfs: bad journal location %lu+%lu\n", j->j_first,
+           j->j_blocks);
+    goto failed;
+  }
+  bh = sb_bread(sb, j->j_first);
+  if (!bh) {
+    err = -EIO;
+    goto failed;
+  }
+  jsb = (struct baby_journal_super *)bh->b_data;
+  if (le32_to_cpu(jsb->js_magic) != BABYFS_JOURNAL_MAGIC ||
+      le32_to_cpu(jsb->js_blocks) != j->j_blocks) {
+    printk(KERN_ERR "babyfs: bad journal superblock\n");
+    brelse(bh);
+    goto failed;
+  }
+  j->j_tail = le32_to_cpu(jsb->js_start);
+  j->j_tail_sequence = le32_to_cpu(jsb->js_sequence);
+  brelse(bh);
+
+  init_rwsem(&j->j_barrier);
+  mutex_init(&j->j_commit_mutex);
+  spin_lock_init(&j->j_lock);
+  for (i = 0; i < ARRAY_SIZE(j->j_hash); i++)
+    INIT_HLIST_HEAD(&j->j_hash[i]);
+  INIT_LIST_HEAD(&j->j_running);
+  INIT_LIST_HEAD(&j->j_revoke);
+  INIT_DELAYED_WORK(&j->j_commit_work, baby_journal_commit_work);
+  atomic_set(&j->j_ordered[0], 0);
+  atomic_set(&j->j_ordered[1], 0);
+  init_waitqueue_head(&j->j_ordered_wait);
+
+  if (j->j_tail) {
+    // 只读挂载也要回放，否则读到的元数据不一致；设备只读时写不了，拒绝挂载
+    if (bdev_read_only(sb->s_bdev)) {
+      printk(KERN_ERR "babyfs: journal needs recovery but %s is read-only, "
+                      "mount it on a writable device first\n",
+             sb->s_id);
+      err = -EROFS;
+      goto failed;
+    }
+    if (sb_rdonly(sb))
+      printk(KERN_INFO "babyfs: replaying journal on read-only mount\n");
+    err = baby_journal_recover(j);
+    if (err) {
+      printk(KERN_ERR "babyfs: journal recovery failed, err %d\n", err);
+      goto failed;
+    }
+  }
+  j->j_head = 1;
+  j->j_running_tid = j->j_tail_sequence;
+  j->j_commit_tid = j->j_running_tid - 1;
+  j->j_max_txn = (j->j_blocks - 1) / 4;
+
+  if (BABY_HAS_INCOMPAT_FEATURE(sb, BABYFS_FEATURE_INCOMPAT_RECOVER)) {
+    percpu_counter_set(&sbi->s_freeinodes_counter,
+                       baby_count_free_inodes(sb));
+  }
+  sbi->s_journal = j;
+  // 只读挂载不写超级块，重新挂载为读写时再设置
+  if (!sb_rdonly(sb))
+    baby_journal_set_recover(sb);
+  return 0;
+
+failed:
+  kfree(j);
+  return err;
+}
+
+// 挂载期间日志可能不为空，设置 RECOVER 标志并写回超级块，旧内核看到这一位就不会挂载
+void baby_journal_set_recover(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+
+  sbi->s_babysb->feature_incompat |=
+      cpu_to_le32(BABYFS_FEATURE_INCOMPAT_RECOVER);
+  mark_buffer_dirty(sbi->s_sbh);
+  sync_dirty_buffer(sbi->s_sbh);
+}
+
+/*
+ * 重新挂载为只读时调用：提交运行事务，做检查点，日志清空之后清除 RECOVER 标志，
+ * 超级块由调用者写回。日志留着，重新挂载为读写时继续使用
+ */
+int baby_journal_flush(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_journal *j = sbi->s_journal;
+  int err;
+
+  if (!j)
+    return 0;
+  cancel_delayed_work_sync(&j->j_commit_work);
+  mutex_lock(&j->j_commit_mutex);
+  err = baby_journal_do_commit(j);
+  down_write(&j->j_barrier);
+  if (!err)
+    err = __baby_journal_checkpoint(j);
+  up_write(&j->j_barrier);
+  mutex_unlock(&j->j_commit_mutex);
+  if (!err)
+    sbi->s_babysb->feature_incompat &=
+        ~cpu_to_le32(BABYFS_FEATURE_INCOMPAT_RECOVER);
+  return err;
+}
+
+// 卸载时调用：提交运行事务，做检查点，日志清空；只读挂载时日志已经是空的，不再写
+void baby_journal_release(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_journal *j = sbi->s_journal;
+  struct baby_jentry *e;
+  struct baby_jrevoke *r, *rtmp;
+  struct hlist_node *tmp;
+  int i, err = 0;
+
+  if (!j)
+    return;
+  cancel_delayed_work_sync(&j->j_commit_work);
+  mutex_lock(&j->j_commit_mutex);
+  if (!sb_rdonly(sb))
+    err = baby_journal_do_commit(j);
+  down_write(&j->j_barrier);
+  if (!err && !sb_rdonly(sb))
+    err = __baby_journal_checkpoint(j);
+  for (i = 0; i < ARRAY_SIZE(j->j_hash); i++) {
+    hlist_for_each_entry_safe(e, tmp, &j->j_hash[i], e_hash)
+      baby_jentry_free(j, e);
+  }
+  list_for_each_entry_safe(r, rtmp, &j->j_revoke, r_list) {
+    list_del(&r->r_list);
+    kfree(r);
+  }
+  up_write(&j->j_barrier);
+  mutex_unlock(&j->j_commit_mutex);
+
+  // 检查点成功，日志已经为空
+  if (!err && !sb_rdonly(sb))
+    sbi->s_babysb->feature_incompat &=
+        ~cpu_to_le32(BABYFS_FEATURE_INCOMPAT_RECOVER);
+  sbi->s_journal = NULL;
+  kfree(j);
+}
@@ -0,0 +1,439 @@
+#include <linux/fs.h>
+#include <linux/rbtree.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+
+#include "babyfs.h"
+
+/*
+ * 逻辑块到物理块的映射缓存
+ *
+ * 每个 inode 有一棵按逻辑块号排序的红黑树，记录已经查到或者刚分配的连续映射，
+ * baby_get_blocks 命中时直接返回，不再从 i_blocks 开始一级级读间接块或者区间树块
+ * 只缓存已经映射的块，空洞仍然要走一遍索引
+ *
+ * 块被释放（截断）时先释放块再删除缓存，同时 i_map_seq 加一：
+ * 查索引之前记下 i_map_seq，插入时发现变了说明中间发生过截断，查到的结果可能已经失效，不插入
+ *
+ * 有缓存的 inode 挂在超级块的 s_map_inodes 上，内存紧张时 shrinker 从链表头开始
+ * 整个 inode 地丢弃缓存，最近命中过的 inode 移到链表尾，给第二次机会
+ *
+ * 延迟分配的块记录在另一棵树 i_da_tree 上，节点结构相同、me_pblk 不用，
+ * 同样由 i_map_lock 保护；它决定回写时哪些没有映射的块需要分配，不是缓存，
+ * shrinker 不会回收，树里的块数总是等于 i_reserved_blocks
+ */
+
+struct baby_map_extent {
+  struct rb_node me_node;
+  unsigned long me_lblk; // 起始逻辑块号
+  unsigned long me_pblk; // 起始物理块号
+  unsigned long me_len;  // 块数
+};
+
+static struct kmem_cache *baby_map_cachep;
+
+// 包含 block 的映射，没有时返回 block 之后的第一个，再没有返回 NULL
+static struct baby_map_extent *baby_map_search(struct rb_root *root,
+                                               unsigned long block) {
+  struct rb_node *node = root->rb_node;
+  struct baby_map_extent *me, *after = NULL;
+
+  while (node) {
+    me = rb_entry(node, struct baby_map_extent, me_node);
+    if (block < me->me_lblk) {
+      after = me;
+      node = node->rb_left;
+    } else if (block >= me->me_lblk + me->me_len) {
+      node = node->rb_right;
+    } else {
+      return me;
+    }
+  }
+  return after;
+}
+
+static struct baby_map_extent *baby_map_next(struct baby_map_extent *me) {
+  struct rb_node *node = rb_next(&me->me_node);
+
+  return node ? rb_entry(node, struct baby_map_extent, me_node) : NULL;
+}
+
+static struct baby_map_extent *baby_map_prev(struct baby_map_extent *me) {
+  struct rb_node *node = rb_prev(&me->me_node);
+
+  return node ? rb_entry(node, struct baby_map_extent, me_node) : NULL;
+}
+
+static struct baby_map_extent *baby_map_last(struct rb_root *root) {
+  struct rb_node *node = rb_last(root);
+
+  return node ? rb_entry(node, struct baby_map_extent, me_node) : NULL;
+}
+
+// 插入一个和树中已有的节点都不重叠的节点
+static void baby_map_link(struct rb_root *root, struct baby_map_extent *new) {
+  struct rb_node **p = &root->rb_node, *parent = NULL;
+  struct baby_map_extent *me;
+
+  while (*p) {
+    parent = *p;
+    me = rb_entry(parent, struct baby_map_extent, me_node);
+    p = new->me_lblk < me->me_lblk ? &parent->rb_left : &parent->rb_right;
+  }
+  rb_link_node(&new->me_node, parent, p);
+  rb_insert_color(&new->me_node, root);
+}
+
+/*
+ * 查找 block 的映射，命中时返回从 block 开始连续映射的块数（不超过 max），没有命中返回 0
+ */
+unsigned long baby_map_cache_lookup(struct inode *inode, unsigned long block,
+                                    unsigned long max, unsigned long *pblk) {
+  struct baby_inode_info *bbi = BABY_I(inode);
+  struct baby_map_extent *me;
+  unsigned long len = 0;
+
+  if (RB_EMPTY_ROOT(&bbi->i_map_tree))
+    return 0;
+  read_lock(&bbi->i_map_lock);
+  me = baby_map_search(&bbi->i_map_tree, block);
+  if (me && me->me_lblk <= block) {
+    *pblk = me->me_pblk + block - me->me_lblk;
+    len = min(max, me->me_lblk + me->me_len - block);
+  }
+  read_unlock(&bbi->i_map_lock);
+  if (len && !READ_ONCE(bbi->i_map_referenced))
+    WRITE_ONCE(bbi->i_map_referenced, 1);
+  return len;
+}
+
+// 查索引之前调用，插入时用来判断这期间有没有发生截断
+unsigned int baby_map_cache_seq(struct inode *inode) {
+  return READ_ONCE(BABY_I(inode)->i_map_seq);
+}
+
+/*
+ * 删除 [start, end) 范围内的映射，跨过边界的只保留范围外的一边
+ * 返回删掉的节点数，调用者持有 i_map_lock
+ */
+static long __baby_map_cache_remove(struct baby_inode_info *bbi,
+                                    unsigned long start, unsigned long end) {
+  struct baby_map_extent *me, *next;
+  unsigned long me_end;
+  long freed = 0;
+
+  me = baby_map_search(&bbi->i_map_tree, start);
+  while (me && me->me_lblk < end) {
+    next = baby_map_next(me);
+    me_end = me->me_lblk + me->me_len;
+    if (me->me_lblk < start) {
+      // 范围在中间时右边一段也丢掉，缓存少一点不影响正确性
+      me->me_len = start - me->me_lblk;
+    } else if (me_end > end) {
+      me->me_pblk += end - me->me_lblk;
+      me->me_len = me_end - end;
+      me->me_lblk = end;
+    } else {
+      rb_erase(&me->me_node, &bbi->i_map_tree);
+      kmem_cache_free(baby_map_cachep, me);
+      freed++;
+    }
+    me = next;
+  }
+  return freed;
+}
+
+/*
+ * 缓存 [block, block + len) -> pblk，能和前后的映射连成一段时合并
+ */
+void baby_map_cache_insert(struct inode *inode, unsigned int seq,
+                           unsigned long block, unsigned long pblk,
+                           unsigned long len) {
+  struct baby_inode_info *bbi = BABY_I(inode);
+  struct baby_sb_info *sbi = BABY_SB(inode->i_sb);
+  struct baby_map_extent *new, *me, *left = NULL, *right = NULL;
+  long delta;
+
+  new = kmem_cache_alloc(baby_map_cachep, GFP_NOFS);
+  if (!new)
+    return;
+  write_lock(&bbi->i_map_lock);
+  if (bbi->i_map_seq != seq) {
+    write_unlock(&bbi->i_map_lock);
+    kmem_cache_free(baby_map_cachep, new);
+    return;
+  }
+  // 一般不会重叠，有的话以新的为准
+  delta = -__baby_map_cache_remove(bbi, block, block + len);
+
+  me = baby_map_search(&bbi->i_map_tree, block);
+  if (me) {
+    if (me->me_lblk == block + len && me->me_pblk == pblk + len)
+      right = me;
+    me = baby_map_prev(me);
+  } else {
+    me = baby_map_last(&bbi->i_map_tree);
+  }
+  if (me && me->me_lblk + me->me_len == block &&
+      me->me_pblk + me->me_len == pblk)
+    left = me;
+
+  if (left) {
+    left->me_len += len;
+    if (right) {
+      left->me_len += right->me_len;
+      rb_erase(&right->me_node, &bbi->i_map_tree);
+      kmem_cache_free(baby_map_cachep, right);
+      delta--;
+    }
+  } else if (right) {
+    right->me_lblk = block;
+    right->me_pblk = pblk;
+    right->me_len += len;
+  } else {
+    new->me_lblk = block;
+    new->me_pblk = pblk;
+    new->me_len = len;
+    baby_map_link(&bbi->i_map_tree, new);
+    new = NULL;
+    delta++;
+  }
+  write_unlock(&bbi->i_map_lock);
+  if (new)
+    kmem_cache_free(baby_map_cachep, new);
+  if (delta)
+    atomic_long_add(delta, &sbi->s_map_nr);
+
+  // 第一次有缓存时挂到超级块的链表上，让 shrinker 能找到
+  if (list_empty(&bbi->i_map_list)) {
+    spin_lock(&sbi->s_map_lock);
+    if (list_empty(&bbi->i_map_list))
+      list_add_tail(&bbi->i_map_list, &sbi->s_map_inodes);
+    spin_unlock(&sbi->s_map_lock);
+  }
+}
+
+/*
+ * 块被释放之后调用，删除 [start, start + len) 的映射
+ */
+void baby_map_cache_remove(struct inode *inode, unsigned long start,
+                           unsigned long len) {
+  struct baby_inode_info *bbi = BABY_I(inode);
+  unsigned long end = start + len < start ? ULONG_MAX : start + len;
+  long freed;
+
+  write_lock(&bbi->i_map_lock);
+  bbi->i_map_seq++;
+  freed = __baby_map_cache_remove(bbi, start, end);
+  write_unlock(&bbi->i_map_lock);
+  if (freed)
+    atomic_long_sub(freed, &BABY_SB(inode->i_sb)->s_map_nr);
+}
+
+// 丢弃一个 inode 的全部缓存，调用者持有 i_map_lock
+static long __baby_map_cache_drop(struct baby_inode_info *bbi) {
+  struct baby_map_extent *me, *tmp;
+  long freed = 0;
+
+  rbtree_postorder_for_each_entry_safe(me, tmp, &bbi->i_map_tree, me_node) {
+    kmem_cache_free(baby_map_cachep, me);
+    freed++;
+  }
+  bbi->i_map_tree = RB_ROOT;
+  return freed;
+}
+
+// inode 被回收时调用
+void baby_map_cache_drop(struct inode *inode) {
+  struct baby_inode_info *bbi = BABY_I(inode);
+  struct baby_sb_info *sbi = BABY_SB(inode->i_sb);
+  long freed;
+
+  if (!list_empty(&bbi->i_map_list)) {
+    spin_lock(&sbi->s_map_lock);
+    list_del_init(&bbi->i_map_list);
+    spin_unlock(&sbi->s_map_lock);
+  }
+  write_lock(&bbi->i_map_lock);
+  bbi->i_map_seq++;
+  freed = __baby_map_cache_drop(bbi);
+  write_unlock(&bbi->i_map_lock);
+  if (freed)
+    atomic_long_sub(freed, &sbi->s_map_nr);
+}
+
+/*
+ * 从 block 开始连续延迟分配的块数，不超过 max，block 不是延迟块时返回 0
+ */
+unsigned long baby_da_lookup(struct inode *inode, unsigned long block,
+                             unsigned long max) {
+  struct baby_inode_info *bbi = BABY_I(inode);
+  struct baby_map_extent *me;
+  unsigned long len = 0;
+
+  if (RB_EMPTY_ROOT(&bbi->i_da_tree))
+    return 0;
+  read_lock(&bbi->i_map_lock);
+  me = baby_map_search(&bbi->i_da_tree, block);
+  if (me && me->me_lblk <= block)
+    len = min(max, me->me_lblk + me->me_len - block);
+  read_unlock(&bbi->i_map_lock);
+  return len;
+}
+
+/*
+ * 记录 [block, block + len) 为延迟块，和前后相邻或者重叠的合并成一段
+ * 返回范围内原来就是延迟块的块数，这部分的预留由调用者归还
+ */
+long baby_da_insert(struct inode *inode, unsigned long block,
+                    unsigned long len) {
+  struct baby_inode_info *bbi = BABY_I(inode);
+  struct baby_map_extent *new, *me, *next, *prev;
+  unsigned long start = block, end = block + len, me_end;
+  long overlap = 0;
+
+  new = kmem_cache_alloc(baby_map_cachep, GFP_NOFS);
+  if (!new)
+    return -ENOMEM;
+  write_lock(&bbi->i_map_lock);
+  me = baby_map_search(&bbi->i_da_tree, block);
+  prev = me ? baby_map_prev(me) : baby_map_last(&bbi->i_da_tree);
+  if (prev && prev->me_lblk + prev->me_len == block)
+    me = prev;
+  while (me && me->me_lblk <= block + len) {
+    me_end = me->me_lblk + me->me_len;
+    if (me_end > block && me->me_lblk < block + len)
+      overlap += min(me_end, block + len) - max(me->me_lblk, block);
+    start = min(start, me->me_lblk);
+    end = max(end, me_end);
+    next = baby_map_next(me);
+    rb_erase(&me->me_node, &bbi->i_da_tree);
+    kmem_cache_free(baby_map_cachep, me);
+    me = next;
+  }
+  new->me_lblk = start;
+  new->me_pblk = 0;
+  new->me_len = end - start;
+  baby_map_link(&bbi->i_da_tree, new);
+  write_unlock(&bbi->i_map_lock);
+  return overlap;
+}
+
+/*
+ * 删除 [start, start + len) 范围内的延迟块，返回删掉的块数
+ * 延迟块分配了磁盘块或者被丢弃时调用，调用者按返回值归还预留
+ */
+unsigned long baby_da_remove(struct inode *inode, unsigned long start,
+                             unsigned long len) {
+  struct baby_inode_info *bbi = BABY_I(inode);
+  unsigned long end = start + len < start ? ULONG_MAX : start + len;
+  struct baby_map_extent *me, *next, *new = NULL;
+  unsigned long me_end, removed = 0;
+
+  if (RB_EMPTY_ROOT(&bbi->i_da_tree))
+    return 0;
+again:
+  write_lock(&bbi->i_map_lock);
+  me = baby_map_search(&bbi->i_da_tree, start);
+  // 从一段的中间删除时要拆成两段，在锁外分配好新节点再来
+  if (!new && me && me->me_lblk < start && me->me_lblk + me->me_len > end) {
+    write_unlock(&bbi->i_map_lock);
+    new = kmem_cache_alloc(baby_map_cachep, GFP_NOFS | __GFP_NOFAIL);
+    goto again;
+  }
+  while (me && me->me_lblk < end) {
+    next = baby_map_next(me);
+    me_end = me->me_lblk + me->me_len;
+    if (me->me_lblk < start && me_end > end) {
+      new->me_lblk = end;
+      new->me_pblk = 0;
+      new->me_len = me_end - end;
+      me->me_len = start - me->me_lblk;
+      baby_map_link(&bbi->i_da_tree, new);
+      new = NULL;
+      removed += end - start;
+    } else if (me->me_lblk < start) {
+      removed += me_end - start;
+      me->me_len = start - me->me_lblk;
+    } else if (me_end > end) {
+      removed += end - me->me_lblk;
+      me->me_len = me_end - end;
+      me->me_lblk = end;
+    } else {
+      removed += me->me_len;
+      rb_erase(&me->me_node, &bbi->i_da_tree);
+      kmem_cache_free(baby_map_cachep, me);
+    }
+    me = next;
+  }
+  write_unlock(&bbi->i_map_lock);
+  if (new)
+    kmem_cache_free(baby_map_cachep, new);
+  return removed;
+}
+
+static unsigned long baby_map_shrink_count(struct shrinker *shrink,
+                                           struct shrink_control *sc) {
+  struct baby_sb_info *sbi =
+      container_of(shrink, struct baby_sb_info, s_map_shrinker);
+
+  return atomic_long_read(&sbi->s_map_nr);
+}
+
+static unsigned long baby_map_shrink_scan(struct shrinker *shrink,
+                                          struct shrink_control *sc) {
+  struct baby_sb_info *sbi =
+      container_of(shrink, struct baby_sb_info, s_map_shrinker);
+  struct baby_inode_info *bbi, *tmp;
+  LIST_HEAD(referenced);
+  long freed = 0;
+
+  spin_lock(&sbi->s_map_lock);
+  list_for_each_entry_safe(bbi, tmp, &sbi->s_map_inodes, i_map_list) {
+    if (freed >= sc->nr_to_scan)
+      break;
+    // 最近命中过，这一轮先跳过
+    if (READ_ONCE(bbi->i_map_referenced)) {
+      WRITE_ONCE(bbi->i_map_referenced, 0);
+      list_move_tail(&bbi->i_map_list, &referenced);
+      continue;
+    }
+    write_lock(&bbi->i_map_lock);
+    freed += __baby_map_cache_drop(bbi);
+    write_unlock(&bbi->i_map_lock);
+    list_del_init(&bbi->i_map_list);
+  }
+  list_splice_tail(&referenced, &sbi->s_map_inodes);
+  spin_unlock(&sbi->s_map_lock);
+  if (freed)
+    atomic_long_sub(freed, &sbi->s_map_nr);
+  return freed;
+}
+
+// 挂载时初始化并注册 shrinker
+int baby_map_cache_init_sb(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+
+  INIT_LIST_HEAD(&sbi->s_map_inodes);
+  spin_lock_init(&sbi->s_map_lock);
+  atomic_long_set(&sbi->s_map_nr, 0);
+  sbi->s_map_shrinker.count_objects = baby_map_shrink_count;
+  sbi->s_map_shrinker.scan_objects = baby_map_shrink_scan;
+  sbi->s_map_shrinker.seeks = DEFAULT_SEEKS;
+  return register_shrinker(&sbi->s_map_shrinker);
+}
+
+void baby_map_cache_exit_sb(struct super_block *sb) {
+  unregister_shrinker(&BABY_SB(sb)->s_map_shrinker);
+}
+
+int __init baby_init_map_cache(void) {
+  baby_map_cachep = KMEM_CACHE(baby_map_extent, SLAB_RECLAIM_ACCOUNT);
+  if (!baby_map_cachep)
+    return -ENOMEM;
+  return 0;
+}
+
+void baby_destroy_map_cache(void) {
+  kmem_cache_destroy(baby_map_cachep);
+}
@@ -2,6 +2,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/blkzoned.h>
+#include <linux/version.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -10,6 +13,54 @@
 
 static int fd;
 static int nr_dstore_blocks;  // 保存数据块起始块号
+static u_int32_t feature_compat =
+    BABYFS_FEATURE_COMPAT_DIR_INDEX | BABYFS_FEATURE_COMPAT_HAS_JOURNAL |
+    BABYFS_FEATURE_COMPAT_WEAR;  // 默认开启的特性
+static u_int32_t feature_incompat = 0;
+static u_int32_t journal_start;   // 日志区起始块号
+static u_int32_t journal_blocks;  // 日志区块数，0 表示没有日志
+static u_int32_t ssa_start;       // 段摘要区起始块号
+static u_int32_t ssa_blocks;      // 段摘要区块数，0 表示没有开启 log
+static u_int32_t wear_start;      // 磨损表起始块号
+static u_int32_t wear_blocks;     // 磨损表块数，0 表示没有开启 wear
+static u_int32_t used_data_blocks = 1;  // 数据区开头已经占用的块数，根目录的数据块
+static u_int64_t conv_blocks;     // zoned 设备开头常规 zone 的块数，0 表示不是 zoned 设备
+
+// -O 可以开启/关闭的特性，"^name" 表示关闭
+static const struct {
+  const char *name;
+  u_int32_t *features;
+  u_int32_t mask;
+} feature_table[] = {
+    {"dir_index", &feature_compat, BABYFS_FEATURE_COMPAT_DIR_INDEX},
+    {"dirv2", &feature_incompat, BABYFS_FEATURE_INCOMPAT_DIRV2},
+    {"extents", &feature_incompat, BABYFS_FEATURE_INCOMPAT_EXTENTS},
+    {"journal", &feature_compat, BABYFS_FEATURE_COMPAT_HAS_JOURNAL},
+    {"log", &feature_incompat, BABYFS_FEATURE_INCOMPAT_LOG},
+    {"wear", &feature_compat, BABYFS_FEATURE_COMPAT_WEAR},
+};
+
+static int parse_features(char *list) {
+  char *name;
+  for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+    int clear = (name[0] == '^');
+    size_t i;
+    if (clear) name++;
+    for (i = 0; i < sizeof(feature_table) / sizeof(feature_table[0]); ++i) {
+      if (strcmp(name, feature_table[i].name)) continue;
+      if (clear)
+        *feature_table[i].features &= ~feature_table[i].mask;
+      else
+        *feature_table[i].features |= feature_table[i].mask;
+      break;
+    }
+    if (i == sizeof(feature_table) / sizeof(feature_table[0])) {
+      fprintf(stderr, "未知特性: %s\n", name);
+      return -1;
+    }
+  }
+  return 0;
+}
 // static int count = 0;
 
 /*
@@ -27,6 +78,36 @@ void optimize_bitmap_datablock(u_int32_t *nr_bfree_blocks, u_int32_t *nr_dstore_
 static void write_superblock(u_int64_t file_size) {
   u_int32_t total_blocks = file_size / BABYFS_BLOCK_SIZE;
 
+  // 日志区放在设备末尾，先从总块数里扣掉，小镜像按比例缩小
+  if (feature_compat & BABYFS_FEATURE_COMPAT_HAS_JOURNAL) {
+    journal_blocks = BABYFS_JOURNAL_DEFAULT_BLOCKS;
+    if (journal_blocks > total_blocks / 32)
+      journal_blocks = total_blocks / 32;
+    if (journal_blocks < 64)
+      journal_blocks = 64;
+    if (!conv_blocks) {
+      total_blocks -= journal_blocks;
+      journal_start = total_blocks;
+    }
+  }
+  // 段摘要区放在日志区前面，每个数据块一项，按扣除之前的块数算，宁多勿少
+  if (feature_incompat & BABYFS_FEATURE_INCOMPAT_LOG) {
+    ssa_blocks = (total_blocks + BABYFS_SUMMARY_PER_BLOCK - 1) / BABYFS_SUMMARY_PER_BLOCK;
+    if (!conv_blocks) {
+      total_blocks -= ssa_blocks;
+      ssa_start = total_blocks;
+    }
+  }
+  // 磨损表放在段摘要区前面，每个块组一项，同样按扣除之前的块数算
+  if (feature_compat & BABYFS_FEATURE_COMPAT_WEAR) {
+    wear_blocks = (total_blocks / BABYFS_BIT_PRE_BLOCK + 1 + BABYFS_WEAR_PER_BLOCK - 1) /
+                  BABYFS_WEAR_PER_BLOCK;
+    if (!conv_blocks) {
+      total_blocks -= wear_blocks;
+      wear_start = total_blocks;
+    }
+  }
+
   // 保证每次偏移量移动一个 block_size
   char *block = malloc(BABYFS_BLOCK_SIZE);
   memset(block, 0, BABYFS_BLOCK_SIZE);
@@ -58,6 +139,36 @@ static void write_superblock(u_int64_t file_size) {
   super_block->nr_free_blocks =
       super_block->nr_blocks;  // data block 剩余空闲数量
   super_block->nr_free_blocks--;  // 根目录的数据
+  // zoned 设备的末尾是顺序写 zone，段摘要、日志区和磨损表放到根目录的数据块之后，位图上标记为已用
+  if (conv_blocks) {
+    ssa_start = super_block->nr_dstore_blocks + 1;
+    journal_start = ssa_start + ssa_blocks;
+    wear_start = journal_start + journal_blocks;
+    used_data_blocks += ssa_blocks + journal_blocks + wear_blocks;
+    super_block->nr_free_blocks -= ssa_blocks + journal_blocks + wear_blocks;
+    if (super_block->nr_dstore_blocks + used_data_blocks > conv_blocks) {
+      fprintf(stderr, "常规 zone 放不下元数据，需要 %u 块，只有 %llu 块\n",
+              super_block->nr_dstore_blocks + used_data_blocks,
+              (unsigned long long)conv_blocks);
+      exit(EXIT_FAILURE);
+    }
+  }
+  super_block->feature_compat = feature_compat;
+  super_block->feature_incompat = feature_incompat;
+  super_block->s_journal_start = journal_start;
+  super_block->s_journal_blocks = journal_blocks;
+  super_block->s_ssa_start = ssa_start;
+  super_block->s_ssa_blocks = ssa_blocks;
+  if (wear_blocks) {
+    super_block->s_wear_start = wear_start;
+    super_block->s_wear_blocks = wear_blocks;
+  }
+  if (journal_blocks)
+    printf("journal start = %u, journal blocks = %u\n", journal_start, journal_blocks);
+  if (ssa_blocks)
+    printf("segment summary start = %u, summary blocks = %u\n", ssa_start, ssa_blocks);
+  if (wear_blocks)
+    printf("wear table start = %u, wear table blocks = %u\n", wear_start, wear_blocks);
   printf("bitmap_start = %d, datablock_start = %d, total free blocks = %d\n", BABYFS_DATA_BIT_MAP_BLOCK_BASE, super_block->nr_dstore_blocks, super_block->nr_free_blocks);
   int ret = write(fd, block, BABYFS_BLOCK_SIZE);
   if (ret != BABYFS_BLOCK_SIZE) {
@@ -142,26 +253,18 @@ static void write_inode_bitmap() {
 }
 
 static void write_datablock_bitmap() {
-  // 写第一块 bitmap
   char *block = malloc(BABYFS_BLOCK_SIZE);
-  u_int64_t *data_bitmap = (u_int64_t *)block;
-  memset(data_bitmap, 0x00, BABYFS_BLOCK_SIZE);
-  // 标记 root_inode 使用的第一块数据块
-  *data_bitmap = 0x0000000000000001;
-  int ret = write(fd, block, BABYFS_BLOCK_SIZE);
-  // count++;
-  // printf("write_datablock_bitmap: %d\n", count);
-  if (ret != BABYFS_BLOCK_SIZE) {
-    free(block);
-    perror("data_block_bitmap: 0, 写出错!\n");
-    return;
-  }
+  u_int32_t bit;
+  int ret;
 
-  // 写剩余的 bitmap
-  *data_bitmap = 0x0000000000000000;
-  for (int i = 1; i < nr_dstore_blocks - BABYFS_DATA_BIT_MAP_BLOCK_BASE; ++i) {
+  // 标记数据区开头已经占用的块：root_inode 使用的第一块数据块，zoned 设备上还有段摘要和日志区
+  for (int i = 0; i < nr_dstore_blocks - BABYFS_DATA_BIT_MAP_BLOCK_BASE; ++i) {
+    memset(block, 0x00, BABYFS_BLOCK_SIZE);
+    for (bit = i * BABYFS_BIT_PRE_BLOCK;
+         bit < used_data_blocks && bit < (i + 1) * BABYFS_BIT_PRE_BLOCK; ++bit)
+      block[(bit % BABYFS_BIT_PRE_BLOCK) / 8] |= 1 << (bit % 8);
     // count++;
-    if (ret = write(fd, block, BABYFS_BLOCK_SIZE) != BABYFS_BLOCK_SIZE) {
+    if ((ret = write(fd, block, BABYFS_BLOCK_SIZE)) != BABYFS_BLOCK_SIZE) {
       free(block);
       fprintf(stderr, "data_block_bitmap: %d, 写出错!\n", i);
       return;
@@ -172,28 +275,50 @@ static void write_datablock_bitmap() {
   printf("data block bitmap 格式化完成!\n");
 }
 
-static void write_first_datablock() {
-  // 分配一个 block_size 大小的内存
-  char *block = malloc(BABYFS_BLOCK_SIZE);
-  memset(block, 0, BABYFS_BLOCK_SIZE);
+// 根目录的 "." 和 ".." 目录项，inode 编号都为 0，这样可以通过 ino +
+// BABYFS_INODE_TABLE_BLOCK_BASE 找到 inode block
+static void fill_root_dir(char *block) {
   struct dir_record *d_record = (struct dir_record *)block;
-  memset(d_record->name, 0, sizeof(d_record->name));  // 清空 name 字段
   // 添加 “.” 目录项
   memcpy(d_record->name, ".", 1);
-  d_record->inode_no = 0;  // inode 编号为 0，这样可以通过 ino +
-                           // BABYFS_INODE_TABLE_BLOCK_BASE 找到 inode block
+  d_record->inode_no = 0;
   d_record->name_len = 1;
   d_record->file_type = BABYFS_FILE_TYPE_DIR;
 
   // 添加 “..” 目录项
   d_record++;
-  memset(d_record->name, 0, sizeof(d_record->name));  //清空 name 字段
   memcpy(d_record->name, "..", 2);
-  d_record->inode_no = 0;  // inode 编号为 0，这样可以通过 ino +
-                           // BABYFS_INODE_TABLE_BLOCK_BASE 找到 inode block
+  d_record->inode_no = 0;
   d_record->name_len = 2;
   d_record->file_type = BABYFS_FILE_TYPE_DIR;
-  
+}
+
+// v2 变长目录项，".." 延伸到块尾
+static void fill_root_dir_v2(char *block) {
+  struct baby_dir_entry_2 *de = (struct baby_dir_entry_2 *)block;
+  de->inode_no = 0;
+  de->rec_len = BABYFS_DIR_V2_REC_LEN(1);
+  de->name_len = 1;
+  de->file_type = BABYFS_FILE_TYPE_DIR;
+  memcpy(de->name, ".", 1);
+
+  de = (struct baby_dir_entry_2 *)(block + BABYFS_DIR_V2_REC_LEN(1));
+  de->inode_no = 0;
+  de->rec_len = BABYFS_BLOCK_SIZE - BABYFS_DIR_V2_REC_LEN(1);
+  de->name_len = 2;
+  de->file_type = BABYFS_FILE_TYPE_DIR;
+  memcpy(de->name, "..", 2);
+}
+
+static void write_first_datablock() {
+  // 分配一个 block_size 大小的内存
+  char *block = malloc(BABYFS_BLOCK_SIZE);
+  memset(block, 0, BABYFS_BLOCK_SIZE);
+  if (feature_incompat & BABYFS_FEATURE_INCOMPAT_DIRV2)
+    fill_root_dir_v2(block);
+  else
+    fill_root_dir(block);
+
   // 写入目录项
   int ret = write(fd, block, BABYFS_BLOCK_SIZE);
   if (ret != BABYFS_BLOCK_SIZE) {
@@ -228,18 +353,193 @@ static void write_first_datablock() {
   printf("根目录目录项写入成功!\n");
 }
 
+// 日志超级块，js_start 为 0 表示日志为空；第一个日志块清零，避免残留数据被当成事务
+static void write_journal() {
+  char *block;
+  struct baby_journal_super *jsb;
+
+  if (!journal_blocks)
+    return;
+  block = malloc(BABYFS_BLOCK_SIZE);
+  memset(block, 0, BABYFS_BLOCK_SIZE);
+  jsb = (struct baby_journal_super *)block;
+  jsb->js_magic = BABYFS_JOURNAL_MAGIC;
+  jsb->js_blocks = journal_blocks;
+  jsb->js_start = 0;
+  jsb->js_sequence = 1;
+  if (pwrite(fd, block, BABYFS_BLOCK_SIZE,
+             (off_t)journal_start * BABYFS_BLOCK_SIZE) != BABYFS_BLOCK_SIZE) {
+    free(block);
+    perror("日志超级块写入出错!\n");
+    return;
+  }
+  memset(block, 0, BABYFS_BLOCK_SIZE);
+  if (pwrite(fd, block, BABYFS_BLOCK_SIZE,
+             (off_t)(journal_start + 1) * BABYFS_BLOCK_SIZE) != BABYFS_BLOCK_SIZE) {
+    free(block);
+    perror("日志块写入出错!\n");
+    return;
+  }
+  free(block);
+  printf("journal 格式化完成!\n");
+}
+
+// 段摘要区全部清零，ino 为 0 的项表示没有记录
+static void write_summary() {
+  char *block;
+  u_int32_t i;
+
+  if (!ssa_blocks)
+    return;
+  block = malloc(BABYFS_BLOCK_SIZE);
+  memset(block, 0, BABYFS_BLOCK_SIZE);
+  for (i = 0; i < ssa_blocks; i++) {
+    if (pwrite(fd, block, BABYFS_BLOCK_SIZE,
+               (off_t)(ssa_start + i) * BABYFS_BLOCK_SIZE) != BABYFS_BLOCK_SIZE) {
+      free(block);
+      perror("段摘要写入出错!\n");
+      return;
+    }
+  }
+  free(block);
+  printf("段摘要格式化完成!\n");
+}
+
+// 磨损表全部清零，所有块组都从没有写过开始
+static void write_wear_table() {
+  char *block;
+  u_int32_t i;
+
+  if (!wear_blocks)
+    return;
+  block = malloc(BABYFS_BLOCK_SIZE);
+  memset(block, 0, BABYFS_BLOCK_SIZE);
+  for (i = 0; i < wear_blocks; i++) {
+    if (pwrite(fd, block, BABYFS_BLOCK_SIZE,
+               (off_t)(wear_start + i) * BABYFS_BLOCK_SIZE) != BABYFS_BLOCK_SIZE) {
+      free(block);
+      perror("磨损表写入出错!\n");
+      return;
+    }
+  }
+  free(block);
+  printf("磨损表格式化完成!\n");
+}
+
+/*
+ * 块设备是 zoned 设备时统计开头的常规 zone，并重置所有顺序写 zone
+ * 超级块、位图、inode 表、段摘要、日志区和磨损表都要原地写，只能放在常规 zone 里
+ */
+static int probe_zones() {
+  struct blk_zone_report *rep;
+  struct blk_zone_range range;
+  u_int32_t zone_sectors = 0;
+  u_int64_t sector = 0, nr_conv = 0, seq_start = 0;
+  unsigned int i, nr = 256;
+
+  if (ioctl(fd, BLKGETZONESZ, &zone_sectors) < 0 || !zone_sectors)
+    return 0;
+  rep = calloc(1, sizeof(*rep) + nr * sizeof(struct blk_zone));
+  for (;;) {
+    rep->sector = sector;
+    rep->nr_zones = nr;
+    if (ioctl(fd, BLKREPORTZONE, rep) < 0) {
+      perror("获取 zone 信息出错");
+      free(rep);
+      return -1;
+    }
+    if (!rep->nr_zones)
+      break;
+    for (i = 0; i < rep->nr_zones; ++i) {
+      if (rep->zones[i].type != BLK_ZONE_TYPE_CONVENTIONAL) {
+        if (!seq_start)
+          seq_start = rep->zones[i].start;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+        // 段按整个 zone 写满，可写容量小于 zone 大小的设备（NVMe ZNS）不支持
+        if ((rep->flags & BLK_ZONE_REP_CAPACITY) &&
+            rep->zones[i].capacity < rep->zones[i].len) {
+          fprintf(stderr, "zone 的容量小于 zone 大小，不支持这样的设备\n");
+          free(rep);
+          return -1;
+        }
+#endif
+        continue;
+      }
+      if (seq_start) {
+        fprintf(stderr, "顺序写 zone 之后不能再有常规 zone\n");
+        free(rep);
+        return -1;
+      }
+      nr_conv++;
+    }
+    sector = rep->zones[rep->nr_zones - 1].start + rep->zones[rep->nr_zones - 1].len;
+  }
+  free(rep);
+  if (!nr_conv) {
+    fprintf(stderr, "zoned 设备开头需要常规 zone 存放元数据\n");
+    return -1;
+  }
+  if (seq_start) {
+    range.sector = seq_start;
+    range.nr_sectors = sector - seq_start;
+    if (ioctl(fd, BLKRESETZONE, &range) < 0) {
+      perror("重置 zone 出错");
+      return -1;
+    }
+  }
+  conv_blocks = nr_conv * zone_sectors / (BABYFS_BLOCK_SIZE / 512);
+  printf("zoned 设备: zone 大小 %u 扇区，常规 zone 共 %llu 块\n", zone_sectors,
+         (unsigned long long)conv_blocks);
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "用法: %s [-O feature[,...]] 设备文件\n", prog);
+  fprintf(stderr, "  特性: dir_index（默认开启，^dir_index 关闭）\n");
+  fprintf(stderr, "        dirv2（变长目录项，旧内核无法挂载）\n");
+  fprintf(stderr, "        extents（普通文件使用区间映射，旧内核无法挂载）\n");
+  fprintf(stderr, "        journal（元数据日志，默认开启，^journal 关闭）\n");
+  fprintf(stderr, "        log（普通文件的数据按日志结构写，同时开启 extents，旧内核无法挂载）\n");
+  fprintf(stderr, "        wear（保存各个块组的磨损计数，默认开启，^wear 关闭）\n");
+  fprintf(stderr, "  zoned 设备上自动开启 log，元数据放在开头的常规 zone 里\n");
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    perror("没有设备文件\n");
+  int opt;
+  while ((opt = getopt(argc, argv, "O:")) != -1) {
+    switch (opt) {
+      case 'O':
+        if (parse_features(optarg)) {
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
     return EXIT_FAILURE;
   }
 
   // 打开设备文件
-  fd = open(argv[1], O_RDWR);
+  fd = open(argv[optind], O_RDWR);
   if (fd == -1) {
     perror("打开文件出错\n");
     return EXIT_FAILURE;
   }
+  if (probe_zones()) {
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  // 顺序写 zone 不能原地写，只能用日志结构写
+  if (conv_blocks)
+    feature_incompat |= BABYFS_FEATURE_INCOMPAT_LOG;
+  // 换块靠区间树记录新位置，日志结构写只支持区间映射的文件
+  if (feature_incompat & BABYFS_FEATURE_INCOMPAT_LOG)
+    feature_incompat |= BABYFS_FEATURE_INCOMPAT_EXTENTS;
   // 获取文件大小
   off_t off = lseek(fd, 0, SEEK_END);
   lseek(fd, 0, SEEK_SET);
@@ -256,6 +556,9 @@ int main(int argc, char **argv) {
   write_inode_table();          // indoe 表
   write_datablock_bitmap();     // 数据位图
   write_first_datablock();      // 主要是写根目录的目录项
+  write_summary();              // 段摘要区
+  write_wear_table();           // 磨损表
+  write_journal();              // 日志区
 
   printf("格式化完成!\n");
   // printf("已初始化的块数: %d\n", count);
@@ -0,0 +1,300 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "babyfs.h"
+
+/*
+ * 孤儿 inode 和后台释放
+ *
+ * 删除大文件时，evict 不再在最后一次 iput 的进程里一级级读间接块、清位图，
+ * 而是把 inode 挂到磁盘上的孤儿链表上就返回：链表头在根目录 raw inode 的
+ * i_next_orphan 里，每个孤儿 inode 的 i_next_orphan 指向下一个，修改都在 handle 里。
+ *
+ * 后台 work 从最早的孤儿开始，重新 iget 之后从文件末尾往前每次截掉
+ * baby_truncate_batch 块，每一批一个 handle，i_size 跟着变小；
+ * 块全部释放后 iput，baby_evict_inode 照常释放 inode，同时把它从链表中删除。
+ *
+ * 卸载时后台停在两批之间，没释放完的孤儿留在磁盘链表上，挂载时重新加载继续释放；
+ * 崩溃之后也一样，不会泄漏块和 inode
+ *
+ * 还没释放的块记在 s_pending_blocks 里，statfs 把它们算进 f_bfree，
+ * 但不算进 f_bavail，等真正释放之后才能分配
+ */
+
+#define BABY_ORPHAN_MIN_BLOCKS 4096 // 小于这么多块的文件直接在 evict 里释放
+
+struct baby_orphan {
+  struct list_head o_list;
+  unsigned long o_ino;
+  unsigned long o_pending; // 还没有释放的块数（估计值）
+  int o_failed;            // 释放出错，留到下次挂载
+};
+
+static inline unsigned long baby_orphan_blocks(struct super_block *sb,
+                                               loff_t size) {
+  return (size + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+}
+
+// 修改磁盘上 ino 的 i_next_orphan，ino 为根目录时修改的是链表头
+static int baby_orphan_set_next(struct super_block *sb, unsigned long ino,
+                                unsigned long next) {
+  struct baby_inode *raw_inode;
+  struct buffer_head *bh;
+
+  raw_inode = baby_get_raw_inode(sb, ino, &bh);
+  if (IS_ERR(raw_inode))
+    return PTR_ERR(raw_inode);
+  raw_inode->i_next_orphan = cpu_to_le32(next);
+  baby_journal_dirty(sb, NULL, bh);
+  brelse(bh);
+  return 0;
+}
+
+static void baby_orphan_put(struct baby_sb_info *sbi, struct baby_orphan *o) {
+  atomic_long_sub(o->o_pending, &sbi->s_pending_blocks);
+  o->o_pending = 0;
+}
+
+/*
+ * evict 删除文件时调用，返回 1 表示块留给后台释放，调用者不再删除
+ * 后台正在处理的孤儿没有释放完（卸载或者出错）时也返回 1，留在链表上
+ */
+int baby_orphan_add(struct inode *inode) {
+  struct super_block *sb = inode->i_sb;
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_handle *handle;
+  struct baby_orphan *o, *head;
+  int err;
+
+  if (BABY_I(inode)->i_orphan)
+    return inode->i_size != 0;
+  // evict 在一个 handle 里释放的块不能超过一批
+  if (!S_ISREG(inode->i_mode) || READ_ONCE(sbi->s_orphan_stop) ||
+      baby_orphan_blocks(sb, inode->i_size) <
+          min_t(unsigned long, BABY_ORPHAN_MIN_BLOCKS, baby_truncate_batch(sb)))
+    return 0;
+  o = kzalloc(sizeof(*o), GFP_NOFS);
+  if (!o)
+    return 0;
+  o->o_ino = inode->i_ino;
+  o->o_pending = baby_orphan_blocks(sb, inode->i_size);
+
+  sb_start_intwrite(sb);
+  handle = baby_journal_start(sb, BABYFS_ORPHAN_CREDITS);
+  if (IS_ERR(handle)) {
+    sb_end_intwrite(sb);
+    kfree(o);
+    return 0;
+  }
+  // 链接数为 0 的 inode 和链表头的修改在同一个事务里
+  err = __baby_write_inode(inode, 0);
+  mutex_lock(&sbi->s_orphan_mutex);
+  head = list_first_entry_or_null(&sbi->s_orphans, struct baby_orphan, o_list);
+  if (!err)
+    err = baby_orphan_set_next(sb, inode->i_ino, head ? head->o_ino : 0);
+  if (!err)
+    err = baby_orphan_set_next(sb, BABYFS_ROOT_INODE_NO, inode->i_ino);
+  if (!err) {
+    list_add(&o->o_list, &sbi->s_orphans);
+    atomic_long_add(o->o_pending, &sbi->s_pending_blocks);
+  }
+  mutex_unlock(&sbi->s_orphan_mutex);
+  baby_journal_stop(handle);
+  sb_end_intwrite(sb);
+  if (err) {
+    kfree(o);
+    return 0;
+  }
+  queue_work(system_long_wq, &sbi->s_orphan_work);
+  return 1;
+}
+
+/*
+ * 孤儿的块已经全部释放，evict 在释放 inode 的 handle 里把它从链表中删除
+ * 前一项从内存链表中找，后一项也用内存链表里的，不依赖磁盘上的值
+ */
+void baby_orphan_del(struct inode *inode) {
+  struct super_block *sb = inode->i_sb;
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_orphan *o = BABY_I(inode)->i_orphan, *prev, *next;
+
+  if (!o)
+    return;
+  mutex_lock(&sbi->s_orphan_mutex);
+  prev = list_is_first(&o->o_list, &sbi->s_orphans)
+             ? NULL
+             : list_prev_entry(o, o_list);
+  next = list_is_last(&o->o_list, &sbi->s_orphans)
+             ? NULL
+             : list_next_entry(o, o_list);
+  if (baby_orphan_set_next(sb, prev ? prev->o_ino : BABYFS_ROOT_INODE_NO,
+                           next ? next->o_ino : 0) ||
+      baby_orphan_set_next(sb, o->o_ino, 0))
+    printk(KERN_ERR "babyfs: remove orphan inode %lu failed\n", o->o_ino);
+  list_del(&o->o_list);
+  baby_orphan_put(sbi, o);
+  mutex_unlock(&sbi->s_orphan_mutex);
+  BABY_I(inode)->i_orphan = NULL;
+  kfree(o);
+}
+
+// 从文件末尾往前分批释放一个孤儿的块，全部释放后 iput 删除 inode
+static void baby_orphan_reap(struct super_block *sb, struct baby_orphan *o) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_handle *handle;
+  struct inode *inode;
+  loff_t size, off;
+  unsigned long max = baby_truncate_batch(sb), nr;
+  loff_t batch = (loff_t)max << sb->s_blocksize_bits;
+
+  inode = baby_iget(sb, o->o_ino);
+  if (IS_ERR(inode))
+    goto failed;
+  if (inode->i_nlink || !S_ISREG(inode->i_mode)) {
+    printk(KERN_ERR "babyfs: bad orphan inode %lu\n", o->o_ino);
+    iput(inode);
+    goto failed;
+  }
+  BABY_I(inode)->i_orphan = o;
+  size = i_size_read(inode);
+  while (size && !READ_ONCE(sbi->s_orphan_stop)) {
+    off = size > batch ? size - batch : 0;
+    sb_start_intwrite(sb);
+    handle = baby_journal_start(sb, baby_truncate_credits(sb, max));
+    if (IS_ERR(handle)) {
+      sb_end_intwrite(sb);
+      o->o_failed = 1;
+      break;
+    }
+    baby_truncate_blocks(inode, off);
+    i_size_write(inode, off);
+    mark_inode_dirty(inode);
+    baby_journal_stop(handle);
+    sb_end_intwrite(sb);
+
+    nr = min(o->o_pending, baby_orphan_blocks(sb, size) -
+                               baby_orphan_blocks(sb, off));
+    o->o_pending -= nr;
+    atomic_long_sub(nr, &sbi->s_pending_blocks);
+    size = off;
+    cond_resched();
+  }
+  if (o->o_failed)
+    baby_orphan_put(sbi, o);
+  // i_size 为 0 时 evict 释放 inode 并调用 baby_orphan_del，否则留在链表上
+  iput(inode);
+  return;
+
+failed:
+  o->o_failed = 1;
+  baby_orphan_put(sbi, o);
+}
+
+static void baby_orphan_work(struct work_struct *work) {
+  struct baby_sb_info *sbi =
+      container_of(work, struct baby_sb_info, s_orphan_work);
+  struct baby_orphan *o, *iter;
+
+  while (!READ_ONCE(sbi->s_orphan_stop)) {
+    o = NULL;
+    mutex_lock(&sbi->s_orphan_mutex);
+    list_for_each_entry_reverse(iter, &sbi->s_orphans, o_list) {
+      if (!iter->o_failed) {
+        o = iter;
+        break;
+      }
+    }
+    mutex_unlock(&sbi->s_orphan_mutex);
+    // 只有这个 work 会删除链表项，放锁之后 o 仍然有效
+    if (!o)
+      break;
+    baby_orphan_reap(sbi->s_sb, o);
+  }
+}
+
+void baby_orphan_sb_init(struct baby_sb_info *sbi, struct super_block *sb) {
+  sbi->s_sb = sb;
+  INIT_LIST_HEAD(&sbi->s_orphans);
+  mutex_init(&sbi->s_orphan_mutex);
+  INIT_WORK(&sbi->s_orphan_work, baby_orphan_work);
+  atomic_long_set(&sbi->s_pending_blocks, 0);
+}
+
+/*
+ * 挂载时沿着磁盘上的链表重建内存链表，交给后台继续释放
+ * 在日志回放之后、根目录建立之后调用，遇到不合法的项时后面的不再加载
+ */
+void baby_orphan_load(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_inode *raw_inode;
+  struct buffer_head *bh;
+  struct baby_orphan *o;
+  unsigned long ino, nr = 0;
+
+  raw_inode = baby_get_raw_inode(sb, BABYFS_ROOT_INODE_NO, &bh);
+  if (IS_ERR(raw_inode))
+    return;
+  ino = le32_to_cpu(raw_inode->i_next_orphan);
+  brelse(bh);
+
+  while (ino) {
+    if (ino >= BABYFS_INODE_NUM_COUNTS || nr >= BABYFS_INODE_NUM_COUNTS) {
+      printk(KERN_ERR "babyfs: bad orphan list at inode %lu\n", ino);
+      break;
+    }
+    raw_inode = baby_get_raw_inode(sb, ino, &bh);
+    if (IS_ERR(raw_inode))
+      break;
+    if (raw_inode->i_nlink || !S_ISREG(le16_to_cpu(raw_inode->i_mode))) {
+      printk(KERN_ERR "babyfs: bad orphan inode %lu\n", ino);
+      brelse(bh);
+      break;
+    }
+    o = kzalloc(sizeof(*o), GFP_KERNEL);
+    if (!o) {
+      brelse(bh);
+      break;
+    }
+    o->o_ino = ino;
+    o->o_pending = baby_orphan_blocks(sb, le64_to_cpu(raw_inode->i_size));
+    list_add_tail(&o->o_list, &sbi->s_orphans);
+    atomic_long_add(o->o_pending, &sbi->s_pending_blocks);
+    nr++;
+    ino = le32_to_cpu(raw_inode->i_next_orphan);
+    brelse(bh);
+  }
+  if (!nr)
+    return;
+  printk(KERN_INFO "babyfs: %lu orphan inodes to free\n", nr);
+  if (!sb_rdonly(sb))
+    queue_work(system_long_wq, &sbi->s_orphan_work);
+}
+
+// 卸载时停止后台释放，正在处理的孤儿释放完当前这一批就返回
+void baby_orphan_stop(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+
+  WRITE_ONCE(sbi->s_orphan_stop, 1);
+  cancel_work_sync(&sbi->s_orphan_work);
+}
+
+// 重新挂载为读写时继续释放剩下的孤儿
+void baby_orphan_resume(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+
+  WRITE_ONCE(sbi->s_orphan_stop, 0);
+  if (!list_empty(&sbi->s_orphans))
+    queue_work(system_long_wq, &sbi->s_orphan_work);
+}
+
+void baby_orphan_release(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_orphan *o, *tmp;
+
+  list_for_each_entry_safe(o, tmp, &sbi->s_orphans, o_list) {
+    list_del(&o->o_list);
+    kfree(o);
+  }
+}
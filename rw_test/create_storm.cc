@@ -0,0 +1,48 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+// g++ -Wall -std=c++11 -O2 create_storm.cc -o create_storm
+// ./create_storm [directory name] [file nums] [batch size]
+//
+// 在同一个目录下连续创建大量空文件，每创建 batch 个文件输出一次这一批的平均耗时，
+// 用来观察单次 create 的开销是否随目录变大而增长
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0] << " [directory] [file nums] [batch size]\n";
+    return 1;
+  }
+  std::string dictory = argv[1];
+  uint32_t num = std::atoi(argv[2]);
+  uint32_t batch = argc > 3 ? std::atoi(argv[3]) : 1000;
+  if (batch == 0)
+    batch = 1000;
+
+  std::cout << "files\tus/create\n";
+  auto start = std::chrono::steady_clock::now();
+  auto batch_start = start;
+  for (uint32_t i = 1; i <= num; ++i) {
+    std::string filename = dictory + "/storm_" + std::to_string(i);
+    int fd = open(filename.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd < 0) {
+      perror(filename.c_str());
+      return 1;
+    }
+    close(fd);
+    if (i % batch == 0 || i == num) {
+      auto now = std::chrono::steady_clock::now();
+      double us = std::chrono::duration<double, std::micro>(now - batch_start).count();
+      uint32_t n = i % batch ? i % batch : batch;
+      std::cout << i << '\t' << us / n << '\n';
+      batch_start = now;
+    }
+  }
+  double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "total " << num << " files in " << total << " s\n";
+  return 0;
+}
@@ -0,0 +1,76 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// g++ -Wall -std=c++11 -O2 dx_lookup.cc -o dx_lookup
+// sudo ./dx_lookup [directory name] [entries]
+//
+// 在同一个目录下建立 entries 个目录项（都是同一个文件的硬链接，不占 inode），
+// 丢掉 dentry 缓存之后逐个 stat，再确认不存在的名字返回 ENOENT，最后全部删除。
+// 目录项超过哈希索引能容纳的数量时索引会被丢弃，之后必须退回线性扫描仍然找得到。
+// 索引的上限是 BABYFS_DX_MAX_BUCKETS 个桶，正常大小的上限建不出这么多目录项，
+// 测试时在 Makefile 里打开 CFLAGS_dir_index.o += -DBABYFS_DX_MAX_BUCKETS=16 重新编译模块
+
+static bool drop_caches() {
+  sync();
+  std::ofstream f("/proc/sys/vm/drop_caches");
+  f << "2\n";
+  return (bool)f;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " [directory] [entries]\n";
+    return 1;
+  }
+  std::string dictory = argv[1];
+  int num = argc > 2 ? std::atoi(argv[2]) : 20000;
+  if (num <= 0)
+    num = 20000;
+
+  std::string target = dictory + "/dx_target";
+  int fd = open(target.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+  if (fd < 0) {
+    perror(target.c_str());
+    return 1;
+  }
+  close(fd);
+  for (int i = 0; i < num; ++i) {
+    std::string name = dictory + "/dx_" + std::to_string(i);
+    if (link(target.c_str(), name.c_str())) {
+      perror(name.c_str());
+      return 1;
+    }
+  }
+  if (!drop_caches())
+    std::cerr << "cannot drop dentry cache, lookups may not reach the directory\n";
+
+  int failed = 0;
+  struct stat st;
+  for (int i = 0; i < num; ++i) {
+    std::string name = dictory + "/dx_" + std::to_string(i);
+    if (stat(name.c_str(), &st)) {
+      perror(name.c_str());
+      ++failed;
+    }
+  }
+  for (int i = num; i < num + 100; ++i) {
+    std::string name = dictory + "/dx_" + std::to_string(i);
+    if (!stat(name.c_str(), &st) || errno != ENOENT) {
+      std::cerr << name << ": expected ENOENT\n";
+      ++failed;
+    }
+  }
+
+  for (int i = 0; i < num; ++i)
+    unlink((dictory + "/dx_" + std::to_string(i)).c_str());
+  unlink(target.c_str());
+  std::cout << num << " entries, " << failed << " lookups failed\n";
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,103 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <random>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+// g++ -Wall -std=c++11 -O2 mmap_write.cc -o mmap_write
+// ./mmap_write [directory name] [file MB]
+//
+// 对比三种写法的吞吐（都包含最后的 fsync/msync）：
+//   write:     write(2) 顺序写一个新文件
+//   mmap seq:  ftruncate 出一个空洞文件，mmap 之后按页顺序写，缺页时 page_mkwrite 预留空间
+//   mmap rand: 在上一步写好的文件上随机改写页，不需要再分配
+// 页都是第一次被写时才分配（延迟分配），msync 时回写
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double write_file(const std::string &filename, uint64_t mb) {
+  int fd = open(filename.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd < 0) {
+    perror(filename.c_str());
+    return -1;
+  }
+  std::vector<char> buf(1 << 20, 'w');
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < mb; ++i) {
+    if (write(fd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+      perror(filename.c_str());
+      close(fd);
+      return -1;
+    }
+  }
+  fsync(fd);
+  double sec = seconds_since(start);
+  close(fd);
+  return mb / sec;
+}
+
+// random 为 false 时新建文件顺序写，为 true 时在已有文件上随机改写
+static double mmap_file(const std::string &filename, uint64_t mb, bool random) {
+  size_t size = mb << 20, page = sysconf(_SC_PAGESIZE);
+  int fd = open(filename.c_str(), random ? O_RDWR : O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if (fd < 0) {
+    perror(filename.c_str());
+    return -1;
+  }
+  if (!random && ftruncate(fd, size) < 0) {
+    perror("ftruncate");
+    close(fd);
+    return -1;
+  }
+  char *p = (char *)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    close(fd);
+    return -1;
+  }
+  std::mt19937_64 rng(1);
+  size_t pages = size / page;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < pages; ++i) {
+    size_t n = random ? rng() % pages : i;
+    memset(p + n * page, 'm', page);
+  }
+  msync(p, size, MS_SYNC);
+  double sec = seconds_since(start);
+  munmap(p, size);
+  close(fd);
+  return mb / sec;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " [directory] [file MB]\n";
+    return 1;
+  }
+  std::string dictory = argv[1];
+  uint64_t mb = argc > 2 ? std::atoi(argv[2]) : 64;
+  if (mb == 0)
+    mb = 64;
+
+  std::string wfile = dictory + "/write_file", mfile = dictory + "/mmap_file";
+  double w = write_file(wfile, mb);
+  double seq = mmap_file(mfile, mb, false);
+  double rand = mmap_file(mfile, mb, true);
+  if (w < 0 || seq < 0 || rand < 0)
+    return 1;
+  std::cout << "mode\t\tMB/s\n"
+            << "write\t\t" << w << '\n'
+            << "mmap seq\t" << seq << '\n'
+            << "mmap rand\t" << rand << '\n';
+  unlink(wfile.c_str());
+  unlink(mfile.c_str());
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// g++ -Wall -std=c++11 -O2 -pthread parallel_write.cc -o parallel_write
+// ./parallel_write [directory name] [max threads] [files per thread] [file KB]
+//
+// 多线程同时创建并写入文件，线程数从 1 开始翻倍直到 max threads，
+// 每一轮在 directory/round_<线程数> 下进行，每个线程使用自己的子目录，
+// 输出每一轮的总文件数/秒和 MB/秒，用来观察分配路径（空闲计数、块组锁等）的多核扩展性
+
+static bool worker(const std::string &dir, uint32_t files, uint32_t kb) {
+  if (mkdir(dir.c_str(), 0755) < 0) {
+    perror(dir.c_str());
+    return false;
+  }
+  std::string buf(1024, 'x');
+  for (uint32_t i = 0; i < files; ++i) {
+    std::string filename = dir + "/file_" + std::to_string(i);
+    int fd = open(filename.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd < 0) {
+      perror(filename.c_str());
+      return false;
+    }
+    for (uint32_t k = 0; k < kb; ++k) {
+      if (write(fd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+        perror(filename.c_str());
+        close(fd);
+        return false;
+      }
+    }
+    close(fd);
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0]
+              << " [directory] [max threads] [files per thread] [file KB]\n";
+    return 1;
+  }
+  std::string dictory = argv[1];
+  uint32_t max_threads = std::atoi(argv[2]);
+  uint32_t files = argc > 3 ? std::atoi(argv[3]) : 1000;
+  uint32_t kb = argc > 4 ? std::atoi(argv[4]) : 4;
+  if (max_threads == 0)
+    max_threads = 1;
+
+  std::cout << "threads\tfiles/s\tMB/s\n";
+  for (uint32_t nr = 1; nr <= max_threads; nr <<= 1) {
+    std::string round = dictory + "/round_" + std::to_string(nr);
+    if (mkdir(round.c_str(), 0755) < 0) {
+      perror(round.c_str());
+      return 1;
+    }
+    std::vector<std::thread> threads;
+    std::vector<char> ok(nr, 0);
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t t = 0; t < nr; ++t) {
+      std::string dir = round + "/t" + std::to_string(t);
+      threads.emplace_back([&ok, t, dir, files, kb] { ok[t] = worker(dir, files, kb); });
+    }
+    for (auto &th : threads)
+      th.join();
+    // 把脏数据也算进去，否则测到的只是写页缓存的速度
+    sync();
+    double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (uint32_t t = 0; t < nr; ++t) {
+      if (!ok[t])
+        return 1;
+    }
+    double nfiles = (double)nr * files;
+    std::cout << nr << '\t' << nfiles / total << '\t'
+              << nfiles * kb / 1024 / total << '\n';
+  }
+  return 0;
+}
@@ -0,0 +1,98 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// g++ -Wall -std=c++11 -O2 seq_read.cc -o seq_read
+// ./seq_read [file name] [file MB] [read KB] [rounds]
+//
+// 顺序读一个大文件，文件不存在时先写入 file MB 并 fsync
+// 每一轮读之前用 POSIX_FADV_DONTNEED 丢掉文件的页缓存，读的都是磁盘（loop 设备）
+// 每一轮分别用 POSIX_FADV_RANDOM（关闭预读，一页一页地读）和
+// POSIX_FADV_SEQUENTIAL（加大预读窗口）读一遍，输出两者的吞吐，
+// 用来对比 readpages 批量预读带来的差别
+
+static bool drop_cache(int fd) {
+  if (fdatasync(fd) < 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) {
+    perror("posix_fadvise");
+    return false;
+  }
+  return true;
+}
+
+static bool create_file(const std::string &filename, uint64_t mb) {
+  int fd = open(filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(filename.c_str());
+    return false;
+  }
+  std::vector<char> buf(1 << 20, 'r');
+  for (uint64_t i = 0; i < mb; ++i) {
+    if (write(fd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+      perror(filename.c_str());
+      close(fd);
+      return false;
+    }
+  }
+  bool ok = drop_cache(fd);
+  close(fd);
+  return ok;
+}
+
+// 返回 MB/s，出错时返回负数
+static double read_once(const std::string &filename, int advice, size_t bs) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    perror(filename.c_str());
+    return -1;
+  }
+  if (!drop_cache(fd) || posix_fadvise(fd, 0, 0, advice) != 0) {
+    close(fd);
+    return -1;
+  }
+  std::vector<char> buf(bs);
+  uint64_t total = 0;
+  ssize_t n;
+  auto start = std::chrono::steady_clock::now();
+  while ((n = read(fd, buf.data(), buf.size())) > 0)
+    total += n;
+  double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  close(fd);
+  if (n < 0) {
+    perror(filename.c_str());
+    return -1;
+  }
+  return total / 1048576.0 / sec;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " [file] [file MB] [read KB] [rounds]\n";
+    return 1;
+  }
+  std::string filename = argv[1];
+  uint64_t mb = argc > 2 ? std::atoi(argv[2]) : 32;
+  size_t bs = (argc > 3 ? std::atoi(argv[3]) : 128) * 1024;
+  int rounds = argc > 4 ? std::atoi(argv[4]) : 3;
+  if (bs == 0)
+    bs = 128 * 1024;
+
+  struct stat st;
+  if (stat(filename.c_str(), &st) < 0 && !create_file(filename, mb))
+    return 1;
+
+  std::cout << "round\tno-readahead MB/s\treadahead MB/s\n";
+  for (int r = 1; r <= rounds; ++r) {
+    double norah = read_once(filename, POSIX_FADV_RANDOM, bs);
+    double rah = read_once(filename, POSIX_FADV_SEQUENTIAL, bs);
+    if (norah < 0 || rah < 0)
+      return 1;
+    std::cout << r << '\t' << norah << "\t\t\t" << rah << '\n';
+  }
+  return 0;
+}
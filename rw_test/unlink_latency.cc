@@ -0,0 +1,90 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/statfs.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// g++ -Wall -std=c++11 -O2 unlink_latency.cc -o unlink_latency
+// ./unlink_latency [directory name] [file MB]
+//
+// 写一个 file MB 的文件并 fsync，然后测量 unlink 本身花的时间，
+// 之后每 100ms 用 statfs 查看一次空闲块：
+//   bfree:  包括等待后台释放的块
+//   bavail: 真正可以分配的块
+// 两者的差回到 unlink 之前的值时后台释放结束，只在数值变化时输出一行
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool create_file(const std::string &filename, uint64_t mb) {
+  int fd = open(filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(filename.c_str());
+    return false;
+  }
+  std::vector<char> buf(1 << 20, 'u');
+  for (uint64_t i = 0; i < mb; ++i) {
+    if (write(fd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+      perror(filename.c_str());
+      close(fd);
+      return false;
+    }
+  }
+  fsync(fd);
+  close(fd);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " [directory] [file MB]\n";
+    return 1;
+  }
+  std::string dictory = argv[1];
+  uint64_t mb = argc > 2 ? std::atoi(argv[2]) : 256;
+  if (mb == 0)
+    mb = 256;
+
+  std::string filename = dictory + "/unlink_file";
+  if (!create_file(filename, mb))
+    return 1;
+
+  struct statfs st;
+  if (statfs(dictory.c_str(), &st) < 0) {
+    perror("statfs");
+    return 1;
+  }
+  // 其他文件系统 bfree 里还有给 root 保留的块
+  uint64_t gap = st.f_bfree - st.f_bavail, last = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  if (unlink(filename.c_str()) < 0) {
+    perror("unlink");
+    return 1;
+  }
+  std::cout << "unlink\t" << seconds_since(start) * 1000 << " ms\n";
+
+  std::cout << "time s\tbfree\tbavail\n";
+  for (int i = 0; i < 600; ++i) {
+    if (statfs(dictory.c_str(), &st) < 0) {
+      perror("statfs");
+      return 1;
+    }
+    if (st.f_bavail != last)
+      std::cout << seconds_since(start) << '\t' << st.f_bfree << '\t' << st.f_bavail << '\n';
+    last = st.f_bavail;
+    if (st.f_bfree - st.f_bavail <= gap) {
+      std::cout << "freed in " << seconds_since(start) << " s\n";
+      return 0;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  std::cout << "still pending after 60 s\n";
+  return 0;
+}
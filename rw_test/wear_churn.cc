@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <random>
+#include <string>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../babyfs.h"
+
+// g++ -Wall -std=c++11 -O2 wear_churn.cc -o wear_churn
+// ./wear_churn [directory name] [files] [rounds] [max file KB]
+//
+// 在 files 个文件名上反复随机创建、改写、删除文件，每次修改后 fsync，
+// 模拟数据不断更替的负载。结束后用 BABYFS_IOC_GET_WEAR 读出各个块组的磨损计数，
+// 输出每个块组每块平均写入的次数，以及最多、最少和变异系数（标准差 / 平均值），
+// 变异系数越小说明写入越均匀地分布在整个数据区上。
+// erased 一列是 discard 成功或者 zone 重置的块数，不带 -o discard 挂载普通设备时都是 0
+
+static const size_t kBlock = 4096;
+
+static int churn(const std::string &dir, int files, int rounds, size_t max_kb) {
+  std::mt19937_64 rng(42);
+  std::uniform_int_distribution<int> pick(0, files - 1), op(0, 2);
+  std::uniform_int_distribution<size_t> blocks(1, std::max<size_t>(max_kb * 1024 / kBlock, 1));
+  std::vector<size_t> size(files, 0);
+  std::vector<char> buf(max_kb * 1024 + kBlock, 'c');
+
+  for (int i = 0; i < rounds; ++i) {
+    int n = pick(rng);
+    std::string name = dir + "/churn_" + std::to_string(n);
+    int o = op(rng);
+    if (!size[n] || o == 0) {
+      // 新建或者整个重写
+      size_t len = blocks(rng) * kBlock;
+      int fd = open(name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+      if (fd < 0 || write(fd, buf.data(), len) != (ssize_t)len) {
+        perror(name.c_str());
+        return -1;
+      }
+      fsync(fd);
+      close(fd);
+      size[n] = len;
+    } else if (o == 1) {
+      // 改写文件中间的一段
+      std::uniform_int_distribution<size_t> at(0, size[n] / kBlock - 1);
+      size_t off = at(rng) * kBlock;
+      size_t len = std::min(blocks(rng) * kBlock, size[n] - off);
+      int fd = open(name.c_str(), O_WRONLY);
+      if (fd < 0 || pwrite(fd, buf.data(), len, off) != (ssize_t)len) {
+        perror(name.c_str());
+        return -1;
+      }
+      fsync(fd);
+      close(fd);
+    } else {
+      unlink(name.c_str());
+      size[n] = 0;
+    }
+  }
+  for (int n = 0; n < files; ++n) {
+    if (size[n])
+      unlink((dir + "/churn_" + std::to_string(n)).c_str());
+  }
+  sync();
+  return 0;
+}
+
+static int report(const std::string &dir) {
+  int fd = open(dir.c_str(), O_RDONLY);
+  if (fd < 0) {
+    perror(dir.c_str());
+    return -1;
+  }
+  struct baby_wear_info info = {};
+  // 先取块组数，再读计数
+  if (ioctl(fd, BABYFS_IOC_GET_WEAR, &info) < 0) {
+    perror("BABYFS_IOC_GET_WEAR");
+    close(fd);
+    return -1;
+  }
+  std::vector<struct baby_wear> wear(info.wi_groups);
+  info.wi_wear = (uintptr_t)wear.data();
+  if (ioctl(fd, BABYFS_IOC_GET_WEAR, &info) < 0) {
+    perror("BABYFS_IOC_GET_WEAR");
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  // 最后一个块组可能不满，按写入次数比较时只看前面的完整块组
+  std::vector<double> per_block;
+  std::cout << "group\twrites\terased\n";
+  for (size_t g = 0; g < wear.size(); ++g) {
+    std::cout << g << "\t" << wear[g].w_writes << "\t" << wear[g].w_erases << "\n";
+    if (g + 1 < wear.size() || wear.size() == 1)
+      per_block.push_back((double)wear[g].w_writes / info.wi_group_blocks);
+  }
+  double sum = 0, sq = 0;
+  for (double w : per_block)
+    sum += w;
+  double mean = sum / per_block.size();
+  for (double w : per_block)
+    sq += (w - mean) * (w - mean);
+  double cv = mean > 0 ? std::sqrt(sq / per_block.size()) / mean : 0;
+  std::cout << "writes per block: min " << *std::min_element(per_block.begin(), per_block.end())
+            << " max " << *std::max_element(per_block.begin(), per_block.end())
+            << " mean " << mean << " cv " << cv << "\n";
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " [directory] [files] [rounds] [max file KB]\n";
+    return 1;
+  }
+  std::string dictory = argv[1];
+  int files = argc > 2 ? std::atoi(argv[2]) : 256;
+  int rounds = argc > 3 ? std::atoi(argv[3]) : 20000;
+  int max_kb = argc > 4 ? std::atoi(argv[4]) : 256;
+  if (files <= 0)
+    files = 256;
+  if (rounds <= 0)
+    rounds = 20000;
+  if (max_kb <= 0)
+    max_kb = 256;
+
+  if (churn(dictory, files, rounds, max_kb))
+    return 1;
+  return report(dictory) ? 1 : 0;
+}
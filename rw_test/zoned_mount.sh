@@ -0,0 +1,46 @@
+#!/bin/sh
+# sudo sh ./rw_test/zoned_mount.sh
+#
+# 用 null_blk 模拟一个开头有常规 zone 的 zoned 设备，格式化之后挂载，
+# 建目录、写文件、sync 之后卸载再挂载，检查文件内容没有变化。
+# zoned 设备上日志区、段摘要和磨损表都在数据区开头，第二次挂载会加载日志
+# 需要先 make、make install 和 gcc -o mkfs.babyfs mkfs.babyfs.c
+
+set -e
+
+DEV=/dev/nullb0
+MNT=$(mktemp -d)
+
+cleanup() {
+  umount "$MNT" 2>/dev/null || true
+  rmdir "$MNT"
+  rmmod null_blk 2>/dev/null || true
+}
+trap cleanup EXIT
+
+modprobe null_blk nr_devices=1 zoned=1 zone_size=64 zone_nr_conv=4 gb=1 memory_backed=1
+echo mq-deadline > /sys/block/nullb0/queue/scheduler
+./mkfs.babyfs $DEV
+
+mount -t babyfs $DEV "$MNT"
+mkdir "$MNT/dir"
+for i in $(seq 1 200); do
+  echo "file $i" > "$MNT/dir/f$i"
+done
+dd if=/dev/urandom of="$MNT/big" bs=1M count=16 status=none
+SUM=$(md5sum < "$MNT/big")
+sync
+umount "$MNT"
+
+mount -t babyfs $DEV "$MNT"
+for i in $(seq 1 200); do
+  if [ "$(cat "$MNT/dir/f$i")" != "file $i" ]; then
+    echo "dir/f$i: wrong content"
+    exit 1
+  fi
+done
+if [ "$(md5sum < "$MNT/big")" != "$SUM" ]; then
+  echo "big: wrong content"
+  exit 1
+fi
+echo "zoned mount: ok"
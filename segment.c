@@ -0,0 +1,315 @@
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+
+#include "babyfs.h"
+
+/*
+ * 日志结构模式
+ *
+ * mkfs 时开启 LOG 特性，普通文件的数据不再写回原位置：回写时已经有块的数据
+ * 分配新块、区间改为指向新块（见 baby_ext_relocate），旧块释放；新块和写空洞
+ * 分配的块一样，从日志上顺序追加。随机改写到了设备上也变成顺序写。
+ *
+ * 数据区按 BABYFS_SEG_BLOCKS 块分成段。热、温、冷数据（见 balloc.c 的冷热分离）
+ * 各有一个日志，每个日志打开一个完全空闲的段，从头到尾顺序分配，写满之后再找下一个
+ * 空闲段；找不到空闲段时退回到在当前位置之后找空闲块（类似 F2FS 的 SSR），
+ * 并唤醒清理线程（见 cleaner.c）。热区域留给间接块和区间树块，日志只用它之后的段。
+ *
+ * 段摘要区给每个数据块记录所属的文件和逻辑块号，和区间的修改在同一个事务里；
+ * 每个段的已用块数跟着位图变化，只保存在内存里，挂载时从位图重新统计
+ *
+ * zoned 设备上一个顺序写 zone 是一个段（见 zoned.c），日志只从写指针的位置分配，
+ * 没有空闲段时不在段里的空隙中分配，而是到常规 zone 里分配
+ */
+
+// 统计一个块组的位图中每个段的已用块数
+static int baby_seg_count_group(struct super_block *sb, unsigned long group) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long base = group * BABYFS_BIT_PRE_BLOCK, i;
+  unsigned long bits = min_t(unsigned long, BABYFS_BIT_PRE_BLOCK,
+                             sbi->nr_blocks - base);
+  struct buffer_head *bh;
+
+  bh = sb_bread(sb, group + BABYFS_DATA_BIT_MAP_BLOCK_BASE);
+  if (!bh)
+    return -EIO;
+  for (i = find_next_bit_le(bh->b_data, bits, 0); i < bits;
+       i = find_next_bit_le(bh->b_data, bits, i + 1))
+    sbi->s_segs[baby_seg_of(sbi, base + i)].sg_valid++;
+  brelse(bh);
+  return 0;
+}
+
+// 挂载时在建立空闲区间树之后调用，没有 LOG 特性时什么都不做
+int baby_seg_init(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_super_block *raw_sb = sbi->s_babysb;
+  unsigned long nr, first, n, i;
+  time64_t now = ktime_get_real_seconds();
+  int err;
+
+  BUILD_BUG_ON(BABYFS_BIT_PRE_BLOCK % BABYFS_SEG_BLOCKS);
+  BUILD_BUG_ON(BABYFS_SEG_BLOCKS % BABYFS_SUMMARY_PER_BLOCK);
+  if (!BABY_HAS_INCOMPAT_FEATURE(sb, BABYFS_FEATURE_INCOMPAT_LOG)) {
+    if (bdev_is_zoned(sb->s_bdev)) {
+      printk(KERN_ERR "babyfs: zoned device needs the log feature\n");
+      return -EINVAL;
+    }
+    return 0;
+  }
+  if ((unsigned long)le32_to_cpu(raw_sb->s_ssa_blocks) *
+          BABYFS_SUMMARY_PER_BLOCK < sbi->nr_blocks) {
+    printk(KERN_ERR "babyfs: segment summary area too small\n");
+    return -EINVAL;
+  }
+  sbi->s_seg_blocks = BABYFS_SEG_BLOCKS;
+  sbi->s_seg_off = 0;
+  if (bdev_is_zoned(sb->s_bdev)) {
+    err = baby_zoned_init(sb);
+    if (err)
+      return err;
+  }
+  nr = baby_seg_of(sbi, sbi->nr_blocks - 1) + 1;
+  sbi->s_segs = kvcalloc(nr, sizeof(*sbi->s_segs), GFP_KERNEL);
+  if (!sbi->s_segs)
+    return -ENOMEM;
+  sbi->s_nr_segs = nr;
+  sbi->s_ssa_start = le32_to_cpu(raw_sb->s_ssa_start);
+  spin_lock_init(&sbi->s_seg_lock);
+  mutex_init(&sbi->s_log_mutex);
+  for (i = 0; i < sbi->nr_bitmap; i++) {
+    err = baby_seg_count_group(sb, i);
+    if (err) {
+      baby_seg_release(sb);
+      return err;
+    }
+  }
+  for (i = 0; i < nr; i++)
+    sbi->s_segs[i].sg_mtime = now;
+  // 热区域只有在分得出来时才和日志分开，zoned 设备上日志只用顺序写 zone
+  baby_temp_region(sbi, BABY_TEMP_HOT, &first, &n);
+  if (!sbi->s_zoned && n < sbi->nr_bitmap)
+    sbi->s_seg_first = (first + n) * BABYFS_BIT_PRE_BLOCK / BABYFS_SEG_BLOCKS;
+  sbi->s_seg_cursor = sbi->s_seg_first;
+  printk(KERN_INFO "babyfs: log-structured mode, %lu segments\n", nr);
+  return 0;
+}
+
+void baby_seg_release(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+
+  kvfree(sbi->s_segs);
+  sbi->s_segs = NULL;
+}
+
+// 位图上 [block, block + count) 被置位或清零，块号相对于第一个数据块
+void baby_seg_update(struct super_block *sb, unsigned long block,
+                     unsigned long count, int used) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_segment *sg;
+  time64_t now = used ? ktime_get_real_seconds() : 0;
+  unsigned long nr;
+
+  spin_lock(&sbi->s_seg_lock);
+  while (count > 0) {
+    sg = &sbi->s_segs[baby_seg_of(sbi, block)];
+    nr = min(count, sbi->s_seg_blocks -
+                        (block + sbi->s_seg_off) % sbi->s_seg_blocks);
+    if (used) {
+      sg->sg_valid += nr;
+      sg->sg_mtime = now;
+    } else {
+      sg->sg_valid -= min_t(unsigned long, nr, sg->sg_valid);
+      sg->sg_flags &= ~BABY_SEG_NOCLEAN;
+    }
+    block += nr;
+    count -= nr;
+  }
+  spin_unlock(&sbi->s_seg_lock);
+}
+
+// 段里没有已用的块，也没有等待放回的块，日志可以从头写到尾
+static int baby_seg_clean(struct super_block *sb, unsigned long seg) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_segment *sg = &sbi->s_segs[seg];
+  int clean;
+
+  spin_lock(&sbi->s_seg_lock);
+  clean = !sg->sg_valid && !(sg->sg_flags & BABY_SEG_OPEN);
+  spin_unlock(&sbi->s_seg_lock);
+  return clean && baby_range_free(sb, baby_seg_start(sbi, seg),
+                                  baby_seg_len(sbi, seg));
+}
+
+static void baby_log_close(struct baby_sb_info *sbi, struct baby_log *log) {
+  if (log->l_open) {
+    spin_lock(&sbi->s_seg_lock);
+    sbi->s_segs[baby_seg_of(sbi, log->l_end - 1)].sg_flags &= ~BABY_SEG_OPEN;
+    spin_unlock(&sbi->s_seg_lock);
+  }
+  log->l_open = 0;
+  log->l_end = log->l_next;
+}
+
+/*
+ * 关闭日志当前的段，从 s_seg_cursor 开始找下一个空闲段打开
+ * zoned 设备上打开之前先重置 zone，写指针回到开头
+ * 调用者持有 s_log_mutex，找不到时返回 0，l_next 留在原来的位置
+ */
+static int baby_log_new_segment(struct super_block *sb, struct baby_log *log) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long nr = sbi->s_nr_segs - sbi->s_seg_first, seg, i;
+
+  baby_log_close(sbi, log);
+  for (i = 0; i < nr; i++) {
+    seg = sbi->s_seg_first + (sbi->s_seg_cursor - sbi->s_seg_first + i) % nr;
+    if (!baby_seg_clean(sb, seg))
+      continue;
+    if (sbi->s_zoned && baby_zone_reset(sb, seg))
+      continue;
+    spin_lock(&sbi->s_seg_lock);
+    sbi->s_segs[seg].sg_flags |= BABY_SEG_OPEN;
+    spin_unlock(&sbi->s_seg_lock);
+    log->l_next = baby_seg_start(sbi, seg);
+    log->l_end = log->l_next + baby_seg_len(sbi, seg);
+    log->l_open = 1;
+    sbi->s_seg_cursor = seg + 1;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * zoned 设备上从日志的写指针分配；日志没有打开的段时到常规 zone 里，
+ * 从热区域之后开始找，块号相对于第一个数据块，失败时返回 -1
+ */
+static baby_fsblk_t baby_log_alloc_zoned(struct super_block *sb,
+                                         struct baby_log *log,
+                                         unsigned long *num) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long first, n;
+  baby_fsblk_t ret;
+
+  if (log->l_next < log->l_end) {
+    *num = min(*num, log->l_end - log->l_next);
+    ret = baby_alloc_at(sb, log->l_next, num);
+    if (ret >= 0) {
+      log->l_next += *num;
+      return ret;
+    }
+    // 写指针的位置不空闲，段已经不能顺序写了，换一个段
+    printk(KERN_ERR "babyfs: zone log at block %lu not free\n", log->l_next);
+    baby_log_close(sbi, log);
+  }
+  baby_temp_region(sbi, BABY_TEMP_HOT, &first, &n);
+  return baby_alloc_from(sb, (first + n) * BABYFS_BIT_PRE_BLOCK, num);
+}
+
+/*
+ * 日志结构模式下给普通文件分配最多 *count 个连续块，返回物理块号
+ * 清理线程回写的数据追加到冷日志，其他按文件的温度选日志
+ * 当前段写满时打开下一个空闲段；没有空闲段时唤醒清理线程，从上次的位置往后找空闲块，
+ * 借用分配到的块所在的段，写到段尾再找空闲段
+ * 其他分配（间接块、目录）占了日志的下一块时，日志跳到新分配的位置继续
+ * zoned 设备上只在写指针的位置分配，没有空闲段时到常规 zone 里分配，日志保持关闭
+ */
+unsigned long baby_log_alloc(struct inode *inode, unsigned long *count,
+                             int *err) {
+  struct super_block *sb = inode->i_sb;
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long first = baby_seg_start(sbi, sbi->s_seg_first);
+  unsigned long num = *count, goal;
+  enum baby_temp temp;
+  struct baby_log *log;
+  baby_fsblk_t ret;
+
+  temp = sbi->s_cleaner == current ? BABY_TEMP_COLD : baby_inode_temp(inode);
+  log = &sbi->s_logs[temp];
+  mutex_lock(&sbi->s_log_mutex);
+  if (log->l_next >= log->l_end && !baby_log_new_segment(sb, log))
+    baby_cleaner_kick(sb);
+  if (sbi->s_zoned) {
+    ret = baby_log_alloc_zoned(sb, log, &num);
+    goto out;
+  }
+  if (log->l_next < log->l_end)
+    num = min(num, log->l_end - log->l_next);
+  goal = log->l_next;
+  if (goal < first || goal >= sbi->nr_blocks)
+    goal = first;
+  ret = baby_alloc_from(sb, goal, &num);
+  if (ret < 0)
+    goto out;
+  if (ret != log->l_next || log->l_next >= log->l_end) {
+    baby_log_close(sbi, log);
+    log->l_end = baby_seg_start(sbi, baby_seg_of(sbi, ret)) +
+                 baby_seg_len(sbi, baby_seg_of(sbi, ret));
+  }
+  log->l_next = ret + num;
+out:
+  mutex_unlock(&sbi->s_log_mutex);
+  if (ret < 0) {
+    *err = -ENOSPC;
+    return 0;
+  }
+  *count = num;
+  *err = 0;
+  return ret + NR_DSTORE_BLOCKS;
+}
+
+/*
+ * 记录物理块 [pblk, pblk + count) 是 inode 的逻辑块 [block, block + count)
+ * 在分配这些块的 handle 里调用
+ */
+void baby_summary_set(struct inode *inode, unsigned long pblk,
+                      unsigned long block, unsigned long count) {
+  struct super_block *sb = inode->i_sb;
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long blk = pblk - NR_DSTORE_BLOCKS, nr, i;
+  struct baby_summary *ss;
+  struct buffer_head *bh;
+
+  while (count > 0) {
+    bh = sb_bread(sb, sbi->s_ssa_start + blk / BABYFS_SUMMARY_PER_BLOCK);
+    if (!bh) {
+      printk(KERN_ERR "babyfs: cannot read segment summary of block %lu\n",
+             pblk);
+      return;
+    }
+    ss = (struct baby_summary *)bh->b_data + blk % BABYFS_SUMMARY_PER_BLOCK;
+    nr = min(count, BABYFS_SUMMARY_PER_BLOCK - blk % BABYFS_SUMMARY_PER_BLOCK);
+    for (i = 0; i < nr; i++) {
+      ss[i].ss_ino = cpu_to_le32(inode->i_ino);
+      ss[i].ss_block = cpu_to_le32(block + i);
+    }
+    baby_journal_dirty(sb, NULL, bh);
+    brelse(bh);
+    blk += nr;
+    block += nr;
+    count -= nr;
+  }
+}
+
+/*
+ * 分配到的 [pblk, pblk + count) 没有用上就要释放时调用
+ * zoned 设备上这些块不会写，写指针停在它们前面，日志之后的块都写不进去，
+ * 它们在日志末尾时关闭日志，下次分配打开新的段
+ */
+void baby_log_abort(struct super_block *sb, unsigned long pblk,
+                    unsigned long count) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long end = pblk - NR_DSTORE_BLOCKS + count;
+  int i;
+
+  if (!baby_log_mode(sb) || !sbi->s_zoned)
+    return;
+  mutex_lock(&sbi->s_log_mutex);
+  for (i = 0; i < BABY_TEMP_NR; i++) {
+    if (sbi->s_logs[i].l_next == end)
+      baby_log_close(sbi, &sbi->s_logs[i]);
+  }
+  mutex_unlock(&sbi->s_log_mutex);
+}
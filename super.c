@@ -4,6 +4,8 @@
 #include <linux/mm.h>
 #include <linux/blkdev.h>
 #include <linux/statfs.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 
 #include "babyfs.h"
 
@@ -45,6 +47,51 @@ static long long baby_max_size(struct super_block *sb) {
   return res;
 }
 
+enum { Opt_discard, Opt_nodiscard, Opt_err };
+
+static const match_table_t tokens = {
+  {Opt_discard, "discard"},
+  {Opt_nodiscard, "nodiscard"},
+  {Opt_err, NULL},
+};
+
+// 解析挂载选项，遇到不认识的选项返回 0
+static int baby_parse_options(char *options, struct baby_sb_info *sbi) {
+  substring_t args[MAX_OPT_ARGS];
+  char *p;
+
+  if (!options)
+    return 1;
+  while ((p = strsep(&options, ",")) != NULL) {
+    if (!*p)
+      continue;
+    switch (match_token(p, tokens, args)) {
+    case Opt_discard:
+      sbi->s_mount_opt |= BABYFS_MOUNT_DISCARD;
+      break;
+    case Opt_nodiscard:
+      sbi->s_mount_opt &= ~BABYFS_MOUNT_DISCARD;
+      break;
+    default:
+      printk(KERN_ERR "babyfs: unrecognized mount option \"%s\"\n", p);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// 设备不支持 discard 时忽略 discard 选项
+static void baby_check_discard(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+
+  if ((sbi->s_mount_opt & BABYFS_MOUNT_DISCARD) &&
+      !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+    printk(KERN_WARNING "babyfs: %s does not support discard, option ignored\n",
+           sb->s_id);
+    sbi->s_mount_opt &= ~BABYFS_MOUNT_DISCARD;
+  }
+}
+
 static int babyfs_fill_super(struct super_block *sb, void *data, int silent) {
   struct buffer_head *bh;
   struct baby_super_block *baby_sb;
@@ -56,6 +103,9 @@ static int babyfs_fill_super(struct super_block *sb, void *data, int silent) {
     printk(KERN_ERR "babyfs_fill_super: kalloc baby_sb_info failed!\n");
     goto failed;
   }
+  baby_orphan_sb_init(baby_sb_info, sb);
+  baby_discard_sb_init(baby_sb_info);
+  baby_cleaner_sb_init(baby_sb_info);
 
   if (!sb_set_blocksize(sb, BABYFS_BLOCK_SIZE)) { // 设置 sb_bread 读取的逻辑块大小
     printk(KERN_ERR "sb_set_blocksize: failed! current blocksize: %lu\n",
@@ -69,7 +119,19 @@ static int babyfs_fill_super(struct super_block *sb, void *data, int silent) {
     goto failed;
   }
   baby_sb = (struct baby_super_block *)bh->b_data;
+  // 有不认识的不兼容特性，磁盘格式无法解析
+  if (le32_to_cpu(baby_sb->feature_incompat) & ~BABYFS_FEATURE_INCOMPAT_SUPP) {
+    printk(KERN_ERR "babyfs_fill_super: unsupported incompat features 0x%x\n",
+           le32_to_cpu(baby_sb->feature_incompat) &
+               ~BABYFS_FEATURE_INCOMPAT_SUPP);
+    ret = -EINVAL;
+    goto failed_mount;
+  }
   NR_DSTORE_BLOCKS = baby_sb->nr_dstore_blocks;
+  if (!baby_parse_options(data, baby_sb_info)) {
+    ret = -EINVAL;
+    goto failed_mount;
+  }
 
   // 初始化超级块
   sb->s_magic = baby_sb->magic; // 魔幻数
@@ -78,11 +140,10 @@ static int babyfs_fill_super(struct super_block *sb, void *data, int silent) {
   baby_sb_info->s_babysb = baby_sb;
   baby_sb_info->s_sbh = bh;
   baby_sb_info->nr_blocks = baby_sb->nr_blocks;
-  baby_sb_info->nr_free_blocks = baby_sb->nr_free_blocks;
-  baby_sb_info->nr_free_inodes = baby_sb->nr_free_inodes;
   baby_sb_info->last_bitmap_bits = baby_sb->nr_blocks % BABYFS_BIT_PRE_BLOCK;
   baby_sb_info->nr_bitmap = baby_sb->nr_dstore_blocks - baby_sb->nr_bfree_blocks;
   sb->s_fs_info = baby_sb_info; // superblock 的私有域存放额外信息，包括磁盘上的结构体
+  baby_check_discard(sb);
   // TODO 测试小文件系统的时候需要注释掉最大文件限制，不然会报错
   // sb->s_maxbytes = baby_max_size(sb); // 设置最大文件大小，在文件写入时起限制作用
 
@@ -102,11 +163,56 @@ static int babyfs_fill_super(struct super_block *sb, void *data, int silent) {
   // 头结点加入预留窗口红黑树
   rsv_window_add(sb, &baby_sb_info->s_rsv_window_head);
 
+  /*
+   * 空闲块和空闲 inode 计数每次分配释放都要修改，用 percpu 计数器避免多核之间来回同步同一个缓存行
+   * 空闲块数在建立块组时按位图重新设置
+   */
+  ret = percpu_counter_init(&baby_sb_info->s_freeblocks_counter,
+                            baby_sb->nr_free_blocks, GFP_KERNEL);
+  if (!ret)
+    ret = percpu_counter_init(&baby_sb_info->s_freeinodes_counter,
+                              baby_sb->nr_free_inodes, GFP_KERNEL);
+  if (!ret)
+    ret = percpu_counter_init(&baby_sb_info->s_dirtyblocks_counter, 0,
+                              GFP_KERNEL);
+  if (ret) {
+    percpu_counter_destroy(&baby_sb_info->s_freeblocks_counter);
+    percpu_counter_destroy(&baby_sb_info->s_freeinodes_counter);
+    goto failed_mount;
+  }
+  // 延迟分配不能用掉的空间，留给回写时分配间接块
+  baby_sb_info->s_resv_blocks =
+      min_t(unsigned long, baby_sb->nr_blocks / 64, BABYFS_MAX_RESV_BLOCKS);
+
+  // 加载元数据日志，上次没有正常卸载时先回放，之后读到的才是一致的元数据
+  if (BABY_HAS_COMPAT_FEATURE(sb, BABYFS_FEATURE_COMPAT_HAS_JOURNAL)) {
+    ret = baby_journal_load(sb);
+    if (ret)
+      goto failed_counters;
+  }
+  // 日志回放之后位图才是最新的，再建立空闲区间树
+  ret = baby_build_free_tree(sb);
+  if (ret)
+    goto failed_journal;
+  baby_wear_init(sb);
+  ret = baby_seg_init(sb);
+  if (ret)
+    goto failed_free_tree;
+  ret = baby_map_cache_init_sb(sb);
+  if (ret)
+    goto failed_seg;
+  baby_sb_info->s_unwritten_wq = alloc_workqueue(
+      "babyfs-unwritten/%s", WQ_MEM_RECLAIM | WQ_FREEZABLE, 0, sb->s_id);
+  if (!baby_sb_info->s_unwritten_wq) {
+    ret = -ENOMEM;
+    goto failed_map_cache;
+  }
+
   // 获取磁盘存储的 inode 结构体
   root_vfs_inode = baby_iget(sb, BABYFS_ROOT_INODE_NO);
   if (IS_ERR(root_vfs_inode)) {
     ret = PTR_ERR(root_vfs_inode);
-    goto failed_mount;
+    goto failed_wq;
   }
 
   // 创建根目录
@@ -114,16 +220,47 @@ static int babyfs_fill_super(struct super_block *sb, void *data, int silent) {
   if (!sb->s_root) {
     printk(KERN_ERR "babyfs_fill_super: create root dentry failed\n");
     ret = -ENOMEM;
-    goto failed_mount;
+    goto failed_wq;
   }
+  // 上次没有释放完的孤儿交给后台继续
+  baby_orphan_load(sb);
+  baby_cleaner_start(sb);
   return 0;
 
+failed_wq:
+  destroy_workqueue(baby_sb_info->s_unwritten_wq);
+failed_map_cache:
+  baby_map_cache_exit_sb(sb);
+failed_seg:
+  baby_seg_release(sb);
+failed_free_tree:
+  baby_destroy_free_tree(sb);
+failed_journal:
+  baby_journal_release(sb);
+  if (!sb_rdonly(sb))
+    baby_sync_super(baby_sb_info, baby_sb, 1);
+failed_counters:
+  percpu_counter_destroy(&baby_sb_info->s_freeblocks_counter);
+  percpu_counter_destroy(&baby_sb_info->s_freeinodes_counter);
+  percpu_counter_destroy(&baby_sb_info->s_dirtyblocks_counter);
 failed_mount:
   brelse(bh);
 failed:  
   return ret;
 }
 
+/*
+ * 后台释放孤儿和清理段时持有 inode 引用，要在 VFS 回收所有 inode 之前停下来，
+ * 放在 put_super 里就晚了
+ */
+static void babyfs_kill_sb(struct super_block *sb) {
+  if (BABY_SB(sb)) {
+    baby_orphan_stop(sb);
+    baby_cleaner_stop(sb);
+  }
+  kill_block_super(sb);
+}
+
 static struct dentry *babyfs_mount(struct file_system_type *fs_type, int flags,
                                    const char *dev_name, void *data) {
   // 在块设备上挂载文件系统
@@ -147,6 +284,16 @@ static struct inode *baby_alloc_inode(struct super_block *sb) {
   struct baby_inode_info *bbi;
   bbi = kmem_cache_alloc(baby_inode_cachep, GFP_KERNEL);
   if (!bbi) return NULL;
+  bbi->i_dir_free = NULL;
+  bbi->i_sync_tid = 0;
+  bbi->i_jbufs = 0;
+  bbi->i_reserved_blocks = 0;
+  bbi->i_map_tree = RB_ROOT;
+  bbi->i_map_seq = 0;
+  bbi->i_map_referenced = 0;
+  bbi->i_da_tree = RB_ROOT;
+  bbi->i_orphan = NULL;
+  bbi->i_auto_hint = WRITE_LIFE_NOT_SET;
 
   return &bbi->vfs_inode;
 }
@@ -165,6 +312,13 @@ static void init_once(void *foo) {
   struct baby_inode_info *bbi = (struct baby_inode_info *)foo;
   // 初始化 baby_inode_info 包含的 vfs inode
   inode_init_once(&bbi->vfs_inode);
+  mutex_init(&bbi->i_alloc_mutex);
+  rwlock_init(&bbi->i_map_lock);
+  init_rwsem(&bbi->i_mmap_sem);
+  INIT_LIST_HEAD(&bbi->i_map_list);
+  INIT_LIST_HEAD(&bbi->i_ioend_list);
+  spin_lock_init(&bbi->i_ioend_lock);
+  INIT_WORK(&bbi->i_ioend_work, baby_end_io_work);
 }
 
 // 初始化 baby_inode_info 内存高速缓存（slab层）
@@ -200,14 +354,34 @@ static void baby_put_super(struct super_block *sb) {
   if (baby_sb_info == NULL) {
     return;
   }
+  // 等待 discard 的块要在日志释放之前处理，discard 前需要提交事务
+  baby_discard_flush(sb);
+  // 日志做完检查点后清除 RECOVER 标志，超级块最后写回
+  if (baby_sb_info->s_journal) {
+    baby_journal_release(sb);
+    if (!sb_rdonly(sb))
+      baby_sync_super(baby_sb_info, baby_sb_info->s_babysb, 1);
+  }
+  baby_wear_sync(sb, 1);
+  destroy_workqueue(baby_sb_info->s_unwritten_wq);
+  baby_orphan_release(sb);
+  baby_map_cache_exit_sb(sb);
+  baby_seg_release(sb);
+  baby_destroy_free_tree(sb);
+  percpu_counter_destroy(&baby_sb_info->s_freeblocks_counter);
+  percpu_counter_destroy(&baby_sb_info->s_freeinodes_counter);
+  percpu_counter_destroy(&baby_sb_info->s_dirtyblocks_counter);
   brelse(baby_sb_info->s_sbh);
   sb->s_fs_info = NULL;
   kfree(baby_sb_info);
 }
 
 void baby_sync_super(struct baby_sb_info *sb_info, struct baby_super_block *raw_sb, int wait) {
-  raw_sb->nr_free_blocks = sb_info->nr_free_blocks;
-  raw_sb->nr_free_inodes = sb_info->nr_free_inodes;
+  // 写回磁盘时需要精确值，把各个 cpu 上的增量加起来
+  raw_sb->nr_free_blocks =
+      percpu_counter_sum_positive(&sb_info->s_freeblocks_counter);
+  raw_sb->nr_free_inodes =
+      percpu_counter_sum_positive(&sb_info->s_freeinodes_counter);
   raw_sb->last_bitmap_bits = sb_info->last_bitmap_bits;
   mark_buffer_dirty(sb_info->s_sbh);
   if(wait) {
@@ -219,22 +393,84 @@ void baby_sync_super(struct baby_sb_info *sb_info, struct baby_super_block *raw_
 static int baby_sync_fs(struct super_block *sb, int wait) {
   struct baby_sb_info* sb_info = BABY_SB(sb);
   struct baby_super_block *raw_sb = sb_info->s_babysb;
-
+  int err = 0;
+
+  // 只读挂载时没有修改，也不能写设备
+  if (sb_rdonly(sb))
+    return 0;
+  // 提交运行中的事务，sync(2) 返回后所有元数据修改都已经在日志里
+  if (wait)
+    err = baby_journal_sync(sb);
   baby_sync_super(sb_info, raw_sb, wait);
+  baby_wear_sync(sb, wait);
+  return err;
+}
+
+/*
+ * 重新挂载：可以修改 discard 选项
+ * 改为只读时停下会开始 handle 的后台释放和清理，提交并清空日志，清除 RECOVER 标志后写回超级块；
+ * 改回读写时重新设置 RECOVER 标志，继续后台的工作
+ */
+static int baby_remount(struct super_block *sb, int *flags, char *data) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long old_opt = sbi->s_mount_opt;
+  int err;
+
+  sync_filesystem(sb);
+  if (!baby_parse_options(data, sbi)) {
+    sbi->s_mount_opt = old_opt;
+    return -EINVAL;
+  }
+  baby_check_discard(sb);
+  if (!(*flags & SB_RDONLY) == !sb_rdonly(sb))
+    return 0;
+
+  if (*flags & SB_RDONLY) {
+    baby_orphan_stop(sb);
+    baby_cleaner_stop(sb);
+    // 等待 discard 的块要等事务提交，在清空日志之前处理
+    baby_discard_flush(sb);
+    err = baby_journal_flush(sb);
+    if (err)
+      printk(KERN_ERR "babyfs: flush journal for read-only remount failed, "
+                      "err %d\n",
+             err);
+    baby_sync_super(sbi, sbi->s_babysb, 1);
+    baby_wear_sync(sb, 1);
+    return 0;
+  }
+
+  if (sbi->s_journal)
+    baby_journal_set_recover(sb);
+  baby_orphan_resume(sb);
+  baby_cleaner_resume(sb);
   return 0;
 }
 
 static int baby_statfs (struct dentry * dentry, struct kstatfs * buf) {
   struct super_block *sb = dentry->d_sb;
   struct baby_sb_info *bbi = BABY_SB(sb);
+  s64 bfree;
   
   buf->f_type = dentry->d_sb->s_magic;
   buf->f_bsize = BABYFS_BLOCK_SIZE;
   buf->f_namelen = BABYFS_FILENAME_MAX_LEN;
   buf->f_blocks = bbi->nr_blocks;
-  buf->f_bavail = buf->f_bfree = bbi->nr_free_blocks;
+  // statfs 只需要近似值，不遍历各个 cpu；延迟分配预留的块也算作已用
+  bfree = percpu_counter_read_positive(&bbi->s_freeblocks_counter) -
+          percpu_counter_read_positive(&bbi->s_dirtyblocks_counter);
+  buf->f_bavail = max_t(s64, bfree, 0);
+  // 等待后台释放的块算作空闲，但还不能分配，只加到 f_bfree 上
+  bfree += atomic_long_read(&bbi->s_pending_blocks);
+  buf->f_bfree = clamp_t(s64, bfree, 0, bbi->nr_blocks);
   buf->f_files = BABYFS_BIT_PRE_BLOCK;
-  buf->f_ffree = bbi->nr_free_inodes;
+  buf->f_ffree = percpu_counter_read_positive(&bbi->s_freeinodes_counter);
+  return 0;
+}
+
+static int baby_show_options(struct seq_file *seq, struct dentry *root) {
+  if (baby_test_opt(root->d_sb, DISCARD))
+    seq_puts(seq, ",discard");
   return 0;
 }
 
@@ -242,17 +478,20 @@ struct super_operations babyfs_super_opts = { // 自定义 super_block 操作集
   .statfs       = baby_statfs,        // 给出文件系统的统计信息，例如使用和未使用的数据块的数目，或者文件名的最大长度
   .alloc_inode	= baby_alloc_inode,     // 申请 inode
   .destroy_inode= baby_destroy_inode,   // 释放 inode
+  .dirty_inode  = baby_dirty_inode,     // 有日志时把 inode 的修改记入事务
   .write_inode	= baby_write_inode,     // 将 inode 写到磁盘上
   .put_super    = baby_put_super,       // 删除超级块实例的方法
   .evict_inode  = baby_evict_inode,     // 回收 inode 所占用的空间
   .sync_fs      = baby_sync_fs,         // 同步 super_block 到磁盘
+  .remount_fs   = baby_remount,         // 重新挂载，切换只读时提交并清空日志
+  .show_options = baby_show_options,    // /proc/mounts 中显示的挂载选项
 };
 
 static struct file_system_type baby_fs_type = { // 文件系统类型
   .owner        = THIS_MODULE,
   .name         = "babyfs",
   .mount        = babyfs_mount,
-  .kill_sb      = kill_block_super, // VFS 提供的销毁方法
+  .kill_sb      = babyfs_kill_sb,
   .fs_flags     = FS_REQUIRES_DEV,  // 给定文件系统的每个实例都使用底层块设备
 };
 
@@ -263,10 +502,16 @@ static int __init init_babyfs(void) {
   // 初始化 baby_inode_info 内存高速缓存（slab层）
   err = init_inodecache();
   if (err) return err;
+  err = baby_init_map_cache();
+  if (err) {
+    destroy_inodecache();
+    return err;
+  }
 
   // 注册文件系统类型到系统中
   err = register_filesystem(&baby_fs_type);
   if (err) {
+    baby_destroy_map_cache();
     destroy_inodecache();
     return err;
   }
@@ -278,6 +523,7 @@ static void __exit exit_babyfs(void) {
   printk("unloading fs...\n");
   unregister_filesystem(&baby_fs_type);
   destroy_inodecache();
+  baby_destroy_map_cache();
 }
 
 module_init(init_babyfs);
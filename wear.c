@@ -0,0 +1,251 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+
+#include "babyfs.h"
+
+/*
+ * 磨损均衡
+ *
+ * 预留窗口从 goal 开始找，后面找不到时绕回数据区开头，开头的块组被反复改写，
+ * 在裸闪存上最先磨损。每个块组记录累计分配的块数（在 baby_update_bitmap 里更新）和
+ * 真正擦除的块数：释放块不算擦除，只有 discard 成功和 zone 重置时才累加；
+ * 有 WEAR 特性时保存在磁盘上的磨损表里，挂载时读入，sync 和卸载时写回。
+ *
+ * 块组的磨损程度按每块平均写入的次数算。普通文件新开预留窗口时，如果 goal 所在的块组
+ * 比同一温度区域里磨损最少、空闲块够用的块组多写了一遍以上，并且超出 1/BABY_WEAR_RATIO，
+ * 窗口改放到那个块组里；绕回时也从磨损最少的块组开始找，不再从数据区开头。
+ * 间接块和区间树块从热区域的 s_hot_cursor 顺序分配，游标所在的块组按同样的条件换到
+ * 热区域里磨损最少的块组，热文件的第一个 goal 跟着游标走。
+ * 冷热分离的区域不变，只是在区域里挑磨损少的块组。
+ * 扫描全部块组代价比较大，磨损最少的块组每秒最多重新找一次，它的空闲块不够时提前重新找
+ */
+
+#define BABY_WEAR_SCALE 16            // 磨损程度 = 每块平均写入次数 * BABY_WEAR_SCALE
+#define BABY_WEAR_SLACK BABY_WEAR_SCALE // 至少多写一遍才换块组
+#define BABY_WEAR_RATIO 8             // 并且超出最少的 1/8
+#define BABY_WEAR_SCAN_INTERVAL HZ    // 重新找磨损最少块组的周期
+
+static unsigned long baby_group_wear(struct baby_sb_info *sbi,
+                                     unsigned long group) {
+  unsigned long base = group * BABYFS_BIT_PRE_BLOCK;
+  unsigned long blocks = min_t(unsigned long, sbi->nr_blocks - base,
+                               BABYFS_BIT_PRE_BLOCK);
+
+  return atomic_long_read(&sbi->s_groups[group].bg_writes) * BABY_WEAR_SCALE /
+         blocks;
+}
+
+// 块组所在的温度区域
+static int baby_group_temp(struct baby_sb_info *sbi, unsigned long group) {
+  unsigned long first, n;
+  int temp;
+
+  for (temp = 0; temp < BABY_TEMP_NR; temp++) {
+    baby_temp_region(sbi, temp, &first, &n);
+    if (group >= first && group < first + n)
+      return temp;
+  }
+  return BABY_TEMP_NR;
+}
+
+/*
+ * 重新找各个温度区域里和整个数据区里磨损最少、空闲块不少于 size 的块组
+ * 只看 s_alloc_end 之前的块组，调用者持有 s_rsv_window_lock
+ */
+static void baby_wear_scan(struct baby_sb_info *sbi, unsigned long size) {
+  unsigned long ngroups =
+      (sbi->s_alloc_end + BABYFS_BIT_PRE_BLOCK - 1) / BABYFS_BIT_PRE_BLOCK;
+  unsigned long best[BABY_TEMP_NR + 1], group, wear, first, n;
+  int temp;
+
+  for (temp = 0; temp <= BABY_TEMP_NR; temp++) {
+    best[temp] = ULONG_MAX;
+    sbi->s_wear_cold[temp] = -1;
+  }
+  for (temp = 0; temp < BABY_TEMP_NR; temp++) {
+    baby_temp_region(sbi, temp, &first, &n);
+    for (group = first; group < first + n && group < ngroups; group++) {
+      if (READ_ONCE(sbi->s_groups[group].bg_free) < size)
+        continue;
+      wear = baby_group_wear(sbi, group);
+      if (wear < best[temp]) {
+        best[temp] = wear;
+        sbi->s_wear_cold[temp] = group;
+      }
+      if (wear < best[BABY_TEMP_NR]) {
+        best[BABY_TEMP_NR] = wear;
+        sbi->s_wear_cold[BABY_TEMP_NR] = group;
+      }
+    }
+  }
+  sbi->s_wear_stamp = jiffies;
+}
+
+// 温度区域 temp 里磨损最少的块组，temp 为 BABY_TEMP_NR 时是整个数据区，没有时返回 -1
+static long baby_wear_coldest(struct baby_sb_info *sbi, int temp,
+                              unsigned long size) {
+  long group = sbi->s_wear_cold[temp];
+
+  if (time_after(jiffies, sbi->s_wear_stamp + BABY_WEAR_SCAN_INTERVAL) ||
+      (group >= 0 && READ_ONCE(sbi->s_groups[group].bg_free) < size)) {
+    baby_wear_scan(sbi, size);
+    group = sbi->s_wear_cold[temp];
+  }
+  return group;
+}
+
+/*
+ * 新预留窗口的起始位置，块号相对于第一个数据块，size 是窗口大小
+ * goal 所在的块组比同一区域里磨损最少的块组写得多很多时换到那个块组的开头
+ * 调用者持有 s_rsv_window_lock
+ */
+unsigned long baby_wear_goal(struct super_block *sb, unsigned long goal,
+                             unsigned long size) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long group = goal / BABYFS_BIT_PRE_BLOCK, wear, cold_wear;
+  long cold;
+
+  if (goal >= sbi->s_alloc_end)
+    return goal;
+  cold = baby_wear_coldest(sbi, baby_group_temp(sbi, group), size);
+  if (cold < 0 || cold == group)
+    return goal;
+  wear = baby_group_wear(sbi, group);
+  cold_wear = baby_group_wear(sbi, cold);
+  if (wear <= cold_wear + max_t(unsigned long, BABY_WEAR_SLACK,
+                                cold_wear / BABY_WEAR_RATIO))
+    return goal;
+  return cold * BABYFS_BIT_PRE_BLOCK;
+}
+
+/*
+ * 预留窗口绕回时从这里开始找：整个数据区里磨损最少的块组的开头，
+ * 块号相对于第一个数据块，没有空闲块够用的块组时返回 -1
+ */
+long baby_wear_cold_block(struct super_block *sb, unsigned long size) {
+  long cold = baby_wear_coldest(BABY_SB(sb), BABY_TEMP_NR, size);
+
+  return cold >= 0 ? cold * BABYFS_BIT_PRE_BLOCK : -1;
+}
+
+// [block, block + count) 已经 discard 或者所在的 zone 已经重置，块号相对于第一个数据块
+void baby_wear_erase(struct super_block *sb, unsigned long block,
+                     unsigned long count) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long group = block / BABYFS_BIT_PRE_BLOCK, nr;
+
+  if (block >= sbi->nr_blocks)
+    return;
+  count = min(count, sbi->nr_blocks - block);
+  for (; count; count -= nr, block += nr, group++) {
+    nr = min(count, BABYFS_BIT_PRE_BLOCK - block % BABYFS_BIT_PRE_BLOCK);
+    atomic_long_add(nr, &sbi->s_groups[group].bg_erases);
+  }
+}
+
+/*
+ * 挂载时在建立块组之后调用，有磨损表时读入各个块组的计数
+ * 磨损表是兼容特性，读不出来时只打印警告，计数从 0 开始、不再写回
+ */
+void baby_wear_init(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_super_block *raw_sb = sbi->s_babysb;
+  unsigned long start = le32_to_cpu(raw_sb->s_wear_start);
+  unsigned long blocks = le32_to_cpu(raw_sb->s_wear_blocks);
+  unsigned long group = 0, i, j;
+  struct baby_block_group *bg;
+  struct buffer_head *bh;
+  struct baby_wear *w;
+  int temp;
+
+  for (temp = 0; temp <= BABY_TEMP_NR; temp++)
+    sbi->s_wear_cold[temp] = -1;
+  // 第一次分配时就扫描
+  sbi->s_wear_stamp = jiffies - BABY_WEAR_SCAN_INTERVAL - 1;
+
+  if (!BABY_HAS_COMPAT_FEATURE(sb, BABYFS_FEATURE_COMPAT_WEAR))
+    return;
+  if (!start || blocks * BABYFS_WEAR_PER_BLOCK < sbi->nr_bitmap) {
+    printk(KERN_WARNING "babyfs: wear table too small, wear counts not saved\n");
+    return;
+  }
+  for (i = 0; i < blocks && group < sbi->nr_bitmap; i++) {
+    bh = sb_bread(sb, start + i);
+    if (!bh) {
+      printk(KERN_WARNING "babyfs: cannot read wear table block %lu\n",
+             start + i);
+      for (group = 0; group < sbi->nr_bitmap; group++) {
+        atomic_long_set(&sbi->s_groups[group].bg_writes, 0);
+        atomic_long_set(&sbi->s_groups[group].bg_erases, 0);
+      }
+      return;
+    }
+    w = (struct baby_wear *)bh->b_data;
+    for (j = 0; j < BABYFS_WEAR_PER_BLOCK && group < sbi->nr_bitmap;
+         j++, group++) {
+      bg = &sbi->s_groups[group];
+      atomic_long_set(&bg->bg_writes, le64_to_cpu(w[j].w_writes));
+      atomic_long_set(&bg->bg_erases, le64_to_cpu(w[j].w_erases));
+    }
+    brelse(bh);
+  }
+  sbi->s_wear_start = start;
+}
+
+/*
+ * 把各个块组的计数写回磨损表，sync_fs 和卸载时调用
+ * 计数只用来挑选块组，不需要和位图一致，不经过日志，崩溃时丢掉最近一次 sync 之后的增量
+ */
+void baby_wear_sync(struct super_block *sb, int wait) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  unsigned long group = 0, blk = sbi->s_wear_start, j;
+  struct baby_block_group *bg;
+  struct buffer_head *bh;
+  struct baby_wear *w;
+
+  if (!blk || sb_rdonly(sb))
+    return;
+  for (; group < sbi->nr_bitmap; blk++) {
+    bh = sb_bread(sb, blk);
+    if (!bh) {
+      printk(KERN_ERR "babyfs: cannot read wear table block %lu\n", blk);
+      return;
+    }
+    w = (struct baby_wear *)bh->b_data;
+    lock_buffer(bh);
+    for (j = 0; j < BABYFS_WEAR_PER_BLOCK && group < sbi->nr_bitmap;
+         j++, group++) {
+      bg = &sbi->s_groups[group];
+      w[j].w_writes = cpu_to_le64(atomic_long_read(&bg->bg_writes));
+      w[j].w_erases = cpu_to_le64(atomic_long_read(&bg->bg_erases));
+    }
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    if (wait)
+      sync_dirty_buffer(bh);
+    brelse(bh);
+  }
+}
+
+/*
+ * BABYFS_IOC_GET_WEAR：把前 info->wi_groups 个块组的计数复制到 info->wi_wear，
+ * 返回时 info 里是块组总数和块组大小；数组项和磁盘上的一样是小端
+ */
+int baby_wear_report(struct super_block *sb, struct baby_wear_info *info) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_wear __user *uw =
+      (struct baby_wear __user *)(unsigned long)info->wi_wear;
+  unsigned long n = min_t(unsigned long, info->wi_groups, sbi->nr_bitmap), i;
+  struct baby_wear w;
+
+  for (i = 0; i < n; i++) {
+    w.w_writes = cpu_to_le64(atomic_long_read(&sbi->s_groups[i].bg_writes));
+    w.w_erases = cpu_to_le64(atomic_long_read(&sbi->s_groups[i].bg_erases));
+    if (copy_to_user(&uw[i], &w, sizeof(w)))
+      return -EFAULT;
+  }
+  info->wi_groups = sbi->nr_bitmap;
+  info->wi_group_blocks = BABYFS_BIT_PRE_BLOCK;
+  return 0;
+}
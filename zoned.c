@@ -0,0 +1,133 @@
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/version.h>
+
+#include "babyfs.h"
+
+/*
+ * zoned 块设备
+ *
+ * 顺序写 zone 只能从写指针的位置往后写，重置之后才能重新写，原地更新和位图分配器都用不了。
+ * zoned 设备必须用 LOG 特性格式化，并且开头有足够的常规 zone：mkfs 把超级块、位图、
+ * inode 表、段摘要、日志区和磨损表都放在常规 zone 里，目录、间接块和区间树块这些原地写的块
+ * 也只从常规 zone 里分配（s_alloc_end）。
+ *
+ * 每个顺序写 zone 是一个段，普通文件的数据只追加到日志打开的 zone 上，分配的位置就是
+ * 写指针（baby_alloc_at）；zone 里的块全部释放、释放它们的事务提交之后，日志重新打开它
+ * 之前先重置 zone。清理按 zone 选择、搬运，见 cleaner.c。
+ *
+ * 写入的顺序必须和分配的顺序相同，普通文件的回写在 s_zone_wb_mutex 下串行执行，
+ * 回写期间分配的块在返回之前都已经按顺序提交
+ */
+
+struct baby_zone_report {
+  unsigned long nr_conv;  // 开头的常规 zone 数
+  unsigned long nr_seq;   // 顺序写 zone 数
+  int mixed;              // 顺序写 zone 之后又出现了常规 zone
+  unsigned long nr_short; // 可写容量小于 zone 大小的顺序写 zone 数
+};
+
+static int baby_report_zone_cb(struct blk_zone *zone, unsigned int idx,
+                               void *data) {
+  struct baby_zone_report *zr = data;
+
+  if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL) {
+    if (zr->nr_seq)
+      zr->mixed = 1;
+    else
+      zr->nr_conv++;
+    return 0;
+  }
+  zr->nr_seq++;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+  if (zone->capacity < zone->len)
+    zr->nr_short++;
+#endif
+  return 0;
+}
+
+/*
+ * 挂载时在 baby_seg_init 里调用：检查 zone 的布局，段改为和 zone 对齐，
+ * 分配器只用常规 zone
+ * 段的大小就是 zone 的大小，整个 zone 都要能写。NVMe ZNS 的 zone 容量可以小于 zone 大小，
+ * 写过容量之后 I/O 会失败，有这样的 zone 时拒绝挂载。struct blk_zone 从 5.9 才有容量字段，
+ * 同时才有 ZNS 驱动，更早的内核只支持 SMR 盘和 null_blk，容量总是等于大小
+ */
+int baby_zoned_init(struct super_block *sb) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct baby_super_block *raw_sb = sbi->s_babysb;
+  struct block_device *bdev = sb->s_bdev;
+  unsigned int shift = sb->s_blocksize_bits - 9;
+  unsigned long zone_blocks = bdev_zone_sectors(bdev) >> shift;
+  unsigned long conv_end, meta_end;
+  struct baby_zone_report zr = {};
+  int ret;
+
+  ret = blkdev_report_zones(bdev, 0, BLK_ALL_ZONES, baby_report_zone_cb, &zr);
+  if (ret < 0)
+    return ret;
+  if (zr.mixed || !zr.nr_conv || !zone_blocks) {
+    printk(KERN_ERR "babyfs: unsupported zone layout, %lu conventional zones\n",
+           zr.nr_conv);
+    return -EINVAL;
+  }
+  if (zr.nr_short) {
+    printk(KERN_ERR "babyfs: %lu zones have capacity smaller than zone size, "
+                    "not supported\n",
+           zr.nr_short);
+    return -EINVAL;
+  }
+  // 原地写的元数据都要落在常规 zone 里
+  conv_end = zr.nr_conv * zone_blocks;
+  meta_end = max_t(unsigned long, NR_DSTORE_BLOCKS + 1,
+                   le32_to_cpu(raw_sb->s_ssa_start) +
+                       le32_to_cpu(raw_sb->s_ssa_blocks));
+  if (le32_to_cpu(raw_sb->s_journal_blocks))
+    meta_end = max_t(unsigned long, meta_end,
+                     le32_to_cpu(raw_sb->s_journal_start) +
+                         le32_to_cpu(raw_sb->s_journal_blocks));
+  meta_end = max_t(unsigned long, meta_end,
+                   le32_to_cpu(raw_sb->s_wear_start) +
+                       le32_to_cpu(raw_sb->s_wear_blocks));
+  if (meta_end > conv_end) {
+    printk(KERN_ERR "babyfs: metadata beyond conventional zones, "
+                    "reformat on this device\n");
+    return -EINVAL;
+  }
+
+  sbi->s_seg_blocks = zone_blocks;
+  sbi->s_seg_off = NR_DSTORE_BLOCKS;
+  sbi->s_seg_first = zr.nr_conv;
+  sbi->s_alloc_end = min_t(unsigned long, conv_end - NR_DSTORE_BLOCKS,
+                           sbi->nr_blocks);
+  sbi->s_zoned = 1;
+  mutex_init(&sbi->s_zone_wb_mutex);
+
+  printk(KERN_INFO "babyfs: zoned device, %lu conventional and %lu sequential "
+                   "zones of %lu blocks\n",
+         zr.nr_conv, zr.nr_seq, zone_blocks);
+  return 0;
+}
+
+// 重置段 seg 所在的顺序写 zone，日志打开它之前调用，持有 s_log_mutex
+int baby_zone_reset(struct super_block *sb, unsigned long seg) {
+  struct baby_sb_info *sbi = BABY_SB(sb);
+  struct block_device *bdev = sb->s_bdev;
+  unsigned int shift = sb->s_blocksize_bits - 9;
+  sector_t sector = (sector_t)(baby_seg_start(sbi, seg) + NR_DSTORE_BLOCKS)
+                    << shift;
+  sector_t nr = (sector_t)sbi->s_seg_blocks << shift;
+  sector_t capacity = i_size_read(bdev->bd_inode) >> 9;
+  int err;
+
+  // 最后一个 zone 可能比较小
+  err = blkdev_zone_mgmt(bdev, REQ_OP_ZONE_RESET, sector,
+                         min(nr, capacity - sector), GFP_NOFS);
+  if (err)
+    printk(KERN_ERR "babyfs: reset zone at sector %llu failed, err %d\n",
+           (unsigned long long)sector, err);
+  else
+    baby_wear_erase(sb, baby_seg_start(sbi, seg), sbi->s_seg_blocks);
+  return err;
+}